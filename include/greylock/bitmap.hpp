@@ -0,0 +1,680 @@
+#ifndef __INDEXES_BITMAP_HPP
+#define __INDEXES_BITMAP_HPP
+
+#include "greylock/dictionary.hpp"
+#include "greylock/postings.hpp"
+
+#include <algorithm>
+#include <sstream>
+
+namespace ioremap { namespace greylock {
+
+// Roaring-style compressed bitmap of 32-bit document numbers.
+//
+// Numbers are split into chunks by their upper 16 bits. Every chunk keeps lower 16 bits of its numbers
+// either in the sorted array (sparse chunk) or in the 65536-bit bitset (dense chunk), array is converted
+// into bitset when it grows over @array_max_size entries, at that point both representations take 8Kb.
+class bitmap {
+public:
+	enum {
+		array_max_size = 4096,
+		bitset_words = 65536 / 64,
+	};
+
+	struct chunk {
+		uint32_t high = 0;
+		uint32_t cardinality = 0;
+		std::vector<uint16_t> array;
+		std::vector<uint64_t> bits;
+
+		MSGPACK_DEFINE(high, cardinality, array, bits);
+
+		bool is_bitset() const {
+			return !bits.empty();
+		}
+
+		bool contains(uint16_t low) const {
+			if (is_bitset())
+				return bits[low >> 6] & (1ULL << (low & 63));
+
+			return std::binary_search(array.begin(), array.end(), low);
+		}
+
+		void add(uint16_t low) {
+			if (is_bitset()) {
+				uint64_t &word = bits[low >> 6];
+				uint64_t mask = 1ULL << (low & 63);
+				if (!(word & mask)) {
+					word |= mask;
+					cardinality++;
+				}
+				return;
+			}
+
+			auto it = std::lower_bound(array.begin(), array.end(), low);
+			if (it != array.end() && *it == low)
+				return;
+
+			array.insert(it, low);
+			cardinality++;
+
+			if (array.size() > array_max_size)
+				to_bitset();
+		}
+
+		// returns false if @low is not in the chunk, bitset which becomes small enough is converted into array
+		bool remove(uint16_t low) {
+			if (is_bitset()) {
+				uint64_t &word = bits[low >> 6];
+				uint64_t mask = 1ULL << (low & 63);
+				if (!(word & mask))
+					return false;
+
+				word &= ~mask;
+				if (--cardinality <= array_max_size)
+					to_array();
+				return true;
+			}
+
+			auto it = std::lower_bound(array.begin(), array.end(), low);
+			if (it == array.end() || *it != low)
+				return false;
+
+			array.erase(it);
+			cardinality--;
+			return true;
+		}
+
+		// sets @ret to the smallest number in the chunk which is not less than @low,
+		// returns false if there is no such number
+		bool lower_bound(uint32_t low, uint16_t &ret) const {
+			if (low > 0xffff)
+				return false;
+
+			if (!is_bitset()) {
+				auto it = std::lower_bound(array.begin(), array.end(), (uint16_t)low);
+				if (it == array.end())
+					return false;
+
+				ret = *it;
+				return true;
+			}
+
+			size_t pos = low >> 6;
+			uint64_t word = bits[pos] & (~0ULL << (low & 63));
+			while (true) {
+				if (word) {
+					ret = pos * 64 + __builtin_ctzll(word);
+					return true;
+				}
+
+				if (++pos == bitset_words)
+					return false;
+
+				word = bits[pos];
+			}
+		}
+
+		// leaves only numbers which are present in both chunks
+		void intersect(const chunk &other) {
+			if (is_bitset() && other.is_bitset()) {
+				cardinality = 0;
+				for (size_t i = 0; i < bitset_words; ++i) {
+					bits[i] &= other.bits[i];
+					cardinality += __builtin_popcountll(bits[i]);
+				}
+
+				if (cardinality <= array_max_size)
+					to_array();
+				return;
+			}
+
+			// result of intersection with array chunk is never larger than that array
+			const chunk &scan = is_bitset() ? other : *this;
+			const chunk &probe = is_bitset() ? *this : other;
+
+			std::vector<uint16_t> ret;
+			for (uint16_t low: scan.array) {
+				if (probe.contains(low))
+					ret.push_back(low);
+			}
+
+			array.swap(ret);
+			bits.clear();
+			cardinality = array.size();
+		}
+
+		size_t memory() const {
+			return sizeof(chunk) + array.size() * sizeof(uint16_t) + bits.size() * sizeof(uint64_t);
+		}
+
+		void to_bitset() {
+			bits.assign(bitset_words, 0);
+			for (uint16_t low: array) {
+				bits[low >> 6] |= 1ULL << (low & 63);
+			}
+
+			std::vector<uint16_t>().swap(array);
+		}
+
+		void to_array() {
+			array.clear();
+			array.reserve(cardinality);
+			for (size_t i = 0; i < bitset_words; ++i) {
+				for (uint64_t word = bits[i]; word; word &= word - 1) {
+					array.push_back(i * 64 + __builtin_ctzll(word));
+				}
+			}
+
+			std::vector<uint64_t>().swap(bits);
+		}
+	};
+
+	void add(uint32_t num) {
+		uint32_t high = num >> 16;
+
+		auto it = find(high);
+		if (it == m_chunks.end() || it->high != high) {
+			chunk c;
+			c.high = high;
+			it = m_chunks.insert(it, c);
+		}
+
+		it->add(num & 0xffff);
+	}
+
+	// returns false if @num is not in the bitmap, empty chunk is dropped
+	bool remove(uint32_t num) {
+		auto it = find(num >> 16);
+		if (it == m_chunks.end() || it->high != (num >> 16))
+			return false;
+
+		if (!it->remove(num & 0xffff))
+			return false;
+
+		if (it->cardinality == 0)
+			m_chunks.erase(it);
+		return true;
+	}
+
+	bool contains(uint32_t num) const {
+		auto it = find(num >> 16);
+		if (it == m_chunks.end() || it->high != (num >> 16))
+			return false;
+
+		return it->contains(num & 0xffff);
+	}
+
+	// sets @ret to the smallest number in the bitmap which is not less than @num,
+	// returns false if there is no such number
+	bool lower_bound(uint32_t num, uint32_t &ret) const {
+		for (auto it = find(num >> 16); it != m_chunks.end(); ++it) {
+			uint32_t low = (it->high == (num >> 16)) ? (num & 0xffff) : 0;
+
+			uint16_t found;
+			if (it->lower_bound(low, found)) {
+				ret = (it->high << 16) | found;
+				return true;
+			}
+		}
+
+		return false;
+	}
+
+	// leaves only numbers which are present in both bitmaps, this is AND of two dense terms
+	// which does not read any document, empty chunks are dropped
+	void intersect(const bitmap &other) {
+		std::vector<chunk> ret;
+
+		auto it = m_chunks.begin();
+		auto oit = other.m_chunks.begin();
+		while (it != m_chunks.end() && oit != other.m_chunks.end()) {
+			if (it->high < oit->high) {
+				++it;
+			} else if (oit->high < it->high) {
+				++oit;
+			} else {
+				it->intersect(*oit);
+				if (it->cardinality)
+					ret.emplace_back(std::move(*it));
+
+				++it;
+				++oit;
+			}
+		}
+
+		m_chunks.swap(ret);
+	}
+
+	uint64_t cardinality() const {
+		uint64_t num = 0;
+		for (const auto &c: m_chunks) {
+			num += c.cardinality;
+		}
+
+		return num;
+	}
+
+	bool empty() const {
+		return m_chunks.empty();
+	}
+
+	size_t memory() const {
+		size_t size = sizeof(bitmap);
+		for (const auto &c: m_chunks) {
+			size += c.memory();
+		}
+
+		return size;
+	}
+
+	std::string str() const {
+		std::ostringstream ss;
+		ss << "chunks: " << m_chunks.size() << ", cardinality: " << cardinality() << ", memory: " << memory();
+		return ss.str();
+	}
+
+	MSGPACK_DEFINE(m_chunks);
+
+private:
+	// sorted by @chunk.high
+	std::vector<chunk> m_chunks;
+
+	std::vector<chunk>::iterator find(uint32_t high) {
+		return std::lower_bound(m_chunks.begin(), m_chunks.end(), high, [] (const chunk &c, uint32_t h) {
+					return c.high < h;
+				});
+	}
+
+	std::vector<chunk>::const_iterator find(uint32_t high) const {
+		return std::lower_bound(m_chunks.begin(), m_chunks.end(), high, [] (const chunk &c, uint32_t h) {
+					return c.high < h;
+				});
+	}
+};
+
+// Every key of the mailbox documents index carries the document number in @key::number,
+// numbers are dense per mailbox, they are assigned in the order documents are indexed.
+// Returns false if @doc does not have a number.
+static inline bool document_number(const key &doc, uint32_t &num) {
+	if (doc.number == key::no_number)
+		return false;
+
+	num = doc.number;
+	return true;
+}
+
+// Dense term, i.e. the word present in the large part of the mailbox documents, is stored as the bitmap
+// of document numbers instead of the index tree of full keys. Term loses its positions, thus it
+// can not take part in phrase and proximity matching, documents containing it are still returned.
+//
+// Generation changes every time the bitmap is updated, like @index_meta generation of the tree.
+struct dense_term {
+	enum {
+		serialization_version = 1,
+	};
+
+	bitmap docs;
+	uint64_t generation_sec = 0;
+	uint64_t generation_nsec = 0;
+
+	static eurl url(const eurl &base) {
+		eurl url;
+		url.bucket = base.bucket;
+		url.key = base.key + ".dense";
+		return url;
+	}
+
+	void update_generation() {
+		struct timespec ts;
+		clock_gettime(CLOCK_REALTIME, &ts);
+
+		generation_sec = ts.tv_sec;
+		generation_nsec = ts.tv_nsec;
+	}
+
+	std::string generation() const {
+		return elliptics::lexical_cast(generation_sec) + "." + elliptics::lexical_cast(generation_nsec);
+	}
+
+	void load(const void *data, size_t size) {
+		msgpack::unpacked result;
+		msgpack::unpack(&result, (const char *)data, size);
+		msgpack::object obj = result.get();
+		obj.convert(this);
+	}
+
+	std::string save() const {
+		std::stringstream ss;
+		msgpack::pack(ss, *this);
+		return ss.str();
+	}
+};
+
+template <typename T>
+class dense_index {
+public:
+	dense_index(T &t, const eurl &base) : m_t(t), m_base(base) {}
+
+	// returns -ENOENT if term is not dense
+	int load() {
+		status e = m_t.read(dense_term::url(m_base));
+		if (e.error)
+			return e.error;
+
+		m_term.load(e.data.data(), e.data.size());
+		return 0;
+	}
+
+	int insert(uint32_t num) {
+		m_term.docs.add(num);
+		m_term.update_generation();
+		return write();
+	}
+
+	// removes numbers of the documents which have been expired from the mailbox documents index,
+	// bitmap is only written if it has been changed, @removed is set to the number of removed documents
+	int remove(const std::vector<uint32_t> &nums, size_t &removed) {
+		removed = 0;
+		for (uint32_t num: nums) {
+			if (m_term.docs.remove(num))
+				removed++;
+		}
+
+		if (removed == 0)
+			return 0;
+
+		m_term.update_generation();
+		return write();
+	}
+
+	const dense_term &term() const {
+		return m_term;
+	}
+
+	// replaces index tree @base with the bitmap of its documents, compact keys (see @compact_key) contain
+	// document numbers, numbers of full keys are taken from the mailbox documents index @documents,
+	// both indexes are sorted in key order, thus every documents page is read at most once,
+	// posting format is taken from the index metadata (see @index_meta::posting_format())
+	//
+	// returns -ENOENT and leaves the tree intact if any of its documents does not have a number,
+	// -EINVAL if the key does not match the posting format of the index
+	int convert(const eurl &documents) {
+		{
+			read_only_index<T> idx(m_t, m_base);
+			read_only_index<T> didx(m_t, documents);
+
+			bool compact = idx.meta().posting_format() == index_meta::flag_compact_postings;
+
+			m_term = dense_term();
+
+			auto dit = didx.begin(key()), dend = didx.end();
+			for (auto it = idx.begin(key()), end = idx.end(); it != end; ++it) {
+				uint32_t num;
+				if (compact) {
+					if (!compact_key::decode(*it, num))
+						return -EINVAL;
+
+					m_term.docs.add(num);
+					continue;
+				}
+
+				if (it->compact())
+					return -EINVAL;
+
+				dit.seek(*it);
+
+				if (dit == dend || *dit != *it || !document_number(*dit, num))
+					return -ENOENT;
+
+				m_term.docs.add(num);
+			}
+		}
+
+		m_term.update_generation();
+
+		int err = write();
+		if (err < 0)
+			return err;
+
+		read_write_index<T> idx(m_t, m_base);
+		return idx.destroy();
+	}
+
+private:
+	T &m_t;
+	eurl m_base;
+	dense_term m_term;
+
+	int write() {
+		std::vector<status> wr = m_t.write(dense_term::url(m_base), m_term.save());
+		for (auto &r: wr) {
+			if (!r.error)
+				return 0;
+		}
+
+		return -EIO;
+	}
+};
+
+// posting list of the dense term: keys of the mailbox documents index whose numbers are in the bitmap
+//
+// documents index is read in key order, thus dense term is intersected with tree-backed lists
+// as any other list, keys are returned without positions
+//
+// if @compact is set, keys are converted into compact keys (see @compact_key), documents index is ordered
+// by document id within the same timestamp and compact keys are ordered by document number,
+// thus all matching documents of the current timestamp are read and sorted at once
+//
+// small bitmap, for example the intersection of several dense terms, is not matched against every key
+// of the documents index, its documents are looked up by number in the mailbox dictionary instead
+template <typename T>
+class bitmap_postings : public posting_list {
+public:
+	enum {
+		// bitmaps with more documents are always read through the documents index
+		lookup_max_documents = 65536,
+	};
+
+	// @docs may be the intersection of several dense terms, see @bitmap::intersect()
+	// documents are looked up in the mailbox dictionary @dictionary if it is not empty, see @lookup()
+	bitmap_postings(T &t, const std::string &name, const eurl &documents, const std::shared_ptr<const bitmap> &docs,
+			const key &start, const time_range &range, bool compact = false, const eurl &dictionary = eurl()) :
+		m_name(name), m_docs(docs), m_list(t, documents, timestamp_key(start.timestamp), range), m_compact(compact) {
+		if (dictionary.empty() || !lookup(t, dictionary, range))
+			load_run();
+		seek_run(start);
+	}
+
+	virtual bool end() {
+		return m_pos >= m_run.size();
+	}
+
+	virtual const key &current() {
+		return m_run[m_pos];
+	}
+
+	virtual void next() {
+		if (++m_pos >= m_run.size())
+			load_run();
+	}
+
+	virtual void seek(const key &k) {
+		if (end() || !(current() < k))
+			return;
+
+		if (k.timestamp > current().timestamp && !m_lookup)
+			seek_timestamp(k.timestamp);
+
+		seek_run(k);
+	}
+
+	virtual uint64_t estimate() const {
+		return std::min(m_docs->cardinality(), m_list.estimate());
+	}
+
+	virtual std::string str() const {
+		return m_name;
+	}
+
+	virtual size_t memory() const {
+		return m_list.memory() + m_docs->memory() + m_run.size() * sizeof(key);
+	}
+
+private:
+	std::string m_name;
+	std::shared_ptr<const bitmap> m_docs;
+	index_postings<T> m_list;
+	bool m_compact;
+
+	// sorted matching documents with the same timestamp, @m_pos points to the current one,
+	// all matching documents if they have been looked up in the dictionary (@m_lookup)
+	std::vector<key> m_run;
+	size_t m_pos = 0;
+	bool m_lookup = false;
+
+	// every dictionary chunk contains @dictionary_chunk::chunk_size documents, documents are looked up
+	// if their chunks contain fewer documents than the documents index has in the requested range,
+	// returns false if any of them is not in the dictionary, documents index is read in this case
+	bool lookup(T &t, const eurl &dictionary, const time_range &range) {
+		if (m_docs->cardinality() > lookup_max_documents)
+			return false;
+
+		std::vector<uint32_t> nums;
+		uint64_t chunks = 0;
+		uint32_t found;
+		for (uint32_t num = 0; m_docs->lower_bound(num, found); num = found + 1) {
+			if (nums.empty() || found / dictionary_chunk::chunk_size != nums.back() / dictionary_chunk::chunk_size)
+				chunks++;
+
+			nums.push_back(found);
+			if (found == UINT32_MAX)
+				break;
+		}
+
+		if (chunks * dictionary_chunk::chunk_size >= m_list.estimate())
+			return false;
+
+		std::vector<key> docs;
+		document_dictionary<T> dict(t, dictionary);
+		if (dict.lookup(nums, docs) < 0)
+			return false;
+
+		m_run.clear();
+		m_pos = 0;
+		for (const auto &doc: docs) {
+			if (!range.contains(doc.timestamp))
+				continue;
+
+			if (m_compact) {
+				m_run.emplace_back(compact_key::encode(doc, doc.number));
+			} else {
+				m_run.emplace_back(doc);
+			}
+		}
+
+		std::sort(m_run.begin(), m_run.end());
+		m_lookup = true;
+		return true;
+	}
+
+	// the smallest key with given timestamp, documents index is ordered differently from compact keys
+	// within the same timestamp, thus it is only positioned by timestamp
+	static key timestamp_key(uint64_t timestamp) {
+		key k;
+		k.timestamp = timestamp;
+		return k;
+	}
+
+	void seek_timestamp(uint64_t timestamp) {
+		m_list.seek(timestamp_key(timestamp));
+		load_run();
+	}
+
+	// moves to the first key of the current or the following runs which is not less than @k
+	void seek_run(const key &k) {
+		while (!end()) {
+			m_pos = std::lower_bound(m_run.begin() + m_pos, m_run.end(), k) - m_run.begin();
+			if (!end())
+				return;
+
+			load_run();
+		}
+	}
+
+	void load_run() {
+		m_run.clear();
+		m_pos = 0;
+
+		// looked up documents are the only run
+		if (m_lookup)
+			return;
+
+		while (m_run.empty() && !m_list.end()) {
+			uint64_t timestamp = m_list.current().timestamp;
+
+			for (; !m_list.end() && m_list.current().timestamp == timestamp; m_list.next()) {
+				const key &k = m_list.current();
+
+				uint32_t num;
+				if (!document_number(k, num) || !m_docs->contains(num))
+					continue;
+
+				if (m_compact) {
+					m_run.emplace_back(compact_key::encode(k, num));
+					m_run.back().positions.clear();
+				} else {
+					m_run.emplace_back(k);
+					m_run.back().positions.clear();
+				}
+			}
+		}
+
+		std::sort(m_run.begin(), m_run.end());
+	}
+};
+
+}} // namespace ioremap::greylock
+
+namespace msgpack {
+static inline ioremap::greylock::dense_term &operator >>(msgpack::object o, ioremap::greylock::dense_term &term)
+{
+	if (o.type != msgpack::type::ARRAY || o.via.array.size != 4) {
+		std::ostringstream ss;
+		ss << "dense term unpack: type: " << o.type <<
+			", must be: " << msgpack::type::ARRAY <<
+			", size: " << o.via.array.size;
+		throw std::runtime_error(ss.str());
+	}
+
+	object *p = o.via.array.ptr;
+	uint16_t version = 0;
+	p[0].convert(&version);
+	if (version != ioremap::greylock::dense_term::serialization_version) {
+		std::ostringstream ss;
+		ss << "dense term unpack: version mismatch: read: " << version <<
+			", must be: " << ioremap::greylock::dense_term::serialization_version;
+		throw std::runtime_error(ss.str());
+	}
+
+	p[1].convert(&term.generation_sec);
+	p[2].convert(&term.generation_nsec);
+	p[3].convert(&term.docs);
+
+	return term;
+}
+
+template <typename Stream>
+inline msgpack::packer<Stream> &operator <<(msgpack::packer<Stream> &o, const ioremap::greylock::dense_term &term)
+{
+	o.pack_array(4);
+	o.pack((int)ioremap::greylock::dense_term::serialization_version);
+	o.pack(term.generation_sec);
+	o.pack(term.generation_nsec);
+	o.pack(term.docs);
+
+	return o;
+}
+} // namespace msgpack
+
+#endif // __INDEXES_BITMAP_HPP
@@ -0,0 +1,199 @@
+#ifndef __INDEXES_DICTIONARY_HPP
+#define __INDEXES_DICTIONARY_HPP
+
+#include "greylock/index.hpp"
+
+#include <map>
+
+namespace ioremap { namespace greylock {
+
+// Compact postings: every document of the mailbox has a dense number (see @document_number()),
+// its id and url are stored once in the mailbox dictionary and postings only contain document timestamp,
+// number and positions, compact key is encoded as follows:
+//  - @key.timestamp is the document timestamp
+//  - @key.number is the document number, keys with equal timestamps are compared by it (see @key::compare())
+//  - @key.id and @key.url are empty
+//
+// Index stores either compact or full keys, its posting format is kept in the index metadata,
+// see @index_meta::posting_format()
+struct compact_key {
+	static key encode(const key &doc, uint32_t num) {
+		key k;
+		k.timestamp = doc.timestamp;
+		k.number = num;
+		k.positions = doc.positions;
+
+		return k;
+	}
+
+	// returns false if @k is not a compact key
+	static bool decode(const key &k, uint32_t &num) {
+		if (!k.compact())
+			return false;
+
+		num = k.number;
+		return true;
+	}
+};
+
+// Dictionary entries of @chunk_size consecutive document numbers are stored in a single object,
+// thus page of results is resolved with a few reads
+struct dictionary_chunk {
+	enum {
+		chunk_size = 256,
+	};
+
+	struct entry {
+		std::string id;
+		eurl url;
+
+		// timestamp of the document key, documents are looked up by number (see @document_dictionary::lookup())
+		uint64_t timestamp = 0;
+
+		MSGPACK_DEFINE(id, url, timestamp);
+	};
+
+	std::vector<entry> entries;
+
+	MSGPACK_DEFINE(entries);
+
+	void load(const void *data, size_t size) {
+		msgpack::unpacked result;
+		msgpack::unpack(&result, (const char *)data, size);
+		result.get().convert(this);
+	}
+
+	std::string save() const {
+		std::stringstream ss;
+		msgpack::pack(ss, *this);
+		return ss.str();
+	}
+};
+
+template <typename T>
+class document_dictionary {
+public:
+	document_dictionary(T &t, const eurl &base) : m_t(t), m_base(base) {}
+
+	// stores id and url of the document @doc with number @num, previous entry is replaced
+	int insert(uint32_t num, const key &doc) {
+		dictionary_chunk chunk;
+		int err = read(num / dictionary_chunk::chunk_size, chunk);
+		if (err < 0 && err != -ENOENT)
+			return err;
+
+		size_t pos = num % dictionary_chunk::chunk_size;
+		if (chunk.entries.size() <= pos)
+			chunk.entries.resize(pos + 1);
+
+		chunk.entries[pos].id = doc.id;
+		chunk.entries[pos].url = doc.url;
+		chunk.entries[pos].timestamp = doc.timestamp;
+
+		std::vector<status> wr = m_t.write(chunk_url(num / dictionary_chunk::chunk_size), chunk.save());
+		for (auto &r: wr) {
+			if (!r.error)
+				return 0;
+		}
+
+		return -EIO;
+	}
+
+	// replaces compact keys in @docs with document ids and urls, keys which are not compact are left intact,
+	// every chunk is read once, returns the first error, documents of the missing chunks are not resolved
+	int resolve(const std::vector<key *> &docs) {
+		std::map<uint32_t, std::vector<std::pair<key *, uint32_t>>> chunks;
+		for (key *doc: docs) {
+			uint32_t num;
+			if (compact_key::decode(*doc, num))
+				chunks[num / dictionary_chunk::chunk_size].emplace_back(doc, num);
+		}
+
+		int ret = 0;
+		for (const auto &c: chunks) {
+			dictionary_chunk chunk;
+			int err = read(c.first, chunk);
+			if (err < 0) {
+				if (ret == 0)
+					ret = err;
+				continue;
+			}
+
+			for (const auto &p: c.second) {
+				size_t pos = p.second % dictionary_chunk::chunk_size;
+				if (pos >= chunk.entries.size() || chunk.entries[pos].id.empty()) {
+					if (ret == 0)
+						ret = -ENOENT;
+					continue;
+				}
+
+				p.first->id = chunk.entries[pos].id;
+				p.first->url = chunk.entries[pos].url;
+			}
+		}
+
+		return ret;
+	}
+
+	// sets @docs to the keys of documents with sorted numbers @nums, every chunk is read once,
+	// keys carry document numbers (see @key::number) and no positions,
+	// returns -ENOENT if any document is missing or has been stored without timestamp
+	int lookup(const std::vector<uint32_t> &nums, std::vector<key> &docs) {
+		docs.clear();
+		docs.reserve(nums.size());
+
+		dictionary_chunk chunk;
+		bool loaded = false;
+		uint32_t chunk_num = 0;
+
+		for (uint32_t num: nums) {
+			if (!loaded || num / dictionary_chunk::chunk_size != chunk_num) {
+				chunk_num = num / dictionary_chunk::chunk_size;
+				int err = read(chunk_num, chunk);
+				if (err < 0)
+					return err;
+
+				loaded = true;
+			}
+
+			size_t pos = num % dictionary_chunk::chunk_size;
+			if (pos >= chunk.entries.size() || chunk.entries[pos].id.empty())
+				return -ENOENT;
+
+			const dictionary_chunk::entry &e = chunk.entries[pos];
+
+			key k;
+			k.id = e.id;
+			k.url = e.url;
+			k.timestamp = e.timestamp;
+			k.number = num;
+			docs.emplace_back(k);
+		}
+
+		return 0;
+	}
+
+private:
+	T &m_t;
+	eurl m_base;
+
+	eurl chunk_url(uint32_t chunk) const {
+		eurl url;
+		url.bucket = m_base.bucket;
+		url.key = m_base.key + "." + elliptics::lexical_cast(chunk);
+		return url;
+	}
+
+	int read(uint32_t chunk_num, dictionary_chunk &chunk) {
+		status e = m_t.read(chunk_url(chunk_num));
+		if (e.error)
+			return e.error;
+
+		chunk.load(e.data.data(), e.data.size());
+		return 0;
+	}
+};
+
+}} // namespace ioremap::greylock
+
+#endif // __INDEXES_DICTIONARY_HPP
@@ -14,7 +14,8 @@ typedef blackhole::wrapper_t<logger_base> logger;
 
 struct index_meta {
 	enum {
-		serialization_version_6 = 6
+		serialization_version_6 = 6,
+		serialization_version_7,
 	};
 
 	index_meta() {
@@ -37,6 +38,9 @@ struct index_meta {
 		generation_number_sec = o.generation_number_sec.load();
 		generation_number_nsec = o.generation_number_nsec.load();
 		num_keys = o.num_keys.load();
+		num_keys_valid = o.num_keys_valid;
+		interior_keys_valid = o.interior_keys_valid;
+		flags = o.flags;
 
 		return *this;
 	}
@@ -48,6 +52,41 @@ struct index_meta {
 	std::atomic<unsigned long long> generation_number_nsec;
 	std::atomic<unsigned long long> num_keys;
 
+	// metadata written in version 6 format does not contain number of keys,
+	// such indexes have to be recounted before @num_keys can be trusted
+	bool num_keys_valid = true;
+
+	// before version 7 keys in interior pages did not carry timestamp of the first key of the child page,
+	// such trees can not be descended by time until interior keys are rebuilt
+	bool interior_keys_valid = true;
+
+	// index format flags, introduced in version 7 together with key counters and interior key timestamps
+	uint64_t flags = 0;
+
+	// Posting format: index of the mailbox word stores either full document keys
+	// or compact keys (see @compact_key), formats can not be mixed in the same index,
+	// since keys of different formats never match each other.
+	// Indexes which have been written before the format was stored do not have either flag.
+	enum {
+		flag_full_postings = 1 << 0,
+		flag_compact_postings = 1 << 1,
+		posting_format_mask = flag_full_postings | flag_compact_postings,
+
+		// key counters and interior keys of the index written in version 6 format have not been rebuilt yet,
+		// this is only stored in packed metadata, @num_keys_valid and @interior_keys_valid are cleared instead
+		flag_keys_not_rebuilt = 1 << 2,
+	};
+
+	// returns format flag of the stored keys, 0 if index is empty and its format has not been set yet,
+	// non-empty index without format has been written before compact postings were introduced
+	uint64_t posting_format() const {
+		uint64_t format = flags & posting_format_mask;
+		if (format == 0 && (!num_keys_valid || num_keys != 0))
+			format = flag_full_postings;
+
+		return format;
+	}
+
 	void update_generation_number() {
 		struct timespec ts;
 		clock_gettime(CLOCK_REALTIME, &ts);
@@ -72,20 +111,53 @@ struct index_meta {
 			", num_pages: " << num_pages <<
 			", num_leaf_pages: " << num_leaf_pages <<
 			", generation_number: " << generation_number_sec << "." << generation_number_nsec <<
-			", num_keys: " << num_keys
+			", num_keys: " << num_keys <<
+			(num_keys_valid ? "" : " (not counted)") <<
+			(interior_keys_valid ? "" : " (old interior keys)") <<
+			((flags & flag_compact_postings) ? ", compact postings" : "") <<
+			((flags & flag_full_postings) ? ", full postings" : "")
 			;
 		return ss.str();
 	}
 };
 
+// thrown when index which is not allowed to be created does not exist,
+// i.e. its metadata has not been found in any group
+class index_not_found : public std::runtime_error {
+public:
+	index_not_found(const std::string &what) : std::runtime_error(what) {}
+};
+
 struct recursion {
 	key page_start;
 	key split_key;
+
+	// number of keys in the subtree of the processed page after insertion
+	uint64_t page_keys = 0;
 };
 
 struct remove_recursion {
 	key page_start;
-	bool removed = false;
+
+	// number of keys in the subtree of the processed page after removal
+	uint64_t page_keys = 0;
+
+	// processed page has become empty, parent page unlinks it and removes it from the storage
+	bool empty = false;
+	bool leaf = false;
+
+	// next page in the chain of the processed page
+	eurl next;
+};
+
+struct truncate_recursion {
+	key page_start;
+
+	// number of keys in the subtree of the processed page after truncation
+	uint64_t page_keys = 0;
+
+	// new first page at every level below the processed page, the last entry is the first leaf
+	std::vector<eurl> first_pages;
 };
 
 template <typename T>
@@ -102,9 +174,12 @@ public:
 		};
 
 		std::vector<separate_index_meta> mg;
+		bool not_found = !meta.empty();
 
 		for (auto it = meta.begin(), end = meta.end(); it != end; ++it) {
 			if (it->error) {
+				if (it->error != -ENOENT)
+					not_found = false;
 				continue;
 			}
 
@@ -129,6 +204,8 @@ public:
 
 			std::ostringstream ss;
 			ss << "index: could not read index metadata from '" << sk.str() << "'and not allowed to create new index";
+			if (not_found)
+				throw index_not_found(ss.str());
 			throw std::runtime_error(ss.str());
 		}
 
@@ -173,6 +250,10 @@ public:
 			throw std::runtime_error(ss.str());
 		}
 
+		if (!m_read_only && (!m_meta.num_keys_valid || !m_meta.interior_keys_valid)) {
+			rebuild_interior_keys();
+		}
+
 		if (recovery_groups.empty())
 			return;
 
@@ -222,6 +303,26 @@ public:
 		return m_sk;
 	}
 
+	// keys written into this index are of posting @format (see @index_meta::posting_format()),
+	// empty index takes it, returns -EINVAL if index already stores keys of the other format
+	int set_posting_format(uint64_t format) {
+		if (m_read_only)
+			return -EPERM;
+
+		uint64_t stored = m_meta.posting_format();
+		if (stored == format)
+			return 0;
+
+		if (stored != 0) {
+			BH_LOG(m_log, INDEXES_LOG_ERROR, "index: %s: posting format mismatch: stored: %llx, requested: %llx",
+					m_sk.str().c_str(), (unsigned long long)stored, (unsigned long long)format);
+			return -EINVAL;
+		}
+
+		m_meta.flags |= format;
+		return 0;
+	}
+
 	key search(const key &obj) const {
 		auto found = search(m_sk, obj);
 		if (found.second < 0)
@@ -256,7 +357,7 @@ public:
 			return -EPERM;
 
 		remove_recursion tmp;
-		int ret = remove(m_sk, obj, tmp);
+		int ret = remove(m_sk, obj, tmp, eurl());
 		if (ret < 0)
 			return ret;
 
@@ -264,15 +365,133 @@ public:
 		return 0;
 	}
 
+	int truncate(uint64_t cutoff) const {
+		return -EPERM;
+	}
+
+	// removes all keys with timestamp less than @cutoff
+	//
+	// since keys are ordered by timestamp, expired keys always form a prefix of the index,
+	// subtrees which are completely older than @cutoff are unlinked from their parents and their pages
+	// are removed from the storage without being rewritten, only pages on the path to the first
+	// not expired key are trimmed and written back
+	//
+	// metadata counters are updated in bulk using per-subtree key counters
+	int truncate(uint64_t cutoff) {
+		if (m_read_only)
+			return -EPERM;
+
+		uint64_t num_keys = m_meta.num_keys;
+		uint64_t num_pages = m_meta.num_pages;
+
+		truncate_recursion rec;
+		int err = truncate(m_sk, cutoff, rec);
+		if (err < 0)
+			return err;
+
+		// all pages of every level form a single chain, the last page of the upper level
+		// points to the first page of the next level, which might have been removed
+		err = relink_levels(rec.first_pages);
+		if (err < 0)
+			return err;
+
+		m_meta.update_generation_number();
+
+		BH_LOG(m_log, INDEXES_LOG_INFO, "index: %s: truncate: cutoff: %llu, removed keys: %llu, removed pages: %llu, "
+				"meta: %s",
+				m_sk.str().c_str(), (unsigned long long)cutoff,
+				(unsigned long long)(num_keys - m_meta.num_keys), (unsigned long long)(num_pages - m_meta.num_pages),
+				m_meta.str().c_str());
+		return 0;
+	}
+
+	int destroy() const {
+		return -EPERM;
+	}
+
+	// removes all pages of the index and its metadata,
+	// index object can not be used after this call
+	int destroy() {
+		if (m_read_only)
+			return -EPERM;
+
+		size_t height = 0;
+		for (eurl url = m_sk;;) {
+			status e = m_t.read(url);
+			if (e.error)
+				return e.error;
+
+			page p;
+			p.load(e.data.data(), e.data.size());
+			if (p.is_leaf() || p.is_empty())
+				break;
+
+			url = p.objects.front().url;
+			height++;
+		}
+
+		drop_subtree(m_sk, height);
+		m_t.remove(meta_key());
+
+		BH_LOG(m_log, INDEXES_LOG_INFO, "index: %s: destroyed: height: %zd", m_sk.str().c_str(), height);
+
+		// there is no metadata to update anymore
+		m_read_only = true;
+		return 0;
+	}
+
 	iterator<T> begin(const std::string &k) const {
 		key zero;
 		zero.id = k;
 
-		auto found = search(m_sk, zero);
-		if (found.second < 0)
-			found.second = 0;
+		return begin(zero);
+	}
 
-		return iterator<T>(m_t, found.first, found.second);
+	// returns iterator pointing to the first key which is not less than @start,
+	// iterator stops (becomes equal to @end()) at the first key with timestamp greater than @max_timestamp
+	//
+	// only pages on the path from the root to the leaf containing @start and leaves
+	// overlapping [@start, @max_timestamp] range are read
+	iterator<T> begin(const key &start, uint64_t max_timestamp = ~0ULL) const {
+		eurl leaf_url;
+		auto found = search(m_sk, start, &leaf_url);
+		if (!found.first.is_leaf())
+			return end();
+
+		size_t pos = found.first.lower_bound(start);
+		return iterator<T>(m_t, found.first, pos, max_timestamp, m_sk, leaf_url);
+	}
+
+	// the same as above, but reads only leaf page @hint (usually saved in paging cookie) instead of descending the tree
+	//
+	// hint is used only if it is a leaf page of this index whose first key is not greater than @start,
+	// i.e. page could not have been removed, and keys could not have been moved out of it into the preceding page,
+	// keys moved into the new pages by splits are still reachable via @page.next, otherwise tree is descended
+	iterator<T> begin(const page_position &hint, const key &start, uint64_t max_timestamp = ~0ULL) const {
+		if (hint.empty() || !(hint.page.key == m_sk.key || hint.page.key.compare(0, m_meta_url.key.size() + 1,
+						m_meta_url.key + ".") == 0))
+			return begin(start, max_timestamp);
+
+		status e = m_t.read(hint.page);
+		if (e.error)
+			return begin(start, max_timestamp);
+
+		page p;
+		p.load(e.data.data(), e.data.size());
+		if (!p.is_leaf() || p.objects.empty() || start < p.objects.front())
+			return begin(start, max_timestamp);
+
+		size_t pos = hint.offset;
+		if (pos >= p.objects.size() || p.objects[pos] != start)
+			pos = p.lower_bound(start);
+
+		BH_LOG(m_log, INDEXES_LOG_NOTICE, "index: %s: begin: %s: using page hint: %s, offset: %zd",
+				m_sk.str().c_str(), start.str().c_str(), hint.page.str().c_str(), pos);
+		return iterator<T>(m_t, p, pos, max_timestamp, m_sk, hint.page);
+	}
+
+	iterator<T> begin(const time_range &range) const {
+		return begin(range.start_key(), range.end_timestamp());
 	}
 
 	iterator<T> begin() const {
@@ -302,6 +521,36 @@ public:
 		return ret;
 	}
 
+	// returned when index (or part of it) has been written without key counters
+	static const uint64_t unknown_count = ~0ULL;
+
+	// returns number of keys within @range
+	//
+	// per-subtree counters stored in interior pages are used for subtrees which are fully covered by the range,
+	// only pages on the paths to the range boundaries are read, keys in the boundary leaves are counted exactly
+	// @unknown_count is returned if index has been written without counters and was not recounted yet,
+	// or if the range is bounded and interior keys of the index have not been rebuilt yet
+	uint64_t estimate_count(const time_range &range = time_range()) const {
+		if (!m_meta.num_keys_valid)
+			return unknown_count;
+
+		if (range.is_bounded() && !m_meta.interior_keys_valid)
+			return unknown_count;
+
+		if (!range.is_bounded())
+			return m_meta.num_keys;
+
+		return estimate_count(range.start_key(), range.end_timestamp());
+	}
+
+	// returns number of keys not less than @start with timestamp not greater than @max_timestamp
+	uint64_t estimate_count(const key &start, uint64_t max_timestamp) const {
+		if (!m_meta.num_keys_valid || !m_meta.interior_keys_valid)
+			return unknown_count;
+
+		return estimate_count(m_sk, start, max_timestamp);
+	}
+
 	page_iterator<T> page_begin() const {
 		return page_iterator<T>(m_t, m_sk);
 	}
@@ -359,6 +608,166 @@ private:
 				meta_key().str(), m_meta.str().c_str(), ms.size());
 	}
 
+	uint64_t estimate_count(const eurl &page_key, const key &start, uint64_t max_timestamp) const {
+		status e = m_t.read(page_key);
+		if (e.error)
+			return unknown_count;
+
+		page p;
+		p.load(e.data.data(), e.data.size());
+
+		if (p.is_leaf()) {
+			uint64_t num = 0;
+			for (size_t pos = p.lower_bound(start); pos < p.objects.size(); ++pos) {
+				if (p.objects[pos].timestamp > max_timestamp)
+					break;
+				num++;
+			}
+
+			return num;
+		}
+
+		uint64_t num = 0;
+		for (size_t pos = 0; pos < p.objects.size(); ++pos) {
+			const key &child = p.objects[pos];
+			if (child.timestamp > max_timestamp)
+				break;
+
+			// child subtree contains keys in [@child, @next) range
+			const key *next = (pos + 1 < p.objects.size()) ? &p.objects[pos + 1] : NULL;
+			if (next && *next <= start)
+				continue;
+
+			// the whole subtree is within the range, there is no need to read it
+			bool covered = start <= child && (next ? next->timestamp <= max_timestamp : max_timestamp == ~0ULL);
+
+			uint64_t child_num;
+			if (covered) {
+				child_num = child.subtree_keys;
+			} else {
+				child_num = estimate_count(child.url, start, max_timestamp);
+			}
+
+			if (child_num == unknown_count)
+				return unknown_count;
+
+			num += child_num;
+		}
+
+		return num;
+	}
+
+	// walks over the whole tree, fixes per-subtree counters and first key timestamps in interior pages
+	// and sets @num_keys in metadata
+	// this is only needed once for indexes written before counters and interior key timestamps (version 6)
+	// were introduced, if some page can not be read, metadata stays invalid and the next writer retries
+	void rebuild_interior_keys() {
+		key first;
+		uint64_t num = 0;
+		int err = rebuild_interior_keys(m_sk, first, num);
+		if (err < 0) {
+			BH_LOG(m_log, INDEXES_LOG_ERROR, "index: %s: could not rebuild interior keys, error: %d, meta: %s",
+					m_sk.str().c_str(), err, m_meta.str().c_str());
+			return;
+		}
+
+		m_meta.num_keys = num;
+		m_meta.num_keys_valid = true;
+		m_meta.interior_keys_valid = true;
+
+		BH_LOG(m_log, INDEXES_LOG_NOTICE, "index: %s: rebuilt interior keys: meta: %s",
+				m_sk.str().c_str(), m_meta.str().c_str());
+	}
+
+	// @num is set to the number of keys in the subtree, @first is set to the first key of the subtree,
+	// returns negative error if any page of the subtree could not be read
+	int rebuild_interior_keys(const eurl &page_key, key &first, uint64_t &num) {
+		num = 0;
+
+		status e = m_t.read(page_key);
+		if (e.error)
+			return e.error;
+
+		page p;
+		p.load(e.data.data(), e.data.size());
+
+		if (p.is_leaf()) {
+			if (!p.objects.empty())
+				first = p.objects.front();
+			num = p.objects.size();
+			return 0;
+		}
+
+		bool changed = false;
+		for (auto &child: p.objects) {
+			key child_first;
+			uint64_t child_num;
+			int err = rebuild_interior_keys(child.url, child_first, child_num);
+			if (err < 0)
+				return err;
+
+			if (child.subtree_keys != child_num) {
+				child.subtree_keys = child_num;
+				changed = true;
+			}
+
+			if (child_first && child != child_first) {
+				child.set_order(child_first);
+				changed = true;
+			}
+
+			num += child_num;
+		}
+
+		if (!p.objects.empty()) {
+			first.set_order(p.objects.front());
+		}
+
+		if (changed)
+			check(m_t.write(page_key, p.save()));
+
+		return 0;
+	}
+
+	// read-only search over the tree whose interior keys do not carry timestamps:
+	// interior keys can not be used to descend by (timestamp, id), thus the leftmost leaf is found
+	// and leaf chain is walked until the leaf which may contain @obj
+	std::pair<page, int> search_leaves(const eurl &page_key, const key &obj, eurl *leaf_key) const {
+		eurl url = page_key;
+		page p;
+
+		for (;;) {
+			status e = m_t.read(url);
+			if (e.error)
+				return std::make_pair(page(), e.error);
+
+			p.load(e.data.data(), e.data.size());
+			if (p.is_leaf() || p.is_empty())
+				break;
+
+			url = p.objects.front().url;
+		}
+
+		while (!p.objects.empty() && p.objects.back() < obj && !p.next.empty()) {
+			status e = m_t.read(p.next);
+			if (e.error)
+				break;
+
+			page next;
+			next.load(e.data.data(), e.data.size());
+			if (next.objects.empty())
+				break;
+
+			url = p.next;
+			p = next;
+		}
+
+		if (leaf_key)
+			*leaf_key = url;
+
+		return std::make_pair(p, p.search_node(obj));
+	}
+
 	void start_page_init() {
 		page start_page;
 
@@ -366,7 +775,11 @@ private:
 		m_meta.num_pages++;
 	}
 
-	std::pair<page, int> search(const eurl &page_key, const key &obj) const {
+	// if @leaf_key is not null, it is set to the address of the leaf page the search has ended at
+	std::pair<page, int> search(const eurl &page_key, const key &obj, eurl *leaf_key = NULL) const {
+		if (!m_meta.interior_keys_valid)
+			return search_leaves(page_key, obj, leaf_key);
+
 		status e = m_t.read(page_key);
 		if (e.error) {
 			return std::make_pair(page(), e.error);
@@ -375,6 +788,9 @@ private:
 		page p;
 		p.load(e.data.data(), e.data.size());
 
+		if (leaf_key && p.is_leaf())
+			*leaf_key = page_key;
+
 		int found_pos = p.search_node(obj);
 		if (found_pos < 0) {
 			BH_LOG(m_log, INDEXES_LOG_NOTICE, "index: search: %s: page: %s -> %s, found_pos: %d",
@@ -393,7 +809,7 @@ private:
 		if (p.is_leaf())
 			return std::make_pair(p, found_pos);
 
-		return search(p.objects[found_pos].url, obj);
+		return search(p.objects[found_pos].url, obj, leaf_key);
 	}
 
 	// returns true if page at @page_key has been split after insertion
@@ -429,7 +845,7 @@ private:
 				//
 				// this path can only be taken once - when new empty index has been created
 				key leaf_key;
-				leaf_key.id = obj.id;
+				leaf_key.set_order(obj);
 				leaf_key.url = generate_page_url();
 
 				page leaf(true), unused_split;
@@ -440,6 +856,8 @@ private:
 				if (err)
 					return err;
 
+				leaf_key.subtree_keys = leaf.subtree_keys();
+
 				// no need to perform recursion unwind, since there were no entry for this new leaf
 				// which can only happen when page was originally empty
 				// do not increment @num_keys since it is not a leaf page
@@ -456,6 +874,10 @@ private:
 
 				m_meta.num_pages++;
 				m_meta.num_leaf_pages++;
+
+				rec.page_start = p.objects.front();
+				rec.split_key = key();
+				rec.page_keys = p.subtree_keys();
 				return 0;
 			}
 
@@ -480,14 +902,21 @@ private:
 			bool want_return = true;
 
 			if (found != rec.page_start) {
-				BH_LOG(m_log, INDEXES_LOG_NOTICE, "index: p: %s: replace: key: %s: id: %s -> %s",
-					p.str().c_str(), found.str().c_str(), found.id.c_str(), rec.page_start.id.c_str());
-				found.id = rec.page_start.id;
+				BH_LOG(m_log, INDEXES_LOG_NOTICE, "index: p: %s: replace: key: %s -> %s",
+					p.str().c_str(), found.str().c_str(), rec.page_start.str().c_str());
+				found.set_order(rec.page_start);
 
 				// page has been changed, it must be written into storage
 				want_return = false;
 			}
 
+			if (found.subtree_keys != rec.page_keys) {
+				// number of keys in the underlying subtree has been changed,
+				// page has to be written to keep counters in sync
+				found.subtree_keys = rec.page_keys;
+				want_return = false;
+			}
+
 			if (rec.split_key) {
 				// not a leaf page, do not increment @num_keys
 				p.insert_and_split(rec.split_key, split, replaced);
@@ -500,6 +929,7 @@ private:
 			if (want_return) {
 				rec.page_start = p.objects.front();
 				rec.split_key = key();
+				rec.page_keys = p.subtree_keys();
 				return 0;
 			}
 		} else {
@@ -515,7 +945,8 @@ private:
 		if (!split.is_empty()) {
 			// generate key for split page
 			rec.split_key.url = generate_page_url();
-			rec.split_key.id = split.objects.front().id;
+			rec.split_key.set_order(split.objects.front());
+			rec.split_key.subtree_keys = split.subtree_keys();
 
 			split.next = p.next;
 			p.next = rec.split_key.url;
@@ -533,6 +964,8 @@ private:
 				m_meta.num_leaf_pages++;
 		}
 
+		rec.page_keys = p.subtree_keys();
+
 		if (!split.is_empty() && page_key == m_sk) {
 			// if we split root page, put old root data into new key
 			// root must always be accessible via start key
@@ -541,7 +974,8 @@ private:
 
 			key old_root_key;
 			old_root_key.url = generate_page_url();
-			old_root_key.id = p.objects.front().id;
+			old_root_key.set_order(p.objects.front());
+			old_root_key.subtree_keys = p.subtree_keys();
 
 			err = check(m_t.write(old_root_key.url, p.save()));
 			if (err)
@@ -578,9 +1012,10 @@ private:
 		return err;
 	}
 
-	// returns true if page at @page_key has been split after insertion
-	// key used to store split part has been saved into @obj.url
-	int remove(const eurl &page_key, const key &obj, remove_recursion &rec) {
+	// removes @obj from the subtree rooted at @page_key
+	// @rec.page_start is set to the new first key of the page if it has been changed
+	// @left is the previous page at the same level as @page_key, it is empty for the first page of the level
+	int remove(const eurl &page_key, const key &obj, remove_recursion &rec, const eurl &left) {
 		status e = m_t.read(page_key);
 		if (e.error) {
 			return e.error;
@@ -613,21 +1048,36 @@ private:
 			page_key.str().c_str(), p.str().c_str(),
 			found_pos, found.str().c_str());
 
-		if (p.is_leaf() || rec.removed) {
-			if (p.is_leaf())
-				p.remove(found_pos);
+		if (p.is_leaf()) {
+			p.remove(found_pos);
 			m_meta.num_keys--;
 		} else {
-			err = remove(found.url, obj, rec);
+			eurl child_left;
+			if (found_pos > 0)
+				child_left = p.objects[found_pos - 1].url;
+
+			err = remove(found.url, obj, rec, child_left);
 			if (err < 0)
 				return err;
 
-			// we have removed key from the underlying page, and the first key of that page hasn't been changed
-			if (!rec.page_start)
-				return 0;
+			if (rec.empty && found_pos == 0 && !left.empty())
+				child_left = last_child(left);
+
+			if (rec.empty && !child_left.empty()) {
+				err = unlink_page(found.url, child_left, rec);
+				if (err)
+					return err;
 
-			// the first key of the underlying page has been changed, update appropriate key in the current page
-			found.id = rec.page_start.id;
+				p.remove(found_pos);
+			} else {
+				// the first key of the underlying page has been changed, update appropriate key in the current page
+				if (rec.page_start) {
+					found.set_order(rec.page_start);
+				}
+
+				found.subtree_keys = rec.page_keys;
+				p.objects[found_pos] = found;
+			}
 		}
 
 		BH_LOG(m_log, INDEXES_LOG_NOTICE, "index: remove: %s: returned: %s -> %s, found_pos: %d, found_key: %s",
@@ -635,30 +1085,197 @@ private:
 				page_key.str().c_str(), p.str().c_str(),
 				found_pos, found.str().c_str());
 
-		rec.page_start.id.clear();
-		rec.removed = false;
+		rec.page_start = key();
+
+		// we have to update higher level page if start of the current page has been changed
+		// we can not use @found here, since it could be removed from the current page
+		if (found_pos == 0 && p.objects.size() != 0) {
+			rec.page_start.set_order(p.objects.front());
+		}
+
+		rec.page_keys = p.subtree_keys();
+
+		// empty page is removed by its parent, which also points the previous page in the chain to the next one,
+		// the root page and the first page of every level are never removed, since the previous page in the chain
+		// is not known for them, iterators skip such empty pages and new keys may be inserted there later
+		rec.empty = p.is_empty();
+		rec.leaf = p.is_leaf();
+		rec.next = p.next;
+
+		err = check(m_t.write(page_key, p.save()));
+		if (err)
+			return err;
+
+		return 0;
+	}
+
+	// returns address of the last child of the interior page @page_key, or empty url if there is no such child
+	eurl last_child(const eurl &page_key) const {
+		status e = m_t.read(page_key);
+		if (e.error)
+			return eurl();
+
+		page p;
+		p.load(e.data.data(), e.data.size());
+		if (p.is_leaf() || p.is_empty())
+			return eurl();
+
+		return p.objects.back().url;
+	}
+
+	// points @prev page to the page following empty page @page_key in the chain and removes @page_key from the storage
+	int unlink_page(const eurl &page_key, const eurl &prev, const remove_recursion &rec) {
+		status e = m_t.read(prev);
+		if (e.error)
+			return e.error;
+
+		page p;
+		p.load(e.data.data(), e.data.size());
+
+		p.next = rec.next;
+		int err = check(m_t.write(prev, p.save()));
+		if (err)
+			return err;
+
+		BH_LOG(m_log, INDEXES_LOG_NOTICE, "index: remove: unlinked empty page: %s, previous page: %s -> %s",
+				page_key.str().c_str(), prev.str().c_str(), rec.next.str().c_str());
 
-		if (p.objects.size() != 0) {
-			// we have to update higher level page if start of the current page has been changed
-			// we can not use @found here, since it could be removed from the current page
-			if (found_pos == 0) {
-				rec.page_start.id = p.objects.front().id;
+		m_meta.num_pages--;
+		if (rec.leaf)
+			m_meta.num_leaf_pages--;
+
+		std::vector<status> rm = m_t.remove(page_key);
+		for (auto &r: rm) {
+			if (r.error) {
+				BH_LOG(m_log, INDEXES_LOG_ERROR, "index: could not remove unlinked page: %s, group: %d, error: %d",
+						page_key.str().c_str(), r.group, r.error);
 			}
+		}
 
-			err = check(m_t.write(page_key, p.save()));
-			if (err)
-				return err;
+		return 0;
+	}
+
+	int truncate(const eurl &page_key, uint64_t cutoff, truncate_recursion &rec) {
+		status e = m_t.read(page_key);
+		if (e.error) {
+			return e.error;
+		}
+
+		page p;
+		p.load(e.data.data(), e.data.size());
+
+		size_t num = 0;
+		if (p.is_leaf()) {
+			while (num < p.objects.size() && p.objects[num].timestamp < cutoff)
+				num++;
+
+			if (num == 0) {
+				rec.page_start = key();
+				rec.page_keys = p.subtree_keys();
+				return 0;
+			}
+
+			p.remove_prefix(num);
+			m_meta.num_keys -= num;
 		} else {
-			// if current page is empty, we have to remove appropriate link from the higher page
-			rec.removed = true;
+			if (p.is_empty()) {
+				rec.page_start = key();
+				rec.page_keys = 0;
+				return 0;
+			}
 
-			err = check(m_t.remove(page_key));
-			if (err)
+			// child subtree contains keys less than the next child key,
+			// if next child key is older than @cutoff, the whole subtree is expired
+			// the last child is never removed, it is truncated if needed
+			while (num + 1 < p.objects.size() && p.objects[num + 1].timestamp < cutoff)
+				num++;
+
+			key &boundary = p.objects[num];
+
+			truncate_recursion child;
+			int err = truncate(boundary.url, cutoff, child);
+			if (err < 0)
 				return err;
 
-			m_meta.num_pages--;
-			if (p.is_leaf())
-				m_meta.num_leaf_pages--;
+			if (child.page_start) {
+				boundary.set_order(child.page_start);
+			}
+			boundary.subtree_keys = child.page_keys;
+
+			// height of the removed subtrees equals to the height of the boundary subtree
+			for (size_t pos = 0; pos < num; ++pos) {
+				m_meta.num_keys -= p.objects[pos].subtree_keys;
+				drop_subtree(p.objects[pos].url, child.first_pages.size());
+			}
+
+			rec.first_pages.push_back(boundary.url);
+			rec.first_pages.insert(rec.first_pages.end(), child.first_pages.begin(), child.first_pages.end());
+
+			p.remove_prefix(num);
+		}
+
+		BH_LOG(m_log, INDEXES_LOG_NOTICE, "index: truncate: cutoff: %llu, page: %s -> %s, removed entries: %zd",
+				(unsigned long long)cutoff, page_key.str().c_str(), p.str().c_str(), num);
+
+		rec.page_start = key();
+		if (!p.is_empty()) {
+			rec.page_start.set_order(p.objects.front());
+		}
+		rec.page_keys = p.subtree_keys();
+
+		return check(m_t.write(page_key, p.save()));
+	}
+
+	// removes all pages of the subtree from the storage, @height is zero for leaf pages
+	void drop_subtree(const eurl &page_key, size_t height) {
+		if (height > 0) {
+			status e = m_t.read(page_key);
+			if (!e.error) {
+				page p;
+				p.load(e.data.data(), e.data.size());
+
+				for (const auto &child: p.objects) {
+					drop_subtree(child.url, height - 1);
+				}
+			}
+		} else {
+			m_meta.num_leaf_pages--;
+		}
+
+		m_meta.num_pages--;
+
+		std::vector<status> rm = m_t.remove(page_key);
+		for (auto &r: rm) {
+			if (r.error) {
+				BH_LOG(m_log, INDEXES_LOG_ERROR, "index: could not remove unlinked page: %s, group: %d, error: %d",
+						page_key.str().c_str(), r.group, r.error);
+			}
+		}
+	}
+
+	// walks over the rightmost pages of every level and points them to the first page of the next level
+	int relink_levels(const std::vector<eurl> &first_pages) {
+		eurl page_key = m_sk;
+		for (size_t level = 0; level < first_pages.size(); ++level) {
+			status e = m_t.read(page_key);
+			if (e.error)
+				return e.error;
+
+			page p;
+			p.load(e.data.data(), e.data.size());
+
+			if (p.next != first_pages[level]) {
+				p.next = first_pages[level];
+
+				int err = check(m_t.write(page_key, p.save()));
+				if (err)
+					return err;
+			}
+
+			if (p.is_leaf() || p.is_empty())
+				break;
+
+			page_key = p.objects.back().url;
 		}
 
 		return 0;
@@ -727,11 +1344,14 @@ static inline ioremap::greylock::index_meta &operator >>(msgpack::object o, iore
 	uint16_t version = 0;
 	p[0].convert(&version);
 	switch (version) {
-	case ioremap::greylock::index_meta::serialization_version_6: {
-		if (size != ioremap::greylock::index_meta::serialization_version_6) {
+	case ioremap::greylock::index_meta::serialization_version_6:
+	case ioremap::greylock::index_meta::serialization_version_7: {
+		// version 6 array size equals to the version number, version 7 adds number of keys and flags
+		const uint32_t must_be = version == ioremap::greylock::index_meta::serialization_version_6 ? 6 : 8;
+		if (size != must_be) {
 			std::ostringstream ss;
 			ss << "page unpack: array size mismatch: read: " << size <<
-				", must be: " << ioremap::greylock::index_meta::serialization_version_6;
+				", must be: " << must_be;
 			throw std::runtime_error(ss.str());
 		}
 
@@ -751,6 +1371,22 @@ static inline ioremap::greylock::index_meta &operator >>(msgpack::object o, iore
 
 		p[5].convert(&tmp);
 		meta.generation_number_nsec = tmp;
+
+		if (version == ioremap::greylock::index_meta::serialization_version_6) {
+			meta.num_keys = 0;
+			meta.num_keys_valid = false;
+			meta.interior_keys_valid = false;
+			meta.flags = 0;
+			break;
+		}
+
+		p[6].convert(&tmp);
+		meta.num_keys = tmp;
+
+		p[7].convert(&tmp);
+		meta.flags = tmp & ~(unsigned long long)ioremap::greylock::index_meta::flag_keys_not_rebuilt;
+		meta.num_keys_valid = !(tmp & ioremap::greylock::index_meta::flag_keys_not_rebuilt);
+		meta.interior_keys_valid = meta.num_keys_valid;
 		break;
 	}
 	default: {
@@ -767,13 +1403,18 @@ static inline ioremap::greylock::index_meta &operator >>(msgpack::object o, iore
 template <typename Stream>
 inline msgpack::packer<Stream> &operator <<(msgpack::packer<Stream> &o, const ioremap::greylock::index_meta &meta)
 {
-	o.pack_array(ioremap::greylock::index_meta::serialization_version_6);
-	o.pack((int)ioremap::greylock::index_meta::serialization_version_6);
+	o.pack_array(8);
+	o.pack((int)ioremap::greylock::index_meta::serialization_version_7);
 	o.pack(meta.page_index.load());
 	o.pack(meta.num_pages.load());
 	o.pack(meta.num_leaf_pages.load());
 	o.pack(meta.generation_number_sec.load());
 	o.pack(meta.generation_number_nsec.load());
+	o.pack(meta.num_keys.load());
+	uint64_t flags = meta.flags;
+	if (!meta.num_keys_valid || !meta.interior_keys_valid)
+		flags |= ioremap::greylock::index_meta::flag_keys_not_rebuilt;
+	o.pack((unsigned long long)flags);
 
 	return o;
 }
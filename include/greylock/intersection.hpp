@@ -2,7 +2,10 @@
 #define __INDEXES_INTERSECTION_HPP
 
 #include "greylock/index.hpp"
+#include "greylock/partition.hpp"
+#include "greylock/postings.hpp"
 
+#include <chrono>
 #include <map>
 
 namespace ioremap { namespace greylock { namespace intersect {
@@ -15,6 +18,10 @@ struct single_doc_result {
 
 	float relevance = 0;
 
+	// product of the weights of the lists (see @posting_list::weight()), it is less than 1
+	// if document has been matched approximately, for example by the fuzzy term
+	float weight = 1;
+
 	// every entry in this array corresponds to one of the requested index name,
 	// array size will always be equal to requested number of indexes
 	//
@@ -32,170 +39,446 @@ struct result {
 	std::string cookie;
 	long max_number_of_documents = ~0UL;
 
+	// intersection has been stopped by @options.deadline, @docs contains documents found so far,
+	// @completed is false and @cookie points to the first document which has not been checked yet
+	bool deadline_exceeded = false;
+
 	// array of documents which contain all requested indexes
 	std::vector<single_doc_result> docs;
+
+	// number of matching documents found in count mode (see @options.count), @docs is empty in this case
+	uint64_t count = 0;
+
+	// facet counts (see @options.facets): @facets[i] is the number of matching documents present
+	// in the i-th facet list, @facet_buckets is the number of matching documents per bucket of their urls,
+	// @facets_completed is cleared if deadline has stopped counting before the end of the lists
+	std::vector<uint64_t> facets;
+	std::map<std::string, uint64_t> facet_buckets;
+	bool facets_completed = true;
+
+	// positional constraint has not been checked for some words, see @phrase_match::relax()
+	bool phrase_relaxed = false;
+
+	// some query words have been expanded into fewer terms than they match (see @query_node::truncated()),
+	// it is set by the caller which has expanded them
+	bool expansion_truncated = false;
 };
 
-template <typename T>
-class intersector {
-public:
-	intersector(T &t) : m_t(t) {}
-	result intersect(const std::vector<eurl> &indexes) const {
-		std::string start = std::string("\0");
-		return intersect(indexes, start, INT_MAX);
+// Paging cookie: the next key intersection has to return and position of every requested index
+// in the leaf page containing this key.
+//
+// Cookie is self-contained and versioned, thus the next page can be requested from any server,
+// which restarts intersection reading only one leaf page per index. Positions are only hints,
+// the key itself is always enough to restart, if index has been changed, the tree is descended.
+struct paging_cookie {
+	enum {
+		serialization_version = 1,
+	};
+
+	// only timestamp and document id are packed, compact key (see @compact_key) is packed with its number
+	key start;
+
+	// every entry corresponds to one of the requested indexes
+	std::vector<page_position> positions;
+
+	std::string save() const {
+		std::stringstream ss;
+		msgpack::pack(ss, *this);
+		return ss.str();
 	}
 
-	result intersect(const std::vector<eurl> &indexes, std::string &start, size_t num) const {
-		return intersect(indexes, start, num, [&] (const std::vector<eurl> &, result &) {return true;});
+	// returns false if @data is not a packed cookie, for example it may be a bare document id
+	bool load(const std::string &data) {
+		if (data.empty())
+			return false;
+
+		try {
+			msgpack::unpacked result;
+			msgpack::unpack(&result, data.data(), data.size());
+			result.get().convert(this);
+		} catch (const std::exception &) {
+			return false;
+		}
+
+		return true;
 	}
+};
 
-	// search for intersections between all @indexes
-	// starting with the key @start, returning at most @num entries
-	//
-	// after @intersect() completes, it sets @start to the next key to start searching from
-	// user should not change that token, otherwise @intersect() may skip some entries or
-	// return duplicates.
-	//
-	// if number of returned entries is less than requested number @num or if @start has been set to empty string
-	// after call to this function returns, then intersection is completed.
-	//
-	// @result.completed will be set to true in this case.
-	result intersect(const std::vector<eurl> &indexes, std::string &start, size_t num,
-			const std::function<bool (const std::vector<eurl> &, result &)> &finish) const {
-		struct iter {
-			read_only_index<T> idx;
-			greylock::iterator<T> begin, end;
-
-			iter(T &t, const eurl &iname, const std::string &start) :
-				idx(t, iname),
-				begin(idx.begin(start)), end(idx.end())
-			{}
-		};
-
-		// contains vector of iterators pointing to the requested indexes
-		// iterator always points to the smallest document ID not yet pushed into resulting structure (or to client)
-		// or discarded (if other index iterators point to larger document IDs)
-		std::vector<iter> idata;
-		idata.reserve(indexes.size());
-
-		for (auto it = indexes.begin(), end = indexes.end(); it != end; ++it) {
-			iter itr(m_t, *it, start);
-			idata.emplace_back(std::move(itr));
+// positional constraint which is checked for every document containing all requested indexes,
+// documents which do not match are dropped before they are added into the result
+struct phrase_match {
+	enum {
+		// every document which contains all indexes matches
+		match_all = 0,
+		// words of every group must be present in the document at the same relative offsets as in the query
+		match_phrase,
+		// words of every group must be present in the document within window of @distance positions
+		match_proximity,
+	};
+
+	int type = match_all;
+	size_t distance = 0;
+
+	struct word {
+		// position of the index in the requested indexes array
+		size_t index;
+
+		// offsets of this word in the query phrase, the same word may be repeated
+		std::vector<size_t> offsets;
+	};
+
+	// every group is checked separately, for example there is a group per document attribute,
+	// since positions of different attributes are not related to each other
+	std::vector<std::vector<word>> groups;
+
+	// some words have been removed from @groups by @relax(), documents are matched by the rest of the words
+	bool relaxed = false;
+
+	// removes words whose lists do not have positions (for example dense terms) from every group,
+	// documents can not be checked against them, @result.phrase_relaxed tells the client about it
+	void relax(const std::function<bool (size_t index)> &no_positions) {
+		for (auto &group: groups) {
+			size_t size = group.size();
+			group.erase(std::remove_if(group.begin(), group.end(), [&] (const word &w) {
+						return no_positions(w.index);
+					}), group.end());
+
+			if (group.size() != size && type != match_all)
+				relaxed = true;
 		}
+	}
 
-		result res;
+	// @positions contains positions of every requested index in the document, they must be sorted
+	bool check(const std::vector<const std::vector<size_t> *> &positions) const {
+		if (type == match_all)
+			return true;
 
-		while (true) {
-			// contains indexes within @idata array of iterators,
-			// each iterator contains the same and smallest to the known moment reference to the document (i.e. document ID)
-			//
-			// if checking @idata array yelds smaller document ID than that in iterators referenced in @pos,
-			// then we clear @pos and starts pushing the new smallest iterator indexes
-			//
-			// we could break out of the @idata processing, increase the smallest pointing iterator and start over,
-			// but we optimize @idata processing - if there are other iterators in @idata which equal to the smallest
-			// iterator value (document ID), we put them into @pos
-			// Since @pos doesn't contain all indexes (its size doesn't equal to the size of @idata), we will increase
-			// all iterators where we have found the smallest document ID, hopefully they will point to the new document ID,
-			// which might be the same for all iterator among @idata and thus we will push this document ID to the result
-			// structure returned to the client
-			//
-			// Here is an example:
-			//
-			// 1. @idata iterators	0	1	2	3
-			//                      -------------------------
-			// document ids		d0	d2	d3	d3
-			// 			d2	d3	d4	d4
-			// 			d3	d4	d5	d5
-			// 			d4	-	-	-
-			// 			d5	-	-	-
-			//
-			// We start from the top of this table, i.e. row after 'document ids' string
-			// @pos will contain following values during iteration over @idata iterators
-			// 	0 - select the first value
-			// 	0 - skip iterator 1 (d2 document id) since its value is greater than that 0'th iterator value (d0)
-			// 	0 - skip iterator 2
-			// 	0 - skip iterator 3
-			//
-			// @pos contains only 0 index, it is not equal to the size of @idata (4), thus we have to increase 0'th iterator
-			// discarding its first value
-			//
-			// 2. @idata iterators	0	1	2	3
-			//                      -------------------------
-			// document ids		d2	d2	d3	d3
-			// 			d3	d3	d4	d4
-			// 			d4	d4	d5	d5
-			// 			d5	-	-	-
-			// @pos:
-			// 	0 - select the first iterator
-			// 	0 1 - 1'th iterator value equals to the value of the 0'th iterator, append it to the array
-			// 	0 1 - 2'th iterator value (d3) is greater than that of the 0'th iterator (d2)
-			// 	0 1 - the same as above
-			// since size of the @pos is not equal to the size of @idata we increment all iterators which are indexed in @pos
-			//
-			// 3. @idata iterators	0	1	2	3
-			//                      -------------------------
-			// document ids		d3	d3	d3	d3
-			// 			d4	d4	d4	d4
-			// 			d5	-	d5	d5
-			// @pos will contain all 4 indexes, since all iterator's value are the same (d3)
-			// We will increment all iterators and push d3 into resulting array which will be returned to the client,
-			// since size of the @pos array equals to the @idata size
-			//
-			// 4. @idata iterators	0	1	2	3
-			//                      -------------------------
-			// document ids		d4	d4	d4	d4
-			// 			d5	-	d5	d5
-			// We put d4 into resulting array and increment all iterators as above
-			//
-			// 5. @idata iterators	0	1	2	3
-			//                      -------------------------
-			// document ids		d5	-	d5	d5
-			//
-			// @pos:
-			// 	0 - select the first iterator
-			// 	Stop processing, since 1'th iterator is empty. This means no further iteration checks can contain all 4 the same
-			// 	value, thus it is not possible to find any other document with higher ID which will contain all 4 requested
-			// 	indexes.
-			//
-			// 6. Return [d3, d4] values to the client
-			std::vector<int> pos;
+		for (const auto &group: groups) {
+			if (group.empty())
+				continue;
 
-			int current = -1;
-			for (auto idata_it = idata.begin(), idata_end = idata.end(); idata_it != idata_end; ++idata_it) {
-				auto &it = idata_it->begin;
-				auto &e = idata_it->end;
-				++current;
+			bool match = (type == match_phrase) ? check_phrase(group, positions) : check_proximity(group, positions);
+			if (!match)
+				return false;
+		}
 
-				if (it == e) {
-					res.completed = true;
-					break;
+		return true;
+	}
+
+	std::string str() const {
+		std::ostringstream ss;
+		switch (type) {
+		case match_phrase:
+			ss << "phrase";
+			break;
+		case match_proximity:
+			ss << "proximity: " << distance;
+			break;
+		default:
+			ss << "all";
+			break;
+		}
+		ss << ", groups: " << groups.size();
+		return ss.str();
+	}
+
+private:
+	// every position of the first word is tried as the phrase start, other words are looked up by binary search
+	bool check_phrase(const std::vector<word> &group, const std::vector<const std::vector<size_t> *> &positions) const {
+		const word &first = group.front();
+		if (first.offsets.empty())
+			return true;
+
+		size_t first_offset = first.offsets.front();
+		for (size_t pos: *positions[first.index]) {
+			if (pos < first_offset)
+				continue;
+
+			size_t start = pos - first_offset;
+
+			bool match = true;
+			for (const auto &w: group) {
+				const std::vector<size_t> &wpos = *positions[w.index];
+
+				for (size_t offset: w.offsets) {
+					if (!std::binary_search(wpos.begin(), wpos.end(), start + offset)) {
+						match = false;
+						break;
+					}
 				}
 
-				res.completed = false;
+				if (!match)
+					break;
+			}
 
-				if (pos.size() == 0) {
-					pos.push_back(current);
-					continue;
+			if (match)
+				return true;
+		}
+
+		return false;
+	}
+
+	// looks for the smallest window which contains every word by merging sorted position lists,
+	// the list with the smallest current position is moved forward
+	bool check_proximity(const std::vector<word> &group, const std::vector<const std::vector<size_t> *> &positions) const {
+		std::vector<size_t> idx(group.size(), 0);
+
+		while (true) {
+			size_t min_pos = ~0UL, max_pos = 0, min_word = 0;
+
+			for (size_t i = 0; i < group.size(); ++i) {
+				const std::vector<size_t> &wpos = *positions[group[i].index];
+				if (idx[i] >= wpos.size())
+					return false;
+
+				size_t pos = wpos[idx[i]];
+				if (pos < min_pos) {
+					min_pos = pos;
+					min_word = i;
 				}
+				if (pos > max_pos)
+					max_pos = pos;
+			}
+
+			if (max_pos - min_pos <= distance)
+				return true;
 
-				auto &min_it = idata[pos[0]].begin;
+			idx[min_word]++;
+		}
+	}
+};
 
-				BH_LOG(m_t.logger(), INDEXES_LOG_INFO, "intersection: min-index: %s, id: %s, it-index: %s, id: %s",
-						idata[pos[0]].idx.start().str(), min_it->str(),
-						idata_it->idx.start().str(), it->str());
+// per-request intersection parameters
+struct options {
+	// only documents with timestamps within @range are returned, every index scan starts
+	// at the lower bound of the range by tree descent and stops at its upper bound
+	time_range range;
+
+	// every returned document must also be present in each of @filters posting lists,
+	// for example in the documents materialized from numeric range index,
+	// filters are not reported in @single_doc_result.indexes
+	std::vector<posting_list_ptr> filters;
+
+	// documents present in any of @excludes posting lists are skipped, excluded lists
+	// are only seeked to the documents which match all indexes and filters
+	std::vector<posting_list_ptr> excludes;
+
+	// if not empty, non-null entry replaces tree-backed list of the requested index at the same position,
+	// for example dense term which is stored as the bitmap (see @bitmap_postings) instead of the index tree
+	std::vector<posting_list_ptr> lists;
+
+	// documents which do not match positional constraint are skipped as well,
+	// positions are checked as soon as all lists point to the same document,
+	// thus only matching documents are counted against requested number of documents
+	phrase_match phrase;
+
+	// if set, every matching document is handed to this callback instead of being added to @result.docs,
+	// number of documents is not limited in this case and intersection runs until the end of the lists
+	// or until callback returns false
+	std::function<bool (single_doc_result &)> process;
+
+	// count mode: matching documents are only counted in @result.count, neither their keys nor positions
+	// are copied, requested number of documents limits the count, for example 1 checks whether there is a match,
+	// intersection stops at the match which reaches the limit and the cookie points at the next candidate,
+	// thus count resumed from it does not count that match again
+	bool count = false;
+
+	// Facets: every matching document is looked up in each of @facets posting lists, and if @facet_buckets
+	// is set, it is counted by the bucket of its url, counts are returned in @result.
+	// Facets are counted over all matching documents in the same pass: when the page is full,
+	// its cookie is saved and the rest of the lists is scanned without building results.
+	// Cursor can not continue after that, the next page has to be opened from the returned cookie.
+	std::vector<posting_list_ptr> facets;
+	bool facet_buckets = false;
+
+	// intersection is stopped as soon as this time passes, it is checked every @deadline_check_interval
+	// candidate documents, i.e. between page loads of the lists
+	std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max();
+	static const size_t deadline_check_interval = 64;
+};
 
-				if (*it == *min_it) {
-					pos.push_back(current);
-					continue;
+// Live intersection state: posting lists of every requested index and filter together with their
+// currently loaded pages and positions within them.
+//
+// Cursor is created by @intersector::open() and every @next() call continues exactly where the previous one
+// has stopped, there is no need to descend index trees again to find the start of the next page.
+// Cursor does not lock indexes, keys inserted after the page has been loaded into the list may be missed.
+class cursor {
+public:
+	cursor(const logger &log, const std::vector<eurl> &indexes, const options &opts) :
+		m_log(log), m_indexes(indexes), m_opts(opts), m_positions(indexes.size()) {
+		m_idata.reserve(indexes.size() + opts.filters.size());
+	}
+
+	// adds new list into intersection, @req_pos is the position of the list in the requested indexes array,
+	// it is -1 for filters
+	// returns false if list is empty, intersection is completed in this case and no more lists have to be added
+	bool add(const posting_list_ptr &list, ssize_t req_pos) {
+		iter itr(list, req_pos);
+		if (itr.estimate == 0) {
+			m_completed = true;
+			return false;
+		}
+
+		m_idata.emplace_back(std::move(itr));
+		return true;
+	}
+
+	// query planner: iterate over indexes starting from the smallest one,
+	// the first (smallest) index is the driving list - its keys are proposed as candidates,
+	// every other index is only moved forward (seeked) to the candidate
+	void plan() {
+		if (m_idata.empty())
+			m_completed = true;
+
+		m_order.resize(m_idata.size());
+		for (size_t i = 0; i < m_order.size(); ++i)
+			m_order[i] = i;
+		std::stable_sort(m_order.begin(), m_order.end(), [&] (size_t i1, size_t i2) {
+					return m_idata[i1].estimate < m_idata[i2].estimate;
+				});
+	}
+
+	// every @next() call has its own time budget
+	void set_deadline(const std::chrono::steady_clock::time_point &deadline) {
+		m_opts.deadline = deadline;
+	}
+
+	// returns true if there are no more documents
+	bool completed() const {
+		return m_completed;
+	}
+
+	const std::vector<eurl> &indexes() const {
+		return m_indexes;
+	}
+
+	// approximate number of bytes held by the posting lists of this cursor
+	size_t memory() const {
+		size_t size = 0;
+		for (const auto &itr: m_idata) {
+			size += itr.list->memory();
+		}
+		for (const auto &ex: m_opts.excludes) {
+			size += ex->memory();
+		}
+		for (const auto &f: m_opts.facets) {
+			size += f->memory();
+		}
+
+		return size;
+	}
+
+	// reads up to @num matching documents, @start is updated to the cookie of the next document
+	// and is cleared when intersection is completed, returned @result.cookie is equal to the updated @start
+	result next(std::string &start, size_t num, const std::function<bool (const std::vector<eurl> &, result &)> &finish) {
+		const std::vector<eurl> &indexes = m_indexes;
+		const options &opts = m_opts;
+		const std::vector<posting_list_ptr> &excludes = opts.excludes;
+		const phrase_match &phrase = opts.phrase;
+
+		result res;
+		res.max_number_of_documents = num;
+		res.phrase_relaxed = phrase.relaxed;
+
+		if (m_completed) {
+			start.clear();
+			finish(indexes, res);
+			return res;
+		}
+
+		// positions of every requested index in the current document, only filled for positional matching
+		std::vector<const std::vector<size_t> *> &positions = m_positions;
+
+		bool has_deadline = opts.deadline != std::chrono::steady_clock::time_point::max();
+		size_t rounds = 0;
+
+		// every matching document is counted in facets, when the page is full (@tail),
+		// the rest of the matching documents are only counted
+		bool facets = !opts.facets.empty() || opts.facet_buckets;
+		bool tail = false;
+		res.facets.resize(opts.facets.size());
+
+		while (true) {
+			// all documents before the current key of the driving list have been either returned or rejected,
+			// intersection can be restarted from it
+			if (has_deadline && (++rounds % options::deadline_check_interval) == 0 &&
+					std::chrono::steady_clock::now() >= opts.deadline) {
+				posting_list &driver = *m_idata[m_order[0]].list;
+				if (!driver.end() && tail) {
+					BH_LOG(m_log, INDEXES_LOG_INFO, "intersection: deadline exceeded while counting facets: "
+							"next candidate: %s", driver.current().str());
+
+					res.facets_completed = false;
+					finish(indexes, res);
+					break;
 				}
 
-				if (*it < *min_it) {
-					pos.clear();
-					pos.push_back(current);
+				if (!driver.end()) {
+					BH_LOG(m_log, INDEXES_LOG_INFO, "intersection: deadline exceeded: found documents: %zd, "
+							"next candidate: %s", res.docs.size(), driver.current().str());
+
+					res.completed = false;
+					res.deadline_exceeded = true;
+					res.facets_completed = !facets;
+					start = save_cookie(driver.current());
+					finish(indexes, res);
+					break;
+				}
+			}
+
+			// This is a leapfrog intersection.
+			//
+			// The driving (smallest) index proposes its current key as a candidate,
+			// every other index iterator is seeked to the first key not less than the candidate.
+			// If some iterator points to a larger key, this key becomes the new candidate,
+			// the driving iterator is seeked to it and the round starts over.
+			// If all iterators point to the candidate, it is pushed into the resulting array
+			// and all iterators are moved forward.
+			//
+			// Seek does not read pages which do not contain the candidate,
+			// it either moves within the current page, checks the next leaf,
+			// or descends the tree from the root, thus long runs of keys present
+			// in the large index but missing in the small one are skipped.
+			//
+			// As soon as any iterator reaches its end, there can be no more documents
+			// which contain all requested indexes, and intersection is completed.
+			posting_list &driver = *m_idata[m_order[0]].list;
+			res.completed = driver.end();
+
+			bool match = true;
+			if (!res.completed) {
+				key candidate = driver.current();
+
+				for (size_t i = 1; i < m_order.size(); ++i) {
+					posting_list &other = *m_idata[m_order[i]].list;
+
+					other.seek(candidate);
+					if (other.end()) {
+						res.completed = true;
+						break;
+					}
+
+					if (other.current() != candidate) {
+						BH_LOG(m_log, INDEXES_LOG_INFO, "intersection: candidate: %s, index: %s: "
+								"moving driving index %s to %s",
+								candidate.str(), other.str(),
+								driver.str(), other.current().str());
+
+						driver.seek(other.current());
+						match = false;
+						break;
+					}
 				}
 			}
 
+			// @start already contains the cookie of the next page
+			if (res.completed && tail) {
+				res.completed = false;
+				finish(indexes, res);
+				break;
+			}
+
 			if (res.completed) {
 				start.clear();
 				if (!finish(indexes, res))
@@ -203,60 +486,422 @@ public:
 				break;
 			}
 
-			if (pos.size() != idata.size()) {
-				for (auto it = pos.begin(); it != pos.end(); ++it) {
-					auto &min_it = idata[*it].begin;
+			if (!match)
+				continue;
 
-					auto prev_str = min_it->str();
-					++min_it;
+			bool skip = excluded(excludes, driver.current());
+			if (!skip && phrase.type != phrase_match::match_all) {
+				for (auto &itr: m_idata) {
+					if (itr.req_pos >= 0)
+						positions[itr.req_pos] = &itr.list->current().positions;
+				}
 
-					std::string min_str = "finished";
-					if (min_it != idata[*it].end)
-						min_str = min_it->str();
+				skip = !phrase.check(positions);
+			}
 
-					BH_LOG(m_t.logger(), INDEXES_LOG_INFO, "intersection: min-index: %s, id: %s increasing to %s",
-							idata[*it].idx.start().str(), prev_str, min_str);
+			if (skip) {
+				for (auto &itr: m_idata) {
+					itr.list->next();
 				}
+				continue;
+			}
+
+			if (!tail && !opts.count && res.docs.size() == num) {
+				start = save_cookie(driver.current());
+				if (facets) {
+					tail = true;
+				} else {
+					if (!finish(indexes, res))
+						continue;
+					break;
+				}
+			}
+
+			if (facets)
+				count_facets(res);
 
+			if (tail) {
+				for (auto &itr: m_idata) {
+					itr.list->next();
+				}
 				continue;
 			}
 
-			start = idata[pos[0]].begin->id;
-			if (res.docs.size() == num) {
-				if (!finish(indexes, res))
-					continue;
-				break;
+			// count stops as soon as it reaches @num without looking for the next match,
+			// cookie points at the candidate which follows the last counted match,
+			// if there is none, intersection is completed at the next round
+			if (opts.count) {
+				res.count++;
+
+				for (auto &itr: m_idata) {
+					itr.list->next();
+				}
+
+				if (res.count >= num && !driver.end()) {
+					start = save_cookie(driver.current());
+					if (facets) {
+						tail = true;
+					} else if (finish(indexes, res)) {
+						break;
+					}
+				}
+				continue;
 			}
 
 			single_doc_result rs;
-			for (auto it = pos.begin(); it != pos.end(); ++it) {
-				auto &idata_iter = idata[*it];
-				auto &min_it = idata_iter.begin;
-				key k = *min_it;
-
-				if (it == pos.begin()) {
-					rs.doc = k;
-					rs.doc.positions.clear();
+			rs.indexes.resize(indexes.size());
+			for (size_t i = 0; i < indexes.size(); ++i)
+				rs.indexes[i].url = indexes[i];
+
+			for (auto &itr: m_idata) {
+				rs.weight *= itr.list->weight();
+
+				if (itr.req_pos >= 0) {
+					// document key has to be taken from the index, filters may not contain document URL
+					if (!rs.doc) {
+						rs.doc = itr.list->current();
+						rs.doc.positions.clear();
+					}
+
+					key &idx = rs.indexes[itr.req_pos];
+					idx.positions = itr.list->current().positions;
 				}
+			}
 
-				key idx;
-				idx.url = indexes[*it];
-				idx.positions = k.positions;
+			if (!rs.doc) {
+				rs.doc = driver.current();
+				rs.doc.positions.clear();
+			}
+
+			for (auto &itr: m_idata) {
+				itr.list->next();
+			}
 
-				rs.indexes.push_back(idx);
+			if (opts.process) {
+				if (!opts.process(rs)) {
+					res.completed = true;
+					res.facets_completed = !facets;
+					start.clear();
+					finish(indexes, res);
+					break;
+				}
 
-				++min_it;
+				continue;
 			}
 
 			res.docs.emplace_back(rs);
 		}
 
+		if (res.completed)
+			m_completed = true;
+
+		res.cookie = start;
+		return res;
+	}
+
+	// reads up to @num matching documents in batches of at most @batch documents, every batch is passed
+	// to @process as soon as it has been found and the next one is not read until @process returns,
+	// @process returns false to stop, the rest of the page continues from the updated @start
+	//
+	// returned result contains no documents, its state is the state of the last batch
+	result stream(std::string &start, size_t num, size_t batch,
+			const std::function<bool (const std::vector<eurl> &, result &)> &finish,
+			const std::function<bool (const result &)> &process) {
+		result res;
+		res.max_number_of_documents = num;
+
+		size_t left = num;
+		while (true) {
+			result part = next(start, std::min(left, batch), finish);
+			left -= part.docs.size();
+
+			res.completed = part.completed;
+			res.deadline_exceeded = part.deadline_exceeded;
+			if (!process(part) || part.completed || part.deadline_exceeded || left == 0)
+				break;
+		}
+
+		res.cookie = start;
 		return res;
 	}
+
+private:
+	// all lists point to the matching document
+	void count_facets(result &res) {
+		// document key has to be taken from the index, filters may not contain document URL
+		const key *doc = &m_idata[m_order[0]].list->current();
+		for (const auto &itr: m_idata) {
+			if (itr.req_pos >= 0) {
+				doc = &itr.list->current();
+				break;
+			}
+		}
+
+		for (size_t i = 0; i < m_opts.facets.size(); ++i) {
+			posting_list &f = *m_opts.facets[i];
+			f.seek(*doc);
+			if (!f.end() && f.current() == *doc)
+				res.facets[i]++;
+		}
+
+		if (m_opts.facet_buckets)
+			res.facet_buckets[doc->url.bucket]++;
+	}
+
+	// packs the next key and positions of the requested indexes, all lists point to @k
+	std::string save_cookie(const key &k) const {
+		paging_cookie cookie;
+		cookie.start.set_order(k);
+
+		cookie.positions.resize(m_indexes.size());
+		for (const auto &itr: m_idata) {
+			if (itr.req_pos >= 0)
+				cookie.positions[itr.req_pos] = itr.list->position();
+		}
+
+		return cookie.save();
+	}
+
+	struct iter {
+		posting_list_ptr list;
+
+		// position of this index in the requested @indexes array, -1 for filters
+		ssize_t req_pos;
+
+		// number of keys in the requested time range, used by query planner
+		uint64_t estimate;
+
+		iter(const posting_list_ptr &l, ssize_t pos) : list(l), req_pos(pos), estimate(l->estimate()) {}
+	};
+
+	const logger &m_log;
+	std::vector<eurl> m_indexes;
+	options m_opts;
+
+	// contains vector of iterators pointing to the requested indexes
+	// iterator always points to the smallest document ID not yet pushed into resulting structure (or to client)
+	// or discarded (if other index iterators point to larger document IDs)
+	std::vector<iter> m_idata;
+	std::vector<size_t> m_order;
+	std::vector<const std::vector<size_t> *> m_positions;
+	bool m_completed = false;
+};
+
+typedef std::shared_ptr<cursor> cursor_ptr;
+
+template <typename T>
+class intersector {
+public:
+	// if @partitioned is set, every index is expected to use time-partitioned layout (see @partitioned_index),
+	// its partitions are chained and partitions outside of requested time range are not read at all
+	intersector(T &t, bool partitioned = false) : m_t(t), m_partitioned(partitioned) {}
+	result intersect(const std::vector<eurl> &indexes) const {
+		std::string start = std::string("\0");
+		return intersect(indexes, start, INT_MAX);
+	}
+
+	result intersect(const std::vector<eurl> &indexes, std::string &start, size_t num) const {
+		return intersect(indexes, start, num, [&] (const std::vector<eurl> &, result &) {return true;});
+	}
+
+	result intersect(const std::vector<eurl> &indexes, std::string &start, size_t num,
+			const std::function<bool (const std::vector<eurl> &, result &)> &finish) const {
+		return intersect(indexes, start, num, time_range(), finish);
+	}
+
+	result intersect(const std::vector<eurl> &indexes, std::string &start, size_t num, const time_range &range,
+			const std::function<bool (const std::vector<eurl> &, result &)> &finish) const {
+		return intersect(indexes, std::vector<posting_list_ptr>(), start, num, range, finish);
+	}
+
+	result intersect(const std::vector<eurl> &indexes, const std::vector<posting_list_ptr> &filters,
+			std::string &start, size_t num, const time_range &range,
+			const std::function<bool (const std::vector<eurl> &, result &)> &finish) const {
+		return intersect(indexes, filters, std::vector<posting_list_ptr>(), start, num, range, finish);
+	}
+
+	result intersect(const std::vector<eurl> &indexes, const std::vector<posting_list_ptr> &filters,
+			const std::vector<posting_list_ptr> &excludes,
+			std::string &start, size_t num, const time_range &range,
+			const std::function<bool (const std::vector<eurl> &, result &)> &finish) const {
+		return intersect(indexes, filters, excludes, phrase_match(), start, num, range, finish);
+	}
+
+	result intersect(const std::vector<eurl> &indexes, const std::vector<posting_list_ptr> &filters,
+			const std::vector<posting_list_ptr> &excludes, const phrase_match &phrase,
+			std::string &start, size_t num, const time_range &range,
+			const std::function<bool (const std::vector<eurl> &, result &)> &finish) const {
+		options opts;
+		opts.range = range;
+		opts.filters = filters;
+		opts.excludes = excludes;
+		opts.phrase = phrase;
+
+		return intersect(indexes, opts, start, num, finish);
+	}
+
+	// returns posting list which reads index @iname starting from @start key within @range,
+	// index layout (plain or time-partitioned) is selected by the intersector setup
+	posting_list_ptr postings(const eurl &iname, const key &start, const time_range &range,
+			const page_position &hint = page_position()) const {
+		if (m_partitioned)
+			return std::make_shared<partitioned_postings<T>>(m_t, iname, start, range, hint);
+
+		return std::make_shared<index_postings<T>>(m_t, iname, start, range, hint);
+	}
+
+	// opens every requested index and filter at @start (or at the lower bound of @opts.range if it is larger),
+	// returned cursor is positioned before the first matching document
+	cursor_ptr open(const std::vector<eurl> &indexes, const options &opts, const std::string &start) const {
+		const time_range &range = opts.range;
+
+		key start_key = range.start_key();
+
+		// cookie which is not a packed @paging_cookie is a bare document id sent by the older clients,
+		// page hints are only valid if intersection restarts exactly at the cookie's key
+		paging_cookie cookie;
+		if (cookie.load(start)) {
+			if (!(cookie.start < start_key)) {
+				start_key = cookie.start;
+			} else {
+				cookie.positions.clear();
+			}
+		} else if (!start.empty()) {
+			// bare id does not carry the timestamp of the document, without time range it is used as is,
+			// but within the range it would always sort before the range start and the same page
+			// would be returned forever, place it at the end of the range instead, this completes the search
+			key id;
+			id.id = start;
+			if (range.is_bounded())
+				id.timestamp = range.end_timestamp();
+
+			if (start_key < id)
+				start_key = id;
+		}
+
+		if (cookie.positions.size() != indexes.size())
+			cookie.positions.clear();
+
+		cursor_ptr c = std::make_shared<cursor>(m_t.logger(), indexes, opts);
+
+		// lists are only estimated here, none of them is positioned (and none of the trees is descended)
+		// until all estimates are known to be non-zero
+		std::vector<posting_list_ptr> external;
+		for (size_t pos = 0; pos < indexes.size() + opts.filters.size(); ++pos) {
+			posting_list_ptr list;
+			if (pos < opts.lists.size() && opts.lists[pos]) {
+				// the same list may replace several requested indexes, for example dense terms whose bitmaps
+				// have already been intersected, it is iterated only once
+				auto lend = opts.lists.begin() + pos;
+				if (std::find(opts.lists.begin(), lend, opts.lists[pos]) != lend)
+					continue;
+
+				list = opts.lists[pos];
+				external.push_back(list);
+			} else if (pos < indexes.size()) {
+				list = postings(indexes[pos], start_key, range,
+						cookie.positions.empty() ? page_position() : cookie.positions[pos]);
+			} else {
+				list = opts.filters[pos - indexes.size()];
+				external.push_back(list);
+			}
+
+			// there are no keys in the requested range in this index, intersection is empty,
+			// there is no need to open and read other indexes
+			if (!c->add(list, pos < indexes.size() ? (ssize_t)pos : -1)) {
+				BH_LOG(m_t.logger(), INDEXES_LOG_INFO, "intersection: index: %s, range: %s: index is empty",
+						list->str(), range.str());
+				return c;
+			}
+		}
+
+		// lists created by the caller are positioned at their own start, move them to the intersection start
+		for (auto &list: external)
+			list->seek(start_key);
+
+		c->plan();
+		return c;
+	}
+
+	// search for intersections between all @indexes
+	// starting with the key @start, returning at most @num entries
+	//
+	// time range, filters, exclusions and positional matching are described in @options
+	//
+	// after @intersect() completes, it sets @start to the next key to start searching from
+	// user should not change that token, otherwise @intersect() may skip some entries or
+	// return duplicates.
+	//
+	// if number of returned entries is less than requested number @num or if @start has been set to empty string
+	// after call to this function returns, then intersection is completed.
+	//
+	// @result.completed will be set to true in this case.
+	result intersect(const std::vector<eurl> &indexes, const options &opts, std::string &start, size_t num,
+			const std::function<bool (const std::vector<eurl> &, result &)> &finish) const {
+		return open(indexes, opts, start)->next(start, num, finish);
+	}
+
+	// counts at most @num documents which match all @indexes and @opts, see @options.count
+	result count(const std::vector<eurl> &indexes, options opts, std::string &start, size_t num) const {
+		opts.count = true;
+		return intersect(indexes, opts, start, num,
+				[] (const std::vector<eurl> &, result &) { return true; });
+	}
 private:
 	T &m_t;
+	bool m_partitioned;
 };
 
 }}} // namespace ioremap::greylock::intersect
 
+namespace msgpack {
+static inline ioremap::greylock::intersect::paging_cookie &operator >>(msgpack::object o,
+		ioremap::greylock::intersect::paging_cookie &cookie)
+{
+	if (o.type != msgpack::type::ARRAY || o.via.array.size < 4 || o.via.array.size > 5) {
+		std::ostringstream ss;
+		ss << "paging cookie unpack: type: " << o.type <<
+			", must be: " << msgpack::type::ARRAY <<
+			", size: " << o.via.array.size;
+		throw std::runtime_error(ss.str());
+	}
+
+	object *p = o.via.array.ptr;
+	uint16_t version = 0;
+	p[0].convert(&version);
+	if (version != ioremap::greylock::intersect::paging_cookie::serialization_version) {
+		std::ostringstream ss;
+		ss << "paging cookie unpack: version mismatch: read: " << version <<
+			", must be: " << ioremap::greylock::intersect::paging_cookie::serialization_version;
+		throw std::runtime_error(ss.str());
+	}
+
+	p[1].convert(&cookie.start.timestamp);
+	p[2].convert(&cookie.start.id);
+	p[3].convert(&cookie.positions);
+
+	cookie.start.number = ioremap::greylock::key::no_number;
+	if (o.via.array.size > 4)
+		p[4].convert(&cookie.start.number);
+
+	return cookie;
+}
+
+template <typename Stream>
+inline msgpack::packer<Stream> &operator <<(msgpack::packer<Stream> &o, const ioremap::greylock::intersect::paging_cookie &cookie)
+{
+	bool compact = cookie.start.compact();
+
+	o.pack_array(compact ? 5 : 4);
+	o.pack((int)ioremap::greylock::intersect::paging_cookie::serialization_version);
+	o.pack(cookie.start.timestamp);
+	o.pack(cookie.start.id);
+	o.pack(cookie.positions);
+	if (compact)
+		o.pack(cookie.start.number);
+
+	return o;
+}
+} // namespace msgpack
+
 #endif // __INDEXES_INTERSECTION_HPP
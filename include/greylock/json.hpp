@@ -38,6 +38,17 @@ static inline int64_t get_int64(const rapidjson::Value &entry, const char *name,
 	return def;
 }
 
+static inline double get_double(const rapidjson::Value &entry, const char *name, double def = 0) {
+	if (entry.HasMember(name)) {
+		const rapidjson::Value &v = entry[name];
+		if (v.IsNumber()) {
+			return v.GetDouble();
+		}
+	}
+
+	return def;
+}
+
 static inline const rapidjson::Value &get_object(const rapidjson::Value &entry, const char *name,
 		const rapidjson::Value &def = rapidjson::Value()) {
 	if (entry.HasMember(name)) {
@@ -3,6 +3,7 @@
 
 #include "greylock/core.hpp"
 
+#include <climits>
 #include <string>
 
 namespace ioremap { namespace greylock {
@@ -13,7 +14,50 @@ struct key {
 	uint64_t timestamp = 0;
 	std::vector<size_t> positions;
 
-	MSGPACK_DEFINE(id, url, positions, timestamp);
+	// number of keys in the subtree this key points to,
+	// it is only maintained for keys in non-leaf pages,
+	// counters are not valid if index metadata says so (@index_meta::num_keys_valid)
+	uint64_t subtree_keys = 0;
+
+	// dense per-mailbox number of the document, it is set in keys of the mailbox documents index
+	// (see @document_number()) and in compact keys (see @compact_key)
+	static const uint64_t no_number = ~0ULL;
+	uint64_t number = no_number;
+
+	// leaf keys are packed without @subtree_keys in the same 4-element layout
+	// which was used before subtree counters were introduced, only interior keys carry the 5th element,
+	// keys with document number carry it in the 6th element
+	template <typename Packer>
+	void msgpack_pack(Packer &pk) const {
+		pk.pack_array(number != no_number ? 6 : (subtree_keys ? 5 : 4));
+		pk.pack(id);
+		pk.pack(url);
+		pk.pack(positions);
+		pk.pack(timestamp);
+		if (subtree_keys || number != no_number)
+			pk.pack(subtree_keys);
+		if (number != no_number)
+			pk.pack(number);
+	}
+
+	void msgpack_unpack(msgpack::object o) {
+		if (o.type != msgpack::type::ARRAY || o.via.array.size < 4)
+			throw msgpack::type_error();
+
+		msgpack::object *p = o.via.array.ptr;
+		p[0].convert(&id);
+		p[1].convert(&url);
+		p[2].convert(&positions);
+		p[3].convert(&timestamp);
+
+		subtree_keys = 0;
+		if (o.via.array.size > 4)
+			p[4].convert(&subtree_keys);
+
+		number = no_number;
+		if (o.via.array.size > 5)
+			p[5].convert(&number);
+	}
 
 	void set_timestamp(long tsec, long nsec) {
 		timestamp = tsec;
@@ -26,33 +70,57 @@ struct key {
 		nsec = timestamp & ((1<<30) - 1);
 	}
 
+	// compact key (see @compact_key) does not have id and url, the document number is its id
+	bool compact() const {
+		return id.empty() && number != no_number;
+	}
+
 	size_t size() const {
-		return id.size() + url.size();
+		return id.size() + url.size() + (compact() ? sizeof(uint32_t) : 0);
+	}
+
+	// keys with equal timestamps are ordered by id, compact keys are ordered by document number,
+	// key without id and number (for example @time_range::start_key()) precedes them
+	int compare(const key &other) const {
+		if (timestamp != other.timestamp)
+			return timestamp < other.timestamp ? -1 : 1;
+
+		if (id.empty() && other.id.empty()) {
+			if (number == other.number)
+				return 0;
+			if (number == no_number)
+				return -1;
+			if (other.number == no_number)
+				return 1;
+			return number < other.number ? -1 : 1;
+		}
+
+		return id.compare(other.id);
+	}
+
+	// copies the part of @k which orders it among other keys, interior keys point to their child pages
+	// with this part of the first key of the child page, number is only copied from compact keys
+	void set_order(const key &k) {
+		id = k.id;
+		timestamp = k.timestamp;
+		number = k.compact() ? k.number : no_number;
 	}
 
 	bool operator<(const key &other) const {
-		if (timestamp < other.timestamp)
-			return true;
-		if (timestamp > other.timestamp)
-			return false;
-		return id < other.id;
+		return compare(other) < 0;
 	}
 	bool operator<=(const key &other) const {
-		if (timestamp < other.timestamp)
-			return true;
-		if (timestamp > other.timestamp)
-			return false;
-		return id <= other.id;
+		return compare(other) <= 0;
 	}
 	bool operator==(const key &other) const {
-		return (timestamp == other.timestamp) && (id == other.id);
+		return compare(other) == 0;
 	}
 	bool operator!=(const key &other) const {
-		return id != other.id || (timestamp != other.timestamp);
+		return compare(other) != 0;
 	}
 
 	operator bool() const {
-		return id.size() != 0;
+		return id.size() != 0 || compact();
 	}
 	bool operator !() const {
 		return !operator bool();
@@ -61,11 +129,53 @@ struct key {
 	std::string str() const {
 		long tsec, tnsec;
 		get_timestamp(tsec, tnsec);
-		return id + ":" + url.str() + ":" + elliptics::lexical_cast(tsec) + "." + elliptics::lexical_cast(tnsec);
+		std::string name = compact() ? "#" + elliptics::lexical_cast(number) : id;
+		return name + ":" + url.str() + ":" + elliptics::lexical_cast(tsec) + "." + elliptics::lexical_cast(tnsec);
 	}
 };
 
 
+// closed range of key timestamps in seconds, used to bound index scans
+// default range covers all possible timestamps
+struct time_range {
+	long tsec_start = 0;
+	long tsec_end = LONG_MAX;
+
+	time_range() {}
+	time_range(long start, long end) : tsec_start(start), tsec_end(end) {}
+
+	// the smallest key which can be found in this range
+	key start_key() const {
+		key k;
+		if (tsec_start > 0)
+			k.set_timestamp(tsec_start, 0);
+		return k;
+	}
+
+	// the highest timestamp which belongs to this range
+	uint64_t end_timestamp() const {
+		// timestamp keeps seconds in the upper 34 bits
+		if (tsec_end < 0)
+			return 0;
+		if ((unsigned long)tsec_end >= (1UL << 34))
+			return ~0ULL;
+
+		return ((uint64_t)tsec_end << 30) | ((1 << 30) - 1);
+	}
+
+	bool is_bounded() const {
+		return tsec_start > 0 || tsec_end != LONG_MAX;
+	}
+
+	bool contains(uint64_t timestamp) const {
+		return timestamp >= start_key().timestamp && timestamp <= end_timestamp();
+	}
+
+	std::string str() const {
+		return "[" + elliptics::lexical_cast(tsec_start) + ", " + elliptics::lexical_cast(tsec_end) + "]";
+	}
+};
+
 }} // namespace ioremap::greylock
 
 #endif // __INDEXES_KEY_HPP
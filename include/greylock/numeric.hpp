@@ -0,0 +1,164 @@
+#ifndef __INDEXES_NUMERIC_HPP
+#define __INDEXES_NUMERIC_HPP
+
+#include "greylock/index.hpp"
+
+#include <stdio.h>
+
+namespace ioremap { namespace greylock {
+
+// Numeric indexes live in the same B+tree as string indexes, but keys are ordered by (value, timestamp, document id).
+//
+// Tree orders keys by @key.timestamp and then by @key.id, thus numeric key is encoded as follows:
+//  - @key.timestamp contains order-preserving unsigned representation of the signed value
+//  - @key.id contains fixed-width hex representation of the document timestamp followed by the document id,
+//    compact document key (see @compact_key) does not have id, its fixed-width hex number is used instead
+//    and the number is also kept in @key.number
+//  - @key.url contains document url
+//
+// Range scan is a tree descent to the lower value bound and a leaf scan which stops at the upper bound,
+// exactly like time-bounded scan of the string index.
+struct numeric_key {
+	static uint64_t encode_value(int64_t value) {
+		return (uint64_t)value ^ (1ULL << 63);
+	}
+
+	static int64_t decode_value(uint64_t encoded) {
+		return (int64_t)(encoded ^ (1ULL << 63));
+	}
+
+	static key encode(int64_t value, const key &doc) {
+		char ts[32];
+		snprintf(ts, sizeof(ts), "%016llx", (unsigned long long)doc.timestamp);
+
+		key k;
+		k.timestamp = encode_value(value);
+		k.url = doc.url;
+
+		if (doc.compact()) {
+			char num[16];
+			snprintf(num, sizeof(num), "%08llx", (unsigned long long)doc.number);
+
+			k.id = std::string(ts) + "." + num;
+			k.number = doc.number;
+		} else {
+			k.id = std::string(ts) + "." + doc.id;
+		}
+
+		return k;
+	}
+
+	// returns document key stored in numeric key @k, empty key if @k was not created by @encode()
+	static key decode(const key &k) {
+		key doc;
+		if (k.id.size() < 17 || k.id[16] != '.')
+			return doc;
+
+		doc.timestamp = strtoull(k.id.substr(0, 16).c_str(), NULL, 16);
+		doc.url = k.url;
+
+		if (k.number != key::no_number) {
+			doc.number = k.number;
+		} else {
+			doc.id = k.id.substr(17);
+		}
+
+		return doc;
+	}
+
+	// the smallest numeric key for @value
+	static key lower(int64_t value) {
+		key k;
+		k.timestamp = encode_value(value);
+		return k;
+	}
+};
+
+// closed range of numeric values
+struct numeric_range {
+	int64_t from = LLONG_MIN;
+	int64_t to = LLONG_MAX;
+
+	numeric_range() {}
+	numeric_range(int64_t f, int64_t t) : from(f), to(t) {}
+
+	std::string str() const {
+		return "[" + elliptics::lexical_cast(from) + ", " + elliptics::lexical_cast(to) + "]";
+	}
+};
+
+template <typename T>
+class numeric_index {
+public:
+	numeric_index(T &t, const eurl &start, bool read_only) : m_idx(t, start, read_only) {}
+
+	// see @index<T>::set_posting_format()
+	int set_posting_format(uint64_t format) {
+		return m_idx.set_posting_format(format);
+	}
+
+	int insert(int64_t value, const key &doc) {
+		return m_idx.insert(numeric_key::encode(value, doc));
+	}
+
+	int remove(int64_t value, const key &doc) {
+		return m_idx.remove(numeric_key::encode(value, doc));
+	}
+
+	// removes keys of the documents with timestamps less than @cutoff
+	// keys are ordered by value, expired keys do not form a prefix of the tree like in string indexes,
+	// thus the whole index is scanned and expired keys are removed one by one
+	int expire(uint64_t cutoff) {
+		std::vector<key> expired;
+		for (auto it = m_idx.begin(), end = m_idx.end(); it != end; ++it) {
+			key doc = numeric_key::decode(*it);
+			if (doc && doc.timestamp < cutoff)
+				expired.push_back(*it);
+		}
+
+		for (const auto &k: expired) {
+			int err = m_idx.remove(k);
+			if (err < 0)
+				return err;
+		}
+
+		return 0;
+	}
+
+	// estimated number of documents with values within @range
+	uint64_t estimate_count(const numeric_range &range) const {
+		return m_idx.estimate_count(numeric_key::lower(range.from), numeric_key::encode_value(range.to));
+	}
+
+	// returns documents with values within @range and timestamps within @time, sorted in key order
+	// (i.e. by timestamp and document id), so that they can be intersected with string indexes
+	std::vector<key> range(const numeric_range &range, const time_range &time = time_range()) const {
+		std::vector<key> ret;
+
+		for (auto it = m_idx.begin(numeric_key::lower(range.from), numeric_key::encode_value(range.to)),
+				end = m_idx.end(); it != end; ++it) {
+			key doc = numeric_key::decode(*it);
+			if (!doc)
+				continue;
+
+			if (!time.contains(doc.timestamp))
+				continue;
+
+			ret.emplace_back(std::move(doc));
+		}
+
+		std::sort(ret.begin(), ret.end());
+		return ret;
+	}
+
+	index_meta meta() const {
+		return m_idx.meta();
+	}
+
+private:
+	index<T> m_idx;
+};
+
+}} // namespace ioremap::greylock
+
+#endif // __INDEXES_NUMERIC_HPP
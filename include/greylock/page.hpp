@@ -65,6 +65,20 @@ struct page {
 		return flags & PAGE_LEAF;
 	}
 
+	// number of keys in the subtree rooted at this page
+	// for non-leaf pages it is a sum of per-child counters
+	uint64_t subtree_keys() const {
+		if (is_leaf())
+			return objects.size();
+
+		uint64_t num = 0;
+		for (const auto &k: objects) {
+			num += k.subtree_keys;
+		}
+
+		return num;
+	}
+
 	void load(const void *data, size_t size) {
 		objects.clear();
 		flags = 0;
@@ -105,6 +119,12 @@ struct page {
 		return it - objects.begin();
 	}
 
+	// returns position of the first key in @objects vector which is not less than @obj,
+	// or size of the @objects vector if there is no such key
+	size_t lower_bound(const key &obj) const {
+		return std::lower_bound(objects.begin(), objects.end(), obj) - objects.begin();
+	}
+
 	// returns position of the key in @objects vector
 	int search_node(const key &obj) const {
 		if (objects.size() == 0)
@@ -142,6 +162,12 @@ struct page {
 		return total_size < max_page_size / 3;
 	}
 
+	// removes first @num keys from the page
+	void remove_prefix(size_t num) {
+		objects.erase(objects.begin(), objects.begin() + std::min(num, objects.size()));
+		recalculate_size();
+	}
+
 	bool insert_and_split(const key &obj, page &other, bool &replaced) {
 		std::vector<key> copy;
 		bool copied = false;
@@ -291,6 +317,18 @@ private:
 	}
 };
 
+// position of the key in the leaf page, iteration can be restarted from it with a single page read
+struct page_position {
+	eurl page;
+	size_t offset = 0;
+
+	MSGPACK_DEFINE(page, offset);
+
+	bool empty() const {
+		return page.empty();
+	}
+};
+
 template <typename T>
 class iterator {
 public:
@@ -301,16 +339,87 @@ public:
 	typedef std::forward_iterator_tag iterator_category;
 	typedef std::ptrdiff_t difference_type;
 
-	iterator(T &t, page &p, size_t internal_index) : m_t(t), m_page(p), m_page_internal_index(internal_index) {}
+	// iterator becomes equal to the end iterator as soon as it reaches key with timestamp
+	// greater than @max_timestamp, no further pages are read after that
+	//
+	// @root is the start page of the index, it is used by @seek() to descend the tree
+	// when requested key is far away from the current page
+	//
+	// @url is the address of the page @p, it is only used to report iterator @position()
+	iterator(T &t, page &p, size_t internal_index, uint64_t max_timestamp = ~0ULL, const eurl &root = eurl(),
+			const eurl &url = eurl()) :
+		m_t(t), m_page(p), m_page_internal_index(internal_index), m_max_timestamp(max_timestamp), m_root(root),
+		m_url(url) {
+		try_loading_next_page();
+		check_bound();
+	}
 	iterator(const iterator &i) : m_t(i.m_t) {
 		m_page = i.m_page;
 		m_page_internal_index = i.m_page_internal_index;
 		m_page_index = i.m_page_index;
+		m_max_timestamp = i.m_max_timestamp;
+		m_root = i.m_root;
+		m_url = i.m_url;
+	}
+
+	// leaf page and offset of the current key, page is empty if it is not known
+	page_position position() const {
+		page_position pos;
+		pos.page = m_url;
+		pos.offset = m_page_internal_index;
+		return pos;
+	}
+
+	// moves iterator forward to the first key which is not less than @k,
+	// iterator never moves backward, if it already points to such key, nothing changes
+	//
+	// if @k is not in the current page, the next leaf is checked first (dense skips),
+	// and if it is not there either, the tree is descended from the root (sparse skips)
+	void seek(const key &k) {
+		if (m_page_internal_index >= m_page.objects.size())
+			return;
+
+		if (!(m_page.objects[m_page_internal_index] < k))
+			return;
+
+		if (k.timestamp > m_max_timestamp) {
+			m_page = page();
+			m_page_internal_index = 0;
+			return;
+		}
+
+		if (m_page.objects.back() < k) {
+			m_page_internal_index = m_page.objects.size();
+			try_loading_next_page();
+
+			if ((m_page_internal_index < m_page.objects.size()) && (m_page.objects.back() < k)) {
+				if (!m_root.empty()) {
+					descend(k);
+					check_bound();
+					return;
+				}
+
+				// there is no way to descend the tree, walk over the leaves
+				while ((m_page_internal_index < m_page.objects.size()) && (m_page.objects.back() < k)) {
+					m_page_internal_index = m_page.objects.size();
+					try_loading_next_page();
+				}
+			}
+
+			if (m_page_internal_index >= m_page.objects.size())
+				return;
+		}
+
+		auto it = std::lower_bound(m_page.objects.begin() + m_page_internal_index, m_page.objects.end(), k);
+		m_page_internal_index = it - m_page.objects.begin();
+		try_loading_next_page();
+		check_bound();
 	}
 
 	self_type operator++() {
 		++m_page_internal_index;
 		try_loading_next_page();
+		check_bound();
 
 		return *this;
 	}
@@ -318,6 +427,7 @@ public:
 	self_type operator++(int num) {
 		m_page_internal_index += num;
 		try_loading_next_page();
+		check_bound();
 
 		return *this;
 	}
@@ -329,10 +439,10 @@ public:
 		return &m_page.objects[m_page_internal_index];
 	}
 
-	bool operator==(const self_type& rhs) {
+	bool operator==(const self_type& rhs) const {
 		return (m_page == rhs.m_page) && (m_page_internal_index == rhs.m_page_internal_index);
 	}
-	bool operator!=(const self_type& rhs) {
+	bool operator!=(const self_type& rhs) const {
 		return (m_page != rhs.m_page) || (m_page_internal_index != rhs.m_page_internal_index);
 	}
 private:
@@ -340,22 +450,72 @@ private:
 	page m_page;
 	size_t m_page_index = 0;
 	size_t m_page_internal_index = 0;
+	uint64_t m_max_timestamp = ~0ULL;
+	eurl m_root;
+	eurl m_url;
+
+	// loads leaf page which may contain @k and positions iterator at the first key not less than @k
+	void descend(const key &k) {
+		eurl url = m_root;
+
+		while (true) {
+			status e = m_t.read(url);
+			if (e.error) {
+				m_page = page();
+				m_page_internal_index = 0;
+				return;
+			}
+
+			m_page.load(e.data.data(), e.data.size());
+			if (m_page.is_leaf()) {
+				m_url = url;
+				break;
+			}
+
+			int pos = m_page.search_node(k);
+			if (pos < 0) {
+				m_page = page();
+				m_page_internal_index = 0;
+				return;
+			}
+
+			url = m_page.objects[pos].url;
+		}
+
+		++m_page_index;
+		m_page_internal_index = m_page.lower_bound(k);
+		try_loading_next_page();
+	}
+
+	void check_bound() {
+		if (m_page_internal_index < m_page.objects.size()) {
+			if (m_page.objects[m_page_internal_index].timestamp > m_max_timestamp) {
+				m_page = page();
+				m_page_internal_index = 0;
+			}
+		}
+	}
 
 	void try_loading_next_page() {
-		if (m_page_internal_index >= m_page.objects.size()) {
+		// empty leaf pages may be left in the chain after keys removal, skip them
+		while (m_page_internal_index >= m_page.objects.size()) {
 			m_page_internal_index = 0;
 			++m_page_index;
 
 			if (m_page.next.empty()) {
 				m_page = page();
-			} else {
-				status e = m_t.read(m_page.next);
-				if (e.error) {
-					m_page = page();
-					return;
-				}
-				m_page.load(e.data.data(), e.data.size());
+				m_url = eurl();
+				return;
 			}
+
+			m_url = m_page.next;
+			status e = m_t.read(m_url);
+			if (e.error) {
+				m_page = page();
+				m_url = eurl();
+				return;
+			}
+			m_page.load(e.data.data(), e.data.size());
 		}
 	}
 };
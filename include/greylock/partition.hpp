@@ -0,0 +1,473 @@
+#ifndef __INDEXES_PARTITION_HPP
+#define __INDEXES_PARTITION_HPP
+
+#include "greylock/index.hpp"
+#include "greylock/postings.hpp"
+
+namespace ioremap { namespace greylock {
+
+// Time-partitioned index layout.
+//
+// Posting list of the frequent term grows without bound when it lives in a single tree,
+// tree depth grows and all writes go into the same rightmost pages.
+// Partitioned layout splits term's keys into fixed-length time periods, every period
+// has its own tree, started at @partition_url(), and there is a small directory object
+// which lists all existing partitions.
+//
+// Iteration chains partitions in time order, time-bounded iteration only opens partitions
+// which overlap requested range.
+struct partition_directory {
+	enum {
+		serialization_version = 1,
+	};
+
+	// partition length in seconds
+	long period = 0;
+
+	// sorted partition numbers, partition N contains keys with timestamps in [N * period, (N + 1) * period) seconds
+	std::vector<long> partitions;
+
+	// generation of the partition set, it changes every time partition is added or removed,
+	// updates of the keys within partition only change @index_meta generation of that partition
+	uint64_t generation_number_sec = 0;
+	uint64_t generation_number_nsec = 0;
+
+	void update_generation_number() {
+		struct timespec ts;
+		clock_gettime(CLOCK_REALTIME, &ts);
+
+		generation_number_sec = ts.tv_sec;
+		generation_number_nsec = ts.tv_nsec;
+	}
+
+	static eurl directory_url(const eurl &base) {
+		eurl url;
+		url.bucket = base.bucket;
+		url.key = base.key + ".partitions";
+		return url;
+	}
+
+	static eurl partition_url(const eurl &base, long partition) {
+		eurl url;
+		url.bucket = base.bucket;
+		url.key = base.key + ".partition." + elliptics::lexical_cast(partition);
+		return url;
+	}
+
+	long partition(uint64_t timestamp) const {
+		return (long)(timestamp >> 30) / period;
+	}
+
+	// returns true if partition has been added, i.e. directory has to be written
+	bool insert(long partition) {
+		auto it = std::lower_bound(partitions.begin(), partitions.end(), partition);
+		if (it != partitions.end() && *it == partition)
+			return false;
+
+		partitions.insert(it, partition);
+		return true;
+	}
+
+	// returns partitions which overlap @range
+	std::vector<long> overlap(const time_range &range) const {
+		std::vector<long> ret;
+		for (long p: partitions) {
+			if ((p + 1) * period <= range.tsec_start)
+				continue;
+			if (p * period > range.tsec_end)
+				break;
+
+			ret.push_back(p);
+		}
+
+		return ret;
+	}
+
+	void load(const void *data, size_t size) {
+		msgpack::unpacked result;
+		msgpack::unpack(&result, (const char *)data, size);
+		msgpack::object obj = result.get();
+		obj.convert(this);
+	}
+
+	std::string save() const {
+		std::stringstream ss;
+		msgpack::pack(ss, *this);
+		return ss.str();
+	}
+
+	std::string str() const {
+		std::ostringstream ss;
+		ss << "period: " << period << ", partitions: " << partitions.size();
+		if (partitions.size())
+			ss << " [" << partitions.front() << ", " << partitions.back() << "]";
+		return ss.str();
+	}
+};
+
+template <typename T>
+class partitioned_index {
+public:
+	// @period is only used when directory does not exist yet, existing directory keeps its own period
+	partitioned_index(T &t, const eurl &base, long period, bool read_only) :
+		m_t(t), m_base(base), m_read_only(read_only) {
+		status e = m_t.read(partition_directory::directory_url(m_base));
+		if (!e.error) {
+			m_dir.load(e.data.data(), e.data.size());
+			return;
+		}
+
+		if (m_read_only) {
+			std::ostringstream ss;
+			ss << "partitioned index: could not read directory for '" << base.str() << "': " << e.error <<
+				" and not allowed to create new index";
+			if (e.error == -ENOENT)
+				throw index_not_found(ss.str());
+			throw std::runtime_error(ss.str());
+		}
+
+		if (period <= 0) {
+			std::ostringstream ss;
+			ss << "partitioned index: '" << base.str() << "': invalid partition period: " << period;
+			throw std::runtime_error(ss.str());
+		}
+
+		m_dir.period = period;
+	}
+
+	// every partition stores keys of the same posting format, see @index<T>::set_posting_format(),
+	// it is checked when the key is inserted into the partition
+	void set_posting_format(uint64_t format) {
+		m_posting_format = format;
+	}
+
+	int insert(const key &obj) {
+		if (m_read_only)
+			return -EPERM;
+
+		long partition = m_dir.partition(obj.timestamp);
+		int err;
+		{
+			read_write_index<T> idx(m_t, partition_directory::partition_url(m_base, partition));
+			if (m_posting_format) {
+				err = idx.set_posting_format(m_posting_format);
+				if (err < 0)
+					return err;
+			}
+
+			err = idx.insert(obj);
+			if (err < 0)
+				return err;
+		}
+
+		// directory is only written when new partition has been created
+		if (!m_dir.insert(partition))
+			return 0;
+
+		m_dir.update_generation_number();
+		return write_directory();
+	}
+
+	int remove(const key &obj) {
+		if (m_read_only)
+			return -EPERM;
+
+		long partition = m_dir.partition(obj.timestamp);
+		if (!std::binary_search(m_dir.partitions.begin(), m_dir.partitions.end(), partition))
+			return -ENOENT;
+
+		int err;
+		{
+			read_write_index<T> idx(m_t, partition_directory::partition_url(m_base, partition));
+			err = idx.remove(obj);
+			if (err < 0)
+				return err;
+		}
+
+		return 0;
+	}
+
+	// removes all keys with timestamp less than @cutoff
+	// partitions which are completely older than @cutoff are destroyed and removed from the directory,
+	// only the partition which contains @cutoff is truncated
+	int truncate(uint64_t cutoff) {
+		if (m_read_only)
+			return -EPERM;
+
+		long cutoff_partition = m_dir.partition(cutoff);
+
+		auto boundary = std::lower_bound(m_dir.partitions.begin(), m_dir.partitions.end(), cutoff_partition);
+		std::vector<long> expired(m_dir.partitions.begin(), boundary);
+
+		// directory is updated first, so that readers never see partitions which do not exist anymore
+		int err;
+		if (!expired.empty()) {
+			m_dir.partitions.erase(m_dir.partitions.begin(), m_dir.partitions.begin() + expired.size());
+
+			m_dir.update_generation_number();
+			err = write_directory();
+			if (err < 0)
+				return err;
+		}
+
+		for (long p: expired) {
+			read_write_index<T> idx(m_t, partition_directory::partition_url(m_base, p));
+			err = idx.destroy();
+			if (err < 0)
+				return err;
+		}
+
+		if (!m_dir.partitions.empty() && m_dir.partitions.front() == cutoff_partition) {
+			{
+				read_write_index<T> idx(m_t, partition_directory::partition_url(m_base, cutoff_partition));
+				err = idx.truncate(cutoff);
+				if (err < 0)
+					return err;
+			}
+		}
+
+		return 0;
+	}
+
+	const partition_directory &directory() const {
+		return m_dir;
+	}
+
+	uint64_t estimate_count(const time_range &range = time_range()) const {
+		uint64_t num = 0;
+		for (long p: m_dir.overlap(range)) {
+			read_only_index<T> idx(m_t, partition_directory::partition_url(m_base, p));
+
+			uint64_t pnum = idx.estimate_count(range);
+			if (pnum == index<T>::unknown_count)
+				return pnum;
+
+			num += pnum;
+		}
+
+		return num;
+	}
+
+private:
+	T &m_t;
+	eurl m_base;
+	bool m_read_only;
+	partition_directory m_dir;
+	uint64_t m_posting_format = 0;
+
+	int write_directory() {
+		std::vector<status> wr = m_t.write(partition_directory::directory_url(m_base), m_dir.save());
+		for (auto &r: wr) {
+			if (!r.error)
+				return 0;
+		}
+
+		return -EIO;
+	}
+};
+
+// posting list which chains partitions of the time-partitioned index in time order,
+// partitions which do not overlap requested time range are never opened,
+// seek to the key in the later partition skips all partitions in between
+//
+// like @index_postings, partitions are only estimated at construction time, the first partition tree
+// is descended at the first access
+template <typename T>
+class partitioned_postings : public posting_list {
+public:
+	// @hint is the leaf page of the partition which is expected to contain @start
+	partitioned_postings(T &t, const eurl &base, const key &start, const time_range &range,
+			const page_position &hint = page_position()) :
+		m_t(t), m_base(base), m_range(range), m_start(start) {
+		partitioned_index<T> idx(t, base, 0, true);
+		m_dir = idx.directory();
+
+		long start_partition = m_dir.partition(start.timestamp);
+		for (long p: m_dir.overlap(range)) {
+			if (p < start_partition)
+				continue;
+
+			part pt;
+			pt.partition = p;
+			pt.idx = std::make_shared<read_only_index<T>>(m_t, partition_directory::partition_url(m_base, p));
+
+			uint64_t pnum = pt.idx->estimate_count(range);
+			if (pnum == index<T>::unknown_count || m_estimate == index<T>::unknown_count) {
+				m_estimate = index<T>::unknown_count;
+			} else {
+				m_estimate += pnum;
+			}
+
+			m_parts.emplace_back(pt);
+		}
+
+		m_hint = hint;
+	}
+
+	virtual bool end() {
+		open_once(m_start);
+		return m_current >= m_parts.size();
+	}
+
+	virtual const key &current() {
+		open_once(m_start);
+		return **m_begin;
+	}
+
+	virtual void next() {
+		open_once(m_start);
+		++(*m_begin);
+		if (*m_begin == *m_end)
+			open(m_current + 1, m_start);
+	}
+
+	virtual void seek(const key &k) {
+		if (!m_opened) {
+			open_once(m_start < k ? k : m_start);
+			return;
+		}
+
+		if (end())
+			return;
+
+		long partition = m_dir.partition(k.timestamp);
+		if (partition > m_parts[m_current].partition) {
+			size_t pos = m_current + 1;
+			while (pos < m_parts.size() && m_parts[pos].partition < partition)
+				++pos;
+
+			open(pos, k);
+			return;
+		}
+
+		m_begin->seek(k);
+		if (*m_begin == *m_end)
+			open(m_current + 1, k);
+	}
+
+	virtual uint64_t estimate() const {
+		return m_estimate;
+	}
+
+	virtual std::string str() const {
+		return m_base.str();
+	}
+
+	virtual page_position position() const {
+		if (!m_opened)
+			return m_hint;
+		if (!m_begin)
+			return page_position();
+
+		return m_begin->position();
+	}
+
+private:
+	struct part {
+		long partition;
+		std::shared_ptr<read_only_index<T>> idx;
+	};
+
+	T &m_t;
+	eurl m_base;
+	time_range m_range;
+	key m_start;
+
+	partition_directory m_dir;
+	std::vector<part> m_parts;
+	uint64_t m_estimate = 0;
+
+	size_t m_current = 0;
+	std::unique_ptr<greylock::iterator<T>> m_begin, m_end;
+
+	bool m_opened = false;
+	page_position m_hint;
+
+	void open_once(const key &start) {
+		if (m_opened)
+			return;
+
+		m_opened = true;
+		if (m_estimate == 0) {
+			m_current = m_parts.size();
+			return;
+		}
+
+		long partition = m_dir.partition(start.timestamp);
+		size_t pos = 0;
+		while (pos < m_parts.size() && m_parts[pos].partition < partition)
+			++pos;
+
+		// hint is only valid for the key it has been saved for
+		open(pos, start, start == m_start ? m_hint : page_position());
+	}
+
+	// positions iterator at the first key not less than @start in partition @pos or any later partition,
+	// @hint is only checked against the first partition, it is ignored if it belongs to different index
+	void open(size_t pos, const key &start, const page_position &hint = page_position()) {
+		for (m_current = pos; m_current < m_parts.size(); ++m_current) {
+			auto &idx = m_parts[m_current].idx;
+
+			if (m_current == pos) {
+				m_begin.reset(new greylock::iterator<T>(idx->begin(hint, start, m_range.end_timestamp())));
+			} else {
+				m_begin.reset(new greylock::iterator<T>(idx->begin(start, m_range.end_timestamp())));
+			}
+			m_end.reset(new greylock::iterator<T>(idx->end()));
+
+			if (*m_begin != *m_end)
+				return;
+		}
+
+		m_begin.reset();
+		m_end.reset();
+	}
+};
+
+}} // namespace ioremap::greylock
+
+namespace msgpack {
+static inline ioremap::greylock::partition_directory &operator >>(msgpack::object o, ioremap::greylock::partition_directory &dir)
+{
+	if (o.type != msgpack::type::ARRAY || o.via.array.size != 5) {
+		std::ostringstream ss;
+		ss << "partition directory unpack: type: " << o.type <<
+			", must be: " << msgpack::type::ARRAY <<
+			", size: " << o.via.array.size;
+		throw std::runtime_error(ss.str());
+	}
+
+	object *p = o.via.array.ptr;
+	uint16_t version = 0;
+	p[0].convert(&version);
+	if (version != ioremap::greylock::partition_directory::serialization_version) {
+		std::ostringstream ss;
+		ss << "partition directory unpack: version mismatch: read: " << version <<
+			", must be: " << ioremap::greylock::partition_directory::serialization_version;
+		throw std::runtime_error(ss.str());
+	}
+
+	p[1].convert(&dir.period);
+	p[2].convert(&dir.partitions);
+
+	p[3].convert(&dir.generation_number_sec);
+	p[4].convert(&dir.generation_number_nsec);
+
+	return dir;
+}
+
+template <typename Stream>
+inline msgpack::packer<Stream> &operator <<(msgpack::packer<Stream> &o, const ioremap::greylock::partition_directory &dir)
+{
+	o.pack_array(5);
+	o.pack((int)ioremap::greylock::partition_directory::serialization_version);
+	o.pack(dir.period);
+	o.pack(dir.partitions);
+	o.pack(dir.generation_number_sec);
+	o.pack(dir.generation_number_nsec);
+
+	return o;
+}
+} // namespace msgpack
+
+#endif // __INDEXES_PARTITION_HPP
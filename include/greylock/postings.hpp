@@ -0,0 +1,716 @@
+#ifndef __INDEXES_POSTINGS_HPP
+#define __INDEXES_POSTINGS_HPP
+
+#include "greylock/index.hpp"
+
+#include <algorithm>
+#include <memory>
+
+namespace ioremap { namespace greylock {
+
+// sorted (in key order, i.e. by timestamp and document id) stream of keys intersection works with
+//
+// posting list may be backed by the index tree or by the keys materialized in memory,
+// for example documents found in the numeric range index
+class posting_list {
+public:
+	virtual ~posting_list() {}
+
+	// returns true if there are no more keys in the list
+	virtual bool end() = 0;
+
+	// current key, must not be called if @end() returns true
+	virtual const key &current() = 0;
+
+	// moves to the next key
+	virtual void next() = 0;
+
+	// moves forward to the first key which is not less than @k
+	virtual void seek(const key &k) = 0;
+
+	// estimated number of keys in the list, used by query planner,
+	// @index<T>::unknown_count if it can not be estimated
+	virtual uint64_t estimate() const = 0;
+
+	virtual std::string str() const = 0;
+
+	// approximate number of bytes this list keeps in memory while it is being iterated,
+	// tree-backed lists hold one loaded page at a time
+	virtual size_t memory() const {
+		return max_page_size;
+	}
+
+	// leaf page and offset of the current key for the tree-backed lists, empty otherwise
+	virtual page_position position() const {
+		return page_position();
+	}
+
+	// how well the current key matches the query, 1 is the exact match,
+	// approximately matched keys (see @weighted_postings) weigh less
+	virtual float weight() {
+		return 1;
+	}
+};
+
+typedef std::shared_ptr<posting_list> posting_list_ptr;
+
+// posting list which reads keys from the index tree
+//
+// only index metadata (and boundary pages for bounded range) is read at construction time to estimate the list,
+// the tree is descended at the first access, so that lists of the intersection which turns out to be empty
+// are never read
+template <typename T>
+class index_postings : public posting_list {
+public:
+	// @hint is the leaf page which is expected to contain @start, see @index<T>::begin()
+	index_postings(T &t, const eurl &iname, const key &start, const time_range &range,
+			const page_position &hint = page_position()) :
+		m_idx(t, iname),
+		m_end(m_idx.end()),
+		m_start(start),
+		m_max_timestamp(range.end_timestamp()),
+		m_hint(hint),
+		m_estimate(m_idx.estimate_count(range))
+	{}
+
+	virtual bool end() {
+		open(m_start);
+		return *m_begin == m_end;
+	}
+
+	virtual const key &current() {
+		open(m_start);
+		return **m_begin;
+	}
+
+	virtual void next() {
+		open(m_start);
+		++(*m_begin);
+	}
+
+	virtual void seek(const key &k) {
+		if (!m_begin) {
+			open(m_start < k ? k : m_start);
+			return;
+		}
+
+		m_begin->seek(k);
+	}
+
+	virtual uint64_t estimate() const {
+		return m_estimate;
+	}
+
+	virtual std::string str() const {
+		return m_idx.start().str();
+	}
+
+	virtual page_position position() const {
+		if (!m_begin)
+			return m_hint;
+
+		return m_begin->position();
+	}
+
+private:
+	read_only_index<T> m_idx;
+	std::unique_ptr<greylock::iterator<T>> m_begin;
+	greylock::iterator<T> m_end;
+	key m_start;
+	uint64_t m_max_timestamp;
+	page_position m_hint;
+	uint64_t m_estimate;
+
+	void open(const key &start) {
+		if (m_begin)
+			return;
+
+		if (m_estimate == 0) {
+			m_begin.reset(new greylock::iterator<T>(m_idx.end()));
+			return;
+		}
+
+		// hint is only valid for the key it has been saved for
+		if (start != m_start)
+			m_hint = page_position();
+
+		m_begin.reset(new greylock::iterator<T>(m_idx.begin(m_hint, start, m_max_timestamp)));
+	}
+};
+
+// posting list over keys materialized in memory, keys must be sorted
+class vector_postings : public posting_list {
+public:
+	vector_postings(const std::string &name, std::vector<key> &&keys) : m_name(name), m_keys(std::move(keys)) {}
+
+	virtual bool end() {
+		return m_pos >= m_keys.size();
+	}
+
+	virtual const key &current() {
+		return m_keys[m_pos];
+	}
+
+	virtual void next() {
+		++m_pos;
+	}
+
+	virtual void seek(const key &k) {
+		if (end() || !(m_keys[m_pos] < k))
+			return;
+
+		m_pos = std::lower_bound(m_keys.begin() + m_pos, m_keys.end(), k) - m_keys.begin();
+	}
+
+	virtual uint64_t estimate() const {
+		return m_keys.size() - std::min(m_pos, m_keys.size());
+	}
+
+	virtual std::string str() const {
+		return m_name;
+	}
+
+	virtual size_t memory() const {
+		return m_keys.size() * sizeof(key);
+	}
+
+private:
+	std::string m_name;
+	std::vector<key> m_keys;
+	size_t m_pos = 0;
+};
+
+// posting list whose every key weighs @weight, for example list of the word which differs
+// from the query word, its documents are ranked lower than documents of the exact word
+class weighted_postings : public posting_list {
+public:
+	weighted_postings(const posting_list_ptr &list, float weight) : m_list(list), m_weight(weight) {}
+
+	virtual bool end() {
+		return m_list->end();
+	}
+
+	virtual const key &current() {
+		return m_list->current();
+	}
+
+	virtual void next() {
+		m_list->next();
+	}
+
+	virtual void seek(const key &k) {
+		m_list->seek(k);
+	}
+
+	virtual uint64_t estimate() const {
+		return m_list->estimate();
+	}
+
+	virtual std::string str() const {
+		return m_list->str();
+	}
+
+	virtual size_t memory() const {
+		return m_list->memory();
+	}
+
+	virtual page_position position() const {
+		return m_list->position();
+	}
+
+	virtual float weight() {
+		return m_weight * m_list->weight();
+	}
+
+private:
+	posting_list_ptr m_list;
+	float m_weight;
+};
+
+// posting list whose positions are shifted by @shift, for example the pair index read as the list
+// of the second word of the pair, its positions are the positions of the first word
+class shifted_postings : public posting_list {
+public:
+	shifted_postings(const posting_list_ptr &list, size_t shift) : m_list(list), m_shift(shift) {}
+
+	virtual bool end() {
+		return m_list->end();
+	}
+
+	virtual const key &current() {
+		if (!m_valid) {
+			m_current = m_list->current();
+			for (auto &pos: m_current.positions)
+				pos += m_shift;
+			m_valid = true;
+		}
+
+		return m_current;
+	}
+
+	virtual void next() {
+		m_list->next();
+		m_valid = false;
+	}
+
+	virtual void seek(const key &k) {
+		m_list->seek(k);
+		m_valid = false;
+	}
+
+	virtual uint64_t estimate() const {
+		return m_list->estimate();
+	}
+
+	virtual std::string str() const {
+		return m_list->str();
+	}
+
+	virtual size_t memory() const {
+		return m_list->memory() + sizeof(key);
+	}
+
+	virtual page_position position() const {
+		return m_list->position();
+	}
+
+	virtual float weight() {
+		return m_list->weight();
+	}
+
+private:
+	posting_list_ptr m_list;
+	size_t m_shift;
+	key m_current;
+	bool m_valid = false;
+};
+
+// sums memory of the lists
+static inline size_t sum_memory(const std::vector<posting_list_ptr> &lists) {
+	size_t size = 0;
+	for (const auto &l: lists) {
+		size += l->memory();
+	}
+
+	return size;
+}
+
+// sums estimates of the lists, @index<T>::unknown_count is contagious
+static inline uint64_t sum_estimates(const std::vector<posting_list_ptr> &lists) {
+	uint64_t num = 0;
+	for (const auto &l: lists) {
+		uint64_t lnum = l->estimate();
+		if (lnum == ~0ULL)
+			return lnum;
+
+		num += lnum;
+	}
+
+	return num;
+}
+
+// OR operator: k-way merge of the sorted lists
+//
+// lists are kept in the binary heap ordered by their current keys, the heap top is the smallest key,
+// key present in several lists is returned only once
+//
+// like tree-backed lists, lists are not read until the first access, heap is built at that time
+class union_postings : public posting_list {
+public:
+	union_postings(const std::string &name, std::vector<posting_list_ptr> &&lists) :
+		m_name(name), m_heap(std::move(lists)), m_estimate(sum_estimates(m_heap)) {
+	}
+
+	virtual bool end() {
+		open();
+		return m_heap.empty();
+	}
+
+	virtual const key &current() {
+		open();
+		return m_heap.front()->current();
+	}
+
+	virtual void next() {
+		open();
+		key k = current();
+
+		while (!m_heap.empty() && m_heap.front()->current() == k) {
+			std::pop_heap(m_heap.begin(), m_heap.end(), heap_compare);
+			m_heap.back()->next();
+			push_back_or_drop();
+		}
+	}
+
+	virtual void seek(const key &k) {
+		open();
+		while (!m_heap.empty() && m_heap.front()->current() < k) {
+			std::pop_heap(m_heap.begin(), m_heap.end(), heap_compare);
+			m_heap.back()->seek(k);
+			push_back_or_drop();
+		}
+	}
+
+	virtual uint64_t estimate() const {
+		return m_estimate;
+	}
+
+	virtual std::string str() const {
+		return m_name;
+	}
+
+	virtual size_t memory() const {
+		return sum_memory(m_heap);
+	}
+
+	// the best weight among the lists containing the current key, they are at the top of the heap
+	virtual float weight() {
+		float w = 0;
+		find_current(0, current(), w);
+		return w;
+	}
+
+private:
+	std::string m_name;
+	std::vector<posting_list_ptr> m_heap;
+	uint64_t m_estimate;
+	bool m_opened = false;
+
+	void open() {
+		if (m_opened)
+			return;
+
+		m_opened = true;
+		m_heap.erase(std::remove_if(m_heap.begin(), m_heap.end(), [] (const posting_list_ptr &l) {
+					return l->end();
+				}), m_heap.end());
+		std::make_heap(m_heap.begin(), m_heap.end(), heap_compare);
+	}
+
+	// std heap functions build max-heap, lists with greater keys must compare as 'less'
+	static bool heap_compare(const posting_list_ptr &l1, const posting_list_ptr &l2) {
+		return l2->current() < l1->current();
+	}
+
+	// walks the heap subtree at @pos whose lists are positioned at @k, heap order guarantees
+	// that subtree rooted at the list with greater key does not contain @k
+	void find_current(size_t pos, const key &k, float &w) {
+		if (pos >= m_heap.size() || m_heap[pos]->current() != k)
+			return;
+
+		w = std::max(w, m_heap[pos]->weight());
+		find_current(pos * 2 + 1, k, w);
+		find_current(pos * 2 + 2, k, w);
+	}
+
+	// list at the back of the heap vector has been moved, put it back into the heap or drop it if it is over
+	void push_back_or_drop() {
+		if (m_heap.back()->end()) {
+			m_heap.pop_back();
+		} else {
+			std::push_heap(m_heap.begin(), m_heap.end(), heap_compare);
+		}
+	}
+};
+
+// AND operator: leapfrog intersection of the sorted lists
+//
+// the smallest list proposes candidates, other lists are seeked to the candidate,
+// this is the same algorithm @intersect::intersector uses for the top-level indexes
+//
+// lists are not read until the first access
+class intersection_postings : public posting_list {
+public:
+	intersection_postings(const std::string &name, std::vector<posting_list_ptr> &&lists) :
+		m_name(name), m_lists(std::move(lists)) {
+		std::stable_sort(m_lists.begin(), m_lists.end(), [] (const posting_list_ptr &l1, const posting_list_ptr &l2) {
+					return l1->estimate() < l2->estimate();
+				});
+
+		m_estimate = m_lists.empty() ? 0 : m_lists.front()->estimate();
+	}
+
+	virtual bool end() {
+		open();
+		return m_end;
+	}
+
+	virtual const key &current() {
+		open();
+		return m_lists.front()->current();
+	}
+
+	virtual void next() {
+		open();
+		m_lists.front()->next();
+		align();
+	}
+
+	virtual void seek(const key &k) {
+		if (m_lists.empty()) {
+			m_opened = true;
+			m_end = true;
+			return;
+		}
+
+		m_opened = true;
+		m_lists.front()->seek(k);
+		align();
+	}
+
+	virtual uint64_t estimate() const {
+		return m_estimate;
+	}
+
+	virtual std::string str() const {
+		return m_name;
+	}
+
+	virtual size_t memory() const {
+		return sum_memory(m_lists);
+	}
+
+	virtual float weight() {
+		float w = 1;
+		for (auto &l: m_lists) {
+			w *= l->weight();
+		}
+
+		return w;
+	}
+
+private:
+	std::string m_name;
+	std::vector<posting_list_ptr> m_lists;
+	uint64_t m_estimate;
+	bool m_end = false;
+	bool m_opened = false;
+
+	void open() {
+		if (m_opened)
+			return;
+
+		m_opened = true;
+		align();
+	}
+
+	// moves all lists to the first key which is present in every list
+	void align() {
+		if (m_lists.empty()) {
+			m_end = true;
+			return;
+		}
+
+		posting_list &driver = *m_lists.front();
+		while (!driver.end()) {
+			const key &candidate = driver.current();
+
+			bool match = true;
+			for (size_t i = 1; i < m_lists.size(); ++i) {
+				posting_list &other = *m_lists[i];
+
+				other.seek(candidate);
+				if (other.end()) {
+					m_end = true;
+					return;
+				}
+
+				if (other.current() != candidate) {
+					driver.seek(other.current());
+					match = false;
+					break;
+				}
+			}
+
+			if (match)
+				return;
+		}
+
+		m_end = true;
+	}
+};
+
+// positional AND: keys present in every list whose positions contain p + @offsets[i] in the list i for some p,
+// for example trigrams of the substring must be present in the document at the same offsets as in the substring
+//
+// lists are intersected by @intersection_postings, positions are only checked for the keys present in all lists
+class phrase_postings : public posting_list {
+public:
+	phrase_postings(const std::string &name, std::vector<posting_list_ptr> &&lists, const std::vector<size_t> &offsets) :
+		m_name(name), m_lists(std::move(lists)), m_offsets(offsets),
+		m_match(name, std::vector<posting_list_ptr>(m_lists)) {
+	}
+
+	virtual bool end() {
+		open();
+		return m_match.end();
+	}
+
+	virtual const key &current() {
+		open();
+		return m_match.current();
+	}
+
+	virtual void next() {
+		open();
+		m_match.next();
+		skip();
+	}
+
+	virtual void seek(const key &k) {
+		m_opened = true;
+		m_match.seek(k);
+		skip();
+	}
+
+	// upper bound, positions are not known until lists are read
+	virtual uint64_t estimate() const {
+		return m_match.estimate();
+	}
+
+	virtual std::string str() const {
+		return m_name;
+	}
+
+	virtual size_t memory() const {
+		return m_match.memory();
+	}
+
+	virtual float weight() {
+		return m_match.weight();
+	}
+
+private:
+	std::string m_name;
+	std::vector<posting_list_ptr> m_lists;
+	std::vector<size_t> m_offsets;
+	intersection_postings m_match;
+	bool m_opened = false;
+
+	void open() {
+		if (m_opened)
+			return;
+
+		m_opened = true;
+		skip();
+	}
+
+	// every position of the first list is tried as the start, other lists are looked up by binary search,
+	// positions must be sorted
+	bool check() {
+		const std::vector<size_t> &first = m_lists.front()->current().positions;
+
+		for (size_t pos: first) {
+			if (pos < m_offsets[0])
+				continue;
+
+			size_t start = pos - m_offsets[0];
+
+			bool match = true;
+			for (size_t i = 1; i < m_lists.size(); ++i) {
+				const std::vector<size_t> &positions = m_lists[i]->current().positions;
+				if (!std::binary_search(positions.begin(), positions.end(), start + m_offsets[i])) {
+					match = false;
+					break;
+				}
+			}
+
+			if (match)
+				return true;
+		}
+
+		return false;
+	}
+
+	void skip() {
+		while (!m_match.end() && !check()) {
+			m_match.next();
+		}
+	}
+};
+
+// returns true if @k is present in any of the @excludes lists
+// lists are only moved forward, thus keys must be checked in increasing order
+static inline bool excluded(const std::vector<posting_list_ptr> &excludes, const key &k) {
+	for (const auto &ex: excludes) {
+		ex->seek(k);
+		if (!ex->end() && ex->current() == k)
+			return true;
+	}
+
+	return false;
+}
+
+// NOT operator: keys of the @base list which are not present in any of the @excludes lists
+//
+// this is anti-join, excluded lists are seeked to the current key of the base list,
+// large runs of the excluded keys which are not present in the base list are never read
+class exclusion_postings : public posting_list {
+public:
+	exclusion_postings(const std::string &name, const posting_list_ptr &base, std::vector<posting_list_ptr> &&excludes) :
+		m_name(name), m_base(base), m_excludes(std::move(excludes)) {
+	}
+
+	virtual bool end() {
+		open();
+		return m_base->end();
+	}
+
+	virtual const key &current() {
+		open();
+		return m_base->current();
+	}
+
+	virtual void next() {
+		open();
+		m_base->next();
+		skip();
+	}
+
+	virtual void seek(const key &k) {
+		m_opened = true;
+		m_base->seek(k);
+		skip();
+	}
+
+	// upper bound, excluded keys are not known until lists are read
+	virtual uint64_t estimate() const {
+		return m_base->estimate();
+	}
+
+	virtual std::string str() const {
+		return m_name;
+	}
+
+	virtual size_t memory() const {
+		return m_base->memory() + sum_memory(m_excludes);
+	}
+
+	virtual float weight() {
+		return m_base->weight();
+	}
+
+private:
+	std::string m_name;
+	posting_list_ptr m_base;
+	std::vector<posting_list_ptr> m_excludes;
+	bool m_opened = false;
+
+	void open() {
+		if (m_opened)
+			return;
+
+		m_opened = true;
+		skip();
+	}
+
+	void skip() {
+		while (!m_base->end() && excluded(m_excludes, m_base->current())) {
+			m_base->next();
+		}
+	}
+};
+
+}} // namespace ioremap::greylock
+
+#endif // __INDEXES_POSTINGS_HPP
@@ -0,0 +1,841 @@
+#ifndef __INDEXES_SEARCH_HPP
+#define __INDEXES_SEARCH_HPP
+
+#include "greylock/intersection.hpp"
+#include "greylock/numeric.hpp"
+
+#include <ribosome/distance.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <climits>
+#include <cmath>
+#include <condition_variable>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+
+namespace ioremap { namespace greylock {
+
+struct single_attribute {
+	typedef std::vector<size_t> pos_t;
+
+	std::string aname;
+	pos_t ivec;
+
+	// greylock operates with raw index names, it doesn't know whether they were organized into attributes or not
+	// It returns array of raw index names and positions where those indexes live in each returned document.
+	//
+	// We have to split array of raw index names into per-attribute indexes
+	// This @apos vector contains positions within raw index name vector of the indexes which belong to @aname attribute
+	pos_t apos;
+};
+
+// Query operators.
+//
+// Document matches the node if it contains every index from @indexes, matches every node from @all,
+// at least one node from every group in @any and none of the nodes from @none.
+// Node without indexes, @phrase, @all and @any nodes does not match anything, there is no way to enumerate
+// documents which do not contain given words.
+struct query_node {
+	std::vector<greylock::eurl> indexes;
+
+	// indexes which must be present in the document at the relative positions @offsets,
+	// see @greylock::phrase_postings, for example trigrams of the substring
+	std::vector<greylock::eurl> phrase;
+	std::vector<size_t> offsets;
+
+	std::vector<query_node> all;
+	std::vector<std::vector<query_node>> any;
+	std::vector<query_node> none;
+
+	// documents matched by this node weigh @weight in the relevance score, see @greylock::weighted_postings
+	float weight = 1;
+
+	// wildcard or fuzzy expansion of this node has been limited by the maximum number of terms,
+	// documents of the words which have not been used are not matched, see @truncated()
+	bool expansion_truncated = false;
+
+	// returns true if this node or any of its nodes has weight, i.e. documents may be matched approximately
+	bool weighted() const {
+		if (weight != 1)
+			return true;
+
+		for (const auto &n: all) {
+			if (n.weighted())
+				return true;
+		}
+		for (const auto &group: any) {
+			for (const auto &n: group) {
+				if (n.weighted())
+					return true;
+			}
+		}
+
+		return false;
+	}
+
+	// returns true if expansion of this node or any of its nodes has been truncated
+	bool truncated() const {
+		if (expansion_truncated)
+			return true;
+
+		for (const auto &n: all) {
+			if (n.truncated())
+				return true;
+		}
+		for (const auto &group: any) {
+			for (const auto &n: group) {
+				if (n.truncated())
+					return true;
+			}
+		}
+		for (const auto &n: none) {
+			if (n.truncated())
+				return true;
+		}
+
+		return false;
+	}
+
+	void urls(std::vector<greylock::eurl> &ret) const {
+		ret.insert(ret.end(), indexes.begin(), indexes.end());
+		ret.insert(ret.end(), phrase.begin(), phrase.end());
+
+		for (const auto &n: all)
+			n.urls(ret);
+		for (const auto &group: any) {
+			for (const auto &n: group)
+				n.urls(ret);
+		}
+		for (const auto &n: none)
+			n.urls(ret);
+	}
+
+	// normalized representation, equal queries produce equal strings
+	std::string str() const {
+		std::ostringstream ss;
+		ss << "[";
+		for (const auto &url: indexes)
+			ss << url.str() << " ";
+		if (!phrase.empty()) {
+			ss << "$phrase(";
+			for (size_t i = 0; i < phrase.size(); ++i)
+				ss << phrase[i].str() << "@" << offsets[i] << " ";
+			ss << ")";
+		}
+		for (const auto &n: all)
+			ss << "$and" << n.str();
+		for (const auto &group: any) {
+			ss << "$or(";
+			for (const auto &n: group)
+				ss << n.str();
+			ss << ")";
+		}
+		for (const auto &n: none)
+			ss << "$not" << n.str();
+		if (weight != 1)
+			ss << "~" << weight;
+		ss << "]";
+
+		return ss.str();
+	}
+};
+
+struct indexes_request {
+	typedef std::vector<size_t> pos_t;
+
+	std::string mailbox;
+
+	std::vector<greylock::eurl> indexes;
+	std::vector<pos_t> positions;
+
+	std::vector<single_attribute> attributes;
+
+	// derived indexes of the document: n-grams (see @http_server::ngrams()) and word pairs
+	// (see @http_server::add_word_pairs()) follow word indexes in @indexes, they start at this position,
+	// derived indexes do not belong to any attribute
+	size_t derived_start = 0;
+
+	// word pair indexes which replace lists of the adjacent words of the phrase, see @http_server::get_phrase_match()
+	struct word_pair {
+		size_t first, second;
+		greylock::eurl url;
+	};
+	std::vector<word_pair> pairs;
+
+	// numeric indexes and requested value ranges, documents must match every range
+	std::vector<greylock::eurl> numeric_indexes;
+	std::vector<greylock::numeric_range> numeric_ranges;
+
+	// "$and", "$or" and "$not" operators of the top-level query,
+	// top-level words are in @indexes, @operators.indexes is always empty
+	query_node operators;
+
+	// positional constraint for the top-level words
+	greylock::intersect::phrase_match phrase;
+
+	// BM25 scoring: relevance combines term rarity with the positional score,
+	// @df contains number of documents which contain every requested index,
+	// @num_documents is the number of documents in the mailbox
+	//
+	// documents length is not stored, thus term frequency is not normalized by it
+	bool bm25 = false;
+	std::vector<uint64_t> df;
+	uint64_t num_documents = 0;
+
+	static constexpr float bm25_k1 = 1.2;
+
+	// top-K mode: only @top most relevant documents are returned,
+	// they are kept in the min-heap @top_docs while intersection runs, the whole result is never materialized
+	size_t top = 0;
+	std::vector<greylock::intersect::single_doc_result> top_docs;
+
+	// count mode: matching documents are only counted, see @greylock::intersect::options.count
+	bool count = false;
+
+	// facets: matching documents are counted per requested attribute value and per bucket of their urls
+	// in the same pass, see @greylock::intersect::options.facets and @http_server::get_facets()
+	struct facet {
+		std::string attribute;
+		std::string value;
+		greylock::eurl url;
+	};
+	std::vector<facet> facets;
+	bool facet_buckets = false;
+
+	bool has_facets() const {
+		return !facets.empty() || facet_buckets;
+	}
+
+	// normalized query: words of every attribute in query order, operators, ranges, matching and scoring options,
+	// requests which produce equal strings return equal results
+	std::string str() const {
+		std::ostringstream ss;
+		ss << mailbox << ": ";
+		for (const auto &sa: attributes) {
+			ss << sa.aname << ": ";
+			for (auto pos: sa.ivec)
+				ss << indexes[pos].str() << " ";
+		}
+
+		for (size_t i = 0; i < numeric_indexes.size(); ++i)
+			ss << numeric_indexes[i].str() << ": " << numeric_ranges[i].str() << " ";
+
+		ss << "operators: " << operators.str() <<
+			", match: " << phrase.str() <<
+			", top: " << top <<
+			", bm25: " << bm25 <<
+			", count: " << count <<
+			", facets: ";
+		for (const auto &f: facets)
+			ss << f.url.str() << " ";
+		ss << "buckets: " << facet_buckets;
+		return ss.str();
+	}
+
+	// key of the result cache and of the coalesced searches, requests with equal keys get equal pages
+	std::string search_key(const greylock::time_range &range, size_t num, const std::string &start) const {
+		return str() + ", time: " + range.str() + ", num: " + std::to_string(num) + ", start: " + start;
+	}
+
+	// puts scored document into the top-K heap
+	// returns false to stop intersection when heap is full of documents with maximum relevance,
+	// since nothing can replace them
+	bool top_process(greylock::intersect::single_doc_result &doc) {
+		auto heap_compare = [] (const greylock::intersect::single_doc_result &d1,
+				const greylock::intersect::single_doc_result &d2) {
+			return d1.relevance > d2.relevance;
+		};
+
+		doc.relevance = relevance(doc);
+
+		if (top_docs.size() < top) {
+			top_docs.emplace_back(std::move(doc));
+			std::push_heap(top_docs.begin(), top_docs.end(), heap_compare);
+		} else if (doc.relevance > top_docs.front().relevance) {
+			std::pop_heap(top_docs.begin(), top_docs.end(), heap_compare);
+			top_docs.back() = std::move(doc);
+			std::push_heap(top_docs.begin(), top_docs.end(), heap_compare);
+		}
+
+		return top_docs.size() < top || top_docs.front().relevance < m_max_relevance;
+	}
+
+	bool top_finish(const std::vector<greylock::eurl> &indexes_unused, greylock::intersect::result &res) {
+		(void) indexes_unused;
+
+		sort_relevance(top_docs);
+		res.docs.swap(top_docs);
+		top_docs.clear();
+		return true;
+	}
+
+	bool distance_sort(const std::vector<greylock::eurl> &indexes_unused, greylock::intersect::result &res) {
+		(void) indexes_unused;
+
+		for (auto &doc: res.docs) {
+			doc.relevance = relevance(doc);
+		}
+
+		sort_relevance(res.docs);
+		return true;
+	}
+
+private:
+	// scratch buffers reused for every scored document
+	std::vector<const pos_t *> m_positions;
+	pos_t m_pos_idx;
+	std::vector<pos_t> m_dvecs;
+	pos_t m_sub;
+
+	bool m_apos_ready = false;
+
+	// relevance never exceeds this value
+	float m_max_relevance = 1.0;
+
+	static void sort_relevance(std::vector<greylock::intersect::single_doc_result> &docs) {
+		std::sort(docs.begin(), docs.end(), []
+				(const greylock::intersect::single_doc_result &d1, const greylock::intersect::single_doc_result &d2) {
+					return d1.relevance > d2.relevance;
+			});
+	}
+
+	void prepare_attributes() {
+		if (m_apos_ready)
+			return;
+
+		for (size_t i = 0; i < indexes.size(); ++i) {
+			const std::string &iname = indexes[i].key;
+
+			for (auto &sa : attributes) {
+				if (iname.find(sa.aname) == 0) {
+					sa.apos.push_back(i);
+					break;
+				}
+			}
+		}
+
+		if (bm25) {
+			// term frequency part of the BM25 score never exceeds @bm25_k1 + 1,
+			// positional score never exceeds 1
+			float max_score = 0;
+			for (size_t i = 0; i < df.size(); ++i) {
+				max_score += idf(i) * (bm25_k1 + 1);
+			}
+
+			m_max_relevance = max_score * 2;
+		}
+
+		m_apos_ready = true;
+	}
+
+	// term whose frequency is not known (see @http_server::document_frequency()) is treated
+	// as present in every document of the mailbox
+	float idf(size_t i) const {
+		double n = num_documents;
+		double d = std::min(df[i], num_documents);
+
+		return log(1.0 + (n - d + 0.5) / (d + 0.5));
+	}
+
+	float bm25_score(const greylock::intersect::single_doc_result &doc) const {
+		float score = 0;
+		for (size_t i = 0; i < doc.indexes.size() && i < df.size(); ++i) {
+			// document is present in the index, even if positions were not specified at insertion time
+			float tf = std::max<size_t>(doc.indexes[i].positions.size(), 1);
+
+			score += idf(i) * tf * (bm25_k1 + 1) / (tf + bm25_k1);
+		}
+
+		return score;
+	}
+
+	float relevance(const greylock::intersect::single_doc_result &doc) {
+		prepare_attributes();
+
+		float rel = distance_relevance(doc);
+		if (bm25)
+			rel = bm25_score(doc) * (1.0 + rel);
+
+		// query without words has no score of its own, it scores 0, unless it has weighted nodes
+		// (for example fuzzy words), their documents are ranked by the weight, exact matches first
+		if (attributes.empty() && !bm25 && operators.weighted())
+			return doc.weight;
+
+		return rel * doc.weight;
+	}
+
+	// positional score, the closer words are in the document to their order in the query, the higher it is
+	float distance_relevance(const greylock::intersect::single_doc_result &doc) {
+//#define STDOUT_DEBUG
+#ifdef STDOUT_DEBUG
+		auto print_vector = [] (const std::vector<size_t> &v) {
+			std::ostringstream ss;
+			ss << "[";
+			for (auto it = v.begin(), end = v.end(); it != end;) {
+				ss << (ssize_t)(*it);
+				++it;
+
+				if (it != end)
+					ss << ", ";
+			}
+			ss << "]";
+
+			return ss.str();
+		};
+#endif
+
+		float rel = doc.relevance;
+		for (const auto &sa: attributes) {
+			m_positions.clear();
+			for (size_t i = 0; i < sa.apos.size(); ++i) {
+				size_t ipos = sa.apos[i];
+
+				m_positions.push_back(&doc.indexes[ipos].positions);
+#ifdef STDOUT_DEBUG
+				printf("doc: %s, sa: %s, index: %s, positions: %s\n",
+						doc.doc.str().c_str(), sa.aname.c_str(),
+						doc.indexes[ipos].str().c_str(), print_vector(doc.indexes[ipos].positions).c_str());
+#endif
+			}
+
+			// fill in with zeroes, every entry in this array is an offset within corresponding entry in @m_positions array
+			m_pos_idx.assign(m_positions.size(), 0);
+
+			// This code converts index positions for given attribute in given document into index vector.
+			//
+			// Given document @doc, let's assume, there are following index positions for @sa attribute:
+			//
+			// idx0 positions: 0, 1, 4, 12
+			// idx1 positions: 3, 7, 15
+			// idx2 positions: 2, 13
+			//
+			//              : 0, 1, 2, 3, 4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15
+			// index vectors: 0, 0, 2, 1, 0
+			//                                        1
+			//                                                            0,  2
+			//                                                                        1
+			//
+			// index vectors are stored in @m_dvecs, whose entries are reused for every document,
+			// only first @dvecs_num entries belong to the current document
+			size_t dvecs_num = 0;
+			auto new_dvec = [&] () {
+				if (dvecs_num == m_dvecs.size())
+					m_dvecs.emplace_back();
+
+				m_dvecs[dvecs_num].clear();
+				return dvecs_num++;
+			};
+
+			size_t current_dvec = new_dvec();
+			size_t prev;
+
+			while (true) {
+				size_t min = INT_MAX;
+				int min_pos = -1;
+
+				for (size_t i = 0; i < m_pos_idx.size(); ++i) {
+					const pos_t &pos_vector = *m_positions[i];
+					size_t pos_offset = m_pos_idx[i];
+
+					if (pos_offset < pos_vector.size()) {
+						if (pos_vector[pos_offset] < min) {
+							min = pos_vector[pos_offset];
+							min_pos = i;
+						}
+					}
+				}
+
+				if (min_pos == -1) {
+					break;
+				}
+
+				if (m_dvecs[current_dvec].size() == 0) {
+					m_dvecs[current_dvec].push_back(min_pos);
+					m_pos_idx[min_pos]++;
+
+					prev = min;
+					continue;
+				}
+
+				if (min != prev + 1) {
+					current_dvec = new_dvec();
+				} else {
+					m_dvecs[current_dvec].push_back(min_pos);
+					m_pos_idx[min_pos]++;
+					prev = min;
+				}
+			}
+
+			int min_dist = INT_MAX;
+			int min_num = 0;
+			size_t total_length = 0;
+			for (size_t d = 0; d < dvecs_num; ++d) {
+				const pos_t &dvec = m_dvecs[d];
+
+				// Using sliding window with size equal to @ivec size for given attribute,
+				// compare every subset of index vector with @ivec using Levenstein distance
+				size_t start = 0;
+				while (true) {
+					size_t num = dvec.size() - start;
+					if (num > sa.ivec.size())
+						num = sa.ivec.size();
+
+					m_sub.assign(dvec.begin() + start, dvec.begin() + start + num);
+
+					int dist = ribosome::distance::levenstein(sa.ivec, m_sub, INT_MAX);
+					if (dist < min_dist) {
+						min_dist = dist;
+						min_num = 1;
+					} else if (dist == min_dist) {
+						min_num++;
+					}
+#ifdef STDOUT_DEBUG
+					printf("doc: %s, sa: %s, start: %zd, index vector: %s, dist: %d, min_dist: %d, min_num: %d\n",
+							doc.doc.str().c_str(),
+							sa.aname.c_str(),
+							start,
+							print_vector(m_sub).c_str(),
+							dist,
+							min_dist,
+							min_num);
+#endif
+
+					if (num < sa.ivec.size())
+						break;
+
+					++start;
+				}
+
+				total_length += dvec.size();
+			}
+
+			rel = (1.0 - (float)min_dist / (float)sa.ivec.size()) * ((float)min_num / (float)total_length);
+		}
+
+		return rel;
+	}
+};
+
+// Paging cookie of the federated search: cookie of every requested mailbox in the request order,
+// mailbox whose intersection has been completed is not searched again.
+// Cookie contains the names of the mailboxes, cookie of the different list of mailboxes is not accepted.
+struct federated_cookie {
+	std::vector<std::string> mailboxes;
+	std::vector<std::string> starts;
+	std::vector<int> completed;
+
+	MSGPACK_DEFINE(mailboxes, starts, completed);
+
+	federated_cookie() {}
+	explicit federated_cookie(const std::vector<std::string> &mboxes) :
+		mailboxes(mboxes), starts(mboxes.size()), completed(mboxes.size(), 0) {}
+
+	// returns false if @data is not a packed federated cookie of @mboxes
+	bool load(const std::string &data, const std::vector<std::string> &mboxes) {
+		if (data.empty())
+			return false;
+
+		try {
+			msgpack::unpacked result;
+			msgpack::unpack(&result, data.data(), data.size());
+			result.get().convert(this);
+		} catch (const std::exception &) {
+			return false;
+		}
+
+		return mailboxes == mboxes && starts.size() == mailboxes.size() && completed.size() == mailboxes.size();
+	}
+
+	std::string save() const {
+		std::stringstream ss;
+		msgpack::pack(ss, *this);
+		return ss.str();
+	}
+
+	// true if intersection of every mailbox has been completed
+	bool done() const {
+		return std::find(completed.begin(), completed.end(), 0) == completed.end();
+	}
+
+	struct candidate {
+		size_t mailbox;
+		intersect::single_doc_result *doc;
+	};
+
+	// merges pages of the mailboxes, @pages[i] is the page of the mailbox i, or NULL if it has not been searched
+	// or its search has failed, such mailbox keeps its start and completion state,
+	// at most @num documents are returned in key order, equal keys are ordered by the mailbox position,
+	// or by relevance if @top is set
+	//
+	// cookie is updated: mailbox continues from its first document which has not been returned,
+	// its positions are not known, thus indexes are descended from the root
+	std::vector<candidate> merge(const std::vector<intersect::result *> &pages, size_t num, bool top) {
+		std::vector<candidate> ret;
+		for (size_t i = 0; i < pages.size(); ++i) {
+			if (!pages[i])
+				continue;
+
+			// documents are sorted by relevance within the page, mailbox pages are merged in key order
+			if (!top) {
+				std::sort(pages[i]->docs.begin(), pages[i]->docs.end(),
+						[] (const intersect::single_doc_result &d1, const intersect::single_doc_result &d2) {
+							return d1.doc < d2.doc;
+						});
+			}
+
+			for (auto &d: pages[i]->docs)
+				ret.push_back(candidate{i, &d});
+		}
+
+		std::stable_sort(ret.begin(), ret.end(), [top] (const candidate &c1, const candidate &c2) {
+					if (top)
+						return c1.doc->relevance > c2.doc->relevance;
+					if (c1.doc->doc != c2.doc->doc)
+						return c1.doc->doc < c2.doc->doc;
+					return c1.mailbox < c2.mailbox;
+				});
+
+		if (ret.size() > num)
+			ret.resize(num);
+
+		std::vector<size_t> taken(pages.size(), 0);
+		for (const auto &c: ret)
+			taken[c.mailbox]++;
+
+		for (size_t i = 0; i < pages.size(); ++i) {
+			if (!pages[i])
+				continue;
+
+			if (taken[i] == pages[i]->docs.size()) {
+				starts[i] = pages[i]->cookie;
+				completed[i] = pages[i]->completed;
+			} else {
+				intersect::paging_cookie pc;
+				pc.start.set_order(pages[i]->docs[taken[i]].doc);
+
+				starts[i] = pc.save();
+				completed[i] = 0;
+			}
+		}
+
+		return ret;
+	}
+};
+
+// Identical searches which run concurrently share a single intersection: the first request (leader) runs it,
+// others wait for its result instead of taking the same index locks and reading the same pages again
+struct search_flight {
+	std::mutex lock;
+	std::condition_variable cond;
+	bool done = false;
+	bool failed = false;
+	greylock::intersect::result result;
+
+	void finish(const greylock::intersect::result &r, bool f) {
+		std::unique_lock<std::mutex> guard(lock);
+		result = r;
+		failed = f;
+		done = true;
+		cond.notify_all();
+	}
+
+	// returns false if leader has failed to run intersection
+	bool wait(greylock::intersect::result &r) {
+		std::unique_lock<std::mutex> guard(lock);
+		cond.wait(guard, [&] { return done; });
+
+		r = result;
+		return !failed;
+	}
+};
+
+typedef std::shared_ptr<search_flight> search_flight_ptr;
+
+// Searches which are running right now keyed by @indexes_request::search_key()
+class search_flights {
+public:
+	// returns in-flight search for @key, @leader is set if this request has started it,
+	// leader must run intersection and call @leave()
+	search_flight_ptr join(const std::string &key, bool &leader) {
+		std::unique_lock<std::mutex> guard(m_lock);
+
+		search_flight_ptr &flight = m_flights[key];
+		leader = !flight;
+		if (leader) {
+			flight = std::make_shared<search_flight>();
+		} else {
+			m_coalesced++;
+		}
+
+		return flight;
+	}
+
+	// wakes up every request waiting for @flight, requests arriving after this call start new search
+	void leave(const std::string &key, const search_flight_ptr &flight,
+			const greylock::intersect::result &result, bool failed) {
+		{
+			std::unique_lock<std::mutex> guard(m_lock);
+			auto it = m_flights.find(key);
+			if (it != m_flights.end() && it->second == flight)
+				m_flights.erase(it);
+		}
+
+		flight->finish(result, failed);
+	}
+
+	// number of requests which have got the result of the search started by another request
+	uint64_t coalesced() const {
+		return m_coalesced;
+	}
+
+private:
+	std::mutex m_lock;
+	std::map<std::string, search_flight_ptr> m_flights;
+	std::atomic<uint64_t> m_coalesced{0};
+};
+
+// Search result cache.
+//
+// Entries are keyed by the normalized query, time range and paging parameters. Every entry contains generations
+// of all indexes intersection has read, entry is only valid if none of them has been updated since.
+// Total memory of the cached results is limited, least recently used entries are evicted first.
+class search_cache {
+public:
+	struct cached_index {
+		greylock::eurl url;
+		bool partitioned = false;
+		bool dense = false;
+
+		// only partitions of the partitioned index which overlap this range are checked
+		greylock::time_range range;
+		std::string generation;
+	};
+
+	struct entry {
+		greylock::intersect::result result;
+		std::vector<cached_index> indexes;
+		size_t memory = 0;
+	};
+	typedef std::shared_ptr<entry> entry_ptr;
+
+	struct stat {
+		uint64_t hits = 0;
+		uint64_t misses = 0;
+		uint64_t stale = 0;
+		uint64_t evictions = 0;
+		size_t entries = 0;
+		size_t memory = 0;
+	};
+
+	void set_max_memory(size_t max_memory) {
+		m_max_memory = max_memory;
+	}
+
+	bool enabled() const {
+		return m_max_memory > 0;
+	}
+
+	// returns entry which has to be validated by the caller, result is either @hit() or @drop()
+	entry_ptr get(const std::string &key) {
+		std::unique_lock<std::mutex> guard(m_lock);
+
+		auto it = m_entries.find(key);
+		if (it == m_entries.end()) {
+			m_stat.misses++;
+			return entry_ptr();
+		}
+
+		m_lru.splice(m_lru.begin(), m_lru, it->second.lru);
+		return it->second.e;
+	}
+
+	void hit() {
+		std::unique_lock<std::mutex> guard(m_lock);
+		m_stat.hits++;
+	}
+
+	// removes stale entry, it could have already been replaced by the newer one
+	void drop(const std::string &key, const entry_ptr &e) {
+		std::unique_lock<std::mutex> guard(m_lock);
+		m_stat.stale++;
+
+		auto it = m_entries.find(key);
+		if (it != m_entries.end() && it->second.e == e)
+			erase(it);
+	}
+
+	void put(const std::string &key, const entry_ptr &e) {
+		e->memory = key.size() + result_memory(e->result);
+		for (const auto &idx: e->indexes)
+			e->memory += idx.url.size() + idx.generation.size();
+
+		if (e->memory > m_max_memory)
+			return;
+
+		std::unique_lock<std::mutex> guard(m_lock);
+
+		auto it = m_entries.find(key);
+		if (it != m_entries.end())
+			erase(it);
+
+		while (m_stat.memory + e->memory > m_max_memory) {
+			erase(m_entries.find(m_lru.back()));
+			m_stat.evictions++;
+		}
+
+		m_lru.push_front(key);
+
+		node n;
+		n.e = e;
+		n.lru = m_lru.begin();
+		m_entries[key] = n;
+
+		m_stat.memory += e->memory;
+		m_stat.entries = m_entries.size();
+	}
+
+	stat get_stat() {
+		std::unique_lock<std::mutex> guard(m_lock);
+		return m_stat;
+	}
+
+private:
+	struct node {
+		entry_ptr e;
+		std::list<std::string>::iterator lru;
+	};
+
+	size_t m_max_memory = 0;
+
+	std::mutex m_lock;
+	std::map<std::string, node> m_entries;
+	std::list<std::string> m_lru;
+	stat m_stat;
+
+	void erase(std::map<std::string, node>::iterator it) {
+		m_stat.memory -= it->second.e->memory;
+		m_lru.erase(it->second.lru);
+		m_entries.erase(it);
+		m_stat.entries = m_entries.size();
+	}
+
+	static size_t result_memory(const greylock::intersect::result &result) {
+		size_t size = sizeof(result) + result.cookie.size();
+		for (const auto &doc: result.docs) {
+			size += sizeof(doc) + doc.doc.id.size() + doc.doc.url.size();
+			for (const auto &idx: doc.indexes) {
+				size += sizeof(idx) + idx.url.size() + idx.positions.size() * sizeof(size_t);
+			}
+		}
+
+		return size;
+	}
+};
+
+}} // namespace ioremap::greylock
+
+#endif // __INDEXES_SEARCH_HPP
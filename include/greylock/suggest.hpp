@@ -0,0 +1,338 @@
+#ifndef __INDEXES_SUGGEST_HPP
+#define __INDEXES_SUGGEST_HPP
+
+#include "greylock/core.hpp"
+
+#include <algorithm>
+#include <iterator>
+#include <map>
+#include <queue>
+#include <sstream>
+
+namespace ioremap { namespace greylock {
+
+// Completion snapshot of the mailbox attribute: sorted array of its words with their document frequencies.
+//
+// Words starting with the given prefix are a contiguous range of the array, it is found by binary search.
+// Max-tree over frequencies returns the most frequent word of any range in O(log n), range is split around it
+// and both halves are pushed into the priority queue, thus N completions cost O(N log n) however many words
+// the range contains, and no index is read.
+//
+// Frequency of the known word is updated in the tree in O(log n). New words are kept in the small sorted
+// pending array which is scanned by @complete() directly, it is merged into the main array and the tree
+// is rebuilt only when it grows over @pending_max(), thus rebuild cost is amortized over many new words.
+class completion_snapshot {
+public:
+	// frequency of the word which has been taken from the term dictionary, but whose index
+	// has not been read yet, see @unknown()
+	static const uint64_t unknown_frequency = ~0ULL;
+
+	enum {
+		pending_min = 64,
+	};
+
+	struct entry {
+		std::string word;
+		uint64_t frequency = 0;
+
+		MSGPACK_DEFINE(word, frequency);
+	};
+
+	// adds @count documents to the frequency of @word, new word is inserted into the pending array,
+	// unknown frequency is not changed, it is read from the word index later, and that already counts them
+	void add(const std::string &word, uint64_t count) {
+		size_t pos;
+		entry *e = find(word, pos);
+		if (!e) {
+			insert(word, count);
+			return;
+		}
+
+		if (e->frequency == unknown_frequency)
+			return;
+
+		e->frequency += count;
+		updated(pos);
+	}
+
+	// sets frequency of @word (it may be @unknown_frequency), word is inserted if it is not present
+	void set(const std::string &word, uint64_t frequency) {
+		size_t pos;
+		entry *e = find(word, pos);
+		if (!e) {
+			insert(word, frequency);
+			return;
+		}
+
+		e->frequency = frequency;
+		updated(pos);
+	}
+
+	// returns words starting with @prefix whose frequencies are not known, they must be set before @complete()
+	std::vector<std::string> unknown(const std::string &prefix) const {
+		std::vector<std::string> ret;
+		for (const auto *entries: {&m_entries, &m_pending}) {
+			for (size_t pos = lower_bound(*entries, prefix); pos < entries->size(); ++pos) {
+				const entry &e = (*entries)[pos];
+				if (e.word.compare(0, prefix.size(), prefix) != 0)
+					break;
+
+				if (e.frequency == unknown_frequency)
+					ret.push_back(e.word);
+			}
+		}
+
+		return ret;
+	}
+
+	// merges @local snapshot of this server into this snapshot which has just been read from the storage,
+	// @added contains numbers of documents added to the @local words since it has been merged last time:
+	// they are added to the known frequencies, words which are not present here are copied with their frequencies,
+	// unknown frequencies are taken from @local
+	void merge(const completion_snapshot &local, const std::map<std::string, uint64_t> &added) {
+		for (const auto *entries: {&local.m_entries, &local.m_pending}) {
+			for (const auto &le: *entries) {
+				size_t pos;
+				entry *e = find(le.word, pos);
+				if (!e) {
+					insert(le.word, le.frequency);
+					continue;
+				}
+
+				if (e->frequency == unknown_frequency) {
+					e->frequency = le.frequency;
+				} else {
+					auto a = added.find(le.word);
+					if (a == added.end())
+						continue;
+
+					e->frequency += a->second;
+				}
+
+				updated(pos);
+			}
+		}
+	}
+
+	// returns at most @num words starting with @prefix, the most frequent words first,
+	// words with equal frequencies are returned in lexicographical order,
+	// unknown frequencies (see @unknown()) are treated as zero
+	std::vector<entry> complete(const std::string &prefix, size_t num) {
+		std::vector<entry> ret;
+		if (num == 0 || size() == 0)
+			return ret;
+
+		if (!m_tree_valid && !m_entries.empty())
+			build();
+
+		size_t start = lower_bound(m_entries, prefix);
+		size_t end = std::partition_point(m_entries.begin() + start, m_entries.end(), [&] (const entry &e) {
+					return e.word.compare(0, prefix.size(), prefix) == 0;
+				}) - m_entries.begin();
+
+		struct range {
+			size_t start, end, max;
+		};
+		auto range_less = [&] (const range &r1, const range &r2) {
+			return better(r2.max, r1.max);
+		};
+		std::priority_queue<range, std::vector<range>, decltype(range_less)> ranges(range_less);
+
+		if (start < end)
+			ranges.push(range{start, end, range_max(start, end)});
+
+		while (!ranges.empty() && ret.size() < num) {
+			range r = ranges.top();
+			ranges.pop();
+
+			ret.push_back(m_entries[r.max]);
+
+			if (r.start < r.max)
+				ranges.push(range{r.start, r.max, range_max(r.start, r.max)});
+			if (r.max + 1 < r.end)
+				ranges.push(range{r.max + 1, r.end, range_max(r.max + 1, r.end)});
+		}
+
+		// pending words are not in the tree, they are merged with the best words of the main array
+		size_t main_num = ret.size();
+		for (size_t pos = lower_bound(m_pending, prefix); pos < m_pending.size(); ++pos) {
+			if (m_pending[pos].word.compare(0, prefix.size(), prefix) != 0)
+				break;
+
+			ret.push_back(m_pending[pos]);
+		}
+
+		if (ret.size() != main_num) {
+			std::sort(ret.begin(), ret.end(), [] (const entry &e1, const entry &e2) {
+						uint64_t f1 = frequency(e1), f2 = frequency(e2);
+						if (f1 != f2)
+							return f1 > f2;
+
+						return e1.word < e2.word;
+					});
+
+			if (ret.size() > num)
+				ret.resize(num);
+		}
+
+		for (auto &e: ret)
+			e.frequency = frequency(e);
+
+		return ret;
+	}
+
+	size_t size() const {
+		return m_entries.size() + m_pending.size();
+	}
+
+	size_t memory() const {
+		size_t size = (m_entries.capacity() + m_pending.capacity()) * sizeof(entry) + m_tree.capacity() * sizeof(size_t);
+		for (const auto *entries: {&m_entries, &m_pending}) {
+			for (const auto &e: *entries)
+				size += e.word.size();
+		}
+
+		return size;
+	}
+
+	void load(const void *data, size_t size) {
+		msgpack::unpacked result;
+		msgpack::unpack(&result, (const char *)data, size);
+		result.get().convert(&m_entries);
+		m_pending.clear();
+		m_tree_valid = false;
+	}
+
+	std::string save() const {
+		std::vector<entry> entries;
+		entries.reserve(size());
+		std::merge(m_entries.begin(), m_entries.end(), m_pending.begin(), m_pending.end(), std::back_inserter(entries),
+				[] (const entry &e1, const entry &e2) {
+					return e1.word < e2.word;
+				});
+
+		std::stringstream ss;
+		msgpack::pack(ss, entries);
+		return ss.str();
+	}
+
+private:
+	// sorted words, the tree is built over them
+	std::vector<entry> m_entries;
+
+	// sorted new words which are not in @m_entries yet
+	std::vector<entry> m_pending;
+
+	// bottom-up segment tree, leaf @n + i corresponds to entry i, every node contains
+	// the position of the best entry of its subtree
+	std::vector<size_t> m_tree;
+	bool m_tree_valid = false;
+
+	static uint64_t frequency(const entry &e) {
+		return e.frequency == unknown_frequency ? 0 : e.frequency;
+	}
+
+	static size_t lower_bound(const std::vector<entry> &entries, const std::string &word) {
+		return std::lower_bound(entries.begin(), entries.end(), word, [] (const entry &e, const std::string &w) {
+					return e.word < w;
+				}) - entries.begin();
+	}
+
+	// returns entry of @word, @pos is its position in the main array, or @m_entries.size() if it is pending
+	entry *find(const std::string &word, size_t &pos) {
+		pos = lower_bound(m_entries, word);
+		if (pos < m_entries.size() && m_entries[pos].word == word)
+			return &m_entries[pos];
+
+		size_t ppos = lower_bound(m_pending, word);
+		pos = m_entries.size();
+		if (ppos < m_pending.size() && m_pending[ppos].word == word)
+			return &m_pending[ppos];
+
+		return NULL;
+	}
+
+	// pending array is at most 1/32 of the snapshot, tree is rebuilt once per n/32 new words,
+	// which is O(32) per new word on average
+	size_t pending_max() const {
+		return std::max<size_t>(pending_min, m_entries.size() / 32);
+	}
+
+	void insert(const std::string &word, uint64_t frequency) {
+		entry e;
+		e.word = word;
+		e.frequency = frequency;
+		m_pending.insert(m_pending.begin() + lower_bound(m_pending, word), e);
+
+		if (m_pending.size() <= pending_max())
+			return;
+
+		std::vector<entry> entries;
+		entries.reserve(size());
+		std::merge(std::make_move_iterator(m_entries.begin()), std::make_move_iterator(m_entries.end()),
+				std::make_move_iterator(m_pending.begin()), std::make_move_iterator(m_pending.end()),
+				std::back_inserter(entries),
+				[] (const entry &e1, const entry &e2) {
+					return e1.word < e2.word;
+				});
+
+		m_entries.swap(entries);
+		m_pending.clear();
+		m_tree_valid = false;
+	}
+
+	void updated(size_t pos) {
+		if (pos < m_entries.size() && m_tree_valid)
+			update(pos);
+	}
+
+	// entry @i goes before entry @j in completions
+	bool better(size_t i, size_t j) const {
+		uint64_t fi = frequency(m_entries[i]), fj = frequency(m_entries[j]);
+		if (fi != fj)
+			return fi > fj;
+
+		return i < j;
+	}
+
+	size_t best(size_t i, size_t j) const {
+		return better(i, j) ? i : j;
+	}
+
+	void build() {
+		size_t n = m_entries.size();
+		m_tree.resize(2 * n);
+
+		for (size_t i = 0; i < n; ++i)
+			m_tree[n + i] = i;
+		for (size_t i = n - 1; i > 0; --i)
+			m_tree[i] = best(m_tree[2 * i], m_tree[2 * i + 1]);
+
+		m_tree_valid = true;
+	}
+
+	void update(size_t pos) {
+		size_t n = m_entries.size();
+		for (size_t i = (n + pos) / 2; i > 0; i /= 2)
+			m_tree[i] = best(m_tree[2 * i], m_tree[2 * i + 1]);
+	}
+
+	// position of the best entry in [@start, @end), range must not be empty
+	size_t range_max(size_t start, size_t end) const {
+		size_t n = m_entries.size();
+		size_t ret = start;
+
+		for (size_t l = start + n, r = end + n; l < r; l /= 2, r /= 2) {
+			if (l & 1)
+				ret = best(ret, m_tree[l++]);
+			if (r & 1)
+				ret = best(ret, m_tree[--r]);
+		}
+
+		return ret;
+	}
+};
+
+}} // namespace ioremap::greylock
+
+#endif // __INDEXES_SUGGEST_HPP
@@ -0,0 +1,250 @@
+#ifndef __INDEXES_TERMS_HPP
+#define __INDEXES_TERMS_HPP
+
+#include "greylock/index.hpp"
+
+#include <algorithm>
+
+namespace ioremap { namespace greylock {
+
+// Term dictionary of the mailbox attribute: sorted set of the words which have their own string index.
+//
+// Dictionary is an index tree whose keys have zero timestamp, thus they are ordered by @key.id,
+// which contains the word, @key.url contains url of the word's index.
+// Words sharing the same prefix are neighbours in the tree, prefix expansion is a tree descent
+// and a leaf scan which stops at the first word without that prefix.
+template <typename T>
+class term_dictionary {
+public:
+	term_dictionary(T &t, const eurl &url, bool read_only) : m_idx(t, url, read_only) {}
+
+	// adding the word which is already present only rewrites its key
+	int insert(const std::string &word, const eurl &iname) {
+		key k;
+		k.id = word;
+		k.url = iname;
+
+		return m_idx.insert(k);
+	}
+
+	int remove(const std::string &word) {
+		key k;
+		k.id = word;
+
+		return m_idx.remove(k);
+	}
+
+	// returns keys of the words which match @pattern, at most @max words are returned,
+	// @truncated is set if there are more matching words
+	//
+	// only words starting with the literal prefix of the pattern are scanned,
+	// pattern which starts with a wildcard scans the whole dictionary
+	std::vector<key> expand(const std::string &pattern, size_t max, bool &truncated) const {
+		std::vector<key> ret;
+		truncated = false;
+
+		std::string prefix = pattern.substr(0, pattern.find_first_of("*?"));
+
+		for (auto it = m_idx.begin(prefix), end = m_idx.end(); it != end; ++it) {
+			if (it->id.compare(0, prefix.size(), prefix) != 0)
+				break;
+
+			if (!match(pattern, it->id))
+				continue;
+
+			if (ret.size() == max) {
+				truncated = true;
+				break;
+			}
+
+			ret.push_back(*it);
+		}
+
+		return ret;
+	}
+
+	// returns keys of the words starting with @prefix, unlike @expand() prefix may contain any characters
+	std::vector<key> prefixed(const std::string &prefix) const {
+		std::vector<key> ret;
+		for (auto it = m_idx.begin(prefix), end = m_idx.end(); it != end; ++it) {
+			if (it->id.compare(0, prefix.size(), prefix) != 0)
+				break;
+
+			ret.push_back(*it);
+		}
+
+		return ret;
+	}
+
+	// returns keys of the words within Levenshtein distance @max_distance of @word together with their distances,
+	// the closest words are returned first, at most @max words, @truncated is set if some words were dropped
+	//
+	// distance is counted in UTF-8 characters. Dictionary is traversed in sorted order like a trie:
+	// distance matrix rows of the common prefix of the neighbouring words are reused, and as soon as every cell
+	// of the last row exceeds @max_distance, no word with this prefix can match, and iterator is moved
+	// past all of them by the tree seek, thus only a small part of the dictionary is read
+	std::vector<std::pair<key, int>> fuzzy(const std::string &word, int max_distance, size_t max, bool &truncated) const {
+		std::vector<std::pair<key, int>> ret;
+		truncated = false;
+
+		std::vector<uint32_t> query;
+		std::vector<size_t> offsets;
+		utf8_decode(word, query, offsets);
+		size_t n = query.size();
+
+		// @rows[i] is the distance matrix row of the first i characters of @prefix
+		std::vector<std::vector<int>> rows(1, std::vector<int>(n + 1));
+		for (size_t j = 0; j <= n; ++j)
+			rows[0][j] = j;
+		std::vector<uint32_t> prefix;
+
+		std::vector<uint32_t> chars;
+		for (auto it = m_idx.begin(std::string()), end = m_idx.end(); it != end;) {
+			std::string current = it->id;
+			utf8_decode(current, chars, offsets);
+
+			size_t common = 0;
+			size_t limit = std::min(prefix.size(), chars.size());
+			while (common < limit && prefix[common] == chars[common])
+				++common;
+			rows.resize(common + 1);
+
+			bool dead = false, last = false;
+			for (size_t i = common + 1; i <= chars.size(); ++i) {
+				const std::vector<int> &up = rows[i - 1];
+				std::vector<int> row(n + 1);
+
+				row[0] = i;
+				int row_min = row[0];
+				for (size_t j = 1; j <= n; ++j) {
+					row[j] = std::min(std::min(up[j], row[j - 1]) + 1, up[j - 1] + (chars[i - 1] != query[j - 1]));
+					row_min = std::min(row_min, row[j]);
+				}
+
+				if (row_min > max_distance) {
+					prefix.assign(chars.begin(), chars.begin() + i - 1);
+
+					key next;
+					next.id = successor(current.substr(0, offsets[i]));
+					if (!next.id.empty())
+						it.seek(next);
+
+					// there is no successor only if the prefix consists of 0xff bytes,
+					// all following words start with it and are rejected too
+					dead = true;
+					last = next.id.empty();
+					break;
+				}
+
+				rows.emplace_back(std::move(row));
+			}
+
+			if (last)
+				break;
+			if (dead)
+				continue;
+
+			prefix.swap(chars);
+
+			int distance = rows.back()[n];
+			if (distance <= max_distance)
+				ret.emplace_back(*it, distance);
+
+			++it;
+		}
+
+		std::sort(ret.begin(), ret.end(), [] (const std::pair<key, int> &p1, const std::pair<key, int> &p2) {
+					return p1.second < p2.second || (p1.second == p2.second && p1.first.id < p2.first.id);
+				});
+
+		if (ret.size() > max) {
+			ret.resize(max);
+			truncated = true;
+		}
+
+		return ret;
+	}
+
+	// glob-style matching: '*' matches any sequence of characters, '?' matches any single UTF-8 character,
+	// like @fuzzy() distance, characters are decoded by @utf8_decode()
+	static bool match(const std::string &pattern, const std::string &word) {
+		std::vector<uint32_t> pchars, wchars;
+		std::vector<size_t> offsets;
+		utf8_decode(pattern, pchars, offsets);
+		utf8_decode(word, wchars, offsets);
+
+		size_t p = 0, w = 0;
+		size_t star = std::string::npos, star_w = 0;
+
+		while (w < wchars.size()) {
+			if (p < pchars.size() && (pchars[p] == '?' || pchars[p] == wchars[w])) {
+				++p;
+				++w;
+			} else if (p < pchars.size() && pchars[p] == '*') {
+				star = p++;
+				star_w = w;
+			} else if (star != std::string::npos) {
+				p = star + 1;
+				w = ++star_w;
+			} else {
+				return false;
+			}
+		}
+
+		while (p < pchars.size() && pchars[p] == '*')
+			++p;
+
+		return p == pchars.size();
+	}
+
+private:
+	index<T> m_idx;
+
+	// splits UTF-8 string into characters, @offsets[i] is the byte offset of the i-th character,
+	// the last entry is the size of the string, invalid bytes are single characters
+	static void utf8_decode(const std::string &str, std::vector<uint32_t> &chars, std::vector<size_t> &offsets) {
+		chars.clear();
+		offsets.clear();
+
+		for (size_t pos = 0; pos < str.size();) {
+			unsigned char lead = str[pos];
+			size_t len = 1;
+			if (lead >= 0xf0 && lead < 0xf8)
+				len = 4;
+			else if (lead >= 0xe0 && lead < 0xf0)
+				len = 3;
+			else if (lead >= 0xc0 && lead < 0xe0)
+				len = 2;
+			len = std::min(len, str.size() - pos);
+
+			// characters are only compared, thus raw bytes are enough
+			uint32_t ch = 0;
+			for (size_t i = 0; i < len; ++i)
+				ch = (ch << 8) | (unsigned char)str[pos + i];
+
+			chars.push_back(ch);
+			offsets.push_back(pos);
+			pos += len;
+		}
+
+		offsets.push_back(str.size());
+	}
+
+	// the smallest string which is greater than every string starting with @prefix, empty if there is none
+	static std::string successor(std::string prefix) {
+		while (!prefix.empty()) {
+			if ((unsigned char)prefix.back() != 0xff) {
+				prefix.back()++;
+				return prefix;
+			}
+
+			prefix.pop_back();
+		}
+
+		return prefix;
+	}
+};
+
+}} // namespace ioremap::greylock
+
+#endif // __INDEXES_TERMS_HPP
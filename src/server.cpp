@@ -1,9 +1,16 @@
+#include "greylock/bitmap.hpp"
 #include "greylock/bucket.hpp"
 #include "greylock/bucket_transport.hpp"
 #include "greylock/core.hpp"
+#include "greylock/dictionary.hpp"
 #include "greylock/index.hpp"
 #include "greylock/intersection.hpp"
 #include "greylock/json.hpp"
+#include "greylock/numeric.hpp"
+#include "greylock/partition.hpp"
+#include "greylock/search.hpp"
+#include "greylock/terms.hpp"
+#include "greylock/suggest.hpp"
 
 
 #include <elliptics/session.hpp>
@@ -17,6 +24,7 @@
 
 #include <thevoid/rapidjson/stringbuffer.h>
 #include <thevoid/rapidjson/prettywriter.h>
+#include <thevoid/rapidjson/writer.h>
 #include <thevoid/rapidjson/document.h>
 
 #include <ribosome/split.hpp>
@@ -25,9 +33,19 @@
 
 #include <swarm/logger.hpp>
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
 #include <condition_variable>
+#include <deque>
 #include <functional>
+#include <future>
+#include <list>
+#include <map>
 #include <mutex>
+#include <random>
+#include <set>
 #include <string>
 #include <thread>
 
@@ -40,6 +58,68 @@
 
 using namespace ioremap;
 
+// paging cookies are binary, they are sent to clients as url-safe base64 strings without padding
+static const char base64_alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+
+static std::string base64_encode(const std::string &data) {
+	std::string ret;
+	ret.reserve((data.size() + 2) / 3 * 4);
+
+	uint32_t acc = 0;
+	int bits = 0;
+	for (unsigned char ch: data) {
+		acc = (acc << 8) | ch;
+		bits += 8;
+
+		while (bits >= 6) {
+			bits -= 6;
+			ret.push_back(base64_alphabet[(acc >> bits) & 0x3f]);
+		}
+	}
+
+	if (bits > 0)
+		ret.push_back(base64_alphabet[(acc << (6 - bits)) & 0x3f]);
+
+	return ret;
+}
+
+// returns false if @str is not a valid base64 string
+static bool base64_decode(const std::string &str, std::string &data) {
+	data.clear();
+	data.reserve(str.size() * 3 / 4);
+
+	uint32_t acc = 0;
+	int bits = 0;
+	for (char ch: str) {
+		const char *pos = strchr(base64_alphabet, ch);
+		if (!pos || !ch)
+			return false;
+
+		acc = (acc << 6) | (pos - base64_alphabet);
+		bits += 6;
+
+		if (bits >= 8) {
+			bits -= 8;
+			data.push_back((char)((acc >> bits) & 0xff));
+		}
+	}
+
+	return bits < 6;
+}
+
+// documents of the page could not be resolved through the mailbox dictionary (see @greylock::compact_key),
+// request fails instead of returning documents without ids and urls
+class resolve_error : public std::runtime_error {
+public:
+	resolve_error(const std::string &what) : std::runtime_error(what) {}
+};
+
+// query can not be executed as requested, it is replied with bad request instead of matching nothing
+class query_error : public std::invalid_argument {
+public:
+	query_error(const std::string &what) : std::invalid_argument(what) {}
+};
+
 struct lock_entry {
 	lock_entry(bool l): locked(l) {}
 	std::condition_variable cond;
@@ -188,211 +268,232 @@ private:
 	rapidjson::MemoryPoolAllocator<> m_allocator;
 };
 
-struct single_attribute {
-	typedef std::vector<size_t> pos_t;
+// Facet counts of the search reply: numbers of matching documents per bucket of their urls
+// and per requested attribute value, counts of several mailboxes are summed
+struct facet_counts {
+	bool buckets = false;
+	std::map<std::string, uint64_t> bucket_counts;
+	std::map<std::string, std::map<std::string, uint64_t>> attributes;
+	bool completed = true;
 
-	std::string aname;
-	pos_t ivec;
-
-	// greylock operates with raw index names, it doesn't know whether they were organized into attributes or not
-	// It returns array of raw index names and positions where those indexes live in each returned document.
-	//
-	// We have to split array of raw index names into per-attribute indexes
-	// This @apos vector contains positions within raw index name vector of the indexes which belong to @aname attribute
-	pos_t apos;
-};
+	bool empty() const {
+		return !buckets && attributes.empty();
+	}
 
-struct indexes_request {
-	typedef std::vector<size_t> pos_t;
+	// requested values which are not found in any matching document are reported with zero counts
+	void add(const greylock::indexes_request &ireq, const greylock::intersect::result &res) {
+		if (!ireq.has_facets())
+			return;
 
-	std::vector<greylock::eurl> indexes;
-	std::vector<pos_t> positions;
+		for (size_t i = 0; i < ireq.facets.size(); ++i) {
+			const greylock::indexes_request::facet &f = ireq.facets[i];
+			attributes[f.attribute][f.value] += i < res.facets.size() ? res.facets[i] : 0;
+		}
 
-	std::vector<single_attribute> attributes;
+		buckets |= ireq.facet_buckets;
+		for (const auto &b: res.facet_buckets)
+			bucket_counts[b.first] += b.second;
 
-	bool distance_sort(const std::vector<greylock::eurl> &indexes_unused, greylock::intersect::result &res) {
-		(void) indexes_unused;
+		completed &= res.facets_completed;
+	}
 
-//#define STDOUT_DEBUG
-#ifdef STDOUT_DEBUG
-		auto print_vector = [] (const std::vector<size_t> &v) {
-			std::ostringstream ss;
-			ss << "[";
-			for (auto it = v.begin(), end = v.end(); it != end;) {
-				ss << (ssize_t)(*it);
-				++it;
+	void to_json(rapidjson::Value &ret, rapidjson::MemoryPoolAllocator<> &allocator) const {
+		if (buckets) {
+			rapidjson::Value bv(rapidjson::kObjectType);
+			for (const auto &b: bucket_counts) {
+				rapidjson::Value name(b.first.c_str(), b.first.size(), allocator);
+				bv.AddMember(name, b.second, allocator);
+			}
+			ret.AddMember("buckets", bv, allocator);
+		}
 
-				if (it != end)
-					ss << ", ";
+		rapidjson::Value av(rapidjson::kObjectType);
+		for (const auto &a: attributes) {
+			rapidjson::Value values(rapidjson::kObjectType);
+			for (const auto &v: a.second) {
+				rapidjson::Value name(v.first.c_str(), v.first.size(), allocator);
+				values.AddMember(name, v.second, allocator);
 			}
-			ss << "]";
 
-			return ss.str();
-		};
-		auto print_vectors = [&] (const std::vector<pos_t> &v) {
-			std::ostringstream ss;
-			for (auto it = v.begin(), end = v.end(); it != end;) {
-				ss << print_vector(*it);
-				++it;
+			rapidjson::Value name(a.first.c_str(), a.first.size(), allocator);
+			av.AddMember(name, values, allocator);
+		}
+		ret.AddMember("attributes", av, allocator);
 
-				if (it != end)
-					ss << ", ";
-			}
+		ret.AddMember("completed", completed, allocator);
+	}
+};
 
-			return ss.str();
-		};
-#endif
+// Search cursor keeps live intersection state between paging requests of the same query:
+// posting lists of every index with their loaded pages and positions. The next page continues
+// right where the previous one has stopped instead of descending every index tree from the cookie.
+struct search_cursor {
+	greylock::intersect::cursor_ptr cursor;
+	std::shared_ptr<greylock::indexes_request> ireq;
 
-		for (size_t i = 0; i < indexes.size(); ++i) {
-			const std::string &iname = indexes[i].key;
+	// indexes which have to be locked while cursor is being advanced
+	std::vector<greylock::eurl> lock_names;
 
-			for (auto &sa : attributes) {
-				if (iname.find(sa.aname) == 0) {
-					sa.apos.push_back(i);
-					break;
-				}
-			}
-		}
+	// finish function of the request (relevance sort or top-K selection), it is bound to @ireq
+	std::function<bool (const std::vector<greylock::eurl> &, greylock::intersect::result &)> finish;
 
-		for (auto &doc: res.docs) {
-			for (const auto &sa: attributes) {
-				std::vector<pos_t> positions;
-				for (size_t i = 0; i < sa.apos.size(); ++i) {
-					size_t ipos = sa.apos[i];
+	std::chrono::steady_clock::time_point expires;
+	size_t memory = 0;
+};
 
-					positions.push_back(doc.indexes[ipos].positions);
-#ifdef STDOUT_DEBUG
-					printf("doc: %s, sa: %s, index: %s, positions: %s\n",
-							doc.doc.str().c_str(), sa.aname.c_str(),
-							doc.indexes[ipos].str().c_str(), print_vector(doc.indexes[ipos].positions).c_str());
-#endif
-				}
+typedef std::shared_ptr<search_cursor> search_cursor_ptr;
 
-				std::vector<size_t> pos_idx;
-				// fill in with zeroes, every entry in this array is an offset within corresponding entry in @positions array
-				pos_idx.resize(positions.size());
+// Mailbox state which does not belong to any index: the number assigned to the next new document
+// and the list of dense terms. It is only updated under the lock of the mailbox documents index.
+struct mailbox_state {
+	uint64_t next_document = 0;
 
-				// This code converts index positions for given attribute in given document into index vector.
-				//
-				// Given document @doc, let's assume, there are following index positions for @sa attribute:
-				//
-				// idx0 positions: 0, 1, 4, 12
-				// idx1 positions: 3, 7, 15
-				// idx2 positions: 2, 13
-				//
-				//              : 0, 1, 2, 3, 4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15
-				// index vectors: 0, 0, 2, 1, 0
-				//                                        1
-				//                                                            0,  2
-				//                                                                        1
+	// sorted names (@greylock::eurl::str()) of the indexes stored as bitmaps of document numbers
+	std::vector<std::string> dense;
 
-				std::vector<pos_t> dvecs;
-				pos_t current_dvec;
+	MSGPACK_DEFINE(next_document, dense);
 
-				size_t prev;
+	bool is_dense(const greylock::eurl &iname) const {
+		return std::binary_search(dense.begin(), dense.end(), iname.str());
+	}
 
-				while (true) {
-					size_t min = INT_MAX;
-					int min_pos = -1;
+	void add_dense(const greylock::eurl &iname) {
+		std::string name = iname.str();
+		auto it = std::lower_bound(dense.begin(), dense.end(), name);
+		if (it == dense.end() || *it != name)
+			dense.insert(it, name);
+	}
 
-					for (size_t i = 0; i < pos_idx.size(); ++i) {
-						const pos_t &pos_vector = positions[i];
-						size_t pos_offset = pos_idx[i];
+	// urls of the dense terms, bucket names do not contain '/'
+	std::vector<greylock::eurl> dense_urls() const {
+		std::vector<greylock::eurl> ret;
+		for (const auto &name: dense) {
+			size_t pos = name.find('/');
+			if (pos == std::string::npos)
+				continue;
 
-						if (pos_offset < pos_vector.size()) {
-							if (pos_vector[pos_offset] < min) {
-								min = pos_vector[pos_offset];
-								min_pos = i;
-							}
-						}
-					}
+			greylock::eurl url;
+			url.bucket = name.substr(0, pos);
+			url.key = name.substr(pos + 1);
+			ret.emplace_back(url);
+		}
 
-					if (min_pos == -1) {
-						dvecs.push_back(current_dvec);
-						break;
-					}
+		return ret;
+	}
 
-					if (current_dvec.size() == 0) {
-						current_dvec.push_back(min_pos);
-						pos_idx[min_pos]++;
+	void load(const void *data, size_t size) {
+		msgpack::unpacked result;
+		msgpack::unpack(&result, (const char *)data, size);
+		result.get().convert(this);
+	}
 
-						prev = min;
-						continue;
-					}
+	std::string save() const {
+		std::stringstream ss;
+		msgpack::pack(ss, *this);
+		return ss.str();
+	}
+};
 
-					if (min != prev + 1) {
-						dvecs.push_back(current_dvec);
-						current_dvec.clear();
-					} else {
-						current_dvec.push_back(min_pos);
-						pos_idx[min_pos]++;
-						prev = min;
-					}
-				}
-#ifdef STDOUT_DEBUG
-				printf("doc: %s, sa: %s, index vectors: %s\n",
-						doc.doc.str().c_str(), sa.aname.c_str(),
-						print_vectors(dvecs).c_str());
-#endif
-				int min_dist = INT_MAX;
-				int min_num = 0;
-				size_t total_length = 0;
-				for (const auto &dvec: dvecs) {
-					// Using sliding window with size equal to @ivec size for given attribute,
-					// compare every subset of index vector with @ivec using Levenstein distance
-					size_t start = 0;
-					while (true) {
-						std::vector<size_t> sub;
-
-						size_t num = dvec.size() - start;
-						if (num > sa.ivec.size())
-							num = sa.ivec.size();
-
-						sub.insert(sub.begin(), dvec.begin() + start, dvec.begin() + start + num);
-
-						int dist = ribosome::distance::levenstein(sa.ivec, sub, INT_MAX);
-						if (dist < min_dist) {
-							min_dist = dist;
-							min_num = 1;
-						} else if (dist == min_dist) {
-							min_num++;
-						}
-#ifdef STDOUT_DEBUG						
-						printf("doc: %s, sa: %s, start: %zd, index vector: %s, dist: %d, min_dist: %d, min_num: %d\n",
-								doc.doc.str().c_str(),
-								sa.aname.c_str(),
-								start,
-								print_vector(sub).c_str(),
-								dist,
-								min_dist,
-								min_num);
-#endif
-
-						if (num < sa.ivec.size())
-							break;
-
-						++start;
-					}
+// Fixed-size pool of worker threads, queued tasks are run in order of submission.
+// Federated search runs intersections of the requested mailboxes on it concurrently.
+class task_pool {
+public:
+	~task_pool() {
+		stop();
+	}
 
-					total_length += dvec.size();
-				}
+	void start(int threads) {
+		for (int i = 0; i < threads; ++i)
+			m_threads.emplace_back(std::bind(&task_pool::process, this));
+	}
 
-				doc.relevance = (1.0 - (float)min_dist / (float)sa.ivec.size()) * ((float)min_num / (float)total_length);
-			}
+	// tasks which have already been queued are run before the workers exit
+	void stop() {
+		{
+			std::unique_lock<std::mutex> guard(m_lock);
+			m_stop = true;
+			m_cond.notify_all();
+		}
+
+		for (auto &t: m_threads) {
+			if (t.joinable())
+				t.join();
 		}
+		m_threads.clear();
+	}
 
-		std::sort(res.docs.begin(), res.docs.end(), [&]
-				(const greylock::intersect::single_doc_result &d1, const greylock::intersect::single_doc_result &d2) {
-					return d1.relevance > d2.relevance;
-			});
+	// exception thrown by @task is rethrown by the returned future,
+	// task runs in the calling thread if the pool has no workers
+	std::future<void> submit(const std::function<void ()> &task) {
+		auto pt = std::make_shared<std::packaged_task<void ()>>(task);
+		std::future<void> ret = pt->get_future();
 
-		return true;
+		if (m_threads.empty()) {
+			(*pt)();
+			return ret;
+		}
+
+		std::unique_lock<std::mutex> guard(m_lock);
+		m_tasks.emplace_back([pt] { (*pt)(); });
+		m_cond.notify_one();
+		return ret;
+	}
+
+	size_t threads() const {
+		return m_threads.size();
+	}
+
+	size_t queued() {
+		std::unique_lock<std::mutex> guard(m_lock);
+		return m_tasks.size();
+	}
+
+private:
+	std::mutex m_lock;
+	std::condition_variable m_cond;
+	std::deque<std::function<void ()>> m_tasks;
+	std::vector<std::thread> m_threads;
+	bool m_stop = false;
+
+	void process() {
+		while (true) {
+			std::function<void ()> task;
+			{
+				std::unique_lock<std::mutex> guard(m_lock);
+				m_cond.wait(guard, [&] { return m_stop || !m_tasks.empty(); });
+				if (m_tasks.empty())
+					return;
+
+				task = std::move(m_tasks.front());
+				m_tasks.pop_front();
+			}
+
+			task();
+		}
 	}
 };
 
 class http_server : public thevoid::server<http_server>
 {
 public:
+	virtual ~http_server() {
+		{
+			std::unique_lock<std::mutex> guard(m_retention_lock);
+			m_retention_stop = true;
+			m_retention_cond.notify_all();
+		}
+
+		if (m_retention_thread.joinable())
+			m_retention_thread.join();
+
+		m_federated_pool.stop();
+
+		for (auto &p: m_suggest) {
+			std::unique_lock<std::mutex> guard(p.second->lock);
+			suggest_flush(p.first, *p.second);
+		}
+	}
+
 	virtual bool initialize(const rapidjson::Value &config) {
 		if (!elliptics_init(config))
 			return false;
@@ -415,6 +516,16 @@ public:
 			options::methods("POST")
 		);
 
+		on<on_stat>(
+			options::exact_match("/stat"),
+			options::methods("GET")
+		);
+
+		on<on_suggest>(
+			options::exact_match("/suggest"),
+			options::methods("POST")
+		);
+
 		return true;
 	}
 
@@ -427,6 +538,138 @@ public:
 		}
 	};
 
+	struct on_stat : public thevoid::simple_request_stream<http_server> {
+		virtual void on_request(const thevoid::http_request &req, const boost::asio::const_buffer &buffer) {
+			(void) buffer;
+			(void) req;
+
+			JsonValue ret;
+			auto &allocator = ret.GetAllocator();
+
+			greylock::search_cache::stat st = server()->result_cache().get_stat();
+			uint64_t requests = st.hits + st.misses + st.stale;
+
+			rapidjson::Value cache(rapidjson::kObjectType);
+			cache.AddMember("hits", st.hits, allocator);
+			cache.AddMember("misses", st.misses, allocator);
+			cache.AddMember("stale", st.stale, allocator);
+			cache.AddMember("evictions", st.evictions, allocator);
+			cache.AddMember("hit-rate", requests ? (double)st.hits / (double)requests : 0.0, allocator);
+			cache.AddMember("entries", st.entries, allocator);
+			cache.AddMember("memory", st.memory, allocator);
+			ret.AddMember("search-cache", cache, allocator);
+
+			rapidjson::Value search(rapidjson::kObjectType);
+			search.AddMember("coalesced", server()->flights().coalesced(), allocator);
+			search.AddMember("federated", server()->search_federated(), allocator);
+			search.AddMember("federated-queued", server()->federated_pool().queued(), allocator);
+			ret.AddMember("search", search, allocator);
+
+			size_t snapshots, memory;
+			server()->suggest_stat(snapshots, memory);
+
+			rapidjson::Value suggest(rapidjson::kObjectType);
+			suggest.AddMember("snapshots", snapshots, allocator);
+			suggest.AddMember("memory", memory, allocator);
+			ret.AddMember("suggest", suggest, allocator);
+
+			std::string data = ret.ToString();
+
+			thevoid::http_response reply;
+			reply.set_code(swarm::http_response::ok);
+			reply.headers().set_content_type("text/json; charset=utf-8");
+			reply.headers().set_content_length(data.size());
+
+			this->send_reply(std::move(reply), std::move(data));
+		}
+	};
+
+	// completions of the word prefix: {"mailbox": mailbox, "attribute": attribute, "prefix": prefix, "num": number}
+	// reply contains at most "num" (10 by default) words of the attribute starting with the prefix,
+	// the most frequent words first, see @greylock::completion_snapshot
+	struct on_suggest : public thevoid::simple_request_stream<http_server> {
+		virtual void on_request(const thevoid::http_request &req, const boost::asio::const_buffer &buffer) {
+			ribosome::timer tm;
+
+			// this is needed to put ending zero-byte, otherwise rapidjson parser will explode
+			std::string data(const_cast<char *>(boost::asio::buffer_cast<const char*>(buffer)), boost::asio::buffer_size(buffer));
+
+			rapidjson::Document doc;
+			doc.Parse<0>(data.c_str());
+
+			if (doc.HasParseError() || !doc.IsObject()) {
+				ILOG_ERROR("on_request: url: %s, error: %d: could not parse document or it is not an object",
+						req.url().to_human_readable().c_str(), -EINVAL);
+				this->send_reply(swarm::http_response::bad_request);
+				return;
+			}
+
+			const char *mbox = greylock::get_string(doc, "mailbox");
+			const char *aname = greylock::get_string(doc, "attribute");
+			const char *prefix = greylock::get_string(doc, "prefix", "");
+			if (!mbox || !aname) {
+				ILOG_ERROR("on_request: url: %s, error: %d: 'mailbox' and 'attribute' must be strings",
+						req.url().to_human_readable().c_str(), -EINVAL);
+				this->send_reply(swarm::http_response::bad_request);
+				return;
+			}
+
+			// empty prefix returns the most frequent words of the attribute
+			std::string normalized;
+			if (*prefix && (!server()->normalize_pattern(prefix, normalized) ||
+						normalized.find_first_of("*?") != std::string::npos)) {
+				ILOG_ERROR("on_request: url: %s, mailbox: %s, attribute: %s, prefix: %s, error: %d: "
+						"prefix must be a single word",
+						req.url().to_human_readable().c_str(), mbox, aname, prefix, -EINVAL);
+				this->send_reply(swarm::http_response::bad_request);
+				return;
+			}
+
+			size_t num = greylock::get_int64(doc, "num", 10);
+
+			std::vector<greylock::completion_snapshot::entry> completions;
+			int err = server()->suggest_complete(server()->index_name(mbox, aname, ""), normalized, num, completions);
+			if (err < 0) {
+				ILOG_ERROR("on_request: url: %s, mailbox: %s, attribute: %s, prefix: %s, error: %d: "
+						"could not load completion snapshot",
+						req.url().to_human_readable().c_str(), mbox, aname, normalized.c_str(), err);
+				this->send_reply(swarm::http_response::service_unavailable);
+				return;
+			}
+
+			JsonValue ret;
+			auto &allocator = ret.GetAllocator();
+
+			rapidjson::Value words(rapidjson::kArrayType);
+			for (const auto &c: completions) {
+				rapidjson::Value word(rapidjson::kObjectType);
+
+				rapidjson::Value wv(c.word.c_str(), c.word.size(), allocator);
+				word.AddMember("word", wv, allocator);
+				word.AddMember("frequency", c.frequency, allocator);
+
+				words.PushBack(word, allocator);
+			}
+
+			rapidjson::Value pv(normalized.c_str(), normalized.size(), allocator);
+			ret.AddMember("prefix", pv, allocator);
+			ret.AddMember("completions", words, allocator);
+
+			std::string reply_data = ret.ToString();
+
+			thevoid::http_response reply;
+			reply.set_code(swarm::http_response::ok);
+			reply.headers().set_content_type("text/json; charset=utf-8");
+			reply.headers().set_content_length(reply_data.size());
+
+			this->send_reply(std::move(reply), std::move(reply_data));
+
+			ILOG_INFO("url: %s, mailbox: %s, attribute: %s, prefix: %s, completions: %zd, duration: %d ms",
+					req.url().to_human_readable().c_str(), mbox, aname, normalized.c_str(),
+					completions.size(), tm.elapsed());
+		}
+	};
+
 	struct on_search : public thevoid::simple_request_stream<http_server> {
 		virtual void on_request(const thevoid::http_request &req, const boost::asio::const_buffer &buffer) {
 			ribosome::timer search_tm;
@@ -453,9 +696,11 @@ public:
 				return;
 			}
 
+			// federated search: "mailboxes" array replaces "mailbox", see @federated_search()
 			const char *mbox = greylock::get_string(doc, "mailbox");
-			if (!mbox) {
-				ILOG_ERROR("on_request: url: %s, error: %d: 'mailbox' must be a string",
+			const rapidjson::Value &mailboxes = greylock::get_array(doc, "mailboxes");
+			if (!mbox && !mailboxes.IsArray()) {
+				ILOG_ERROR("on_request: url: %s, error: %d: 'mailbox' must be a string or 'mailboxes' must be an array",
 						req.url().to_human_readable().c_str(), -EINVAL);
 				this->send_reply(swarm::http_response::bad_request);
 				return;
@@ -465,376 +710,3282 @@ public:
 			const rapidjson::Value &query = greylock::get_object(doc, "query");
 			if (!query.IsObject()) {
 				ILOG_ERROR("on_request: url: %s, mailbox: %s, error: %d: 'query' must be object",
-						req.url().to_human_readable().c_str(), mbox, -EINVAL);
+						req.url().to_human_readable().c_str(), mbox ? mbox : "federated", -EINVAL);
 				this->send_reply(swarm::http_response::bad_request);
 				return;
 			}
 
 			size_t page_num = ~0U;
 			std::string page_start("\0");
+			std::string cursor_id;
 
 			if (doc.HasMember("paging")) {
 				const auto &pages = doc["paging"];
 				page_num = greylock::get_int64(pages, "num", ~0U);
 				page_start = greylock::get_string(pages, "start", "\0");
+				cursor_id = greylock::get_string(pages, "cursor", "");
 			}
 
-			auto ireq = server()->get_indexes(mbox, query);
-
-			greylock::intersect::result result;
-			result.cookie = page_start;
-			result.max_number_of_documents = page_num;
+			// intersection returns documents found so far when timeout (in milliseconds) expires,
+			// reply is not completed and its cookie continues the search
+			m_stream = greylock::get_bool(doc, "stream", false);
 
-			ILOG_INFO("url: %s: starting intersection, json parsing duration: %d ms",
-					req.url().to_human_readable().c_str(), search_tm.elapsed());
+			long timeout = greylock::get_int64(doc, "timeout", server()->search_timeout());
+			if (timeout > 0)
+				m_deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout);
 
-			try {
-				intersect(req, ireq, result);
-			} catch (const std::exception &e) {
-				// likely this exception tells that there are no requested indexes
-				// FIXME exception mechanism has to be reworked
-				ILOG_ERROR("url: %s: could not run intersection for %d indexes: %s",
-					req.url().to_human_readable().c_str(), ireq.indexes.size(), e.what());
-				send_search_result(result);
+			// streamed search waits for the client to read every batch, without deadline slow client
+			// would hold the request thread forever
+			if (m_stream && timeout <= 0) {
+				ILOG_ERROR("on_request: url: %s, mailbox: %s, error: %d: streaming requires 'timeout'",
+						req.url().to_human_readable().c_str(), mbox ? mbox : "federated", -EINVAL);
+				this->send_reply(swarm::http_response::bad_request);
 				return;
 			}
 
-			const rapidjson::Value &match = greylock::get_object(doc, "match");
-			if (match.IsObject()) {
-				const char *match_type = greylock::get_string(match, "type");
-				if (match_type) {
-					if (strcmp(match_type, "and")) {
-					} else if (strcmp(match_type, "phrase")) {
-					}
-				}
+			greylock::time_range range;
+			const rapidjson::Value &time = greylock::get_object(doc, "time");
+			if (time.IsObject()) {
+				range.tsec_start = greylock::get_int64(time, "start", 0);
+				range.tsec_end = greylock::get_int64(time, "end", LONG_MAX);
 			}
 
-			send_search_result(result);
-
-			ILOG_INFO("url: %s: requested indexes: %d, requested number of documents: %d, search start: %s, "
-					"found documents: %d, cookie: %s, completed: %d, duration: %d ms",
-					req.url().to_human_readable().c_str(),
-					ireq.indexes.size(), page_num, page_start.c_str(),
-					result.docs.size(), result.cookie.c_str(), result.completed, search_tm.elapsed());
-		}
+			bool count = greylock::get_bool(doc, "count", false);
+			bool exists = greylock::get_bool(doc, "exists", false);
+			if (count || exists) {
+				if (!mbox) {
+					ILOG_ERROR("on_request: url: %s, error: %d: count mode requires 'mailbox'",
+							req.url().to_human_readable().c_str(), -EINVAL);
+					this->send_reply(swarm::http_response::bad_request);
+					return;
+				}
 
-		void send_search_result(const greylock::intersect::result &result) {
-			JsonValue ret;
-			auto &allocator = ret.GetAllocator();
+				std::shared_ptr<greylock::indexes_request> ireq = request(mbox, doc, query);
+				if (!ireq)
+					return;
 
-			rapidjson::Value ids(rapidjson::kArrayType);
-			for (auto it = result.docs.begin(), end = result.docs.end(); it != end; ++it) {
-				rapidjson::Value key(rapidjson::kObjectType);
+				count_search(req, ireq, range, page_start, exists,
+						greylock::get_bool(doc, "approximate", false), search_tm);
+				return;
+			}
 
-				const greylock::key &doc = it->doc;
+			if (mailboxes.IsArray()) {
+				federated_search(req, doc, mailboxes, query, range, page_num, page_start, search_tm);
+				return;
+			}
 
-				rapidjson::Value kv(doc.url.key.c_str(), doc.url.key.size(), allocator);
-				key.AddMember("key", kv, allocator);
+			// cursor may have expired or it may have been evicted, search restarts from the cookie in this case
+			search_cursor_ptr cursor;
+			if (!cursor_id.empty()) {
+				cursor = server()->cursor_take(cursor_id, mbox);
+				if (!cursor) {
+					ILOG_INFO("url: %s, mailbox: %s, cursor: %s: cursor not found, search starts from cookie: %s",
+							req.url().to_human_readable().c_str(), mbox, cursor_id.c_str(), page_start.c_str());
+				}
+			}
 
-				rapidjson::Value bv(doc.url.bucket.c_str(), doc.url.bucket.size(), allocator);
-				key.AddMember("bucket", bv, allocator);
+			std::shared_ptr<greylock::indexes_request> ireq;
+			if (cursor) {
+				ireq = cursor->ireq;
+			} else {
+				ireq = request(mbox, doc, query);
+				if (!ireq)
+					return;
+			}
 
-				rapidjson::Value idv(doc.id.c_str(), doc.id.size(), allocator);
-				key.AddMember("id", idv, allocator);
+			// facets are counted over the whole result in a single pass, it can not be split into streamed batches
+			if (ireq->has_facets())
+				m_stream = false;
 
-				key.AddMember("relevance", it->relevance, allocator);
+			// cookie which is not a packed paging cookie is a bare document id sent by the older clients
+			greylock::intersect::result result;
+			greylock::intersect::paging_cookie cookie;
+			if (!base64_decode(page_start, result.cookie) || !cookie.load(result.cookie))
+				result.cookie = page_start;
+			result.max_number_of_documents = page_num;
 
-				rapidjson::Value ts(rapidjson::kObjectType);
-				long tsec, tnsec;
-				doc.get_timestamp(tsec, tnsec);
-				ts.AddMember("tsec", tsec, allocator);
-				ts.AddMember("tnsec", tnsec, allocator);
-				key.AddMember("timestamp", ts, allocator);
+			// cursor continues its own intersection, its pages are neither looked up in the cache nor cached,
+			// and they are not coalesced with other searches
+			std::string query_key;
+			greylock::search_cache::entry_ptr cached;
+			if (!cursor) {
+				query_key = ireq->search_key(range, page_num, result.cookie);
 
-				ids.PushBack(key, allocator);
+				// streamed documents are not kept, they can not be shared with other requests or cached
+				if (server()->result_cache().enabled() && !m_stream)
+					cached = server()->cached_result(query_key);
 			}
 
-			ret.AddMember("ids", ids, allocator);
-			ret.AddMember("completed", result.completed, allocator);
-
-			{
-				rapidjson::Value page(rapidjson::kObjectType);
-				page.AddMember("num", result.docs.size(), allocator);
+			greylock::search_flight_ptr flight;
+			bool leader = false;
+			if (!cursor && !cached && !m_stream)
+				flight = server()->flights().join(query_key, leader);
 
-				rapidjson::Value sv(result.cookie.c_str(), result.cookie.size(), allocator);
-				page.AddMember("start", sv, allocator);
+			ILOG_INFO("url: %s: starting intersection, cursor: %s, cached: %d, coalesced: %d, "
+					"json parsing duration: %d ms",
+					req.url().to_human_readable().c_str(), cursor ? cursor_id.c_str() : "none", !!cached,
+					flight && !leader, search_tm.elapsed());
 
-				ret.AddMember("paging", page, allocator);
-			}
+			try {
+				if (cached) {
+					result = cached->result;
+				} else if (cursor) {
+					resume(req, cursor, result);
+				} else if (flight && !leader) {
+					if (!flight->wait(result))
+						throw std::runtime_error("coalesced search has failed");
+				} else if (server()->result_cache().enabled() && !m_stream) {
+					greylock::search_cache::entry_ptr e = std::make_shared<greylock::search_cache::entry>();
+					cursor = intersect(req, ireq, range, result, &e->indexes);
+
+					// partial result depends on the server load, it is not cached
+					if (!result.deadline_exceeded && result.facets_completed) {
+						e->result = result;
+						server()->result_cache().put(query_key, e);
+					}
+				} else {
+					cursor = intersect(req, ireq, range, result, NULL);
+				}
+			} catch (const resolve_error &e) {
+				if (leader)
+					server()->flights().leave(query_key, flight, result, true);
 
-			std::string data = ret.ToString();
+				ILOG_ERROR("url: %s: %s", req.url().to_human_readable().c_str(), e.what());
 
-			thevoid::http_response reply;
-			reply.set_code(swarm::http_response::ok);
-			reply.headers().set_content_type("text/json; charset=utf-8");
-			reply.headers().set_content_length(data.size());
+				if (m_stream_started) {
+					this->close(boost::system::errc::make_error_code(boost::system::errc::io_error));
+					return;
+				}
 
-			this->send_reply(std::move(reply), std::move(data));
-		}
+				this->send_reply(swarm::http_response::internal_server_error);
+				return;
+			} catch (const greylock::index_not_found &e) {
+				if (leader)
+					server()->flights().leave(query_key, flight, result, true);
 
-		bool intersect(const thevoid::http_request &req, indexes_request &ireq, greylock::intersect::result &result) {
-			ribosome::timer tm;
+				// there are no requested indexes, there are no matching documents
+				ILOG_ERROR("url: %s: could not run intersection for %d indexes: %s",
+					req.url().to_human_readable().c_str(), ireq->indexes.size(), e.what());
 
-			greylock::intersect::intersector<greylock::bucket_transport> p(*(server()->bucket()));
+				// reply has already been started, the only way to report error is to break it
+				if (m_stream_started) {
+					this->close(boost::system::errc::make_error_code(boost::system::errc::io_error));
+					return;
+				}
 
-			std::vector<locker<http_server>> lockers;
-			lockers.reserve(ireq.indexes.size());
+				result.cookie.clear();
+				send_search_result(result, std::string());
+				return;
+			} catch (const std::exception &e) {
+				if (leader)
+					server()->flights().leave(query_key, flight, result, true);
 
-			std::vector<std::unique_lock<locker<http_server>>> locks;
-			locks.reserve(ireq.indexes.size());
+				ILOG_ERROR("url: %s: intersection of %d indexes has failed: %s",
+					req.url().to_human_readable().c_str(), ireq->indexes.size(), e.what());
 
-			for (auto it = ireq.indexes.begin(), end = ireq.indexes.end(); it != end; ++it) {
-				locker<http_server> l(server(), it->str());
-				lockers.emplace_back(std::move(l));
+				if (m_stream_started) {
+					this->close(boost::system::errc::make_error_code(boost::system::errc::io_error));
+					return;
+				}
 
-				std::unique_lock<locker<http_server>> lk(lockers.back());
-				locks.emplace_back(std::move(lk));
+				this->send_reply(swarm::http_response::internal_server_error);
+				return;
 			}
 
-			ILOG_INFO("url: %s: locks: %d: intersection locked: duration: %d ms",
-					req.url().to_human_readable().c_str(), ireq.indexes.size(), tm.elapsed());
+			// waiting requests get the same page, but cursor belongs to the leader only
+			if (leader)
+				server()->flights().leave(query_key, flight, result, false);
 
-			ribosome::timer intersect_tm;
-			result = p.intersect(ireq.indexes, result.cookie, result.max_number_of_documents,
-					std::bind(&indexes_request::distance_sort, &ireq, std::placeholders::_1, std::placeholders::_2));
+			// top-K result is not paged, even if it has been interrupted by the deadline,
+			// intersection which has counted facets has already scanned the whole lists
+			std::string next_cursor;
+			if (cursor && !result.completed && !ireq->top && !ireq->has_facets())
+				next_cursor = server()->cursor_put(cursor);
 
-			ILOG_INFO("url: %s: locks: %d: completed: %d, result keys: %d, requested num: %d, page start: %s: "
-					"intersection completed: duration: %d ms, whole duration: %d ms",
-					req.url().to_human_readable().c_str(),
-					ireq.indexes.size(), result.completed, result.docs.size(),
-					result.max_number_of_documents, result.cookie.c_str(),
-					intersect_tm.elapsed(), tm.elapsed());
+			m_facets.add(*ireq, result);
 
-			return result.completed;
-		}
-	};
+			result.cookie = base64_encode(result.cookie);
 
-	struct on_index : public thevoid::simple_request_stream<http_server> {
-		void process_one_document(const thevoid::http_request &req, const std::string &mbox,
-				greylock::key &doc, const rapidjson::Value &idxs) {
-			ribosome::timer all_tm;
-			ribosome::timer tm;
+			send_search_result(result, next_cursor);
 
-			ILOG_INFO("process_one_document: url: %s, mailbox: %s, doc: %s: start insertion",
-					req.url().to_human_readable().c_str(), mbox,
-					doc.str().c_str());
+			ILOG_INFO("url: %s: requested indexes: %d, requested number of documents: %d, search start: %s, "
+					"time range: %s, match: %s, found documents: %d, cookie: %s, cursor: %s, cached: %d, "
+					"completed: %d, duration: %d ms",
+					req.url().to_human_readable().c_str(),
+					ireq->indexes.size(), page_num, page_start.c_str(), range.str().c_str(), ireq->phrase.str().c_str(),
+					m_stream ? m_stream_num : result.docs.size(), result.cookie.c_str(), next_cursor.c_str(), !!cached,
+					result.completed, search_tm.elapsed());
+		}
 
-			auto ireq = server()->get_indexes(mbox, idxs);
+		// invalid query (see @query_error) is replied with bad request, NULL is returned in this case
+		std::shared_ptr<greylock::indexes_request> request(const std::string &mbox, const rapidjson::Document &doc,
+				const rapidjson::Value &query) {
+			auto ireq = std::make_shared<greylock::indexes_request>(server()->get_indexes(mbox, query));
+			server()->get_numeric_ranges(mbox, greylock::get_object(doc, "range"), *ireq);
+			try {
+				server()->get_query_operators(mbox, query, ireq->operators);
+				server()->get_facets(mbox, greylock::get_object(doc, "facets"), *ireq);
+			} catch (const query_error &e) {
+				ILOG_ERROR("on_request: mailbox: %s, error: %d: invalid query: %s", mbox.c_str(), -EINVAL, e.what());
+				this->send_reply(swarm::http_response::bad_request);
+				return std::shared_ptr<greylock::indexes_request>();
+			}
+			server()->get_phrase_match(greylock::get_object(doc, "match"), *ireq);
+			ireq->top = greylock::get_int64(doc, "top", 0);
+			ireq->bm25 = !strcmp(greylock::get_string(doc, "scoring", "distance"), "bm25");
+			return ireq;
+		}
+
+		// Federated search: the query runs over every mailbox of @mboxes, per-mailbox intersections run
+		// concurrently on the server worker pool, every one of them returns up to @page_num documents.
+		// Documents are merged in key (timestamp) order, or by relevance in top-K mode,
+		// only the first @page_num of them are returned and resolved.
+		//
+		// Combined cookie (see @greylock::federated_cookie) contains the cookie of every mailbox,
+		// mailbox whose documents have not been returned continues from the first of them,
+		// thus no document is lost or returned twice.
+		// Federated pages are neither cached nor coalesced, cursors and streaming are not supported.
+		void federated_search(const thevoid::http_request &req, const rapidjson::Document &doc,
+				const rapidjson::Value &mboxes, const rapidjson::Value &query, const greylock::time_range &range,
+				size_t page_num, const std::string &page_start, ribosome::timer &search_tm) {
+			std::vector<std::string> mailboxes;
+			for (auto it = mboxes.Begin(), end = mboxes.End(); it != end; ++it) {
+				if (!it->IsString()) {
+					ILOG_ERROR("on_request: url: %s, error: %d: 'mailboxes' must be an array of strings",
+							req.url().to_human_readable().c_str(), -EINVAL);
+					this->send_reply(swarm::http_response::bad_request);
+					return;
+				}
+
+				mailboxes.emplace_back(it->GetString());
+			}
+
+			if (mailboxes.empty() || mailboxes.size() > server()->federated_max_mailboxes()) {
+				ILOG_ERROR("on_request: url: %s, error: %d: invalid number of mailboxes: %zd, max: %zd",
+						req.url().to_human_readable().c_str(), -EINVAL,
+						mailboxes.size(), server()->federated_max_mailboxes());
+				this->send_reply(swarm::http_response::bad_request);
+				return;
+			}
+
+			server()->federated_started();
+			m_stream = false;
+
+			// cookie of the different list of mailboxes is not valid, search starts from the beginning
+			greylock::federated_cookie cookie;
+			std::string packed;
+			if (!base64_decode(page_start, packed) || !cookie.load(packed, mailboxes))
+				cookie = greylock::federated_cookie(mailboxes);
+
+			struct mailbox_search {
+				std::shared_ptr<greylock::indexes_request> ireq;
+				greylock::intersect::result result;
+				std::string error;
+			};
+			std::vector<mailbox_search> searches(mailboxes.size());
+
+			for (size_t i = 0; i < mailboxes.size(); ++i) {
+				if (cookie.completed[i])
+					continue;
+
+				mailbox_search &ms = searches[i];
+				ms.ireq = request(mailboxes[i], doc, query);
+				if (!ms.ireq)
+					return;
+				ms.result.cookie = cookie.starts[i];
+				ms.result.max_number_of_documents = page_num;
+			}
+
+			// every task refers to its own slot of @searches, all of them are waited for before it is destroyed
+			std::vector<std::future<void>> tasks;
+			for (auto &ms: searches) {
+				if (!ms.ireq)
+					continue;
+
+				mailbox_search *msp = &ms;
+				tasks.emplace_back(server()->federated_pool().submit([this, &req, &range, msp] {
+							try {
+								intersect(req, msp->ireq, range, msp->result, NULL, false);
+							} catch (const greylock::index_not_found &e) {
+								// there are no requested indexes in this mailbox, it does not contain matching documents
+								msp->result = greylock::intersect::result();
+							} catch (const std::exception &e) {
+								msp->error = e.what();
+							}
+						}));
+			}
+			for (auto &t: tasks)
+				t.wait();
+
+			std::vector<greylock::intersect::result *> mailbox_pages(searches.size(), NULL);
+			greylock::intersect::result result;
+			size_t num = page_num;
+			bool top = false;
+			for (size_t i = 0; i < searches.size(); ++i) {
+				mailbox_search &ms = searches[i];
+				if (!ms.ireq)
+					continue;
+
+				// failed mailbox is not merged, thus it keeps its previous start and is not completed in the cookie,
+				// the next page searches it again, reply lists it in "failed_mailboxes"
+				if (!ms.error.empty()) {
+					ILOG_ERROR("url: %s, mailbox: %s: intersection of %d indexes has failed: %s",
+						req.url().to_human_readable().c_str(), mailboxes[i].c_str(),
+						ms.ireq->indexes.size(), ms.error.c_str());
+					m_failed_mailboxes.push_back(mailboxes[i]);
+					m_facets.completed = false;
+					continue;
+				}
+
+				if (ms.ireq->top) {
+					top = true;
+					num = ms.ireq->top;
+				}
+
+				result.deadline_exceeded |= ms.result.deadline_exceeded;
+				result.phrase_relaxed |= ms.result.phrase_relaxed;
+				result.expansion_truncated |= ms.result.expansion_truncated;
+				m_facets.add(*ms.ireq, ms.result);
+				mailbox_pages[i] = &ms.result;
+			}
+
+			std::vector<greylock::federated_cookie::candidate> merged = cookie.merge(mailbox_pages, num, top);
+			result.completed = cookie.done();
+
+			// only returned documents are resolved, every mailbox has its own dictionary
+			std::vector<std::vector<greylock::intersect::single_doc_result>> pages(mailboxes.size());
+			std::vector<std::pair<size_t, size_t>> order;
+			for (const auto &c: merged) {
+				order.emplace_back(c.mailbox, pages[c.mailbox].size());
+				pages[c.mailbox].emplace_back(std::move(*c.doc));
+			}
+
+			if (server()->compact_postings()) {
+				for (size_t i = 0; i < pages.size(); ++i) {
+					if (pages[i].empty())
+						continue;
+
+					int err = server()->resolve_documents(mailboxes[i], pages[i]);
+					if (err < 0) {
+						ILOG_ERROR("url: %s, mailbox: %s, error: %d: federated search: could not resolve documents",
+							req.url().to_human_readable().c_str(), mailboxes[i].c_str(), err);
+						this->send_reply(swarm::http_response::internal_server_error);
+						return;
+					}
+				}
+			}
+
+			// like the page of the single mailbox, merged page is sorted by relevance
+			std::stable_sort(order.begin(), order.end(),
+					[&] (const std::pair<size_t, size_t> &o1, const std::pair<size_t, size_t> &o2) {
+						return pages[o1.first][o1.second].relevance > pages[o2.first][o2.second].relevance;
+					});
+
+			std::vector<std::string> docs_mailboxes;
+			for (const auto &o: order) {
+				result.docs.emplace_back(std::move(pages[o.first][o.second]));
+				docs_mailboxes.push_back(mailboxes[o.first]);
+			}
+
+			// top-K result is not paged, even if it has been interrupted by the deadline
+			if (!result.completed && !top)
+				result.cookie = base64_encode(cookie.save());
+
+			send_search_result(result, std::string(), docs_mailboxes);
+
+			ILOG_INFO("url: %s: federated search: mailboxes: %d, requested number of documents: %d, search start: %s, "
+					"time range: %s, found documents: %d, cookie: %s, completed: %d, duration: %d ms",
+					req.url().to_human_readable().c_str(),
+					mailboxes.size(), page_num, page_start.c_str(), range.str().c_str(),
+					result.docs.size(), result.cookie.c_str(), result.completed, search_tm.elapsed());
+		}
+
+		// Count mode: the number of documents matching the query is returned instead of the documents,
+		// "exists" stops at the first match.
+		//
+		// Query of the single word without any other condition is answered from the counters of its index,
+		// postings are not read: bitmap cardinality of the dense term and key counter of the index tree are exact,
+		// counter of the time-partitioned index is an estimate, it is only used if approximate answer is allowed.
+		// Otherwise matches are counted by the intersection, which may be interrupted by the deadline,
+		// partial count is not exact and the next request continues counting from its cookie.
+		void count_search(const thevoid::http_request &req, const std::shared_ptr<greylock::indexes_request> &ireq,
+				const greylock::time_range &range, const std::string &page_start, bool exists, bool approximate,
+				ribosome::timer &search_tm) {
+			m_stream = false;
+
+			greylock::intersect::result result;
+			bool exact = false;
+			bool counters = page_start.empty() && term_count(*ireq, range, approximate, result.count, exact);
+
+			if (!counters) {
+				ireq->count = true;
+				ireq->top = 0;
+
+				greylock::intersect::paging_cookie cookie;
+				if (!base64_decode(page_start, result.cookie) || !cookie.load(result.cookie))
+					result.cookie = page_start;
+				result.max_number_of_documents = exists ? 1 : ~0UL;
+
+				try {
+					intersect(req, ireq, range, result, NULL, false);
+				} catch (const greylock::index_not_found &e) {
+					// there are no requested indexes in the mailbox, there are no matching documents
+					ILOG_ERROR("url: %s: could not run intersection for %d indexes: %s",
+						req.url().to_human_readable().c_str(), ireq->indexes.size(), e.what());
+					result = greylock::intersect::result();
+				} catch (const std::exception &e) {
+					ILOG_ERROR("url: %s: count mode: intersection of %d indexes has failed: %s",
+						req.url().to_human_readable().c_str(), ireq->indexes.size(), e.what());
+					this->send_reply(swarm::http_response::internal_server_error);
+					return;
+				}
+
+				// the first match decides existence, there is nothing to continue
+				if (exists && result.count) {
+					result.completed = true;
+					result.cookie.clear();
+				}
+
+				exact = result.completed;
+				m_facets.add(*ireq, result);
+			}
+
+			if (exists)
+				result.count = std::min<uint64_t>(result.count, 1);
+
+			JsonValue ret;
+			auto &allocator = ret.GetAllocator();
+
+			ret.AddMember("count", result.count, allocator);
+			if (exists)
+				ret.AddMember("exists", result.count != 0, allocator);
+			ret.AddMember("exact", exact, allocator);
+
+			result.cookie = base64_encode(result.cookie);
+			status_to_json(result, 0, std::string(), ret, allocator);
+
+			std::string data = ret.ToString();
+
+			thevoid::http_response reply;
+			reply.set_code(swarm::http_response::ok);
+			reply.headers().set_content_type("text/json; charset=utf-8");
+			reply.headers().set_content_length(data.size());
+
+			this->send_reply(std::move(reply), std::move(data));
+
+			ILOG_INFO("url: %s: count mode: requested indexes: %d, time range: %s, exists: %d, counters: %d, "
+					"count: %llu, exact: %d, cookie: %s, completed: %d, duration: %d ms",
+					req.url().to_human_readable().c_str(),
+					ireq->indexes.size(), range.str().c_str(), exists, counters,
+					(unsigned long long)result.count, exact, result.cookie.c_str(), result.completed,
+					search_tm.elapsed());
+		}
+
+		// returns true if the query is a single word without any other condition or facet and its number of documents
+		// has been read from the counters of its index, @exact is set if the counter is not an estimate
+		//
+		// counter which is not known to be valid is not used: missing index, index without key counters
+		// and dense bitmap when retention is enabled (expired documents are not removed from bitmaps)
+		// are counted by the intersection
+		bool term_count(const greylock::indexes_request &ireq, const greylock::time_range &range, bool approximate,
+				uint64_t &count, bool &exact) {
+			std::vector<greylock::eurl> operators;
+			ireq.operators.urls(operators);
+
+			if (ireq.indexes.size() != 1 || !ireq.numeric_indexes.empty() || !operators.empty() ||
+					range.is_bounded() || ireq.has_facets())
+				return false;
+
+			const greylock::eurl &url = ireq.indexes[0];
+
+			mailbox_state state;
+			int err = server()->mailbox_state_read(ireq.mailbox, state);
+			if (err < 0) {
+				ILOG_ERROR("mailbox: %s, index: %s, error: %d: could not read mailbox state, "
+						"matches are counted by the intersection",
+						ireq.mailbox.c_str(), url.str().c_str(), err);
+				return false;
+			}
+
+			if (state.is_dense(url) || server()->dense_converted(url)) {
+				if (server()->retention_max_age() > 0)
+					return false;
+
+				std::shared_ptr<const greylock::bitmap> docs = server()->dense_bitmap(url);
+				if (!docs)
+					return false;
+
+				count = docs->cardinality();
+				exact = true;
+				return true;
+			}
+
+			bool partitioned = server()->time_partition_period() > 0;
+			if (partitioned && !approximate)
+				return false;
+
+			// counter which can not be read is not an error, matches are counted by the intersection,
+			// which reports errors of the index itself
+			try {
+				count = server()->document_frequency(url, partitioned);
+			} catch (const std::exception &e) {
+				ILOG_ERROR("mailbox: %s, index: %s: could not read key counter: %s",
+						ireq.mailbox.c_str(), url.str().c_str(), e.what());
+				return false;
+			}
+			// missing index has zero documents, it is not known whether the index exists or the counter is broken
+			if (count == 0 || count == greylock::index<greylock::bucket_transport>::unknown_count)
+				return false;
+
+			exact = !partitioned;
+			return true;
+		}
+
+		// @mailboxes contains the mailbox of every document of the federated search result, it is empty otherwise
+		void send_search_result(const greylock::intersect::result &result, const std::string &cursor_id,
+				const std::vector<std::string> &mailboxes = std::vector<std::string>()) {
+			if (m_stream) {
+				stream_docs(result.docs);
+				stream_finish(result, cursor_id);
+				return;
+			}
+
+			JsonValue ret;
+			auto &allocator = ret.GetAllocator();
+
+			rapidjson::Value ids(rapidjson::kArrayType);
+			for (size_t i = 0; i < result.docs.size(); ++i) {
+				rapidjson::Value key(rapidjson::kObjectType);
+				doc_to_json(result.docs[i], key, allocator);
+
+				if (i < mailboxes.size()) {
+					rapidjson::Value mv(mailboxes[i].c_str(), mailboxes[i].size(), allocator);
+					key.AddMember("mailbox", mv, allocator);
+				}
+
+				ids.PushBack(key, allocator);
+			}
+
+			ret.AddMember("ids", ids, allocator);
+			status_to_json(result, result.docs.size(), cursor_id, ret, allocator);
+
+			std::string data = ret.ToString();
+
+			thevoid::http_response reply;
+			reply.set_code(swarm::http_response::ok);
+			reply.headers().set_content_type("text/json; charset=utf-8");
+			reply.headers().set_content_length(data.size());
+
+			this->send_reply(std::move(reply), std::move(data));
+		}
+
+		void doc_to_json(const greylock::intersect::single_doc_result &res, rapidjson::Value &key,
+				rapidjson::MemoryPoolAllocator<> &allocator) {
+			const greylock::key &doc = res.doc;
+
+			rapidjson::Value kv(doc.url.key.c_str(), doc.url.key.size(), allocator);
+			key.AddMember("key", kv, allocator);
+
+			rapidjson::Value bv(doc.url.bucket.c_str(), doc.url.bucket.size(), allocator);
+			key.AddMember("bucket", bv, allocator);
+
+			rapidjson::Value idv(doc.id.c_str(), doc.id.size(), allocator);
+			key.AddMember("id", idv, allocator);
+
+			key.AddMember("relevance", res.relevance, allocator);
+
+			rapidjson::Value ts(rapidjson::kObjectType);
+			long tsec, tnsec;
+			doc.get_timestamp(tsec, tnsec);
+			ts.AddMember("tsec", tsec, allocator);
+			ts.AddMember("tnsec", tnsec, allocator);
+			key.AddMember("timestamp", ts, allocator);
+		}
+
+		// @num is the number of returned documents, in streaming mode they are not kept in @result
+		void status_to_json(const greylock::intersect::result &result, size_t num, const std::string &cursor_id,
+				rapidjson::Value &ret, rapidjson::MemoryPoolAllocator<> &allocator) {
+			ret.AddMember("completed", result.completed, allocator);
+			ret.AddMember("deadline_exceeded", result.deadline_exceeded, allocator);
+			ret.AddMember("match_relaxed", result.phrase_relaxed, allocator);
+			ret.AddMember("expansion_truncated", result.expansion_truncated, allocator);
+
+			rapidjson::Value page(rapidjson::kObjectType);
+			page.AddMember("num", num, allocator);
+
+			rapidjson::Value sv(result.cookie.c_str(), result.cookie.size(), allocator);
+			page.AddMember("start", sv, allocator);
+
+			if (!cursor_id.empty()) {
+				rapidjson::Value cv(cursor_id.c_str(), cursor_id.size(), allocator);
+				page.AddMember("cursor", cv, allocator);
+			}
+
+			ret.AddMember("paging", page, allocator);
+
+			if (!m_facets.empty()) {
+				rapidjson::Value facets(rapidjson::kObjectType);
+				m_facets.to_json(facets, allocator);
+				ret.AddMember("facets", facets, allocator);
+			}
+
+			if (!m_failed_mailboxes.empty()) {
+				rapidjson::Value failed(rapidjson::kArrayType);
+				for (const auto &mbox: m_failed_mailboxes) {
+					rapidjson::Value mv(mbox.c_str(), mbox.size(), allocator);
+					failed.PushBack(mv, allocator);
+				}
+				ret.AddMember("failed_mailboxes", failed, allocator);
+			}
+		}
+
+		// facet counts of the reply, they are filled before the reply is sent
+		facet_counts m_facets;
+
+		// mailboxes of the federated search whose intersection has failed, they are searched again by the next page
+		std::vector<std::string> m_failed_mailboxes;
+
+		// Streaming mode: reply is sent with chunked transfer encoding, documents are written in compact form
+		// as soon as intersection finds every batch of them, only the current batch is kept in memory.
+		// Reply has the same format as the usual one, but documents are sorted by relevance only within the batch.
+		bool m_stream = false;
+		bool m_stream_started = false;
+		size_t m_stream_num = 0;
+
+		// completion of the last streamed chunk, the next batch is not produced until it has been written,
+		// thus slow client slows down its intersection instead of queueing the whole reply in memory
+		std::future<boost::system::error_code> m_stream_sent;
+
+		static std::string to_compact_string(const rapidjson::Value &value) {
+			rapidjson::StringBuffer buffer;
+			rapidjson::Writer<rapidjson::StringBuffer> writer(buffer);
+			value.Accept(writer);
+
+			return std::string(buffer.GetString(), buffer.Size());
+		}
+
+		void stream_chunk(const std::string &data) {
+			// empty chunk terminates the reply
+			if (data.empty())
+				return;
+
+			char size[32];
+			snprintf(size, sizeof(size), "%zx\r\n", data.size());
+
+			auto chunk = std::make_shared<std::string>(size + data + "\r\n");
+			auto sent = std::make_shared<std::promise<boost::system::error_code>>();
+			m_stream_sent = sent->get_future();
+
+			this->send_data(boost::asio::const_buffer(chunk->data(), chunk->size()),
+					[chunk, sent] (const boost::system::error_code &error) {
+						sent->set_value(error);
+					});
+		}
+
+		// waits until the last streamed chunk has been written, send completion is run by another thread
+		// of the server pool (see "threads" in the config), waiting is limited by the search deadline,
+		// which is always set for streamed search, returns false if the deadline has passed,
+		// throws if the chunk could not be sent
+		bool stream_wait() {
+			if (!m_stream_sent.valid())
+				return true;
+
+			if (m_stream_sent.wait_until(m_deadline) != std::future_status::ready)
+				return false;
+
+			boost::system::error_code error = m_stream_sent.get();
+			if (error)
+				throw std::runtime_error("could not send streamed documents: " + error.message());
+
+			return true;
+		}
+
+		void stream_start() {
+			if (m_stream_started)
+				return;
+
+			m_stream_started = true;
+
+			thevoid::http_response reply;
+			reply.set_code(swarm::http_response::ok);
+			reply.headers().set_content_type("text/json; charset=utf-8");
+			reply.headers().set("Transfer-Encoding", "chunked");
+
+			this->send_headers(std::move(reply), [] (const boost::system::error_code &) {});
+			stream_chunk("{\"ids\":[");
+		}
+
+		void stream_docs(const std::vector<greylock::intersect::single_doc_result> &docs) {
+			stream_start();
+
+			std::string data;
+			for (const auto &doc: docs) {
+				JsonValue key;
+				doc_to_json(doc, key, key.GetAllocator());
+
+				if (m_stream_num++ != 0)
+					data.push_back(',');
+				data += to_compact_string(key);
+			}
+
+			stream_chunk(data);
+		}
+
+		void stream_finish(const greylock::intersect::result &result, const std::string &cursor_id) {
+			JsonValue ret;
+			status_to_json(result, m_stream_num, cursor_id, ret, ret.GetAllocator());
+
+			// status object is appended to the array of documents: '{' is replaced with '],'
+			std::string data = to_compact_string(ret);
+			data[0] = ',';
+			stream_chunk("]" + data);
+
+			auto end = std::make_shared<std::string>("0\r\n\r\n");
+			this->send_data(boost::asio::const_buffer(end->data(), end->size()),
+					[end] (const boost::system::error_code &) {});
+			this->close(boost::system::error_code());
+		}
+
+		typedef std::function<bool (const std::vector<greylock::eurl> &, greylock::intersect::result &)> finish_t;
+
+		// compact postings do not contain document ids and urls, only returned documents are resolved
+		// through the mailbox dictionary when intersection finishes the page
+		finish_t resolving(const std::string &mbox, const finish_t &finish) {
+			if (!server()->compact_postings())
+				return finish;
+
+			http_server *srv = server();
+			return [srv, mbox, finish] (const std::vector<greylock::eurl> &indexes, greylock::intersect::result &res) {
+				bool ret = finish(indexes, res);
+
+				int err = srv->resolve_documents(mbox, res.docs);
+				if (err < 0)
+					throw resolve_error("mailbox: " + mbox + ": could not resolve documents: " + std::to_string(err));
+
+				return ret;
+			};
+		}
+
+		// locks every index in @names, names must be unique and every request must lock them in the same order
+		void lock_indexes(const std::vector<greylock::eurl> &names, std::vector<locker<http_server>> &lockers,
+				std::vector<std::unique_lock<locker<http_server>>> &locks) {
+			lockers.reserve(names.size());
+			locks.reserve(names.size());
+
+			for (auto it = names.begin(), end = names.end(); it != end; ++it) {
+				locker<http_server> l(server(), it->str());
+				lockers.emplace_back(std::move(l));
+
+				std::unique_lock<locker<http_server>> lk(lockers.back());
+				locks.emplace_back(std::move(lk));
+			}
+		}
+
+		// continues intersection of the stored cursor, indexes are locked again, since they could be
+		// modified between requests, keys which were inserted into already loaded pages are not returned
+		void resume(const thevoid::http_request &req, const search_cursor_ptr &cursor,
+				greylock::intersect::result &result) {
+			ribosome::timer tm;
+
+			std::vector<locker<http_server>> lockers;
+			std::vector<std::unique_lock<locker<http_server>>> locks;
+			lock_indexes(cursor->lock_names, lockers, locks);
+
+			ribosome::timer intersect_tm;
+			cursor->cursor->set_deadline(m_deadline);
+			if (m_stream) {
+				stream_intersect(cursor->cursor, cursor->finish, locks, result);
+			} else {
+				result = cursor->cursor->next(result.cookie, result.max_number_of_documents, cursor->finish);
+			}
+			result.expansion_truncated = cursor->ireq->operators.truncated();
+
+			ILOG_INFO("url: %s: locks: %d: completed: %d, result keys: %d, requested num: %d, page start: %s: "
+					"cursor intersection completed: duration: %d ms, whole duration: %d ms",
+					req.url().to_human_readable().c_str(),
+					cursor->lock_names.size(), result.completed, result.docs.size(),
+					result.max_number_of_documents, base64_encode(result.cookie).c_str(),
+					intersect_tm.elapsed(), tm.elapsed());
+		}
+
+		// returns cursor which can continue this intersection for the next page
+		// if @cached is not null, it is filled with generations of every index intersection reads,
+		// they are read under the same locks, thus they match the result
+		// compact keys of the result are not resolved if @resolve is not set,
+		// federated search only resolves documents of the merged page
+		search_cursor_ptr intersect(const thevoid::http_request &req, const std::shared_ptr<greylock::indexes_request> &ireq_ptr,
+				const greylock::time_range &range, greylock::intersect::result &result,
+				std::vector<greylock::search_cache::cached_index> *cached, bool resolve = true) {
+			ribosome::timer tm;
+			greylock::indexes_request &ireq = *ireq_ptr;
+
+			greylock::intersect::intersector<greylock::bucket_transport> p(*(server()->bucket()),
+					server()->time_partition_period() > 0);
+			search_state st(p);
+
+			std::vector<greylock::eurl> lock_names(ireq.indexes);
+			lock_names.insert(lock_names.end(), ireq.numeric_indexes.begin(), ireq.numeric_indexes.end());
+			ireq.operators.urls(lock_names);
+			for (const auto &pair: ireq.pairs)
+				lock_names.push_back(pair.url);
+			for (const auto &f: ireq.facets)
+				lock_names.push_back(f.url);
+
+			// the same index may be used several times in the query, it must be locked only once
+			std::sort(lock_names.begin(), lock_names.end(), [] (const greylock::eurl &u1, const greylock::eurl &u2) {
+						return u1.str() < u2.str();
+					});
+			lock_names.erase(std::unique(lock_names.begin(), lock_names.end()), lock_names.end());
+
+			// dense terms are read through the mailbox documents index, it is locked before any term index,
+			// indexing locks them in the same order, term converted after the state has been read
+			// is still found after its lock has been taken, but documents index is not locked in this case
+			greylock::eurl dname = server()->documents_index_url(ireq.mailbox);
+			mailbox_state state;
+			int err = server()->mailbox_state_read(ireq.mailbox, state);
+			if (err < 0) {
+				ILOG_ERROR("url: %s: mailbox: %s, error: %d: could not read mailbox state, dense terms are not known",
+						req.url().to_human_readable().c_str(), ireq.mailbox.c_str(), err);
+			}
+
+			auto is_dense = [&] (const greylock::eurl &url) {
+				return url != dname && (state.is_dense(url) || server()->dense_converted(url));
+			};
+
+			if (std::any_of(lock_names.begin(), lock_names.end(), is_dense)) {
+				lock_names.erase(std::remove(lock_names.begin(), lock_names.end(), dname), lock_names.end());
+				lock_names.insert(lock_names.begin(), dname);
+			}
+
+			std::vector<locker<http_server>> lockers;
+			std::vector<std::unique_lock<locker<http_server>>> locks;
+			lock_indexes(lock_names, lockers, locks);
+
+			ILOG_INFO("url: %s: locks: %d: intersection locked: duration: %d ms",
+					req.url().to_human_readable().c_str(), lock_names.size(), tm.elapsed());
+
+			st.documents = dname;
+			if (server()->dictionary_enabled())
+				st.dictionary = server()->dictionary_url(ireq.mailbox);
+			for (const auto &url: lock_names) {
+				if (!is_dense(url))
+					continue;
+
+				std::shared_ptr<const greylock::bitmap> docs = server()->dense_bitmap(url);
+				if (docs)
+					st.dense[url.str()] = docs;
+			}
+
+			if (cached) {
+				for (const auto &url: lock_names) {
+					greylock::search_cache::cached_index idx;
+					idx.url = url;
+					idx.dense = st.dense.find(url.str()) != st.dense.end();
+					idx.partitioned = server()->time_partition_period() > 0 && !idx.dense && url != dname &&
+						std::find(ireq.numeric_indexes.begin(), ireq.numeric_indexes.end(), url) ==
+							ireq.numeric_indexes.end();
+					if (idx.partitioned)
+						idx.range = range;
+					idx.generation = server()->index_generation(idx.url, idx.partitioned, idx.dense, idx.range);
+					cached->emplace_back(idx);
+				}
+
+				if (ireq.bm25) {
+					greylock::search_cache::cached_index idx;
+					idx.url = server()->documents_index_url(ireq.mailbox);
+					idx.generation = server()->index_generation(idx.url, false);
+					cached->emplace_back(idx);
+				}
+			}
+
+			if (ireq.bm25) {
+				for (const auto &iname: ireq.indexes) {
+					auto dense = st.dense.find(iname.str());
+					if (dense != st.dense.end()) {
+						ireq.df.push_back(dense->second->cardinality());
+						continue;
+					}
+
+					ireq.df.push_back(server()->document_frequency(iname, server()->time_partition_period() > 0));
+				}
+
+				ireq.num_documents = server()->document_frequency(server()->documents_index_url(ireq.mailbox), false);
+
+				// documents index written without counters, mailbox is at least as large as any of its terms
+				if (ireq.num_documents == greylock::index<greylock::bucket_transport>::unknown_count) {
+					ireq.num_documents = 0;
+					for (uint64_t df: ireq.df) {
+						if (df != greylock::index<greylock::bucket_transport>::unknown_count)
+							ireq.num_documents = std::max(ireq.num_documents, df);
+					}
+				}
+			}
+
+			greylock::intersect::options opts;
+			opts.range = range;
+			opts.phrase = ireq.phrase;
+			opts.deadline = m_deadline;
+			opts.count = ireq.count;
+
+			// dense top-level terms are AND'ed as bitmaps without reading any document,
+			// documents of the result are read through the documents index by a single list,
+			// dense terms do not have positions and are not checked by phrase matching,
+			// "match_relaxed" reply member is set in this case
+			std::shared_ptr<greylock::bitmap> dense_docs;
+			std::string dense_names;
+			for (const auto &iname: ireq.indexes) {
+				auto dense = st.dense.find(iname.str());
+				if (dense == st.dense.end())
+					continue;
+
+				if (!dense_docs) {
+					dense_docs = std::make_shared<greylock::bitmap>(*dense->second);
+				} else {
+					dense_docs->intersect(*dense->second);
+				}
+				dense_names += dense->first + " ";
+			}
+
+			if (dense_docs) {
+				greylock::posting_list_ptr list = std::make_shared<greylock::bitmap_postings<greylock::bucket_transport>>(
+						*(server()->bucket()), dense_names, dname, dense_docs, range.start_key(), range,
+						server()->compact_postings(), st.dictionary);
+
+				opts.lists.resize(ireq.indexes.size());
+				for (size_t i = 0; i < ireq.indexes.size(); ++i) {
+					if (st.dense.find(ireq.indexes[i].str()) != st.dense.end())
+						opts.lists[i] = list;
+				}
+
+				opts.phrase.relax([&] (size_t index) {
+							return !!opts.lists[index];
+						});
+
+				ILOG_INFO("url: %s: dense terms: %s, documents: %s, match relaxed: %d",
+						req.url().to_human_readable().c_str(), dense_names.c_str(), dense_docs->str().c_str(),
+						opts.phrase.relaxed);
+			}
+
+			// both words of the pair are read from the pair index, positions of the second word
+			// are the pair positions shifted by one, phrase matching checks them like the original positions,
+			// words which are read as dense bitmaps are not replaced
+			for (const auto &pair: ireq.pairs) {
+				opts.lists.resize(ireq.indexes.size());
+				if (opts.lists[pair.first] || opts.lists[pair.second])
+					continue;
+
+				opts.lists[pair.first] = postings(st, pair.url, range);
+				opts.lists[pair.second] = std::make_shared<greylock::shifted_postings>(postings(st, pair.url, range), 1);
+
+				ILOG_INFO("url: %s: words: %s, %s: replaced by pair index: %s",
+						req.url().to_human_readable().c_str(),
+						ireq.indexes[pair.first].str().c_str(), ireq.indexes[pair.second].str().c_str(),
+						pair.url.str().c_str());
+			}
+
+			// numeric ranges are not ordered by document timestamp,
+			// matching documents are materialized and intersected with string indexes as sorted lists
+			std::vector<greylock::posting_list_ptr> &filters = opts.filters;
+			for (size_t i = 0; i < ireq.numeric_indexes.size(); ++i) {
+				const greylock::eurl &url = ireq.numeric_indexes[i];
+				const greylock::numeric_range &nr = ireq.numeric_ranges[i];
+
+				greylock::numeric_index<greylock::bucket_transport> nidx(*(server()->bucket()), url, true);
+				std::vector<greylock::key> docs = nidx.range(nr, range);
+
+				ILOG_INFO("url: %s: numeric index: %s, range: %s, documents: %d",
+						req.url().to_human_readable().c_str(), url.str().c_str(), nr.str().c_str(), docs.size());
+
+				filters.emplace_back(std::make_shared<greylock::vector_postings>(url.str(), std::move(docs)));
+			}
+
+			// operator subqueries are AND'ed with the top-level words as filters,
+			// "$not" subqueries are excluded from the result
+			const greylock::query_node &ops = ireq.operators;
+			for (const auto &n: ops.all) {
+				filters.emplace_back(postings(st, n, range));
+			}
+			for (const auto &group: ops.any) {
+				filters.emplace_back(union_postings(st, group, range));
+			}
+
+			for (const auto &n: ops.none) {
+				opts.excludes.emplace_back(postings(st, n, range));
+			}
+
+			// value which has never been indexed does not have its index, it is counted as an empty list,
+			// list which can not be read is counted as empty too, but facet counts are not complete then
+			bool facets_failed = false;
+			for (const auto &f: ireq.facets) {
+				try {
+					opts.facets.emplace_back(open_postings(st, f.url, range));
+					continue;
+				} catch (const greylock::index_not_found &e) {
+				} catch (const std::exception &e) {
+					ILOG_ERROR("url: %s, facet: %s: could not open facet index: %s",
+							req.url().to_human_readable().c_str(), f.url.str().c_str(), e.what());
+					facets_failed = true;
+				}
+
+				opts.facets.emplace_back(std::make_shared<greylock::vector_postings>(f.url.str(),
+							std::vector<greylock::key>()));
+			}
+			opts.facet_buckets = ireq.facet_buckets;
+
+			finish_t finish = std::bind(&greylock::indexes_request::distance_sort, &ireq,
+					std::placeholders::_1, std::placeholders::_2);
+
+			// in top-K mode every matching document is scored as soon as it is found,
+			// only the most relevant documents are kept and sorted
+			if (ireq.top) {
+				opts.process = std::bind(&greylock::indexes_request::top_process, &ireq, std::placeholders::_1);
+				finish = std::bind(&greylock::indexes_request::top_finish, &ireq, std::placeholders::_1, std::placeholders::_2);
+			}
+
+			if (resolve)
+				finish = resolving(ireq.mailbox, finish);
+
+			ribosome::timer intersect_tm;
+			search_cursor_ptr cursor = std::make_shared<search_cursor>();
+			cursor->cursor = p.open(ireq.indexes, opts, result.cookie);
+			cursor->ireq = ireq_ptr;
+			cursor->lock_names.swap(lock_names);
+			cursor->finish = finish;
+
+			if (m_stream) {
+				stream_intersect(cursor->cursor, finish, locks, result);
+			} else {
+				result = cursor->cursor->next(result.cookie, result.max_number_of_documents, finish);
+			}
+			result.expansion_truncated = ireq.operators.truncated();
+
+			if (facets_failed)
+				result.facets_completed = false;
+
+			ILOG_INFO("url: %s: locks: %d: completed: %d, result keys: %d, requested num: %d, page start: %s: "
+					"intersection completed: duration: %d ms, whole duration: %d ms",
+					req.url().to_human_readable().c_str(),
+					ireq.indexes.size(), result.completed, result.docs.size(),
+					result.max_number_of_documents, base64_encode(result.cookie).c_str(),
+					intersect_tm.elapsed(), tm.elapsed());
+
+			return cursor;
+		}
+
+		std::chrono::steady_clock::time_point m_deadline = std::chrono::steady_clock::time_point::max();
+
+		// number of documents intersection sends in every streamed chunk
+		enum {
+			stream_batch = 64,
+		};
+
+		// runs intersection in batches and streams documents of every batch, @result.docs stays empty,
+		// the next batch is produced only after the previous one has been sent
+		//
+		// @locks are released while the batch is being sent and taken again in the same order,
+		// like between cursor pages (see @resume()), keys inserted into already loaded pages are not returned
+		void stream_intersect(const greylock::intersect::cursor_ptr &cursor, const finish_t &finish,
+				std::vector<std::unique_lock<locker<http_server>>> &locks, greylock::intersect::result &result) {
+			bool sent = true;
+			std::string cookie = result.cookie;
+
+			result = cursor->stream(cookie, result.max_number_of_documents, stream_batch, finish,
+					[&] (const greylock::intersect::result &batch) {
+						stream_docs(batch.docs);
+
+						for (auto it = locks.rbegin(); it != locks.rend(); ++it)
+							it->unlock();
+
+						sent = stream_wait();
+
+						for (auto &lk: locks)
+							lk.lock();
+						return sent;
+					});
+
+			// the rest of the page is returned by the next request starting from the cookie
+			if (!sent && !result.completed)
+				result.deadline_exceeded = true;
+		}
+
+		typedef greylock::intersect::intersector<greylock::bucket_transport> intersector_t;
+
+		// state of the single intersection, federated search runs intersections of several mailboxes
+		// of the same request concurrently, each of them has its own state
+		struct search_state {
+			search_state(const intersector_t &p) : p(p) {}
+
+			const intersector_t &p;
+
+			// bitmaps of the dense terms used in the query, they are loaded under index locks,
+			// their documents are read from the mailbox documents index @documents
+			// or looked up in the mailbox dictionary @dictionary, which is empty if it is not maintained
+			std::map<std::string, std::shared_ptr<const greylock::bitmap>> dense;
+			greylock::eurl documents;
+			greylock::eurl dictionary;
+		};
+
+		// dense term is read from its bitmap, other indexes from their trees, errors are thrown
+		greylock::posting_list_ptr open_postings(search_state &st, const greylock::eurl &iname,
+				const greylock::time_range &range) {
+			auto dense = st.dense.find(iname.str());
+			if (dense != st.dense.end()) {
+				return std::make_shared<greylock::bitmap_postings<greylock::bucket_transport>>(
+						*(server()->bucket()), dense->first, st.documents, dense->second,
+						range.start_key(), range, server()->compact_postings(), st.dictionary);
+			}
+
+			return st.p.postings(iname, range.start_key(), range);
+		}
+
+		// index which does not exist does not contain any document, it is not an error for operators,
+		// other errors fail the search, otherwise "$not" would not exclude documents it has to exclude
+		greylock::posting_list_ptr postings(search_state &st, const greylock::eurl &iname,
+				const greylock::time_range &range) {
+			try {
+				return open_postings(st, iname, range);
+			} catch (const greylock::index_not_found &e) {
+				ILOG_NOTICE("index: %s: could not open index, it is considered empty: %s",
+						iname.str().c_str(), e.what());
+				return std::make_shared<greylock::vector_postings>(iname.str(), std::vector<greylock::key>());
+			}
+		}
+
+		greylock::posting_list_ptr union_postings(search_state &st, const std::vector<greylock::query_node> &group,
+				const greylock::time_range &range) {
+			std::vector<greylock::posting_list_ptr> lists;
+			for (const auto &n: group) {
+				lists.emplace_back(postings(st, n, range));
+			}
+
+			return std::make_shared<greylock::union_postings>("$or", std::move(lists));
+		}
+
+		greylock::posting_list_ptr postings(search_state &st, const greylock::query_node &node,
+				const greylock::time_range &range) {
+			std::vector<greylock::posting_list_ptr> lists;
+			for (const auto &iname: node.indexes) {
+				lists.emplace_back(postings(st, iname, range));
+			}
+			if (!node.phrase.empty()) {
+				std::vector<greylock::posting_list_ptr> phrase;
+				for (const auto &iname: node.phrase) {
+					phrase.emplace_back(postings(st, iname, range));
+				}
+
+				lists.emplace_back(std::make_shared<greylock::phrase_postings>("$phrase",
+							std::move(phrase), node.offsets));
+			}
+			for (const auto &n: node.all) {
+				lists.emplace_back(postings(st, n, range));
+			}
+			for (const auto &group: node.any) {
+				lists.emplace_back(union_postings(st, group, range));
+			}
+
+			greylock::posting_list_ptr base;
+			if (lists.size() == 1) {
+				base = lists.front();
+			} else {
+				base = std::make_shared<greylock::intersection_postings>("$and", std::move(lists));
+			}
+
+			if (node.none.empty())
+				return weighted(base, node);
+
+			std::vector<greylock::posting_list_ptr> excludes;
+			for (const auto &n: node.none) {
+				excludes.emplace_back(postings(st, n, range));
+			}
+
+			base = std::make_shared<greylock::exclusion_postings>("$not", base, std::move(excludes));
+			return weighted(base, node);
+		}
+
+		greylock::posting_list_ptr weighted(const greylock::posting_list_ptr &list, const greylock::query_node &node) {
+			if (node.weight == 1)
+				return list;
+
+			return std::make_shared<greylock::weighted_postings>(list, node.weight);
+		}
+	};
+
+	struct on_index : public thevoid::simple_request_stream<http_server> {
+		void process_one_document(const thevoid::http_request &req, const std::string &mbox,
+				greylock::key &doc, const rapidjson::Value &idxs, const rapidjson::Value &numeric) {
+			ribosome::timer all_tm;
+			ribosome::timer tm;
+
+			ILOG_INFO("process_one_document: url: %s, mailbox: %s, doc: %s: start insertion",
+					req.url().to_human_readable().c_str(), mbox,
+					doc.str().c_str());
+
+			auto ireq = server()->get_indexes(mbox, idxs, true);
+			server()->add_word_pairs(ireq);
+
+			// every document is also put into the mailbox documents index, its number of keys
+			// is the number of unique documents in the mailbox, it is used for scoring,
+			// document number is assigned here, before the document is added into the dense terms
+			uint32_t docnum;
+			uint64_t num_documents;
+			bool new_document;
+			mailbox_state state;
+			{
+				greylock::eurl iname = server()->documents_index_url(mbox);
+
+				locker<http_server> l(server(), iname.str());
+				std::unique_lock<locker<http_server>> lk(l);
+
+				try {
+					greylock::read_write_index<greylock::bucket_transport> index(*(server()->bucket()), iname);
+
+					int err = server()->assign_document_number(mbox, index, doc, state, docnum);
+					if (err < 0) {
+						ILOG_ERROR("process_one_document: url: %s, mailbox: %s, "
+								"doc: %s, documents index: %s, error: %d: could not assign document number",
+							req.url().to_human_readable().c_str(), mbox,
+							doc.str().c_str(),
+							iname.str().c_str(),
+							err);
+						this->send_reply(swarm::http_response::internal_server_error);
+						return;
+					}
+
+					greylock::key dkey = doc;
+					dkey.positions.clear();
+					dkey.number = docnum;
+
+					uint64_t prev_documents = index.meta().num_keys;
+					err = index.insert(dkey);
+					if (err < 0) {
+						ILOG_ERROR("process_one_document: url: %s, mailbox: %s, "
+								"doc: %s, documents index: %s, error: %d: could not insert new key",
+							req.url().to_human_readable().c_str(), mbox,
+							doc.str().c_str(),
+							iname.str().c_str(),
+							err);
+						this->send_reply(swarm::http_response::internal_server_error);
+						return;
+					}
+
+					num_documents = index.meta().num_keys;
+					new_document = num_documents > prev_documents;
+
+					if (server()->dictionary_enabled()) {
+						greylock::document_dictionary<greylock::bucket_transport> dict(*(server()->bucket()),
+								server()->dictionary_url(mbox));
+
+						err = dict.insert(docnum, doc);
+						if (err < 0) {
+							ILOG_ERROR("process_one_document: url: %s, mailbox: %s, "
+									"doc: %s, number: %u, error: %d: could not insert document into dictionary",
+								req.url().to_human_readable().c_str(), mbox,
+								doc.str().c_str(), docnum,
+								err);
+							this->send_reply(swarm::http_response::internal_server_error);
+							return;
+						}
+					}
+				} catch (const std::exception &e) {
+					ILOG_ERROR("process_one_document: url: %s, mailbox: %s, "
+							"doc: %s, documents index: %s, exception: %s",
+						req.url().to_human_readable().c_str(), mbox,
+						doc.str().c_str(),
+						iname.str().c_str(),
+						e.what());
+					this->send_reply(swarm::http_response::internal_server_error);
+					return;
+				}
+
+				server()->retention_schedule(mbox, iname, http_server::retention_documents);
+			}
+
+			// key which is inserted into string and numeric indexes
+			greylock::key posting = server()->compact_postings() ? greylock::compact_key::encode(doc, docnum) : doc;
+
+			// indexes which have become dense after this document has been inserted
+			std::vector<size_t> convert;
+
+			for (size_t i = 0; i < ireq.indexes.size(); ++i) {
+				greylock::eurl &iname = ireq.indexes[i];
+				std::vector<size_t> &positions = ireq.positions[i];
+
+				// for every index we put vector of positions where given index is located in the document
+				// since it is an inverted index, it contains list of document links each of which contains
+				// array of the positions, where given index lives in the document
+				posting.positions.swap(positions);
+
+				locker<http_server> l(server(), iname.str());
+				std::unique_lock<locker<http_server>> lk(l);
+
+				try {
+					int err;
+					uint64_t num_keys = 0;
+					bool dense = state.is_dense(iname) || server()->dense_converted(iname);
+
+					if (dense) {
+						// dense term does not have index tree, only document number is added into its bitmap
+						greylock::dense_index<greylock::bucket_transport> index(*(server()->bucket()), iname);
+						err = index.load();
+						if (err == 0 || err == -ENOENT)
+							err = index.insert(docnum);
+					} else if (server()->time_partition_period() > 0) {
+						greylock::partitioned_index<greylock::bucket_transport> index(*(server()->bucket()), iname,
+								server()->time_partition_period(), false);
+						index.set_posting_format(server()->posting_format());
+						err = index.insert(posting);
+					} else {
+						greylock::read_write_index<greylock::bucket_transport> index(*(server()->bucket()), iname);
+						err = index.set_posting_format(server()->posting_format());
+						if (err == 0)
+							err = index.insert(posting);
+						num_keys = index.meta().num_keys;
+					}
+
+					if (err < 0) {
+						ILOG_ERROR("process_one_document: url: %s, mailbox: %s, "
+								"doc: %s, index: %s error: %d: could not insert new key",
+							req.url().to_human_readable().c_str(), mbox,
+							doc.str().c_str(),
+							iname.str().c_str(),
+							err);
+						this->send_reply(swarm::http_response::internal_server_error);
+						return;
+					}
+
+					// conversion locks the documents index before the term index, like search does,
+					// thus it runs after this index lock has been released
+					// derived indexes are never converted, their matching needs positions
+					if (!dense && i < ireq.derived_start &&
+							server()->dense_convertible(iname, num_keys, num_documents))
+						convert.push_back(i);
+
+					if (!dense)
+						server()->retention_schedule(mbox, iname, http_server::retention_tree);
+				} catch (const std::exception &e) {
+					ILOG_ERROR("process_one_document: url: %s, mailbox: %s, "
+							"doc: %s, index: %s, exception: %s",
+						req.url().to_human_readable().c_str(), mbox,
+						doc.str().c_str(),
+						iname.str().c_str(),
+						e.what());
+					this->send_reply(swarm::http_response::internal_server_error);
+					return;
+				}
+
+				ILOG_INFO("process_one_document: url: %s, mailbox: %s, "
+						"doc: %s, index: %s, elapsed time: %d ms",
+					req.url().to_human_readable().c_str(), mbox,
+					doc.str().c_str(),
+					iname.str().c_str(),
+					tm.restart());
+			}
+
+			// failed conversion is not an error, term stays in the index tree
+			for (size_t i: convert) {
+				const greylock::eurl &iname = ireq.indexes[i];
+
+				int err = server()->dense_convert(mbox, iname);
+				ILOG_INFO("process_one_document: url: %s, mailbox: %s, index: %s, documents: %llu, "
+						"error: %d, elapsed time: %d ms: dense term conversion",
+					req.url().to_human_readable().c_str(), mbox,
+					iname.str().c_str(),
+					(unsigned long long)num_documents,
+					err, tm.restart());
+			}
+
+			// new words are added into term dictionaries of their attributes
+			for (const auto &sa: ireq.attributes) {
+				std::vector<size_t> words;
+				for (size_t idx: sa.ivec) {
+					if (server()->term_unrecorded(ireq.indexes[idx]))
+						words.push_back(idx);
+				}
+
+				if (words.empty())
+					continue;
+
+				greylock::eurl dname = server()->term_dictionary_url(sa.aname);
+
+				locker<http_server> l(server(), dname.str());
+				std::unique_lock<locker<http_server>> lk(l);
+
+				try {
+					greylock::term_dictionary<greylock::bucket_transport> dict(*(server()->bucket()), dname, false);
+
+					for (size_t idx: words) {
+						const greylock::eurl &iname = ireq.indexes[idx];
+
+						int err = dict.insert(iname.key.substr(sa.aname.size()), iname);
+						if (err < 0) {
+							ILOG_ERROR("process_one_document: url: %s, mailbox: %s, "
+									"doc: %s, term dictionary: %s, index: %s, error: %d: could not insert new term",
+								req.url().to_human_readable().c_str(), mbox,
+								doc.str().c_str(),
+								dname.str().c_str(), iname.str().c_str(),
+								err);
+							server()->term_forget(iname);
+							this->send_reply(swarm::http_response::internal_server_error);
+							return;
+						}
+					}
+
+					server()->retention_schedule(mbox, dname, http_server::retention_dictionary);
+				} catch (const std::exception &e) {
+					ILOG_ERROR("process_one_document: url: %s, mailbox: %s, "
+							"doc: %s, term dictionary: %s, exception: %s",
+						req.url().to_human_readable().c_str(), mbox,
+						doc.str().c_str(),
+						dname.str().c_str(),
+						e.what());
+					for (size_t idx: words)
+						server()->term_forget(ireq.indexes[idx]);
+					this->send_reply(swarm::http_response::internal_server_error);
+					return;
+				}
+			}
+
+			// reindexed document does not change frequencies of the completions,
+			// failed snapshot update is not an error, it only affects suggestions
+			for (const auto &sa: ireq.attributes) {
+				if (!new_document)
+					break;
+
+				std::set<std::string> words;
+				for (size_t idx: sa.ivec)
+					words.insert(ireq.indexes[idx].key.substr(sa.aname.size()));
+
+				int err = server()->suggest_add(sa.aname, std::vector<std::string>(words.begin(), words.end()));
+				if (err < 0) {
+					ILOG_ERROR("process_one_document: url: %s, mailbox: %s, doc: %s, attribute: %s, error: %d: "
+							"could not update completion snapshot",
+						req.url().to_human_readable().c_str(), mbox,
+						doc.str().c_str(), sa.aname.c_str(), err);
+				}
+			}
+
+			if (numeric.IsObject()) {
+				for (auto it = numeric.MemberBegin(), end = numeric.MemberEnd(); it != end; ++it) {
+					const char *aname = it->name.GetString();
+					if (!it->value.IsInt64()) {
+						ILOG_ERROR("process_one_document: url: %s, mailbox: %s, doc: %s, attribute: %s, error: %d: "
+								"numeric attribute must be integer",
+							req.url().to_human_readable().c_str(), mbox,
+							doc.str().c_str(), aname, -EINVAL);
+						continue;
+					}
+
+					greylock::eurl iname = server()->numeric_index_url(mbox, aname);
+					int64_t value = it->value.GetInt64();
+
+					locker<http_server> l(server(), iname.str());
+					std::unique_lock<locker<http_server>> lk(l);
+
+					try {
+						greylock::numeric_index<greylock::bucket_transport> index(*(server()->bucket()), iname, false);
+
+						int err = index.set_posting_format(server()->posting_format());
+						if (err == 0)
+							err = index.insert(value, posting);
+						if (err < 0) {
+							ILOG_ERROR("process_one_document: url: %s, mailbox: %s, "
+									"doc: %s, numeric index: %s, value: %ld, error: %d: could not insert new key",
+								req.url().to_human_readable().c_str(), mbox,
+								doc.str().c_str(),
+								iname.str().c_str(), value,
+								err);
+							this->send_reply(swarm::http_response::internal_server_error);
+							return;
+						}
+
+						server()->retention_schedule(mbox, iname, http_server::retention_numeric);
+					} catch (const std::exception &e) {
+						ILOG_ERROR("process_one_document: url: %s, mailbox: %s, "
+								"doc: %s, numeric index: %s, exception: %s",
+							req.url().to_human_readable().c_str(), mbox,
+							doc.str().c_str(),
+							iname.str().c_str(),
+							e.what());
+						this->send_reply(swarm::http_response::internal_server_error);
+						return;
+					}
+				}
+			}
+
+			ILOG_INFO("process_one_document: url: %s, mailbox: %s, doc: %s, total number of indexes: %d, elapsed time: %d ms",
+					req.url().to_human_readable().c_str(), mbox,
+					doc.str().c_str(), ireq.indexes.size(), all_tm.elapsed());
+		}
+
+		void parse_docs(const thevoid::http_request &req, const std::string &mbox, const rapidjson::Value &docs) {
+			for (auto it = docs.Begin(), id_end = docs.End(); it != id_end; ++it) {
+				if (it->IsObject()) {
+					greylock::key doc;
+
+					const char *id = greylock::get_string(*it, "id");
+					const char *bucket = greylock::get_string(*it, "bucket");
+					const char *key = greylock::get_string(*it, "key");
+					if (!bucket || !key || !id) {
+						ILOG_ERROR("parse_docs: url: %s, mailbox: %s, error: %d: 'docs/{bucket,ket,id} must be strings",
+								req.url().to_human_readable().c_str(), mbox, -EINVAL);
+						continue;
+					}
+
+					struct timespec ts;
+					clock_gettime(CLOCK_REALTIME, &ts);
+
+					const rapidjson::Value &timestamp = greylock::get_object(*it, "timestamp");
+					if (timestamp.IsObject()) {
+						long tsec, tnsec;
+
+						tsec = greylock::get_int64(timestamp, "tsec", ts.tv_sec);
+						tnsec = greylock::get_int64(timestamp, "tnsec", ts.tv_nsec);
+
+						doc.set_timestamp(tsec, tnsec);
+					} else {
+						doc.set_timestamp(ts.tv_sec, ts.tv_nsec);
+					}
+
+					doc.url.bucket.assign(bucket);
+					doc.url.key.assign(key);
+					doc.id.assign(id);
+
+					const rapidjson::Value &idxs = greylock::get_object(*it, "index");
+					if (!idxs.IsObject()) {
+						ILOG_ERROR("parse_docs: url: %s, mailbox: %s, doc: %s, error: %d: 'docs/index' must be object",
+								req.url().to_human_readable().c_str(), mbox, doc.str().c_str(), -EINVAL);
+						continue;
+					}
+
+					process_one_document(req, mbox, doc, idxs, greylock::get_object(*it, "numeric"));
+				}
+			}
+		}
+
+		virtual void on_request(const thevoid::http_request &req, const boost::asio::const_buffer &buffer) {
+			ribosome::timer index_tm;
+			ILOG_INFO("url: %s: start", req.url().to_human_readable().c_str());
+
+			// this is needed to put ending zero-byte, otherwise rapidjson parser will explode
+			std::string data(const_cast<char *>(boost::asio::buffer_cast<const char*>(buffer)), boost::asio::buffer_size(buffer));
+
+			rapidjson::Document doc;
+			doc.Parse<0>(data.c_str());
+
+			if (doc.HasParseError()) {
+				ILOG_ERROR("on_request: url: %s, error: %d: could not parse document: %s, error offset: %d",
+						req.url().to_human_readable().c_str(), -EINVAL, doc.GetParseError(), doc.GetErrorOffset());
+				this->send_reply(swarm::http_response::bad_request);
+				return;
+			}
+
+			if (!doc.IsObject()) {
+				ILOG_ERROR("on_request: url: %s, error: %d: document must be object, its type: %d",
+						req.url().to_human_readable().c_str(), -EINVAL, doc.GetType());
+				this->send_reply(swarm::http_response::bad_request);
+				return;
+			}
+
+			const char *mbox = greylock::get_string(doc, "mailbox");
+			if (!mbox) {
+				ILOG_ERROR("on_request: url: %s, error: %d: 'mailbox' must be a string",
+						req.url().to_human_readable().c_str(), -EINVAL);
+				this->send_reply(swarm::http_response::bad_request);
+				return;
+			}
+
+			const rapidjson::Value &docs = greylock::get_array(doc, "docs");
+			if (!docs.IsArray()) {
+				ILOG_ERROR("on_request: url: %s, mailbox: %s, error: %d: 'docs' must be array",
+						req.url().to_human_readable().c_str(), mbox, -EINVAL);
+				this->send_reply(swarm::http_response::bad_request);
+				return;
+			}
+
+			parse_docs(req, mbox, docs);
+
+			ILOG_INFO("on_request: url: %s, mailbox: %s, keys: %d: insertion completed, index duration: %d ms",
+					req.url().to_human_readable().c_str(), mbox, docs.Size(), index_tm.elapsed());
+			this->send_reply(thevoid::http_response::ok);
+		}
+	};
+
+	std::shared_ptr<greylock::bucket_transport> bucket() {
+		return m_bucket;
+	}
+
+	void lock(const std::string &key) {
+		m_lock.lock(key);
+	}
+
+	void unlock(const std::string &key) {
+		m_lock.unlock(key);
+	}
+
+	const std::string &meta_bucket_name() const {
+		return m_meta_bucket;
+	}
+
+	long time_partition_period() const {
+		return m_time_partition_period;
+	}
+
+	long retention_max_age() const {
+		return m_retention_max_age;
+	}
+
+	// how retention thread expires keys of the registered index
+	enum retention_kind {
+		// string index, time-partitioned if @m_time_partition_period is set
+		retention_tree = 0,
+		// mailbox documents index, it never uses time-partitioned layout
+		retention_documents,
+		// numeric index, see @greylock::numeric_index::expire()
+		retention_numeric,
+		// term dictionary, words whose indexes have become empty are removed
+		retention_dictionary,
+	};
+
+	// adds index into the retention registry of the mailbox, it will be processed by every retention pass,
+	// called under the lock of the index
+	//
+	// registry is the index tree (like the term dictionary) whose key ids are the names of the indexes,
+	// @key.url is the index url and the first position is @retention_kind,
+	// mailboxes which have registries are listed in the same way in @retention_mailboxes_url()
+	void retention_schedule(const std::string &mbox, const greylock::eurl &iname, retention_kind kind) {
+		if (m_retention_max_age <= 0)
+			return;
+
+		// every index is registered by this server only once, set of registered indexes is dropped
+		// when it grows too large, since registering index again only rewrites its registry key
+		{
+			std::unique_lock<std::mutex> guard(m_retention_lock);
+			if (m_retention_registered.size() >= m_retention_registered_max)
+				m_retention_registered.clear();
+
+			if (!m_retention_registered.insert(iname.str()).second)
+				return;
+		}
+
+		greylock::key k;
+		k.id = iname.str();
+		k.url = iname;
+		k.positions.push_back(kind);
+
+		int err = retention_register(retention_registry_url(mbox), k);
+		if (err == 0) {
+			greylock::key mk;
+			mk.id = mbox;
+			mk.url = retention_registry_url(mbox);
+
+			err = retention_register(retention_mailboxes_url(), mk);
+		}
+
+		if (err < 0) {
+			ILOG_ERROR("retention: mailbox: %s, index: %s, error: %d: could not register index",
+					mbox.c_str(), iname.str().c_str(), err);
+
+			std::unique_lock<std::mutex> guard(m_retention_lock);
+			m_retention_registered.erase(iname.str());
+		}
+	}
+
+	// stores cursor for the next page request and returns its opaque id,
+	// empty id is returned if cursors are disabled or cursor does not fit into memory limit
+	std::string cursor_put(const search_cursor_ptr &cursor) {
+		if (m_cursor_ttl <= 0)
+			return std::string();
+
+		cursor->memory = cursor->cursor->memory();
+		if (cursor->memory > m_cursor_max_memory)
+			return std::string();
+
+		auto now = std::chrono::steady_clock::now();
+		cursor->expires = now + std::chrono::seconds(m_cursor_ttl);
+
+		std::unique_lock<std::mutex> guard(m_cursors_lock);
+		cursor_expire(now);
+
+		// cursors which were not used for the longest time are evicted first
+		while (m_cursors_memory + cursor->memory > m_cursor_max_memory) {
+			auto oldest = std::min_element(m_cursors.begin(), m_cursors.end(),
+					[] (const std::pair<const std::string, search_cursor_ptr> &c1,
+						const std::pair<const std::string, search_cursor_ptr> &c2) {
+						return c1.second->expires < c2.second->expires;
+					});
+			cursor_erase(oldest);
+		}
+
+		char id[33];
+		snprintf(id, sizeof(id), "%016llx%016llx",
+				(unsigned long long)m_cursor_rng(), (unsigned long long)m_cursor_rng());
+
+		m_cursors[id] = cursor;
+		m_cursors_memory += cursor->memory;
+		return id;
+	}
+
+	// removes cursor from the cache and returns it, cursor belongs to the single request until it is put back,
+	// cursor of the other mailbox is never returned
+	search_cursor_ptr cursor_take(const std::string &id, const std::string &mbox) {
+		std::unique_lock<std::mutex> guard(m_cursors_lock);
+		cursor_expire(std::chrono::steady_clock::now());
+
+		auto it = m_cursors.find(id);
+		if (it == m_cursors.end() || it->second->ireq->mailbox != mbox)
+			return search_cursor_ptr();
+
+		search_cursor_ptr cursor = it->second;
+		cursor_erase(it);
+		return cursor;
+	}
+
+	// if @with_ngrams is set, n-gram indexes of the attributes listed in @m_ngram_attributes are added
+	// after word indexes, this is only needed at ingest, substring queries are parsed by @get_query_operators()
+	greylock::indexes_request get_indexes(const std::string &mbox, const rapidjson::Value &idxs, bool with_ngrams = false) {
+		greylock::indexes_request ireq;
+		ireq.mailbox = mbox;
+
+		if (!idxs.IsObject())
+			return ireq;
+
+		ribosome::split spl;
+		for (rapidjson::Value::ConstMemberIterator it = idxs.MemberBegin(), idxs_end = idxs.MemberEnd(); it != idxs_end; ++it) {
+			const char *aname = it->name.GetString();
+			const rapidjson::Value &avalue = it->value;
+
+			if (!avalue.IsString())
+				continue;
+
+			greylock::single_attribute sa;
+			sa.aname = index_name(mbox, aname, "");
+
+			std::vector<ribosome::lstring> indexes = spl.convert_split_words(avalue.GetString(), avalue.GetStringLength());
+			for (size_t pos = 0; pos < indexes.size(); ++pos) {
+				greylock::eurl url;
+				url.bucket = meta_bucket_name();
+				url.key = index_name(mbox, aname, ribosome::lconvert::to_string(indexes[pos]));
+
+				auto f = std::find(ireq.indexes.begin(), ireq.indexes.end(), url);
+				if (f == ireq.indexes.end()) {
+					std::vector<size_t> v;
+					v.push_back(pos);
+					ireq.positions.push_back(v);
+					ireq.indexes.push_back(url);
+
+					sa.ivec.push_back(ireq.indexes.size() - 1);
+				} else {
+					size_t idx = std::distance(ireq.indexes.begin(), f);
+					ireq.positions[idx].push_back(pos);
+					sa.ivec.push_back(idx);
+				}
+			}
+
+			ireq.attributes.push_back(sa);
+		}
+
+		ireq.derived_start = ireq.indexes.size();
+		if (!with_ngrams)
+			return ireq;
+
+		for (auto it = idxs.MemberBegin(), idxs_end = idxs.MemberEnd(); it != idxs_end; ++it) {
+			const char *aname = it->name.GetString();
+			if (!it->value.IsString() || !m_ngram_attributes.count(aname))
+				continue;
+
+			std::vector<std::string> grams = ngrams(std::string(it->value.GetString(), it->value.GetStringLength()));
+			for (size_t pos = 0; pos < grams.size(); ++pos) {
+				greylock::eurl url = ngram_index_url(mbox, aname, grams[pos]);
+
+				auto f = std::find(ireq.indexes.begin() + ireq.derived_start, ireq.indexes.end(), url);
+				if (f == ireq.indexes.end()) {
+					ireq.positions.push_back(std::vector<size_t>(1, pos));
+					ireq.indexes.push_back(url);
+				} else {
+					ireq.positions[std::distance(ireq.indexes.begin(), f)].push_back(pos);
+				}
+			}
+		}
+
+		return ireq;
+	}
+
+	enum {
+		ngram_size = 3,
+	};
+
+	// n-grams of the text: it is lowercased like the tokenizer does (see @get_indexes()) and split into characters,
+	// runs of whitespace are collapsed into a single space, n-gram at position i starts at character i
+	std::vector<std::string> ngrams(const std::string &text) {
+		ribosome::lstring ltext = ribosome::lconvert::to_lower(ribosome::lconvert::from_utf8(text));
+
+		std::vector<std::string> chars;
+		for (const auto &l: ltext) {
+			std::string ch = ribosome::lconvert::to_string(ribosome::lstring(1, l));
+
+			if (ch.size() == 1 && isspace((unsigned char)ch[0])) {
+				if (chars.empty() || chars.back() == " ")
+					continue;
+				ch = " ";
+			}
+
+			chars.emplace_back(std::move(ch));
+		}
+
+		if (!chars.empty() && chars.back() == " ")
+			chars.pop_back();
+
+		std::vector<std::string> ret;
+		for (size_t i = 0; i + ngram_size <= chars.size(); ++i) {
+			std::string gram;
+			for (size_t j = 0; j < ngram_size; ++j)
+				gram += chars[i + j];
+
+			ret.emplace_back(std::move(gram));
+		}
+
+		return ret;
+	}
+
+	// adds index of every pair of adjacent words of the attribute at least one of which is in @m_pair_words,
+	// pair is present at the position of its first word
+	void add_word_pairs(greylock::indexes_request &ireq) {
+		if (m_pair_words.empty())
+			return;
+
+		for (const auto &sa: ireq.attributes) {
+			for (size_t pos = 0; pos + 1 < sa.ivec.size(); ++pos) {
+				std::string first = ireq.indexes[sa.ivec[pos]].key.substr(sa.aname.size());
+				std::string second = ireq.indexes[sa.ivec[pos + 1]].key.substr(sa.aname.size());
+				if (!m_pair_words.count(first) && !m_pair_words.count(second))
+					continue;
+
+				greylock::eurl url = pair_index_url(sa.aname, first, second);
+
+				auto f = std::find(ireq.indexes.begin() + ireq.derived_start, ireq.indexes.end(), url);
+				if (f == ireq.indexes.end()) {
+					ireq.positions.push_back(std::vector<size_t>(1, pos));
+					ireq.indexes.push_back(url);
+				} else {
+					ireq.positions[std::distance(ireq.indexes.begin(), f)].push_back(pos);
+				}
+			}
+		}
+	}
+
+	// index of the word pair, @attribute_prefix is the @index_name() of the attribute with empty word
+	greylock::eurl pair_index_url(const std::string &attribute_prefix, const std::string &first, const std::string &second) {
+		greylock::eurl url;
+		url.bucket = meta_bucket_name();
+		url.key = attribute_prefix + "#2." + first + " " + second;
+		return url;
+	}
+
+	greylock::eurl ngram_index_url(const std::string &mbox, const std::string &aname, const std::string &gram) {
+		greylock::eurl url;
+		url.bucket = meta_bucket_name();
+		url.key = index_name(mbox, aname, "#" + elliptics::lexical_cast(ngram_size) + "." + gram);
+		return url;
+	}
+
+	// substring is covered by non-overlapping n-grams and the last one, they must be present in the document
+	// at the same offsets as in the substring, thus every character is checked and n-gram lists are intersected
+	// without reading documents
+	//
+	// @query_error is thrown if the attribute is not listed in @m_ngram_attributes, it does not have n-gram indexes,
+	// or if substring is shorter than n-gram
+	greylock::query_node substring_node(const std::string &mbox, const std::string &aname, const std::string &substring) {
+		if (!m_ngram_attributes.count(aname)) {
+			throw query_error("mailbox: " + mbox + ", attribute: " + aname +
+					": substring search requires attribute to be listed in 'ngram-attributes'");
+		}
+
+		std::vector<std::string> grams = ngrams(substring);
+		if (grams.empty()) {
+			throw query_error("mailbox: " + mbox + ", attribute: " + aname + ", substring: " + substring +
+					": substring must contain at least " + std::to_string((int)ngram_size) + " characters");
+		}
+
+		greylock::query_node node;
+
+		for (size_t pos = 0; pos < grams.size(); pos += ngram_size) {
+			node.phrase.push_back(ngram_index_url(mbox, aname, grams[pos]));
+			node.offsets.push_back(pos);
+		}
+
+		if (node.offsets.back() != grams.size() - 1) {
+			node.phrase.push_back(ngram_index_url(mbox, aname, grams.back()));
+			node.offsets.push_back(grams.size() - 1);
+		}
+
+		return node;
+	}
+
+	// parses query operators into @node:
+	// "$and": [query, ...] - document must match every query
+	// "$or": [query, ...] - document must match at least one query
+	// "$not": query or [query, ...] - document must not match any query
+	//
+	// every query is an object of the same format as the top-level search query,
+	// string members are words which must be present in the document, operators may be nested
+	void get_query_operators(const std::string &mbox, const rapidjson::Value &query, greylock::query_node &node) {
+		if (!query.IsObject())
+			return;
+
+		auto parse = [&] (const rapidjson::Value &sub) {
+			greylock::query_node n;
+			n.indexes = get_indexes(mbox, sub).indexes;
+			get_query_operators(mbox, sub, n);
+			return n;
+		};
+
+		auto parse_array = [&] (const rapidjson::Value &v) {
+			std::vector<greylock::query_node> ret;
+			if (v.IsObject()) {
+				ret.emplace_back(parse(v));
+			} else if (v.IsArray()) {
+				for (auto it = v.Begin(), end = v.End(); it != end; ++it) {
+					if (it->IsObject())
+						ret.emplace_back(parse(*it));
+				}
+			}
+
+			return ret;
+		};
+
+		std::vector<greylock::query_node> all = parse_array(greylock::get_array(query, "$and"));
+		node.all.insert(node.all.end(), all.begin(), all.end());
+
+		std::vector<greylock::query_node> any = parse_array(greylock::get_array(query, "$or"));
+		if (!any.empty())
+			node.any.emplace_back(std::move(any));
+
+		if (query.HasMember("$not")) {
+			std::vector<greylock::query_node> none = parse_array(query["$not"]);
+			node.none.insert(node.none.end(), none.begin(), none.end());
+		}
+
+		// "$substring": {"attribute": substring or [substring, ...]} - attribute text of the document must contain
+		// every substring, attribute must be listed in "ngram-attributes" server option, see @substring_node()
+		const rapidjson::Value &substring = greylock::get_object(query, "$substring");
+		if (substring.IsObject()) {
+			for (auto it = substring.MemberBegin(), end = substring.MemberEnd(); it != end; ++it) {
+				const char *aname = it->name.GetString();
+
+				if (it->value.IsString()) {
+					node.all.emplace_back(substring_node(mbox, aname, it->value.GetString()));
+				} else if (it->value.IsArray()) {
+					for (auto v = it->value.Begin(), vend = it->value.End(); v != vend; ++v) {
+						if (v->IsString())
+							node.all.emplace_back(substring_node(mbox, aname, v->GetString()));
+					}
+				}
+			}
+		}
+
+		// "$fuzzy": {"attribute": word or {"word": word, "distance": number} or [...]} - document must contain
+		// at least one word of the attribute close enough to every word, see @expand_fuzzy()
+		const rapidjson::Value &fuzzy = greylock::get_object(query, "$fuzzy");
+		if (fuzzy.IsObject()) {
+			auto parse_fuzzy = [&] (const char *aname, const rapidjson::Value &v) {
+				if (v.IsString()) {
+					node.any.emplace_back(expand_fuzzy(mbox, aname, v.GetString(), -1, node.expansion_truncated));
+				} else if (v.IsObject()) {
+					const char *word = greylock::get_string(v, "word");
+					if (word)
+						node.any.emplace_back(expand_fuzzy(mbox, aname, word,
+									greylock::get_int64(v, "distance", -1), node.expansion_truncated));
+				}
+			};
+
+			for (auto it = fuzzy.MemberBegin(), end = fuzzy.MemberEnd(); it != end; ++it) {
+				if (it->value.IsArray()) {
+					for (auto w = it->value.Begin(), wend = it->value.End(); w != wend; ++w)
+						parse_fuzzy(it->name.GetString(), *w);
+				} else {
+					parse_fuzzy(it->name.GetString(), it->value);
+				}
+			}
+		}
+
+		// "$wildcard": {"attribute": pattern or [pattern, ...]} - document must contain at least one word
+		// of the attribute matching every pattern, see @expand_pattern()
+		const rapidjson::Value &wildcard = greylock::get_object(query, "$wildcard");
+		if (!wildcard.IsObject())
+			return;
+
+		for (auto it = wildcard.MemberBegin(), end = wildcard.MemberEnd(); it != end; ++it) {
+			const char *aname = it->name.GetString();
+
+			if (it->value.IsString()) {
+				node.any.emplace_back(expand_pattern(mbox, aname, it->value.GetString(), node.expansion_truncated));
+			} else if (it->value.IsArray()) {
+				for (auto p = it->value.Begin(), pend = it->value.End(); p != pend; ++p) {
+					if (p->IsString())
+						node.any.emplace_back(expand_pattern(mbox, aname, p->GetString(),
+									node.expansion_truncated));
+				}
+			}
+		}
+	}
+
+	// pattern is normalized like indexed text, every its literal part must be a single word,
+	// '*' and '?' wildcards are kept as is
+	bool normalize_pattern(const std::string &pattern, std::string &ret) {
+		ribosome::split spl;
+		ret.clear();
+
+		size_t pos = 0;
+		while (pos < pattern.size()) {
+			size_t wc = pattern.find_first_of("*?", pos);
+			std::string literal = pattern.substr(pos, wc == std::string::npos ? std::string::npos : wc - pos);
+
+			if (!literal.empty()) {
+				std::vector<ribosome::lstring> words = spl.convert_split_words(literal.data(), literal.size());
+				if (words.size() != 1)
+					return false;
+
+				ret += ribosome::lconvert::to_string(words[0]);
+			}
+
+			if (wc == std::string::npos)
+				break;
+
+			ret.push_back(pattern[wc]);
+			pos = wc + 1;
+		}
+
+		return !ret.empty();
+	}
+
+	// returns a node for every word of the attribute which matches @pattern, at most @m_wildcard_max_terms words,
+	// @truncated is set if pattern matches more words, pattern which does not match any word produces
+	// empty group, which matches nothing, @query_error is thrown if pattern is invalid
+	std::vector<greylock::query_node> expand_pattern(const std::string &mbox, const std::string &aname, const std::string &pattern,
+			bool &truncated) {
+		std::vector<greylock::query_node> ret;
+
+		std::string normalized;
+		if (!normalize_pattern(pattern, normalized))
+			throw query_error("mailbox: " + mbox + ", attribute: " + aname + ", pattern: " + pattern +
+					": invalid wildcard pattern");
+
+		greylock::eurl dname = term_dictionary_url(index_name(mbox, aname, ""));
+
+		lock(dname.str());
+		try {
+			greylock::term_dictionary<greylock::bucket_transport> dict(*m_bucket, dname, true);
+
+			bool limited;
+			std::vector<greylock::key> terms = dict.expand(normalized, m_wildcard_max_terms, limited);
+			for (const auto &t: terms) {
+				greylock::query_node n;
+				n.indexes.push_back(t.url);
+				ret.emplace_back(std::move(n));
+			}
+			truncated |= limited;
+
+			ILOG_INFO("mailbox: %s, attribute: %s, pattern: %s: expanded into %zd terms, truncated: %d",
+					mbox.c_str(), aname.c_str(), normalized.c_str(), ret.size(), limited);
+		} catch (const std::exception &e) {
+			ILOG_NOTICE("mailbox: %s, attribute: %s, pattern: %s: could not open term dictionary, "
+					"no terms match: %s",
+					mbox.c_str(), aname.c_str(), normalized.c_str(), e.what());
+		}
+		unlock(dname.str());
+
+		return ret;
+	}
+
+	enum {
+		fuzzy_max_distance = 2,
+	};
+
+	// returns a node for every word of the attribute within edit distance @distance of @word,
+	// the closest @m_wildcard_max_terms words are used, @truncated is set if there are more of them,
+	// documents of the word at distance d weigh 1 / (1 + d), @query_error is thrown if @word is not a single word
+	//
+	// negative @distance selects it by the word length: short words must match exactly,
+	// distance is never greater than @fuzzy_max_distance, larger distances match too many words
+	std::vector<greylock::query_node> expand_fuzzy(const std::string &mbox, const std::string &aname, const std::string &word,
+			int distance, bool &truncated) {
+		std::vector<greylock::query_node> ret;
+
+		std::string normalized;
+		if (!normalize_pattern(word, normalized) || normalized.find_first_of("*?") != std::string::npos)
+			throw query_error("mailbox: " + mbox + ", attribute: " + aname + ", word: " + word +
+					": invalid fuzzy word");
+
+		if (distance < 0) {
+			size_t len = std::count_if(normalized.begin(), normalized.end(), [] (char ch) {
+						return ((unsigned char)ch & 0xc0) != 0x80;
+					});
+			distance = len <= 2 ? 0 : (len <= 5 ? 1 : 2);
+		}
+		distance = std::min<int>(distance, fuzzy_max_distance);
+
+		greylock::eurl dname = term_dictionary_url(index_name(mbox, aname, ""));
+
+		lock(dname.str());
+		try {
+			greylock::term_dictionary<greylock::bucket_transport> dict(*m_bucket, dname, true);
+
+			bool limited;
+			auto terms = dict.fuzzy(normalized, distance, m_wildcard_max_terms, limited);
+			for (const auto &t: terms) {
+				greylock::query_node n;
+				n.indexes.push_back(t.first.url);
+				n.weight = 1.0 / (1 + t.second);
+				ret.emplace_back(std::move(n));
+			}
+			truncated |= limited;
+
+			ILOG_INFO("mailbox: %s, attribute: %s, word: %s, distance: %d: expanded into %zd terms, truncated: %d",
+					mbox.c_str(), aname.c_str(), normalized.c_str(), distance, ret.size(), limited);
+		} catch (const std::exception &e) {
+			ILOG_NOTICE("mailbox: %s, attribute: %s, word: %s: could not open term dictionary, "
+					"no terms match: %s",
+					mbox.c_str(), aname.c_str(), normalized.c_str(), e.what());
+		}
+		unlock(dname.str());
+
+		return ret;
+	}
+
+	// term dictionary of the attribute, @attribute_prefix is the @index_name() of the attribute with empty word
+	greylock::eurl term_dictionary_url(const std::string &attribute_prefix) {
+		greylock::eurl url;
+		url.bucket = meta_bucket_name();
+		url.key = attribute_prefix + "#terms";
+		return url;
+	}
+
+	// returns true if word @iname has not been added into its term dictionary by this server yet
+	// and marks it as added, set of added words is dropped when it grows too large,
+	// since adding the word again only rewrites its dictionary key
+	bool term_unrecorded(const greylock::eurl &iname) {
+		std::unique_lock<std::mutex> guard(m_terms_lock);
+		if (m_terms_recorded.size() >= m_terms_recorded_max)
+			m_terms_recorded.clear();
+
+		return m_terms_recorded.insert(iname.str()).second;
+	}
+
+	void term_forget(const greylock::eurl &iname) {
+		std::unique_lock<std::mutex> guard(m_terms_lock);
+		m_terms_recorded.erase(iname.str());
+	}
+
+	// completion snapshot of the attribute, @attribute_prefix is the @index_name() of the attribute with empty word
+	greylock::eurl suggest_url(const std::string &attribute_prefix) {
+		greylock::eurl url;
+		url.bucket = meta_bucket_name();
+		url.key = attribute_prefix + "#suggest";
+		return url;
+	}
+
+	// adds one document to the frequencies of @words, they must be unique words of the attribute,
+	// snapshot is written back every @m_suggest_flush_documents documents
+	int suggest_add(const std::string &attribute_prefix, const std::vector<std::string> &words) {
+		suggest_entry_ptr e = suggest_get(attribute_prefix);
+
+		std::unique_lock<std::mutex> guard(e->lock);
+		int err = suggest_load(attribute_prefix, *e);
+		if (err < 0)
+			return err;
+
+		for (const auto &w: words) {
+			e->snapshot.add(w, 1);
+			e->added[w]++;
+		}
+		e->dirty++;
+
+		if (e->dirty >= m_suggest_flush_documents || e->evicted)
+			return suggest_flush(attribute_prefix, *e);
+
+		return 0;
+	}
+
+	int suggest_complete(const std::string &attribute_prefix, const std::string &prefix, size_t num,
+			std::vector<greylock::completion_snapshot::entry> &ret) {
+		suggest_entry_ptr e = suggest_get(attribute_prefix);
+
+		std::unique_lock<std::mutex> guard(e->lock);
+		int err = suggest_load(attribute_prefix, *e);
+		if (err < 0)
+			return err;
+
+		err = suggest_resolve(attribute_prefix, prefix, *e);
+		if (err < 0)
+			return err;
+
+		ret = e->snapshot.complete(prefix, num);
+		return 0;
+	}
+
+	void suggest_stat(size_t &snapshots, size_t &memory) {
+		std::unique_lock<std::mutex> guard(m_suggest_lock);
+
+		snapshots = m_suggest.size();
+		memory = 0;
+		for (auto &p: m_suggest) {
+			std::unique_lock<std::mutex> eguard(p.second->lock);
+			memory += p.second->snapshot.memory();
+		}
+	}
+
+	// parses "facets" search object: {"buckets": true, "attributes": {"attribute": ["value", ...]}}
+	// values are normalized like query words, value with wildcards (see @expand_pattern()) and empty array
+	// select words of the attribute from its term dictionary, at most @m_wildcard_max_terms words per value
+	//
+	// compact postings do not contain document urls, buckets can not be counted in this case,
+	// @query_error is thrown if they are requested
+	void get_facets(const std::string &mbox, const rapidjson::Value &facets, greylock::indexes_request &ireq) {
+		if (!facets.IsObject())
+			return;
+
+		if (greylock::get_bool(facets, "buckets", false)) {
+			if (m_compact_postings)
+				throw query_error("mailbox: " + mbox + ": bucket facets are not supported with compact postings");
+
+			ireq.facet_buckets = true;
+		}
+
+		const rapidjson::Value &attributes = greylock::get_object(facets, "attributes");
+		if (!attributes.IsObject())
+			return;
+
+		auto add = [&] (const std::string &aname, const std::string &value, const greylock::eurl &url) {
+			for (const auto &f: ireq.facets) {
+				if (f.url == url)
+					return;
+			}
+
+			greylock::indexes_request::facet f;
+			f.attribute = aname;
+			f.value = value;
+			f.url = url;
+			ireq.facets.emplace_back(std::move(f));
+		};
+
+		for (auto it = attributes.MemberBegin(), end = attributes.MemberEnd(); it != end; ++it) {
+			const char *aname = it->name.GetString();
+			if (!it->value.IsArray())
+				continue;
+
+			std::vector<std::string> values;
+			for (auto v = it->value.Begin(), vend = it->value.End(); v != vend; ++v) {
+				if (v->IsString())
+					values.emplace_back(v->GetString());
+			}
+			if (it->value.Size() == 0)
+				values.emplace_back("*");
+
+			for (const auto &value: values) {
+				std::string normalized;
+				if (!normalize_pattern(value, normalized)) {
+					ILOG_ERROR("mailbox: %s, attribute: %s, value: %s: invalid facet value",
+							mbox.c_str(), aname, value.c_str());
+					continue;
+				}
+
+				if (normalized.find_first_of("*?") == std::string::npos) {
+					greylock::eurl url;
+					url.bucket = meta_bucket_name();
+					url.key = index_name(mbox, aname, normalized);
+					add(aname, normalized, url);
+					continue;
+				}
+
+				greylock::eurl dname = term_dictionary_url(index_name(mbox, aname, ""));
+
+				lock(dname.str());
+				try {
+					greylock::term_dictionary<greylock::bucket_transport> dict(*m_bucket, dname, true);
+
+					bool truncated;
+					std::vector<greylock::key> terms = dict.expand(normalized, m_wildcard_max_terms, truncated);
+					for (const auto &t: terms)
+						add(aname, t.id, t.url);
+
+					ILOG_INFO("mailbox: %s, attribute: %s, facet value: %s: expanded into %zd terms, truncated: %d",
+							mbox.c_str(), aname, normalized.c_str(), terms.size(), truncated);
+				} catch (const std::exception &e) {
+					ILOG_NOTICE("mailbox: %s, attribute: %s, facet value: %s: could not open term dictionary, "
+							"no terms match: %s",
+							mbox.c_str(), aname, normalized.c_str(), e.what());
+				}
+				unlock(dname.str());
+			}
+		}
+	}
+
+	// parses "match" search object: {"type": "and" | "phrase" | "proximity", "distance": number}
+	// "and" is the default, every document which contains all words matches
+	// "phrase" requires words of every attribute to be present in the document in the query order without gaps
+	// "proximity" requires words of every attribute to be present within window of "distance" positions
+	void get_phrase_match(const rapidjson::Value &match, greylock::indexes_request &ireq) {
+		if (!match.IsObject())
+			return;
+
+		const char *type = greylock::get_string(match, "type", "and");
+		if (!strcmp(type, "phrase")) {
+			ireq.phrase.type = greylock::intersect::phrase_match::match_phrase;
+		} else if (!strcmp(type, "proximity")) {
+			ireq.phrase.type = greylock::intersect::phrase_match::match_proximity;
+			ireq.phrase.distance = greylock::get_int64(match, "distance", 0);
+		} else {
+			return;
+		}
+
+		// positions of different attributes are not related, every attribute is a separate group
+		for (const auto &sa: ireq.attributes) {
+			std::vector<greylock::intersect::phrase_match::word> group;
 
 			for (size_t i = 0; i < ireq.indexes.size(); ++i) {
-				greylock::eurl &iname = ireq.indexes[i];
-				std::vector<size_t> &positions = ireq.positions[i];
+				if (ireq.indexes[i].key.find(sa.aname) != 0)
+					continue;
 
-				// for every index we put vector of positions where given index is located in the document
-				// since it is an inverted index, it contains list of document links each of which contains
-				// array of the positions, where given index lives in the document
-				doc.positions.swap(positions);
+				greylock::intersect::phrase_match::word w;
+				w.index = i;
+				w.offsets = ireq.positions[i];
+				group.emplace_back(w);
+			}
 
-				locker<http_server> l(server(), iname.str());
-				std::unique_lock<locker<http_server>> lk(l);
+			ireq.phrase.groups.emplace_back(group);
+		}
+
+		if (ireq.phrase.type != greylock::intersect::phrase_match::match_phrase || m_pair_words.empty())
+			return;
+
+		// adjacent words of the phrase are covered by their pair indexes, pair index is usually much smaller
+		// than the lists of its words, since one of them is frequent
+		//
+		// word replaced by the pair must occur in the query only once, its other occurrences would lose positions
+		for (const auto &sa: ireq.attributes) {
+			for (size_t pos = 0; pos + 1 < sa.ivec.size();) {
+				size_t first = sa.ivec[pos];
+				size_t second = sa.ivec[pos + 1];
+
+				std::string fword = ireq.indexes[first].key.substr(sa.aname.size());
+				std::string sword = ireq.indexes[second].key.substr(sa.aname.size());
+
+				if (first == second || ireq.positions[first].size() != 1 || ireq.positions[second].size() != 1 ||
+						(!m_pair_words.count(fword) && !m_pair_words.count(sword))) {
+					++pos;
+					continue;
+				}
+
+				greylock::indexes_request::word_pair pair;
+				pair.first = first;
+				pair.second = second;
+				pair.url = pair_index_url(sa.aname, fword, sword);
+				ireq.pairs.emplace_back(pair);
+
+				pos += 2;
+			}
+		}
+	}
+
+	// index of all documents in the mailbox
+	greylock::eurl documents_index_url(const std::string &mbox) {
+		greylock::eurl url;
+		url.bucket = meta_bucket_name();
+		url.key = std::string(mbox) + ".#documents";
+		return url;
+	}
+
+	// dictionary of the mailbox documents, it resolves compact postings and looks up documents of dense terms,
+	// see @dictionary_enabled()
+	greylock::eurl dictionary_url(const std::string &mbox) {
+		greylock::eurl url;
+		url.bucket = meta_bucket_name();
+		url.key = std::string(mbox) + ".#dictionary";
+		return url;
+	}
+
+	bool compact_postings() const {
+		return m_compact_postings;
+	}
+
+	// string and numeric indexes written by this server store keys of this format,
+	// index which has been written in the other format refuses new keys, see @greylock::index_meta::posting_format()
+	uint64_t posting_format() const {
+		return m_compact_postings ? greylock::index_meta::flag_compact_postings :
+			greylock::index_meta::flag_full_postings;
+	}
+
+	// documents are put into the mailbox dictionary if postings are compact or terms may become dense
+	bool dictionary_enabled() const {
+		return m_compact_postings || m_dense_ratio > 0;
+	}
+
+	// replaces compact keys of @docs with document ids and urls from the mailbox dictionary,
+	// returns negative error if any document can not be resolved
+	int resolve_documents(const std::string &mbox, std::vector<greylock::intersect::single_doc_result> &docs) {
+		std::vector<greylock::key *> keys;
+		keys.reserve(docs.size());
+		for (auto &doc: docs)
+			keys.push_back(&doc.doc);
+
+		int err;
+		try {
+			greylock::document_dictionary<greylock::bucket_transport> dict(*m_bucket, dictionary_url(mbox));
+			err = dict.resolve(keys);
+		} catch (const std::exception &e) {
+			ILOG_ERROR("mailbox: %s, documents: %zd, exception: %s: could not resolve documents",
+					mbox.c_str(), docs.size(), e.what());
+			return -EINVAL;
+		}
+
+		if (err < 0) {
+			ILOG_ERROR("mailbox: %s, documents: %zd, error: %d: could not resolve every document",
+					mbox.c_str(), docs.size(), err);
+			return err;
+		}
+
+		return 0;
+	}
+
+	// mailbox state object, see @mailbox_state
+	greylock::eurl mailbox_state_url(const std::string &mbox) {
+		greylock::eurl url;
+		url.bucket = meta_bucket_name();
+		url.key = std::string(mbox) + ".#state";
+		return url;
+	}
+
+	// mailbox which does not have state object yet gets the empty state
+	int mailbox_state_read(const std::string &mbox, mailbox_state &state) {
+		greylock::status e = m_bucket->read(mailbox_state_url(mbox));
+		if (e.error == -ENOENT) {
+			state = mailbox_state();
+			return 0;
+		}
+		if (e.error)
+			return e.error;
+
+		try {
+			state.load(e.data.data(), e.data.size());
+		} catch (const std::exception &ex) {
+			ILOG_ERROR("mailbox: %s: could not unpack mailbox state: %s", mbox.c_str(), ex.what());
+			return -EINVAL;
+		}
+
+		return 0;
+	}
+
+	int mailbox_state_write(const std::string &mbox, const mailbox_state &state) {
+		std::vector<greylock::status> wr = m_bucket->write(mailbox_state_url(mbox), state.save());
+		for (auto &r: wr) {
+			if (!r.error)
+				return 0;
+		}
+
+		return -EIO;
+	}
+
+	// sets @docnum to the number of document @doc, document which is indexed for the first time
+	// (or which has been indexed before document numbers were introduced) gets the next number of the mailbox,
+	// @state is read in any case, it must be called under the lock of the mailbox documents index @index
+	int assign_document_number(const std::string &mbox, greylock::read_write_index<greylock::bucket_transport> &index,
+			const greylock::key &doc, mailbox_state &state, uint32_t &docnum) {
+		int err = mailbox_state_read(mbox, state);
+		if (err < 0)
+			return err;
+
+		greylock::key found = index.search(doc);
+		if (found && greylock::document_number(found, docnum))
+			return 0;
+
+		if (state.next_document > UINT32_MAX)
+			return -E2BIG;
+
+		docnum = state.next_document++;
+		return mailbox_state_write(mbox, state);
+	}
+
+	// term is converted into the bitmap when it is present in at least @m_dense_ratio part of the documents
+	// of the mailbox which contains at least @m_dense_min_documents documents,
+	// only plain index trees are converted, @num_keys is zero for time-partitioned indexes
+	bool dense_convertible(const greylock::eurl &iname, uint64_t num_keys, uint64_t num_documents) {
+		if (m_dense_ratio <= 0 || num_keys == 0 || num_documents < m_dense_min_documents)
+			return false;
+		if ((double)num_keys < (double)num_documents * m_dense_ratio)
+			return false;
+
+		std::unique_lock<std::mutex> guard(m_dense_lock);
+		return m_dense_rejected.find(iname.str()) == m_dense_rejected.end();
+	}
+
+	// returns true if term has been converted by this server, mailbox state which has been read
+	// before conversion does not contain it
+	bool dense_converted(const greylock::eurl &iname) {
+		std::unique_lock<std::mutex> guard(m_dense_lock);
+		return m_dense.find(iname.str()) != m_dense.end();
+	}
+
+	// replaces index tree @iname with the bitmap of document numbers and adds it into mailbox dense terms,
+	// locks mailbox documents index and then @iname, thus it must be called without index locks held
+	int dense_convert(const std::string &mbox, const greylock::eurl &iname) {
+		greylock::eurl dname = documents_index_url(mbox);
+
+		locker<http_server> dl(this, dname.str());
+		std::unique_lock<locker<http_server>> dlk(dl);
+
+		locker<http_server> l(this, iname.str());
+		std::unique_lock<locker<http_server>> lk(l);
+
+		if (dense_converted(iname))
+			return 0;
+
+		mailbox_state state;
+		int err = mailbox_state_read(mbox, state);
+		if (err < 0)
+			return err;
+
+		if (!state.is_dense(iname)) {
+			greylock::dense_index<greylock::bucket_transport> index(*m_bucket, iname);
+			err = index.convert(dname);
+			if (err == -ENOENT) {
+				// some documents have been indexed before document numbers were introduced,
+				// term is never tried again by this server
+				std::unique_lock<std::mutex> guard(m_dense_lock);
+				m_dense_rejected.insert(iname.str());
+				return err;
+			}
+			if (err < 0)
+				return err;
+
+			state.add_dense(iname);
+			err = mailbox_state_write(mbox, state);
+		}
+
+		// index tree has already been removed, until the state is written this server is the only one
+		// which knows that term is dense
+		// retention pass drops the index tree from the mailbox registry
+		std::unique_lock<std::mutex> guard(m_dense_lock);
+		m_dense.insert(iname.str());
+		return err;
+	}
+
+	// loads bitmap of the dense term, returns null pointer if term is not dense
+	std::shared_ptr<const greylock::bitmap> dense_bitmap(const greylock::eurl &iname) {
+		greylock::dense_index<greylock::bucket_transport> index(*m_bucket, iname);
+		if (index.load() < 0)
+			return std::shared_ptr<const greylock::bitmap>();
+
+		return std::make_shared<greylock::bitmap>(index.term().docs);
+	}
+
+	// returns string which changes every time index is updated, empty string if index does not exist,
+	// partitioned index is changed if partition is added or removed or if any of its partitions
+	// which overlap @range is changed, updates of other partitions do not affect results read within @range,
+	// generation of the dense term is the generation of its bitmap
+	std::string index_generation(const greylock::eurl &iname, bool partitioned, bool dense = false,
+			const greylock::time_range &range = greylock::time_range()) {
+		auto generation = [] (const greylock::index_meta &meta) {
+			return elliptics::lexical_cast(meta.generation_number_sec) + "." +
+				elliptics::lexical_cast(meta.generation_number_nsec);
+		};
+
+		try {
+			if (dense) {
+				greylock::dense_index<greylock::bucket_transport> index(*m_bucket, iname);
+				if (index.load() < 0)
+					return std::string();
+
+				return "dense:" + index.term().generation();
+			}
+
+			if (partitioned) {
+				greylock::partitioned_index<greylock::bucket_transport> index(*m_bucket, iname, 0, true);
+
+				const greylock::partition_directory &dir = index.directory();
+				std::string ret = "dir:" + elliptics::lexical_cast(dir.generation_number_sec) + "." +
+					elliptics::lexical_cast(dir.generation_number_nsec) + " ";
+				for (long p: dir.overlap(range)) {
+					greylock::read_only_index<greylock::bucket_transport> part(*m_bucket,
+							greylock::partition_directory::partition_url(iname, p));
+					ret += elliptics::lexical_cast(p) + ":" + generation(part.meta()) + " ";
+				}
+
+				return ret;
+			}
+
+			greylock::read_only_index<greylock::bucket_transport> index(*m_bucket, iname);
+			return generation(index.meta());
+		} catch (const std::exception &e) {
+			return std::string();
+		}
+	}
+
+	// searches which are running right now, equal concurrent searches share a single intersection
+	greylock::search_flights &flights() {
+		return m_flights;
+	}
+
+	// default search timeout in milliseconds, 0 means there is no timeout
+	long search_timeout() const {
+		return m_search_timeout;
+	}
+
+	uint64_t search_federated() const {
+		return m_search_federated;
+	}
+
+	// worker pool which runs per-mailbox intersections of the federated search
+	task_pool &federated_pool() {
+		return m_federated_pool;
+	}
+
+	size_t federated_max_mailboxes() const {
+		return m_federated_max_mailboxes;
+	}
+
+	void federated_started() {
+		m_search_federated++;
+	}
+
+	greylock::search_cache &result_cache() {
+		return m_search_cache;
+	}
+
+	// returns cached result if none of the indexes it has been read from has been updated since
+	greylock::search_cache::entry_ptr cached_result(const std::string &key) {
+		greylock::search_cache::entry_ptr e = m_search_cache.get(key);
+		if (!e)
+			return e;
+
+		for (const auto &idx: e->indexes) {
+			if (index_generation(idx.url, idx.partitioned, idx.dense, idx.range) != idx.generation) {
+				m_search_cache.drop(key, e);
+				return greylock::search_cache::entry_ptr();
+			}
+		}
+
+		m_search_cache.hit();
+		return e;
+	}
+
+	// number of documents which contain given index, zero if index does not exist
+	//
+	// this is the number of keys in the index, thus it is approximate: document which has been indexed again
+	// with a different timestamp has two keys and is counted twice until the old key expires,
+	// @greylock::index<T>::unknown_count is returned if the index has been written without key counters
+	// and has not been recounted yet, errors other than missing index are thrown
+	uint64_t document_frequency(const greylock::eurl &iname, bool partitioned) {
+		try {
+			if (partitioned) {
+				greylock::partitioned_index<greylock::bucket_transport> index(*m_bucket, iname, 0, true);
+				return index.estimate_count();
+			}
+
+			greylock::read_only_index<greylock::bucket_transport> index(*m_bucket, iname);
+			return index.estimate_count();
+		} catch (const greylock::index_not_found &) {
+			return 0;
+		}
+	}
+
+	greylock::eurl numeric_index_url(const std::string &mbox, const std::string &aname) {
+		greylock::eurl url;
+		url.bucket = meta_bucket_name();
+		url.key = index_name(mbox, aname, "#numeric");
+		return url;
+	}
+
+	// parses "range" search object: {"attribute": {"from": number, "to": number}, ...},
+	// both boundaries are optional and inclusive
+	void get_numeric_ranges(const std::string &mbox, const rapidjson::Value &ranges, greylock::indexes_request &ireq) {
+		if (!ranges.IsObject())
+			return;
+
+		for (auto it = ranges.MemberBegin(), end = ranges.MemberEnd(); it != end; ++it) {
+			if (!it->value.IsObject())
+				continue;
+
+			greylock::numeric_range nr;
+			nr.from = greylock::get_int64(it->value, "from", LLONG_MIN);
+			nr.to = greylock::get_int64(it->value, "to", LLONG_MAX);
+
+			ireq.numeric_indexes.push_back(numeric_index_url(mbox, it->name.GetString()));
+			ireq.numeric_ranges.push_back(nr);
+		}
+	}
+
+
+private:
+	vector_lock m_lock;
+
+	std::shared_ptr<elliptics::node> m_node;
+
+	std::string m_meta_bucket;
+	std::shared_ptr<greylock::bucket_transport> m_bucket;
+
+	long m_read_timeout = 60;
+	long m_write_timeout = 60;
+
+	// if positive, every string index is split into time partitions of this many seconds
+	long m_time_partition_period = 0;
+
+	// if set, postings contain document numbers instead of ids and urls, see @greylock::compact_key,
+	// like time partitions, this layout is chosen at deployment time
+	bool m_compact_postings = false;
+
+	// Retention: keys older than @m_retention_max_age seconds are removed from indexes.
+	// Every index is added into the persistent retention registry of its mailbox when it is written
+	// (see @retention_schedule()), retention thread wakes up every @m_retention_interval seconds
+	// and walks registries of all mailboxes, thus indexes which are not updated anymore are expired too.
+	long m_retention_max_age = 0;
+	long m_retention_interval = 3600;
+
+	std::mutex m_retention_lock;
+	std::condition_variable m_retention_cond;
+	std::set<std::string> m_retention_registered;
+	size_t m_retention_registered_max = 1024 * 1024;
+	bool m_retention_stop = false;
+	std::thread m_retention_thread;
+
+	long m_search_timeout = 0;
+
+	// Federated search: at most @m_federated_max_mailboxes mailboxes per request,
+	// their intersections run on @m_federated_pool
+	task_pool m_federated_pool;
+	int m_federated_threads = 8;
+	size_t m_federated_max_mailboxes = 64;
+	std::atomic<uint64_t> m_search_federated{0};
+
+	greylock::search_cache m_search_cache;
+
+	// Dense terms: term whose index tree contains at least @m_dense_ratio part of the documents
+	// of the mailbox is converted into the bitmap of document numbers, 0 disables conversion.
+	// @m_dense contains terms converted by this server, @m_dense_rejected - terms which could not be converted.
+	double m_dense_ratio = 0;
+	uint64_t m_dense_min_documents = 1024;
+
+	std::mutex m_dense_lock;
+	std::set<std::string> m_dense;
+	std::set<std::string> m_dense_rejected;
+
+	// maximum number of words every wildcard pattern is expanded into
+	size_t m_wildcard_max_terms = 64;
+
+	// attributes whose text is also indexed as n-grams for substring search
+	std::set<std::string> m_ngram_attributes;
+
+	// adjacent words of the document are also indexed as a pair if at least one of them is in this set,
+	// phrase queries read pair indexes instead of the lists of these words
+	std::set<std::string> m_pair_words;
+
+	std::mutex m_terms_lock;
+	std::set<std::string> m_terms_recorded;
+	size_t m_terms_recorded_max = 1024 * 1024;
+
+	// Completion snapshots: snapshot of the attribute is loaded once and kept in memory, documents indexed
+	// by this server update it in place, they are merged into the stored snapshot (see @suggest_flush())
+	// every @m_suggest_flush_documents documents, when it is evicted and when server stops.
+	// At most @m_suggest_max_snapshots snapshots are kept, least recently used one is evicted first.
+	struct suggest_entry {
+		std::mutex lock;
+		greylock::completion_snapshot snapshot;
+		bool loaded = false;
+		bool evicted = false;
+
+		// number of documents added to the words since the snapshot has been merged
+		std::map<std::string, uint64_t> added;
+
+		// number of documents added since the snapshot has been written
+		size_t dirty = 0;
+		uint64_t used = 0;
+	};
+	typedef std::shared_ptr<suggest_entry> suggest_entry_ptr;
+
+	size_t m_suggest_flush_documents = 64;
+	size_t m_suggest_max_snapshots = 1024;
+
+	std::mutex m_suggest_lock;
+	std::map<std::string, suggest_entry_ptr> m_suggest;
+	uint64_t m_suggest_clock = 0;
+
+	suggest_entry_ptr suggest_get(const std::string &attribute_prefix) {
+		suggest_entry_ptr e;
+		std::pair<std::string, suggest_entry_ptr> victim;
+
+		{
+			std::unique_lock<std::mutex> guard(m_suggest_lock);
+
+			suggest_entry_ptr &ref = m_suggest[attribute_prefix];
+			if (!ref)
+				ref = std::make_shared<suggest_entry>();
+			ref->used = ++m_suggest_clock;
+			e = ref;
+
+			// requested entry is the most recently used one, it is never evicted
+			if (m_suggest.size() > m_suggest_max_snapshots) {
+				auto it = std::min_element(m_suggest.begin(), m_suggest.end(),
+						[] (const std::pair<const std::string, suggest_entry_ptr> &p1,
+							const std::pair<const std::string, suggest_entry_ptr> &p2) {
+							return p1.second->used < p2.second->used;
+						});
+
+				victim = *it;
+				m_suggest.erase(it);
+			}
+		}
 
-				try {
-					greylock::read_write_index<greylock::bucket_transport> index(*(server()->bucket()), iname);
+		// evicted entry may still be updated by the concurrent request, it writes the snapshot itself then
+		if (victim.second) {
+			std::unique_lock<std::mutex> guard(victim.second->lock);
+			victim.second->evicted = true;
+			suggest_flush(victim.first, *victim.second);
+		}
 
-					int err = index.insert(doc);
-					if (err < 0) {
-						ILOG_ERROR("process_one_document: url: %s, mailbox: %s, "
-								"doc: %s, index: %s error: %d: could not insert new key",
-							req.url().to_human_readable().c_str(), mbox,
-							doc.str().c_str(),
-							iname.str().c_str(),
-							err);
-						this->send_reply(swarm::http_response::internal_server_error);
-						return;
-					}
-				} catch (const std::exception &e) {
-					ILOG_ERROR("process_one_document: url: %s, mailbox: %s, "
-							"doc: %s, index: %s, exception: %s",
-						req.url().to_human_readable().c_str(), mbox,
-						doc.str().c_str(),
-						iname.str().c_str(),
-						e.what());
-					this->send_reply(swarm::http_response::internal_server_error);
-					return;
-				}
+		return e;
+	}
 
-				ILOG_INFO("process_one_document: url: %s, mailbox: %s, "
-						"doc: %s, index: %s, elapsed time: %d ms",
-					req.url().to_human_readable().c_str(), mbox,
-					doc.str().c_str(),
-					iname.str().c_str(),
-					tm.restart());
+	// must be called with the entry lock held
+	//
+	// snapshot which has never been written is built from the term dictionary of the attribute,
+	// only the dictionary is scanned, frequencies of its words are unknown until they are completed,
+	// see @suggest_resolve()
+	int suggest_load(const std::string &attribute_prefix, suggest_entry &e) {
+		if (e.loaded)
+			return 0;
+
+		greylock::status st = m_bucket->read(suggest_url(attribute_prefix));
+		if (st.error && st.error != -ENOENT)
+			return st.error;
+
+		if (!st.error) {
+			try {
+				e.snapshot.load(st.data.data(), st.data.size());
+			} catch (const std::exception &ex) {
+				ILOG_ERROR("suggest: %s: could not unpack completion snapshot: %s",
+						attribute_prefix.c_str(), ex.what());
+				return -EINVAL;
 			}
 
-			ILOG_INFO("process_one_document: url: %s, mailbox: %s, doc: %s, total number of indexes: %d, elapsed time: %d ms",
-					req.url().to_human_readable().c_str(), mbox,
-					doc.str().c_str(), ireq.indexes.size(), all_tm.elapsed());
+			e.loaded = true;
+			return 0;
 		}
 
-		void parse_docs(const thevoid::http_request &req, const std::string &mbox, const rapidjson::Value &docs) {
-			for (auto it = docs.Begin(), id_end = docs.End(); it != id_end; ++it) {
-				if (it->IsObject()) {
-					greylock::key doc;
-
-					const char *id = greylock::get_string(*it, "id");
-					const char *bucket = greylock::get_string(*it, "bucket");
-					const char *key = greylock::get_string(*it, "key");
-					if (!bucket || !key || !id) {
-						ILOG_ERROR("parse_docs: url: %s, mailbox: %s, error: %d: 'docs/{bucket,ket,id} must be strings",
-								req.url().to_human_readable().c_str(), mbox, -EINVAL);
-						continue;
-					}
+		ribosome::timer tm;
+		greylock::eurl dname = term_dictionary_url(attribute_prefix);
 
-					struct timespec ts;
-					clock_gettime(CLOCK_REALTIME, &ts);
+		lock(dname.str());
+		try {
+			greylock::term_dictionary<greylock::bucket_transport> dict(*m_bucket, dname, true);
+
+			for (const auto &t: dict.prefixed(""))
+				e.snapshot.set(t.id, greylock::completion_snapshot::unknown_frequency);
+		} catch (const greylock::index_not_found &ex) {
+			ILOG_NOTICE("suggest: %s: could not open term dictionary, attribute does not have words yet: %s",
+					attribute_prefix.c_str(), ex.what());
+		} catch (const std::exception &ex) {
+			ILOG_ERROR("suggest: %s: could not build completion snapshot: %s",
+					attribute_prefix.c_str(), ex.what());
+			unlock(dname.str());
+
+			// snapshot is built again by the next call
+			e.snapshot = greylock::completion_snapshot();
+			return -EIO;
+		}
+		unlock(dname.str());
 
-					const rapidjson::Value &timestamp = greylock::get_object(*it, "timestamp");
-					if (timestamp.IsObject()) {
-						long tsec, tnsec;
+		ILOG_INFO("suggest: %s: completion snapshot has been built: words: %zd, duration: %d ms",
+				attribute_prefix.c_str(), e.snapshot.size(), tm.elapsed());
 
-						tsec = greylock::get_int64(timestamp, "tsec", ts.tv_sec);
-						tnsec = greylock::get_int64(timestamp, "tnsec", ts.tv_nsec);
+		e.loaded = true;
+		e.dirty = 1;
+		return 0;
+	}
 
-						doc.set_timestamp(tsec, tnsec);
-					} else {
-						doc.set_timestamp(ts.tv_sec, ts.tv_nsec);
-					}
+	// must be called with the entry lock held
+	//
+	// reads frequencies of the words starting with @prefix which are not known yet from their indexes,
+	// every word is read once, frequencies are written with the snapshot
+	int suggest_resolve(const std::string &attribute_prefix, const std::string &prefix, suggest_entry &e) {
+		std::vector<std::string> unknown = e.snapshot.unknown(prefix);
+		if (unknown.empty())
+			return 0;
 
-					doc.url.bucket.assign(bucket);
-					doc.url.key.assign(key);
-					doc.id.assign(id);
+		std::set<std::string> words(unknown.begin(), unknown.end());
 
-					const rapidjson::Value &idxs = greylock::get_object(*it, "index");
-					if (!idxs.IsObject()) {
-						ILOG_ERROR("parse_docs: url: %s, mailbox: %s, doc: %s, error: %d: 'docs/index' must be object",
-								req.url().to_human_readable().c_str(), mbox, doc.str().c_str(), -EINVAL);
-						continue;
-					}
+		ribosome::timer tm;
+		greylock::eurl dname = term_dictionary_url(attribute_prefix);
 
-					process_one_document(req, mbox, doc, idxs);
+		int err = 0;
+		lock(dname.str());
+		try {
+			greylock::term_dictionary<greylock::bucket_transport> dict(*m_bucket, dname, true);
+
+			for (const auto &t: dict.prefixed(prefix)) {
+				if (words.find(t.id) == words.end())
+					continue;
+
+				uint64_t df = document_frequency(t.url, m_time_partition_period > 0);
+				if (df == greylock::index<greylock::bucket_transport>::unknown_count)
+					df = 0;
+				if (df == 0) {
+					std::shared_ptr<const greylock::bitmap> docs = dense_bitmap(t.url);
+					if (docs)
+						df = docs->cardinality();
 				}
+
+				e.snapshot.set(t.id, df);
+				words.erase(t.id);
 			}
+		} catch (const std::exception &ex) {
+			ILOG_ERROR("suggest: %s, prefix: %s: could not read word frequencies: %s",
+					attribute_prefix.c_str(), prefix.c_str(), ex.what());
+			err = -EIO;
 		}
+		unlock(dname.str());
 
-		virtual void on_request(const thevoid::http_request &req, const boost::asio::const_buffer &buffer) {
-			ribosome::timer index_tm;
-			ILOG_INFO("url: %s: start", req.url().to_human_readable().c_str());
+		// words which have been removed from the dictionary do not have documents
+		for (const auto &w: words)
+			e.snapshot.set(w, 0);
 
-			// this is needed to put ending zero-byte, otherwise rapidjson parser will explode
-			std::string data(const_cast<char *>(boost::asio::buffer_cast<const char*>(buffer)), boost::asio::buffer_size(buffer));
+		e.dirty++;
 
-			rapidjson::Document doc;
-			doc.Parse<0>(data.c_str());
+		ILOG_INFO("suggest: %s, prefix: %s: frequencies have been read: words: %zd, duration: %d ms",
+				attribute_prefix.c_str(), prefix.c_str(), unknown.size(), tm.elapsed());
+		return err;
+	}
 
-			if (doc.HasParseError()) {
-				ILOG_ERROR("on_request: url: %s, error: %d: could not parse document: %s, error offset: %d",
-						req.url().to_human_readable().c_str(), -EINVAL, doc.GetParseError(), doc.GetErrorOffset());
-				this->send_reply(swarm::http_response::bad_request);
-				return;
-			}
+	// must be called with the entry lock held
+	//
+	// snapshot object is shared by all servers, documents added by this server since the last flush
+	// are merged into the stored snapshot, which replaces the local one, thus updates of other servers
+	// become visible here too. Storage does not provide atomic update, servers flushing the same snapshot
+	// at the same moment may lose one of their batches, but never the whole snapshot.
+	int suggest_flush(const std::string &attribute_prefix, suggest_entry &e) {
+		if (e.dirty == 0)
+			return 0;
+
+		greylock::eurl url = suggest_url(attribute_prefix);
+		greylock::status st = m_bucket->read(url);
+		if (st.error && st.error != -ENOENT) {
+			ILOG_ERROR("suggest: %s: could not read completion snapshot: %d", attribute_prefix.c_str(), st.error);
+			return st.error;
+		}
 
-			if (!doc.IsObject()) {
-				ILOG_ERROR("on_request: url: %s, error: %d: document must be object, its type: %d",
-						req.url().to_human_readable().c_str(), -EINVAL, doc.GetType());
-				this->send_reply(swarm::http_response::bad_request);
-				return;
+		if (!st.error) {
+			try {
+				greylock::completion_snapshot stored;
+				stored.load(st.data.data(), st.data.size());
+				stored.merge(e.snapshot, e.added);
+				e.snapshot = std::move(stored);
+			} catch (const std::exception &ex) {
+				ILOG_ERROR("suggest: %s: could not unpack stored completion snapshot, it is replaced: %s",
+						attribute_prefix.c_str(), ex.what());
 			}
+		}
+		e.added.clear();
 
-			const char *mbox = greylock::get_string(doc, "mailbox");
-			if (!mbox) {
-				ILOG_ERROR("on_request: url: %s, error: %d: 'mailbox' must be a string",
-						req.url().to_human_readable().c_str(), -EINVAL);
-				this->send_reply(swarm::http_response::bad_request);
-				return;
+		std::vector<greylock::status> wr = m_bucket->write(url, e.snapshot.save());
+		for (auto &r: wr) {
+			if (!r.error) {
+				e.dirty = 0;
+				return 0;
 			}
+		}
 
-			const rapidjson::Value &docs = greylock::get_array(doc, "docs");
-			if (!docs.IsArray()) {
-				ILOG_ERROR("on_request: url: %s, mailbox: %s, error: %d: 'docs' must be array",
-						req.url().to_human_readable().c_str(), mbox, -EINVAL);
-				this->send_reply(swarm::http_response::bad_request);
-				return;
-			}
+		ILOG_ERROR("suggest: %s: could not write completion snapshot, documents: %zd",
+				attribute_prefix.c_str(), e.dirty);
+		return -EIO;
+	}
 
-			parse_docs(req, mbox, docs);
+	greylock::search_flights m_flights;
 
-			ILOG_INFO("on_request: url: %s, mailbox: %s, keys: %d: insertion completed, index duration: %d ms",
-					req.url().to_human_readable().c_str(), mbox, docs.Size(), index_tm.elapsed());
-			this->send_reply(thevoid::http_response::ok);
+	// Search cursors: live intersection state is kept for @m_cursor_ttl seconds after the page has been sent,
+	// cursors are disabled if ttl is not positive. Total memory of the loaded pages of all cursors
+	// is limited by @m_cursor_max_memory.
+	long m_cursor_ttl = 0;
+	size_t m_cursor_max_memory = 64 * 1024 * 1024;
+
+	std::mutex m_cursors_lock;
+	std::map<std::string, search_cursor_ptr> m_cursors;
+	size_t m_cursors_memory = 0;
+	std::mt19937_64 m_cursor_rng{std::random_device()()};
+
+	void cursor_erase(std::map<std::string, search_cursor_ptr>::iterator it) {
+		m_cursors_memory -= it->second->memory;
+		m_cursors.erase(it);
+	}
+
+	// must be called with @m_cursors_lock held
+	void cursor_expire(const std::chrono::steady_clock::time_point &now) {
+		for (auto it = m_cursors.begin(); it != m_cursors.end();) {
+			auto cur = it++;
+			if (cur->second->expires <= now)
+				cursor_erase(cur);
 		}
-	};
+	}
 
-	std::shared_ptr<greylock::bucket_transport> bucket() {
-		return m_bucket;
+	greylock::eurl retention_registry_url(const std::string &mbox) {
+		greylock::eurl url;
+		url.bucket = meta_bucket_name();
+		url.key = mbox + ".#retention";
+		return url;
 	}
 
-	void lock(const std::string &key) {
-		m_lock.lock(key);
+	greylock::eurl retention_mailboxes_url() {
+		greylock::eurl url;
+		url.bucket = meta_bucket_name();
+		url.key = "#retention.mailboxes";
+		return url;
 	}
 
-	void unlock(const std::string &key) {
-		m_lock.unlock(key);
+	int retention_register(const greylock::eurl &registry, const greylock::key &k) {
+		lock(registry.str());
+		int err;
+		try {
+			greylock::read_write_index<greylock::bucket_transport> index(*m_bucket, registry);
+			err = index.insert(k);
+		} catch (const std::exception &e) {
+			ILOG_ERROR("retention: registry: %s, key: %s, exception: %s",
+					registry.str().c_str(), k.str().c_str(), e.what());
+			err = -EINVAL;
+		}
+		unlock(registry.str());
+
+		return err;
 	}
 
-	const std::string &meta_bucket_name() const {
-		return m_meta_bucket;
+	// returns keys of the registry, empty vector if registry does not exist
+	std::vector<greylock::key> retention_registry_keys(const greylock::eurl &registry) {
+		try {
+			greylock::read_only_index<greylock::bucket_transport> index(*m_bucket, registry);
+			return index.keys();
+		} catch (const std::exception &e) {
+			ILOG_INFO("retention: registry: %s: could not read registry: %s", registry.str().c_str(), e.what());
+			return std::vector<greylock::key>();
+		}
 	}
 
-	indexes_request get_indexes(const std::string &mbox, const rapidjson::Value &idxs) {
-		indexes_request ireq;
+	void retention_process() {
+		while (true) {
+			{
+				std::unique_lock<std::mutex> guard(m_retention_lock);
+				m_retention_cond.wait_for(guard, std::chrono::seconds(m_retention_interval),
+						[&] { return m_retention_stop; });
+				if (m_retention_stop)
+					return;
+			}
 
-		if (!idxs.IsObject())
-			return ireq;
+			struct timespec ts;
+			clock_gettime(CLOCK_REALTIME, &ts);
 
-		ribosome::split spl;
-		for (rapidjson::Value::ConstMemberIterator it = idxs.MemberBegin(), idxs_end = idxs.MemberEnd(); it != idxs_end; ++it) {
-			const char *aname = it->name.GetString();
-			const rapidjson::Value &avalue = it->value;
+			greylock::key cutoff;
+			cutoff.set_timestamp(ts.tv_sec - m_retention_max_age, 0);
 
-			if (!avalue.IsString())
-				continue;
+			ribosome::timer tm;
+			size_t num_indexes = 0;
+			std::vector<greylock::key> mailboxes = retention_registry_keys(retention_mailboxes_url());
+			for (const auto &mk: mailboxes) {
+				num_indexes += retention_mailbox(mk.id, cutoff.timestamp);
+			}
 
-			single_attribute sa;
-			sa.aname = index_name(mbox, aname, "");
+			ILOG_INFO("retention: max-age: %ld seconds, mailboxes: %zd, indexes: %zd, duration: %d ms",
+					m_retention_max_age, mailboxes.size(), num_indexes, tm.elapsed());
+		}
+	}
 
-			std::vector<ribosome::lstring> indexes = spl.convert_split_words(avalue.GetString(), avalue.GetStringLength());
-			for (size_t pos = 0; pos < indexes.size(); ++pos) {
-				greylock::eurl url;
-				url.bucket = meta_bucket_name();
-				url.key = index_name(mbox, aname, ribosome::lconvert::to_string(indexes[pos]));
+	// expires keys older than @cutoff in every index registered for the mailbox,
+	// bitmaps of the dense terms are truncated before the documents index, since it contains numbers
+	// of the expired documents, term dictionaries are processed after all indexes,
+	// since they drop words whose indexes have become empty
+	// returns number of processed indexes
+	size_t retention_mailbox(const std::string &mbox, uint64_t cutoff) {
+		retention_dense_expire(mbox, cutoff);
+
+		mailbox_state state;
+		int err = mailbox_state_read(mbox, state);
+		if (err < 0) {
+			ILOG_ERROR("retention: mailbox: %s, error: %d: could not read mailbox state", mbox.c_str(), err);
+			return 0;
+		}
 
-				auto f = std::find(ireq.indexes.begin(), ireq.indexes.end(), url);
-				if (f == ireq.indexes.end()) {
-					std::vector<size_t> v;
-					v.push_back(pos);
-					ireq.positions.push_back(v);
-					ireq.indexes.push_back(url);
+		greylock::eurl registry = retention_registry_url(mbox);
+		std::vector<greylock::key> keys = retention_registry_keys(registry);
+		std::stable_partition(keys.begin(), keys.end(), [] (const greylock::key &k) {
+					return k.positions.empty() || k.positions[0] != retention_dictionary;
+				});
+
+		// indexes which have been converted into bitmaps do not have trees anymore
+		std::vector<greylock::key> dropped;
+
+		for (const auto &k: keys) {
+			const greylock::eurl &iname = k.url;
+			int kind = k.positions.empty() ? retention_tree : k.positions[0];
 
-					sa.ivec.push_back(pos);
+			if (kind == retention_tree && (state.is_dense(iname) || dense_converted(iname))) {
+				dropped.push_back(k);
+				continue;
+			}
+
+			if (kind == retention_dictionary) {
+				retention_dictionary_expire(state, iname);
+				continue;
+			}
+
+			lock(iname.str());
+			try {
+				if (kind == retention_numeric) {
+					greylock::numeric_index<greylock::bucket_transport> index(*m_bucket, iname, false);
+					err = index.expire(cutoff);
+				} else if (kind == retention_tree && m_time_partition_period > 0) {
+					greylock::partitioned_index<greylock::bucket_transport> index(*m_bucket, iname,
+							m_time_partition_period, false);
+					err = index.truncate(cutoff);
 				} else {
-					size_t idx = std::distance(ireq.indexes.begin(), f);
-					ireq.positions[idx].push_back(pos);
-					sa.ivec.push_back(idx);
+					greylock::read_write_index<greylock::bucket_transport> index(*m_bucket, iname);
+					err = index.truncate(cutoff);
+				}
+
+				if (err < 0) {
+					ILOG_ERROR("retention: mailbox: %s, index: %s, cutoff: %llu, error: %d: could not expire index",
+							mbox.c_str(), iname.str().c_str(), (unsigned long long)cutoff, err);
 				}
+			} catch (const std::exception &e) {
+				ILOG_ERROR("retention: mailbox: %s, index: %s, cutoff: %llu, exception: %s",
+						mbox.c_str(), iname.str().c_str(), (unsigned long long)cutoff, e.what());
 			}
+			unlock(iname.str());
+		}
 
-			ireq.attributes.push_back(sa);
+		if (!dropped.empty()) {
+			lock(registry.str());
+			try {
+				greylock::read_write_index<greylock::bucket_transport> index(*m_bucket, registry);
+				for (const auto &k: dropped)
+					index.remove(k);
+			} catch (const std::exception &e) {
+				ILOG_ERROR("retention: registry: %s, exception: %s", registry.str().c_str(), e.what());
+			}
+			unlock(registry.str());
 		}
 
-		return ireq;
+		return keys.size();
 	}
 
+	// removes documents older than @cutoff from the bitmaps of the mailbox dense terms,
+	// like intersection and indexing, it takes the lock of the documents index before the term locks
+	void retention_dense_expire(const std::string &mbox, uint64_t cutoff) {
+		greylock::eurl dname = documents_index_url(mbox);
 
-private:
-	vector_lock m_lock;
+		lock(dname.str());
+		try {
+			mailbox_state state;
+			int err = mailbox_state_read(mbox, state);
+			if (err < 0) {
+				ILOG_ERROR("retention: mailbox: %s, error: %d: could not read mailbox state, "
+						"dense terms are not truncated", mbox.c_str(), err);
+			}
 
-	std::shared_ptr<elliptics::node> m_node;
+			std::vector<uint32_t> nums;
+			if (err == 0 && !state.dense.empty()) {
+				greylock::read_only_index<greylock::bucket_transport> index(*m_bucket, dname);
+				for (auto it = index.begin(greylock::key()), end = index.end(); it != end; ++it) {
+					if (it->timestamp >= cutoff)
+						break;
 
-	std::string m_meta_bucket;
-	std::shared_ptr<greylock::bucket_transport> m_bucket;
+					uint32_t num;
+					if (greylock::document_number(*it, num))
+						nums.push_back(num);
+				}
+			}
 
-	long m_read_timeout = 60;
-	long m_write_timeout = 60;
+			std::vector<greylock::eurl> terms;
+			if (!nums.empty())
+				terms = state.dense_urls();
+
+			for (const auto &iname: terms) {
+				lock(iname.str());
+				try {
+					greylock::dense_index<greylock::bucket_transport> index(*m_bucket, iname);
+					size_t removed = 0;
+					err = index.load();
+					if (err == 0)
+						err = index.remove(nums, removed);
+
+					if (err < 0) {
+						ILOG_ERROR("retention: mailbox: %s, dense term: %s, cutoff: %llu, error: %d: "
+								"could not truncate bitmap",
+								mbox.c_str(), iname.str().c_str(), (unsigned long long)cutoff, err);
+					} else {
+						ILOG_INFO("retention: mailbox: %s, dense term: %s, cutoff: %llu, removed documents: %zd, "
+								"bitmap: %s",
+								mbox.c_str(), iname.str().c_str(), (unsigned long long)cutoff, removed,
+								index.term().docs.str().c_str());
+					}
+				} catch (const std::exception &e) {
+					ILOG_ERROR("retention: mailbox: %s, dense term: %s, exception: %s",
+							mbox.c_str(), iname.str().c_str(), e.what());
+				}
+				unlock(iname.str());
+			}
+		} catch (const std::exception &e) {
+			ILOG_ERROR("retention: mailbox: %s, documents index: %s, exception: %s",
+					mbox.c_str(), dname.str().c_str(), e.what());
+		}
+		unlock(dname.str());
+	}
+
+	// removes words whose indexes do not contain keys anymore from the term dictionary @dname
+	//
+	// every word is checked and removed under the lock of its index, thus concurrently indexed document
+	// either sees the word removed and adds it again (since it is forgotten by @term_forget()),
+	// or its key is found by this check, other servers may still remember the word as recorded
+	// until their set of recorded words is dropped
+	void retention_dictionary_expire(const mailbox_state &state, const greylock::eurl &dname) {
+		lock(dname.str());
+		try {
+			greylock::term_dictionary<greylock::bucket_transport> dict(*m_bucket, dname, false);
+
+			bool truncated;
+			std::vector<greylock::key> words = dict.expand("*", ~0UL, truncated);
+			for (const auto &word: words) {
+				const greylock::eurl &iname = word.url;
+				if (state.is_dense(iname) || dense_converted(iname))
+					continue;
+
+				lock(iname.str());
+				try {
+					uint64_t num_keys;
+					if (m_time_partition_period > 0) {
+						greylock::partitioned_index<greylock::bucket_transport> index(*m_bucket, iname,
+								m_time_partition_period, true);
+						num_keys = index.estimate_count(greylock::time_range());
+					} else {
+						greylock::read_only_index<greylock::bucket_transport> index(*m_bucket, iname);
+						num_keys = index.meta().num_keys_valid ? index.meta().num_keys.load() :
+							greylock::index<greylock::bucket_transport>::unknown_count;
+					}
+
+					if (num_keys == 0) {
+						int err = dict.remove(word.id);
+						if (err < 0) {
+							ILOG_ERROR("retention: term dictionary: %s, word: %s, error: %d: could not remove word",
+									dname.str().c_str(), word.id.c_str(), err);
+						} else {
+							term_forget(iname);
+						}
+					}
+				} catch (const std::exception &e) {
+					// index of the word could have never been written
+					ILOG_INFO("retention: term dictionary: %s, word: %s, index: %s: %s",
+							dname.str().c_str(), word.id.c_str(), iname.str().c_str(), e.what());
+				}
+				unlock(iname.str());
+			}
+		} catch (const std::exception &e) {
+			ILOG_ERROR("retention: term dictionary: %s, exception: %s", dname.str().c_str(), e.what());
+		}
+		unlock(dname.str());
+	}
 
 	bool elliptics_init(const rapidjson::Value &config) {
 		dnet_config node_config;
@@ -988,6 +4139,87 @@ private:
 				ioremap::greylock::default_reserve_size = ps.GetInt();
 		}
 
+		if (config.HasMember("time-partition-period")) {
+			auto &tp = config["time-partition-period"];
+			if (tp.IsNumber())
+				m_time_partition_period = tp.GetInt64();
+		}
+
+		m_compact_postings = greylock::get_bool(config, "compact-postings", false);
+
+		const rapidjson::Value &retention = greylock::get_object(config, "retention");
+		if (retention.IsObject()) {
+			m_retention_max_age = greylock::get_int64(retention, "max-age", 0);
+			m_retention_interval = greylock::get_int64(retention, "interval", m_retention_interval);
+			if (m_retention_interval <= 0) {
+				ILOG_ERROR("retention: interval must be positive: %ld", m_retention_interval);
+				return false;
+			}
+
+			if (m_retention_max_age > 0) {
+				m_retention_thread = std::thread(std::bind(&http_server::retention_process, this));
+			}
+		}
+
+		m_search_timeout = greylock::get_int64(config, "search-timeout", 0);
+		m_wildcard_max_terms = greylock::get_int64(config, "wildcard-max-terms", m_wildcard_max_terms);
+
+		const rapidjson::Value &federated = greylock::get_object(config, "federated-search");
+		if (federated.IsObject()) {
+			m_federated_threads = greylock::get_int64(federated, "threads", m_federated_threads);
+			m_federated_max_mailboxes = greylock::get_int64(federated, "max-mailboxes", m_federated_max_mailboxes);
+		}
+		m_federated_pool.start(m_federated_threads);
+
+		const rapidjson::Value &cache = greylock::get_object(config, "search-cache");
+		if (cache.IsObject()) {
+			m_search_cache.set_max_memory(greylock::get_int64(cache, "max-memory", 0));
+		}
+
+		const rapidjson::Value &dense = greylock::get_object(config, "dense-terms");
+		if (dense.IsObject()) {
+			m_dense_ratio = greylock::get_double(dense, "ratio", 0);
+			m_dense_min_documents = greylock::get_int64(dense, "min-documents", m_dense_min_documents);
+		}
+
+		const rapidjson::Value &ngram = greylock::get_array(config, "ngram-attributes");
+		if (ngram.IsArray()) {
+			for (auto it = ngram.Begin(), end = ngram.End(); it != end; ++it) {
+				if (it->IsString())
+					m_ngram_attributes.insert(it->GetString());
+			}
+		}
+
+		// pair words are normalized like indexed text
+		const rapidjson::Value &pairs = greylock::get_array(config, "pair-words");
+		if (pairs.IsArray()) {
+			ribosome::split spl;
+			for (auto it = pairs.Begin(), end = pairs.End(); it != end; ++it) {
+				if (!it->IsString())
+					continue;
+
+				std::vector<ribosome::lstring> words = spl.convert_split_words(it->GetString(), it->GetStringLength());
+				for (const auto &w: words)
+					m_pair_words.insert(ribosome::lconvert::to_string(w));
+			}
+		}
+
+		const rapidjson::Value &suggest = greylock::get_object(config, "suggest");
+		if (suggest.IsObject()) {
+			m_suggest_flush_documents = greylock::get_int64(suggest, "flush-documents", m_suggest_flush_documents);
+			m_suggest_max_snapshots = greylock::get_int64(suggest, "max-snapshots", m_suggest_max_snapshots);
+			if (m_suggest_max_snapshots == 0) {
+				ILOG_ERROR("suggest: max-snapshots must be positive");
+				return false;
+			}
+		}
+
+		const rapidjson::Value &cursors = greylock::get_object(config, "cursors");
+		if (cursors.IsObject()) {
+			m_cursor_ttl = greylock::get_int64(cursors, "ttl", 0);
+			m_cursor_max_memory = greylock::get_int64(cursors, "max-memory", m_cursor_max_memory);
+		}
+
 		return true;
 	}
 
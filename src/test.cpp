@@ -1,9 +1,18 @@
 #include <algorithm>
 #include <iostream>
+#include <map>
+#include <set>
 
+#include "greylock/bitmap.hpp"
 #include "greylock/bucket_transport.hpp"
+#include "greylock/dictionary.hpp"
 #include "greylock/elliptics.hpp"
 #include "greylock/intersection.hpp"
+#include "greylock/numeric.hpp"
+#include "greylock/partition.hpp"
+#include "greylock/search.hpp"
+#include "greylock/suggest.hpp"
+#include "greylock/terms.hpp"
 
 #include <boost/program_options.hpp>
 
@@ -34,6 +43,28 @@ public:
 		test::run(this, func(&test::test_iterator_number, idx, keys));
 		test::run(this, func(&test::test_select_many_keys, idx, keys));
 		test::run(this, func(&test::test_intersection, t, 3, 5000, 10000));
+		test::run(this, func(&test::test_time_range, t, 10000));
+		test::run(this, func(&test::test_numeric_range, t, 10000));
+		test::run(this, func(&test::test_time_partitions, t, 10000));
+		test::run(this, func(&test::test_truncate, t, 10000));
+		test::run(this, func(&test::test_operators, t, 10000));
+		test::run(this, func(&test::test_phrase_postings, 10000));
+		test::run(this, func(&test::test_phrase, t, 1000));
+		test::run(this, func(&test::test_cursor, t, 1000));
+		test::run(this, func(&test::test_count, t, 1000));
+		test::run(this, func(&test::test_facets, t, 1000));
+		test::run(this, func(&test::test_paging_cookie, t, 1000));
+		test::run(this, func(&test::test_deadline, t, 2000));
+		test::run(this, func(&test::test_dense, t, 10000));
+		test::run(this, func(&test::test_dictionary, t, 1000));
+		test::run(this, func(&test::test_term_dictionary, t, 1000));
+		test::run(this, func(&test::test_fuzzy, t, 1000));
+		test::run(this, func(&test::test_completions, 10000));
+		test::run(this, func(&test::test_search_sharing, 100));
+		test::run(this, func(&test::test_operator_relevance));
+		test::run(this, func(&test::test_top, 1000));
+		test::run(this, func(&test::test_bm25, t, 1000));
+		test::run(this, func(&test::test_federated_cookie, 100));
 	}
 
 private:
@@ -150,6 +181,29 @@ private:
 
 			++pos;
 		}
+
+		// empty pages are unlinked and removed, only the root and the first page of every level are left
+		for (auto it = keys.begin() + del_num, end = keys.end(); it != end; ++it) {
+			int err = idx.remove(*it);
+			if (err < 0) {
+				std::ostringstream ss;
+				ss << "failed to remove key: " << it->str() << ": " << err;
+				throw std::runtime_error(ss.str());
+			}
+		}
+
+		size_t num_pages = 0;
+		for (auto it = idx.page_begin(), end = idx.page_end(); it != end; ++it) {
+			num_pages++;
+		}
+
+		if (idx.meta().num_keys != 0 || num_pages != idx.meta().num_pages || num_pages > 8 ||
+				idx.begin() != idx.end()) {
+			std::ostringstream ss;
+			ss << "remove-test: all keys have been removed: meta: " << idx.meta().str() <<
+				", pages in the chain: " << num_pages;
+			throw std::runtime_error(ss.str());
+		}
 	}
 
 	void test_index_recovery(T &t, int max) {
@@ -299,6 +353,1971 @@ private:
 		}
 	}
 
+	void test_time_range(T &t, int max) {
+		greylock::eurl start;
+		start.key = "time-range-test." + elliptics::lexical_cast(rand());
+		start.bucket = m_bucket;
+
+		greylock::read_write_index<T> idx(t, start);
+
+		for (int i = 0; i < max; ++i) {
+			greylock::key k;
+			k.id = elliptics::lexical_cast(rand()) + ".time-range-key." + elliptics::lexical_cast(i);
+			k.url.key = "time-range-data." + elliptics::lexical_cast(i);
+			k.url.bucket = m_bucket;
+			k.set_timestamp(i + 1, i);
+
+			int err = idx.insert(k);
+			if (err < 0) {
+				std::ostringstream ss;
+				ss << "time-range: failed to insert key: " << k.str() << ": " << err;
+				throw std::runtime_error(ss.str());
+			}
+		}
+
+		auto check_range = [&] (const greylock::time_range &range, long must_be) {
+			long num = 0;
+			for (auto it = idx.begin(range), end = idx.end(); it != end; ++it) {
+				long tsec, tnsec;
+				it->get_timestamp(tsec, tnsec);
+
+				if (tsec < range.tsec_start || tsec > range.tsec_end) {
+					std::ostringstream ss;
+					ss << "time-range: range: " << range.str() << ", key: " << it->str() << " is out of range";
+					throw std::runtime_error(ss.str());
+				}
+
+				num++;
+			}
+
+			if (num != must_be) {
+				std::ostringstream ss;
+				ss << "time-range: range: " << range.str() << ", found keys: " << num << ", must be: " << must_be;
+				throw std::runtime_error(ss.str());
+			}
+
+			// per-subtree counters are exact, estimation must not differ from the real number of keys
+			uint64_t estimate = idx.estimate_count(range);
+			if (estimate != (uint64_t)must_be) {
+				std::ostringstream ss;
+				ss << "time-range: range: " << range.str() << ", estimated keys: " << estimate << ", must be: " << must_be;
+				throw std::runtime_error(ss.str());
+			}
+		};
+
+		check_range(greylock::time_range(), max);
+		check_range(greylock::time_range(max / 4, max / 2), max / 2 - max / 4 + 1);
+		check_range(greylock::time_range(max - 10, max * 2), 11);
+		check_range(greylock::time_range(max * 2, max * 3), 0);
+
+		// only interior keys carry subtree counters, leaf keys keep the old 4-element layout
+		auto check_packed_key = [&] (const greylock::key &k, uint32_t must_be) {
+			std::stringstream ss;
+			msgpack::pack(ss, k);
+			std::string packed = ss.str();
+
+			msgpack::unpacked result;
+			msgpack::unpack(&result, packed.data(), packed.size());
+			msgpack::object obj = result.get();
+
+			greylock::key unpacked;
+			obj.convert(&unpacked);
+
+			if (obj.via.array.size != must_be || unpacked != k || unpacked.subtree_keys != k.subtree_keys) {
+				std::ostringstream es;
+				es << "time-range: key: " << k.str() << ", subtree keys: " << k.subtree_keys <<
+					", packed array size: " << obj.via.array.size << ", must be: " << must_be <<
+					", unpacked subtree keys: " << unpacked.subtree_keys;
+				throw std::runtime_error(es.str());
+			}
+		};
+
+		greylock::key leaf;
+		leaf.id = "time-range-packed-key";
+		leaf.set_timestamp(max, 0);
+		check_packed_key(leaf, 4);
+
+		greylock::key interior = leaf;
+		interior.subtree_keys = max;
+		check_packed_key(interior, 5);
+
+		// interior keys of the indexes written before version 7 do not have timestamps,
+		// such index must not be descended by time, its key counters are not valid either
+		std::stringstream ms;
+		msgpack::packer<std::stringstream> pk(ms);
+		pk.pack_array(greylock::index_meta::serialization_version_6);
+		pk.pack((int)greylock::index_meta::serialization_version_6);
+		for (int i = 0; i < 5; ++i)
+			pk.pack((unsigned long long)i + 1);
+
+		std::string packed_meta = ms.str();
+		msgpack::unpacked meta_result;
+		msgpack::unpack(&meta_result, packed_meta.data(), packed_meta.size());
+		greylock::index_meta old_meta = meta_result.get().as<greylock::index_meta>();
+		if (old_meta.interior_keys_valid || old_meta.num_keys_valid || old_meta.num_pages != 2) {
+			std::ostringstream ss;
+			ss << "time-range: version 6 metadata: " << old_meta.str() << ": interior keys must not be valid";
+			throw std::runtime_error(ss.str());
+		}
+	}
+
+	void test_term_dictionary(T &t, int max) {
+		greylock::eurl dname;
+		dname.key = "term-dictionary-test." + elliptics::lexical_cast(rand());
+		dname.bucket = m_bucket;
+
+		greylock::term_dictionary<T> dict(t, dname, false);
+
+		// words are inserted in random order, every word is inserted twice
+		std::vector<std::string> words;
+		for (int i = 0; i < max; ++i) {
+			words.push_back((i % 2 ? "alpha" : "beta") + elliptics::lexical_cast(i));
+		}
+		words.insert(words.end(), words.begin(), words.end());
+		std::random_shuffle(words.begin(), words.end());
+
+		for (const auto &w: words) {
+			greylock::eurl iname;
+			iname.key = "term-dictionary-test.index." + w;
+			iname.bucket = m_bucket;
+
+			int err = dict.insert(w, iname);
+			if (err < 0)
+				throw std::runtime_error("term dictionary: insert failed: " + elliptics::lexical_cast(err));
+		}
+
+		auto check = [&] (const std::string &pattern, size_t limit, size_t must_be, bool must_be_truncated) {
+			bool truncated;
+			std::vector<greylock::key> terms = dict.expand(pattern, limit, truncated);
+
+			bool sorted = std::is_sorted(terms.begin(), terms.end(), [] (const greylock::key &k1, const greylock::key &k2) {
+						return k1.id < k2.id;
+					});
+			bool matched = std::all_of(terms.begin(), terms.end(), [&] (const greylock::key &k) {
+						return greylock::term_dictionary<T>::match(pattern, k.id) &&
+							k.url.key == "term-dictionary-test.index." + k.id;
+					});
+
+			if (terms.size() != must_be || truncated != must_be_truncated || !sorted || !matched) {
+				std::ostringstream ss;
+				ss << "term dictionary: pattern: " << pattern << ", limit: " << limit <<
+					", terms: " << terms.size() << ", must be: " << must_be <<
+					", truncated: " << truncated << ", sorted: " << sorted << ", matched: " << matched;
+				throw std::runtime_error(ss.str());
+			}
+		};
+
+		// alpha1 and alpha10..alpha19, alpha100..alpha199 for max = 1000, only odd numbers
+		check("alpha1*", max, 1 + 5 + 50, false);
+		check("alpha1*", 10, 10, true);
+		check("alpha1?", max, 5, false);
+		check("*a99?", max, 10, false);
+		check("gamma*", max, 0, false);
+		check("beta0", max, 1, false);
+
+		// '?' matches the whole multibyte character, not its single byte
+		const std::string word = "\xd0\xbc\xd0\xb8\xd1\x80";
+		if (!greylock::term_dictionary<T>::match("\xd0\xbc?\xd1\x80", word) ||
+				!greylock::term_dictionary<T>::match("???", word) ||
+				greylock::term_dictionary<T>::match("????", word) ||
+				greylock::term_dictionary<T>::match("\xd0\xbc??\xd1\x80", word) ||
+				!greylock::term_dictionary<T>::match("*\xd1\x80", word))
+			throw std::runtime_error("term dictionary: '?' does not match one UTF-8 character");
+	}
+
+	void test_fuzzy(T &t, int max) {
+		greylock::eurl dname;
+		dname.key = "fuzzy-test." + elliptics::lexical_cast(rand());
+		dname.bucket = m_bucket;
+
+		greylock::term_dictionary<T> dict(t, dname, false);
+
+		// short words over small alphabet, thus many of them are close to each other
+		auto random_word = [] () {
+			std::string w;
+			int len = 3 + rand() % 5;
+			for (int i = 0; i < len; ++i)
+				w.push_back('a' + rand() % 4);
+			return w;
+		};
+
+		std::set<std::string> words;
+		for (int i = 0; i < max; ++i) {
+			std::string w = random_word();
+			words.insert(w);
+
+			greylock::eurl iname;
+			iname.key = "fuzzy-test.index." + w;
+			iname.bucket = m_bucket;
+
+			int err = dict.insert(w, iname);
+			if (err < 0)
+				throw std::runtime_error("fuzzy: insert failed: " + elliptics::lexical_cast(err));
+		}
+
+		auto distance = [] (const std::string &s1, const std::string &s2) {
+			std::vector<std::vector<int>> d(s1.size() + 1, std::vector<int>(s2.size() + 1));
+			for (size_t i = 0; i <= s1.size(); ++i)
+				d[i][0] = i;
+			for (size_t j = 0; j <= s2.size(); ++j)
+				d[0][j] = j;
+
+			for (size_t i = 1; i <= s1.size(); ++i) {
+				for (size_t j = 1; j <= s2.size(); ++j) {
+					d[i][j] = std::min(std::min(d[i - 1][j], d[i][j - 1]) + 1,
+							d[i - 1][j - 1] + (s1[i - 1] != s2[j - 1]));
+				}
+			}
+
+			return d[s1.size()][s2.size()];
+		};
+
+		for (int i = 0; i < 20; ++i) {
+			std::string query = random_word();
+			int max_distance = i % 3;
+
+			size_t must_be = std::count_if(words.begin(), words.end(), [&] (const std::string &w) {
+						return distance(query, w) <= max_distance;
+					});
+
+			bool truncated;
+			auto terms = dict.fuzzy(query, max_distance, words.size(), truncated);
+
+			bool sorted = std::is_sorted(terms.begin(), terms.end(),
+					[] (const std::pair<greylock::key, int> &p1, const std::pair<greylock::key, int> &p2) {
+						return p1.second < p2.second;
+					});
+			bool matched = std::all_of(terms.begin(), terms.end(), [&] (const std::pair<greylock::key, int> &p) {
+						return p.second == distance(query, p.first.id) &&
+							p.first.url.key == "fuzzy-test.index." + p.first.id;
+					});
+
+			if (terms.size() != must_be || truncated || !sorted || !matched) {
+				std::ostringstream ss;
+				ss << "fuzzy: query: " << query << ", distance: " << max_distance <<
+					", terms: " << terms.size() << ", must be: " << must_be <<
+					", truncated: " << truncated << ", sorted: " << sorted << ", matched: " << matched;
+				throw std::runtime_error(ss.str());
+			}
+
+			if (must_be > 1) {
+				terms = dict.fuzzy(query, max_distance, 1, truncated);
+				if (terms.size() != 1 || !truncated || terms[0].second != distance(query, terms[0].first.id))
+					throw std::runtime_error("fuzzy: query: " + query + ": truncated expansion failed");
+			}
+		}
+	}
+
+	// equal requests must get the same cached or coalesced result, requests which differ in any option must not
+	// query made only of operators scores 0, documents of weighted nodes are ranked by their weight
+	void test_operator_relevance() {
+		greylock::eurl url;
+		url.bucket = "b";
+		url.key = "test@relevance.body.word";
+
+		greylock::query_node node;
+		node.indexes.push_back(url);
+
+		greylock::indexes_request ireq;
+		ireq.operators.all.push_back(node);
+
+		greylock::intersect::single_doc_result doc;
+		if (ireq.relevance(doc) != 0)
+			throw std::runtime_error("relevance: operator query without weights must score 0");
+
+		node.weight = 0.5;
+		ireq.operators.any.push_back(std::vector<greylock::query_node>({node}));
+
+		greylock::intersect::single_doc_result fuzzy;
+		fuzzy.weight = 0.5;
+		if (ireq.relevance(doc) != 1 || ireq.relevance(fuzzy) != 0.5)
+			throw std::runtime_error("relevance: weighted operator query must rank documents by their weight");
+	}
+
+	// top-K heap keeps the most relevant documents, intersection is stopped only when every kept document
+	// has the maximum relevance, since nothing can replace them
+	void test_top(int max) {
+		greylock::eurl url;
+		url.bucket = "b";
+		url.key = "test@top.body.word";
+
+		// query of the weighted word only, documents are ranked by their weights, maximum relevance is 1
+		greylock::query_node node;
+		node.indexes.push_back(url);
+		node.weight = 0.5;
+
+		greylock::indexes_request ireq;
+		ireq.operators.any.push_back(std::vector<greylock::query_node>({node}));
+		ireq.top = 10;
+
+		std::vector<float> weights;
+		for (int i = 0; i < max; ++i) {
+			greylock::intersect::single_doc_result doc;
+			doc.doc.id = "top-key." + elliptics::lexical_cast(i);
+			doc.weight = (float)(1 + rand() % 1000) / 1001.0;
+			weights.push_back(doc.weight);
+
+			if (!ireq.top_process(doc))
+				throw std::runtime_error("top: intersection must not be stopped before the heap is full of the best documents");
+		}
+
+		// every kept document but the last one has the maximum relevance, the last one stops intersection
+		for (size_t i = 0; i < ireq.top; ++i) {
+			greylock::intersect::single_doc_result doc;
+			doc.doc.id = "top-best-key." + elliptics::lexical_cast(i);
+			doc.weight = 1;
+			weights.push_back(doc.weight);
+
+			bool more = ireq.top_process(doc);
+			if (more != (i + 1 < ireq.top)) {
+				std::ostringstream ss;
+				ss << "top: best documents: " << i + 1 << ", intersection continues: " << more;
+				throw std::runtime_error(ss.str());
+			}
+		}
+
+		greylock::intersect::result res;
+		ireq.top_finish(std::vector<greylock::eurl>(), res);
+
+		std::sort(weights.begin(), weights.end(), std::greater<float>());
+		weights.resize(ireq.top);
+
+		bool equal = res.docs.size() == weights.size() && ireq.top_docs.empty();
+		for (size_t i = 0; equal && i < res.docs.size(); ++i)
+			equal = res.docs[i].relevance == weights[i] && res.docs[i].doc.id.compare(0, 13, "top-best-key.") == 0;
+
+		if (!equal) {
+			std::ostringstream ss;
+			ss << "top: returned documents: " << res.docs.size() << ", must be: " << weights.size();
+			throw std::runtime_error(ss.str());
+		}
+
+		// the same heap without the best documents keeps the most relevant of the rest in order
+		ireq.top_docs.clear();
+		weights.clear();
+		for (int i = 0; i < max; ++i) {
+			greylock::intersect::single_doc_result doc;
+			doc.weight = (float)(1 + rand() % 1000) / 1001.0;
+			weights.push_back(doc.weight);
+			ireq.top_process(doc);
+		}
+
+		res = greylock::intersect::result();
+		ireq.top_finish(std::vector<greylock::eurl>(), res);
+
+		std::sort(weights.begin(), weights.end(), std::greater<float>());
+		weights.resize(ireq.top);
+
+		equal = res.docs.size() == weights.size();
+		for (size_t i = 0; equal && i < res.docs.size(); ++i)
+			equal = res.docs[i].relevance == weights[i];
+
+		if (!equal)
+			throw std::runtime_error("top: heap must keep the most relevant documents sorted by relevance");
+	}
+
+	// BM25: document frequencies are the key counters of the indexes (see @http_server::document_frequency()),
+	// document which contains the rarer word more times ranks above the document which contains
+	// the common word the same number of times at the same positions
+	void test_bm25(T &t, int max) {
+		std::string aname = "bm25-test." + elliptics::lexical_cast(rand()) + ".";
+
+		greylock::eurl rare, common;
+		rare.key = aname + "rare";
+		rare.bucket = m_bucket;
+		common.key = aname + "common";
+		common.bucket = m_bucket;
+
+		{
+			greylock::read_write_index<T> ridx(t, rare);
+			greylock::read_write_index<T> cidx(t, common);
+
+			for (int i = 0; i < max; ++i) {
+				greylock::key k;
+				k.id = "bm25-key." + elliptics::lexical_cast(i);
+				k.url.key = "bm25-data." + elliptics::lexical_cast(i);
+				k.url.bucket = m_bucket;
+				k.set_timestamp(i, 0);
+
+				cidx.insert(k);
+				if (i % 10 == 0)
+					ridx.insert(k);
+			}
+		}
+
+		greylock::indexes_request ireq;
+		ireq.bm25 = true;
+		ireq.num_documents = max;
+		ireq.indexes = {rare, common};
+
+		greylock::single_attribute sa;
+		sa.aname = aname;
+		sa.ivec = {0, 1};
+		ireq.attributes.push_back(sa);
+
+		for (const auto &url: ireq.indexes) {
+			greylock::read_only_index<T> idx(t, url);
+			ireq.df.push_back(idx.estimate_count());
+		}
+
+		if (ireq.df[0] != (uint64_t)(max + 9) / 10 || ireq.df[1] != (uint64_t)max) {
+			std::ostringstream ss;
+			ss << "bm25: document frequencies: rare: " << ireq.df[0] << ", common: " << ireq.df[1];
+			throw std::runtime_error(ss.str());
+		}
+
+		// both documents contain one word at positions 0 and 1 and the other one at position 5
+		auto document = [&] (const std::string &id, size_t twice) {
+			greylock::intersect::single_doc_result doc;
+			doc.doc.id = id;
+			doc.indexes.resize(ireq.indexes.size());
+			for (size_t i = 0; i < ireq.indexes.size(); ++i) {
+				doc.indexes[i].url = ireq.indexes[i];
+				doc.indexes[i].positions = i == twice ? std::vector<size_t>({0, 1}) : std::vector<size_t>({5});
+			}
+
+			return doc;
+		};
+
+		greylock::intersect::result res;
+		res.docs.push_back(document("bm25-common", 1));
+		res.docs.push_back(document("bm25-rare", 0));
+
+		ireq.distance_sort(ireq.indexes, res);
+
+		if (res.docs.size() != 2 || res.docs[0].doc.id != "bm25-rare" ||
+				!(res.docs[0].relevance > res.docs[1].relevance)) {
+			std::ostringstream ss;
+			ss << "bm25: the first document: " << res.docs[0].doc.id <<
+				", relevance: " << res.docs[0].relevance << ", the second one: " << res.docs[1].relevance;
+			throw std::runtime_error(ss.str());
+		}
+	}
+
+	// federated pages are merged from the mailbox pages which start from the cookie,
+	// every document of every mailbox must be returned exactly once, in key order
+	void test_federated_cookie(int max) {
+		std::vector<std::string> mailboxes({"test@federated.1", "test@federated.2", "test@federated.3"});
+
+		std::vector<std::vector<greylock::key>> keys(mailboxes.size());
+		std::vector<greylock::key> all;
+		for (int i = 0; i < max; ++i) {
+			greylock::key k;
+			k.id = "federated-key." + elliptics::lexical_cast(i);
+			k.set_timestamp(rand() % (max / 4), 0);
+
+			// some keys are present in several mailboxes
+			for (size_t m = 0; m < mailboxes.size(); ++m) {
+				if (m == 0 || rand() % 3 == 0) {
+					keys[(i + m) % mailboxes.size()].push_back(k);
+					all.push_back(k);
+				}
+			}
+		}
+		for (auto &v: keys)
+			std::sort(v.begin(), v.end());
+		std::stable_sort(all.begin(), all.end());
+
+		size_t page_num = 7;
+		std::vector<greylock::key> returned;
+		std::string packed;
+
+		for (size_t pages = 0; pages < all.size() + 1; ++pages) {
+			greylock::federated_cookie cookie;
+			if (!cookie.load(packed, mailboxes))
+				cookie = greylock::federated_cookie(mailboxes);
+
+			// intersection of the mailbox returns up to @page_num documents starting from its cookie
+			std::vector<greylock::intersect::result> results(mailboxes.size());
+			std::vector<greylock::intersect::result *> mailbox_pages(mailboxes.size(), NULL);
+			for (size_t m = 0; m < mailboxes.size(); ++m) {
+				if (cookie.completed[m])
+					continue;
+
+				greylock::intersect::paging_cookie pc;
+				bool started = pc.load(cookie.starts[m]);
+
+				greylock::intersect::result &res = results[m];
+				auto it = keys[m].begin();
+				if (started)
+					it = std::lower_bound(keys[m].begin(), keys[m].end(), pc.start);
+
+				for (; it != keys[m].end() && res.docs.size() < page_num; ++it) {
+					greylock::intersect::single_doc_result doc;
+					doc.doc = *it;
+					doc.relevance = rand();
+					res.docs.push_back(doc);
+				}
+
+				res.completed = it == keys[m].end();
+				if (!res.completed) {
+					pc.start.set_order(*it);
+					res.cookie = pc.save();
+				}
+
+				mailbox_pages[m] = &res;
+			}
+
+			std::vector<greylock::federated_cookie::candidate> merged = cookie.merge(mailbox_pages, page_num, false);
+			if (merged.size() > page_num)
+				throw std::runtime_error("federated: merged page is too large");
+
+			for (const auto &c: merged)
+				returned.push_back(c.doc->doc);
+
+			if (cookie.done())
+				break;
+
+			packed = cookie.save();
+		}
+
+		bool equal = returned.size() == all.size();
+		for (size_t i = 0; equal && i < all.size(); ++i)
+			equal = returned[i] == all[i];
+
+		if (!equal) {
+			std::ostringstream ss;
+			ss << "federated: returned documents: " << returned.size() << ", must be: " << all.size();
+			throw std::runtime_error(ss.str());
+		}
+
+		// cookie of the different list of mailboxes is not accepted
+		greylock::federated_cookie cookie(mailboxes), loaded;
+		cookie.starts[1] = "start";
+		packed = cookie.save();
+
+		std::vector<std::string> reordered({mailboxes[1], mailboxes[0], mailboxes[2]});
+		if (!loaded.load(packed, mailboxes) || loaded.starts[1] != "start" ||
+				loaded.load(packed, reordered) ||
+				loaded.load(packed, std::vector<std::string>(mailboxes.begin(), mailboxes.begin() + 2)))
+			throw std::runtime_error("federated: cookie must be accepted only for its own mailboxes");
+
+		// mailbox which has not been merged, for example because its search has failed, continues from its start
+		greylock::intersect::result page;
+		page.docs.resize(1);
+		page.docs[0].doc = all.front();
+		page.completed = true;
+		std::vector<greylock::intersect::result *> failed({&page, NULL, NULL});
+
+		cookie.merge(failed, page_num, false);
+		if (cookie.starts[1] != "start" || cookie.completed[1] || !cookie.completed[0] || cookie.done())
+			throw std::runtime_error("federated: mailbox which has not been merged must keep its start");
+	}
+
+	void test_search_sharing(int max) {
+		auto request = [] (const std::vector<std::string> &words) {
+			greylock::indexes_request ireq;
+			ireq.mailbox = "test@sharing";
+
+			greylock::single_attribute sa;
+			sa.aname = "test@sharing.body.";
+			for (const auto &w: words) {
+				greylock::eurl url;
+				url.bucket = "b";
+				url.key = sa.aname + w;
+
+				sa.ivec.push_back(ireq.indexes.size());
+				ireq.indexes.push_back(url);
+			}
+			ireq.attributes.push_back(sa);
+
+			return ireq;
+		};
+
+		greylock::time_range range(100, 200);
+		std::vector<std::string> words = {"first", "second"};
+		std::string key = request(words).search_key(range, max, "");
+		if (request(words).search_key(range, max, "") != key)
+			throw std::runtime_error("equal requests produce different search keys");
+
+		std::vector<std::string> different;
+		different.push_back(request({"first", "third"}).search_key(range, max, ""));
+		different.push_back(request({"second", "first"}).search_key(range, max, ""));
+		different.push_back(request(words).search_key(greylock::time_range(100, 300), max, ""));
+		different.push_back(request(words).search_key(range, max + 1, ""));
+		different.push_back(request(words).search_key(range, max, "cookie"));
+
+		greylock::indexes_request top = request(words);
+		top.top = 10;
+		different.push_back(top.search_key(range, max, ""));
+
+		greylock::indexes_request bm25 = request(words);
+		bm25.bm25 = true;
+		different.push_back(bm25.search_key(range, max, ""));
+
+		greylock::indexes_request count = request(words);
+		count.count = true;
+		different.push_back(count.search_key(range, max, ""));
+
+		greylock::indexes_request facets = request(words);
+		greylock::indexes_request::facet f;
+		f.attribute = "from";
+		f.value = "sender";
+		f.url.bucket = "b";
+		f.url.key = "test@sharing.from.sender";
+		facets.facets.push_back(f);
+		different.push_back(facets.search_key(range, max, ""));
+
+		greylock::indexes_request buckets = request(words);
+		buckets.facet_buckets = true;
+		different.push_back(buckets.search_key(range, max, ""));
+
+		std::set<std::string> keys(different.begin(), different.end());
+		keys.insert(key);
+		if (keys.size() != different.size() + 1) {
+			std::ostringstream ss;
+			ss << "search keys: different requests: " << different.size() + 1 << ", different keys: " << keys.size();
+			throw std::runtime_error(ss.str());
+		}
+
+		greylock::intersect::result result;
+		result.cookie = "next page";
+		for (int i = 0; i < max; ++i) {
+			greylock::intersect::single_doc_result doc;
+			doc.doc.id = "doc" + elliptics::lexical_cast(i);
+			result.docs.emplace_back(doc);
+		}
+
+		auto check_result = [&] (const char *what, const greylock::intersect::result &shared) {
+			bool equal = shared.cookie == result.cookie && shared.docs.size() == result.docs.size();
+			for (size_t i = 0; equal && i < shared.docs.size(); ++i)
+				equal = shared.docs[i].doc.id == result.docs[i].doc.id;
+
+			if (!equal) {
+				std::ostringstream ss;
+				ss << what << ": shared result differs: docs: " << shared.docs.size() <<
+					", must be: " << result.docs.size() << ", cookie: " << shared.cookie;
+				throw std::runtime_error(ss.str());
+			}
+		};
+
+		greylock::search_cache cache;
+		cache.set_max_memory(1024 * 1024);
+
+		auto e = std::make_shared<greylock::search_cache::entry>();
+		e->result = result;
+		cache.put(key, e);
+
+		greylock::search_cache::entry_ptr cached = cache.get(request(words).search_key(range, max, ""));
+		if (!cached)
+			throw std::runtime_error("cache: equal request has not found cached result");
+		check_result("cache", cached->result);
+
+		for (const auto &k: different) {
+			if (cache.get(k))
+				throw std::runtime_error("cache: different request has found cached result: " + k);
+		}
+
+		greylock::search_flights flights;
+		bool leader = false;
+
+		greylock::search_flight_ptr flight = flights.join(key, leader);
+		if (!leader)
+			throw std::runtime_error("coalescing: the first request is not a leader");
+
+		greylock::search_flight_ptr waiting = flights.join(request(words).search_key(range, max, ""), leader);
+		if (leader || waiting != flight)
+			throw std::runtime_error("coalescing: equal request has started its own search");
+
+		for (const auto &k: different) {
+			greylock::search_flight_ptr other = flights.join(k, leader);
+			if (!leader || other == flight)
+				throw std::runtime_error("coalescing: different request has joined the search: " + k);
+
+			flights.leave(k, other, greylock::intersect::result(), false);
+		}
+
+		if (flights.coalesced() != 1) {
+			std::ostringstream ss;
+			ss << "coalescing: coalesced requests: " << flights.coalesced() << ", must be: 1";
+			throw std::runtime_error(ss.str());
+		}
+
+		flights.leave(key, flight, result, false);
+
+		greylock::intersect::result shared;
+		if (!waiting->wait(shared))
+			throw std::runtime_error("coalescing: waiting request has got failed search");
+		check_result("coalescing", shared);
+
+		// search which has been finished is not shared with the requests arrived after it
+		flight = flights.join(key, leader);
+		if (!leader)
+			throw std::runtime_error("coalescing: finished search has been joined");
+		flights.leave(key, flight, result, false);
+	}
+
+	void test_completions(int max) {
+		greylock::completion_snapshot snapshot;
+		std::map<std::string, uint64_t> frequencies;
+
+		for (int i = 0; i < max; ++i) {
+			std::string w;
+			int len = 1 + rand() % 5;
+			for (int j = 0; j < len; ++j)
+				w.push_back('a' + rand() % 4);
+
+			uint64_t count = 1 + rand() % 3;
+			snapshot.add(w, count);
+			frequencies[w] += count;
+
+			// completions in the middle of the updates use both the tree and the pending words
+			if (i % 97 == 0)
+				snapshot.complete("a", 5);
+		}
+
+		// snapshot of the other server: it has been stored before the first one was merged into it,
+		// some of its words have not been read yet, and it has added documents of its own
+		greylock::completion_snapshot other, local = snapshot;
+		std::map<std::string, uint64_t> added, merged = frequencies;
+		for (const auto &p: frequencies) {
+			if (rand() % 3 == 0) {
+				other.set(p.first, greylock::completion_snapshot::unknown_frequency);
+			} else if (rand() % 2 == 0) {
+				other.set(p.first, p.second / 2);
+				added[p.first] = p.second - p.second / 2;
+			}
+		}
+		for (int i = 0; i < max / 10; ++i) {
+			std::string w = "d" + std::to_string(rand() % 100);
+			other.add(w, 1);
+			merged[w] += 1;
+		}
+
+		if (other.unknown("").empty() || !other.unknown("e").empty())
+			throw std::runtime_error("completions: unknown words mismatch");
+
+		std::string data = other.save();
+		greylock::completion_snapshot stored;
+		stored.load(data.data(), data.size());
+		stored.merge(local, added);
+
+		// snapshot is checked while it is updated, after it has been written and read back,
+		// and after it has been merged with the snapshot of the other server
+		greylock::completion_snapshot loaded;
+		data = snapshot.save();
+		loaded.load(data.data(), data.size());
+
+		for (auto c: {std::make_pair(&snapshot, &frequencies), std::make_pair(&loaded, &frequencies),
+				std::make_pair(&stored, &merged)}) {
+			for (const std::string prefix: {"", "a", "ab", "dcb", "abcda", "d1", "e"}) {
+				for (size_t num: {1, 5, 10}) {
+					std::vector<std::pair<std::string, uint64_t>> must_be;
+					for (const auto &p: *c.second) {
+						if (p.first.compare(0, prefix.size(), prefix) == 0)
+							must_be.push_back(p);
+					}
+					std::stable_sort(must_be.begin(), must_be.end(),
+							[] (const std::pair<std::string, uint64_t> &p1, const std::pair<std::string, uint64_t> &p2) {
+								return p1.second > p2.second;
+							});
+					if (must_be.size() > num)
+						must_be.resize(num);
+
+					std::vector<greylock::completion_snapshot::entry> completions = c.first->complete(prefix, num);
+
+					bool equal = completions.size() == must_be.size();
+					for (size_t i = 0; equal && i < completions.size(); ++i) {
+						equal = completions[i].word == must_be[i].first && completions[i].frequency == must_be[i].second;
+					}
+
+					if (!equal) {
+						std::ostringstream ss;
+						ss << "completions: prefix: " << prefix << ", num: " << num <<
+							", completions: " << completions.size() << ", must be: " << must_be.size();
+						throw std::runtime_error(ss.str());
+					}
+				}
+			}
+		}
+	}
+
+	void test_dictionary(T &t, int max) {
+		greylock::eurl dname, all, fifth;
+		dname.key = "dictionary-test.dictionary." + elliptics::lexical_cast(rand());
+		dname.bucket = m_bucket;
+		all.key = "dictionary-test.all." + elliptics::lexical_cast(rand());
+		all.bucket = m_bucket;
+		fifth.key = "dictionary-test.fifth." + elliptics::lexical_cast(rand());
+		fifth.bucket = m_bucket;
+
+		greylock::document_dictionary<T> dict(t, dname);
+
+		{
+			greylock::read_write_index<T> aidx(t, all);
+			greylock::read_write_index<T> fidx(t, fifth);
+
+			if (aidx.set_posting_format(greylock::index_meta::flag_compact_postings) ||
+					fidx.set_posting_format(greylock::index_meta::flag_compact_postings))
+				throw std::runtime_error("dictionary: could not set posting format of the empty index");
+
+			for (int i = 0; i < max; ++i) {
+				greylock::key k;
+				k.id = "dictionary-key." + elliptics::lexical_cast(i);
+				k.url.key = "dictionary-data." + elliptics::lexical_cast(i);
+				k.url.bucket = m_bucket;
+
+				// every 4 documents share the same timestamp, compact keys are ordered by number within it
+				k.set_timestamp(i / 4, 0);
+
+				int err = dict.insert(i, k);
+				if (err < 0)
+					throw std::runtime_error("dictionary: insert failed: " + elliptics::lexical_cast(err));
+
+				greylock::key ck = greylock::compact_key::encode(k, i);
+				aidx.insert(ck);
+				if (i % 5 == 0)
+					fidx.insert(ck);
+			}
+		}
+
+		greylock::intersect::intersector<T> inter(t);
+		std::string start;
+		greylock::intersect::result res = inter.intersect(std::vector<greylock::eurl>({all, fifth}), start, max);
+
+		std::vector<greylock::key *> keys;
+		for (auto &doc: res.docs)
+			keys.push_back(&doc.doc);
+
+		int err = dict.resolve(keys);
+		if (err < 0)
+			throw std::runtime_error("dictionary: resolve failed: " + elliptics::lexical_cast(err));
+
+		long must_be = (max + 4) / 5;
+		if ((long)res.docs.size() != must_be) {
+			std::ostringstream ss;
+			ss << "dictionary: found documents: " << res.docs.size() << ", must be: " << must_be;
+			throw std::runtime_error(ss.str());
+		}
+
+		for (size_t i = 0; i < res.docs.size(); ++i) {
+			const greylock::key &doc = res.docs[i].doc;
+			std::string num = elliptics::lexical_cast(i * 5);
+			if (doc.id != "dictionary-key." + num || doc.url.key != "dictionary-data." + num) {
+				std::ostringstream ss;
+				ss << "dictionary: document: " << doc.str() << ", must be: " << num;
+				throw std::runtime_error(ss.str());
+			}
+		}
+
+		// compact keys are compared by number, not by its text, and follow the key without id and number
+		greylock::key doc;
+		doc.set_timestamp(1, 0);
+		greylock::key k9 = greylock::compact_key::encode(doc, 9), k16 = greylock::compact_key::encode(doc, 16);
+		greylock::key first;
+		first.timestamp = doc.timestamp;
+		if (!(k9 < k16) || k9 == k16 || !(first < k9) || !k9)
+			throw std::runtime_error("dictionary: compact keys are not ordered by number");
+
+		// full key whose id looks like a number is not compact
+		greylock::key hex;
+		hex.id = "00000010";
+		uint32_t num;
+		if (greylock::compact_key::decode(hex, num) || !greylock::compact_key::decode(k16, num) || num != 16)
+			throw std::runtime_error("dictionary: compact key is recognized by its id");
+
+		// cookie keeps the number of the compact key
+		greylock::intersect::paging_cookie cookie, loaded;
+		cookie.start = k16;
+		if (!loaded.load(cookie.save()) || loaded.start != k16 || !loaded.start.compact())
+			throw std::runtime_error("dictionary: cookie does not keep compact key");
+
+		greylock::key nk = greylock::numeric_key::decode(greylock::numeric_key::encode(-5, k16));
+		if (nk != k16 || !nk.compact())
+			throw std::runtime_error("dictionary: numeric key does not keep compact key: " + nk.str());
+
+		// document which is not in the dictionary is not resolved
+		greylock::key missing = greylock::compact_key::encode(doc, max + greylock::dictionary_chunk::chunk_size);
+		keys.assign(1, &missing);
+		if (dict.resolve(keys) == 0)
+			throw std::runtime_error("dictionary: missing document has been resolved");
+
+		// index keeps its posting format, keys of the other format are refused
+		{
+			greylock::read_write_index<T> aidx(t, all);
+			if (aidx.meta().posting_format() != greylock::index_meta::flag_compact_postings)
+				throw std::runtime_error("dictionary: posting format is not stored: " + aidx.meta().str());
+
+			int err = aidx.set_posting_format(greylock::index_meta::flag_full_postings);
+			if (err != -EINVAL)
+				throw std::runtime_error("dictionary: full keys are accepted by the compact index: " +
+						elliptics::lexical_cast(err));
+		}
+	}
+
+	void test_dense(T &t, int max) {
+		greylock::eurl docs, half, third;
+		docs.key = "dense-test.documents." + elliptics::lexical_cast(rand());
+		docs.bucket = m_bucket;
+		half.key = "dense-test.half." + elliptics::lexical_cast(rand());
+		half.bucket = m_bucket;
+		third.key = "dense-test.third." + elliptics::lexical_cast(rand());
+		third.bucket = m_bucket;
+		greylock::eurl dictionary;
+		dictionary.key = "dense-test.dictionary." + elliptics::lexical_cast(rand());
+		dictionary.bucket = m_bucket;
+
+		{
+			greylock::read_write_index<T> didx(t, docs);
+			greylock::read_write_index<T> hidx(t, half);
+			greylock::read_write_index<T> tidx(t, third);
+			greylock::document_dictionary<T> dict(t, dictionary);
+
+			for (int i = 0; i < max; ++i) {
+				greylock::key k;
+				char id[32];
+				snprintf(id, sizeof(id), "dense-key.%08d", i);
+				k.id = id;
+				k.url.key = "dense-data." + elliptics::lexical_cast(i);
+				k.url.bucket = m_bucket;
+				k.set_timestamp(i, 0);
+
+				if (i % 2 == 0)
+					hidx.insert(k);
+				if (i % 3 == 0)
+					tidx.insert(k);
+
+				// documents are numbered in reverse order, bitmap order does not have to match key order
+				k.number = max - i;
+				didx.insert(k);
+
+				int err = dict.insert(max - i, k);
+				if (err < 0)
+					throw std::runtime_error("dense: dictionary insert failed: " + elliptics::lexical_cast(err));
+			}
+		}
+
+		uint32_t num;
+		greylock::key nk;
+		nk.number = 7;
+		nk.positions.assign(1, 5);
+		if (!greylock::document_number(nk, num) || num != 7)
+			throw std::runtime_error("dense: document number is not taken from the key field");
+		nk.number = greylock::key::no_number;
+		if (greylock::document_number(nk, num))
+			throw std::runtime_error("dense: document position is taken as its number");
+
+		auto check = [&] (const std::vector<greylock::eurl> &indexes, const greylock::intersect::options &opts,
+				int divisor) {
+			greylock::intersect::intersector<T> inter(t);
+			std::string start;
+			greylock::intersect::result res = inter.intersect(indexes, opts, start, max,
+					[] (const std::vector<greylock::eurl> &, greylock::intersect::result &) { return true; });
+
+			long must_be = (max + divisor - 1) / divisor;
+			if ((long)res.docs.size() != must_be) {
+				std::ostringstream ss;
+				ss << "dense: found documents: " << res.docs.size() << ", must be: " << must_be;
+				throw std::runtime_error(ss.str());
+			}
+
+			for (const auto &doc: res.docs) {
+				long tsec, tnsec;
+				doc.doc.get_timestamp(tsec, tnsec);
+				if (tsec % divisor != 0 || doc.indexes.size() != indexes.size() ||
+						doc.indexes.back().url != indexes.back()) {
+					std::ostringstream ss;
+					ss << "dense: document: " << doc.doc.str() << " must not be found";
+					throw std::runtime_error(ss.str());
+				}
+			}
+		};
+
+		greylock::dense_index<T> hdense(t, half);
+		int err = hdense.convert(docs);
+		if (err < 0 || hdense.term().docs.cardinality() != (uint64_t)(max + 1) / 2) {
+			std::ostringstream ss;
+			ss << "dense: conversion: error: " << err << ", bitmap: " << hdense.term().docs.str();
+			throw std::runtime_error(ss.str());
+		}
+
+		// bitmap x list
+		auto hdocs = std::make_shared<greylock::bitmap>(hdense.term().docs);
+
+		greylock::intersect::options opts;
+		opts.lists.push_back(std::make_shared<greylock::bitmap_postings<T>>(t, half.str(), docs, hdocs,
+					greylock::key(), greylock::time_range()));
+		check(std::vector<greylock::eurl>({half, third}), opts, 6);
+
+		// bitmap x bitmap, the same list replaces both indexes
+		greylock::dense_index<T> tdense(t, third);
+		err = tdense.convert(docs);
+		if (err < 0)
+			throw std::runtime_error("dense: conversion failed: " + elliptics::lexical_cast(err));
+
+		hdocs->intersect(tdense.term().docs);
+
+		greylock::posting_list_ptr list = std::make_shared<greylock::bitmap_postings<T>>(t, "both", docs, hdocs,
+				greylock::key(), greylock::time_range());
+		opts.lists.assign(2, list);
+		check(std::vector<greylock::eurl>({half, third}), opts, 6);
+
+		// small bitmap is looked up in the dictionary, its list must be equal to the documents index scan
+		auto sparse = std::make_shared<greylock::bitmap>();
+		for (int i = 0; i < std::min(max, 600); i += 6)
+			sparse->add(max - i);
+
+		for (const auto &range: {greylock::time_range(), greylock::time_range(100, 400)}) {
+			auto read_list = [] (greylock::posting_list &l) {
+				std::vector<greylock::key> ret;
+				for (; !l.end(); l.next())
+					ret.push_back(l.current());
+				return ret;
+			};
+
+			greylock::bitmap_postings<T> scan(t, "scan", docs, sparse, range.start_key(), range);
+			greylock::bitmap_postings<T> lookup(t, "lookup", docs, sparse, range.start_key(), range, false, dictionary);
+
+			std::vector<greylock::key> scanned = read_list(scan);
+			std::vector<greylock::key> looked_up = read_list(lookup);
+
+			bool equal = !scanned.empty() && scanned.size() == looked_up.size();
+			for (size_t i = 0; equal && i < scanned.size(); ++i) {
+				equal = scanned[i] == looked_up[i] && scanned[i].url == looked_up[i].url &&
+					scanned[i].number == looked_up[i].number;
+			}
+
+			if (!equal) {
+				std::ostringstream ss;
+				ss << "dense: range: " << range.str() << ", scanned documents: " << scanned.size() <<
+					", looked up documents: " << looked_up.size();
+				throw std::runtime_error(ss.str());
+			}
+		}
+
+		// dense words are removed from the phrase, documents are matched by the rest of the words
+		greylock::intersect::phrase_match phrase;
+		phrase.type = greylock::intersect::phrase_match::match_phrase;
+		phrase.groups.resize(1);
+		for (size_t i = 0; i < 3; ++i) {
+			greylock::intersect::phrase_match::word w;
+			w.index = i;
+			w.offsets.push_back(i);
+			phrase.groups[0].push_back(w);
+		}
+
+		phrase.relax([] (size_t index) { return index == 1; });
+		if (!phrase.relaxed || phrase.groups[0].size() != 2)
+			throw std::runtime_error("dense: phrase has not been relaxed");
+
+		// retention removes expired documents from the bitmap, it is converted back into array
+		// when it becomes small enough
+		int expired = std::min(max, 2000);
+		std::vector<uint32_t> nums;
+		for (int i = 0; i < expired; ++i)
+			nums.push_back(max - i);
+
+		size_t removed;
+		err = hdense.remove(nums, removed);
+		if (err < 0 || removed != (size_t)(expired + 1) / 2)
+			throw std::runtime_error("dense: bitmap truncation: error: " + elliptics::lexical_cast(err) +
+					", removed: " + elliptics::lexical_cast(removed));
+
+		greylock::dense_index<T> loaded(t, half);
+		err = loaded.load();
+		if (err < 0)
+			throw std::runtime_error("dense: truncated bitmap can not be loaded: " + elliptics::lexical_cast(err));
+
+		for (int i = 0; i < max; ++i) {
+			bool must_be = i % 2 == 0 && i >= expired;
+			if (loaded.term().docs.contains(max - i) != must_be) {
+				std::ostringstream ss;
+				ss << "dense: truncated bitmap: document: " << i << ", must be present: " << must_be <<
+					", bitmap: " << loaded.term().docs.str();
+				throw std::runtime_error(ss.str());
+			}
+		}
+	}
+
+	void test_deadline(T &t, int max) {
+		greylock::eurl all, seventh;
+		all.key = "deadline-test.all." + elliptics::lexical_cast(rand());
+		all.bucket = m_bucket;
+		seventh.key = "deadline-test.seventh." + elliptics::lexical_cast(rand());
+		seventh.bucket = m_bucket;
+
+		{
+			greylock::read_write_index<T> aidx(t, all);
+			greylock::read_write_index<T> sidx(t, seventh);
+
+			for (int i = 0; i < max; ++i) {
+				greylock::key k;
+				char id[32];
+				snprintf(id, sizeof(id), "deadline-key.%08d", i);
+				k.id = id;
+				k.url.key = "deadline-data." + elliptics::lexical_cast(i);
+				k.url.bucket = m_bucket;
+				k.set_timestamp(i, 0);
+
+				aidx.insert(k);
+				if (i % 7 == 0)
+					sidx.insert(k);
+			}
+		}
+
+		greylock::intersect::intersector<T> inter(t);
+
+		// deadline has already passed, every request returns partial result after a bounded number of candidates,
+		// but every next request continues from the cookie and all documents are eventually found exactly once
+		greylock::intersect::options opts;
+		opts.deadline = std::chrono::steady_clock::now();
+
+		std::set<std::string> found;
+		long partial = 0;
+		std::string start;
+		while (true) {
+			greylock::intersect::result res = inter.intersect(std::vector<greylock::eurl>({all, seventh}), opts,
+					start, max,
+					[] (const std::vector<greylock::eurl> &, greylock::intersect::result &) { return true; });
+
+			for (const auto &doc: res.docs) {
+				if (!found.insert(doc.doc.id).second) {
+					std::ostringstream ss;
+					ss << "deadline: document: " << doc.doc.str() << " has been returned twice";
+					throw std::runtime_error(ss.str());
+				}
+			}
+
+			if (res.deadline_exceeded) {
+				if (res.completed || start.empty())
+					throw std::runtime_error("deadline: partial result must not be completed and must have cookie");
+				partial++;
+			}
+
+			if (res.completed)
+				break;
+		}
+
+		long must_be = (max + 6) / 7;
+		if ((long)found.size() != must_be || partial == 0) {
+			std::ostringstream ss;
+			ss << "deadline: found documents: " << found.size() << ", must be: " << must_be <<
+				", partial results: " << partial;
+			throw std::runtime_error(ss.str());
+		}
+	}
+
+	void test_paging_cookie(T &t, int max) {
+		greylock::eurl all, half;
+		all.key = "cookie-test.all." + elliptics::lexical_cast(rand());
+		all.bucket = m_bucket;
+		half.key = "cookie-test.half." + elliptics::lexical_cast(rand());
+		half.bucket = m_bucket;
+
+		// document ids decrease with time and every 10 documents share the same timestamp,
+		// cookie which does not contain timestamp restarts from the wrong place
+		{
+			greylock::read_write_index<T> aidx(t, all);
+			greylock::read_write_index<T> hidx(t, half);
+
+			for (int i = 0; i < max; ++i) {
+				greylock::key k;
+				char id[32];
+				snprintf(id, sizeof(id), "cookie-key.%08d", max - i);
+				k.id = id;
+				k.url.key = "cookie-data." + elliptics::lexical_cast(i);
+				k.url.bucket = m_bucket;
+				k.set_timestamp(i / 10, 0);
+
+				aidx.insert(k);
+				if ((i & 1) == 0)
+					hidx.insert(k);
+			}
+		}
+
+		greylock::intersect::intersector<T> inter(t);
+
+		// every page is started from the cookie returned by the previous one, as if by a different server
+		std::set<std::string> found;
+		std::string start;
+		do {
+			greylock::intersect::result res = inter.intersect(std::vector<greylock::eurl>({all, half}), start, 9);
+
+			for (const auto &doc: res.docs) {
+				if (!found.insert(doc.doc.id).second) {
+					std::ostringstream ss;
+					ss << "paging cookie: document: " << doc.doc.str() << " has been returned twice";
+					throw std::runtime_error(ss.str());
+				}
+			}
+
+			// callers which only keep the result, like the server, continue from its cookie
+			if (res.cookie != start || res.max_number_of_documents != 9) {
+				std::ostringstream ss;
+				ss << "paging cookie: result cookie: " << res.cookie.size() << " bytes, start: " << start.size() <<
+					" bytes, requested number of documents: " << res.max_number_of_documents;
+				throw std::runtime_error(ss.str());
+			}
+
+			greylock::intersect::paging_cookie cookie;
+			if (!start.empty() && (!cookie.load(start) || cookie.positions.size() != 2)) {
+				throw std::runtime_error("paging cookie: could not load cookie returned by intersection");
+			}
+		} while (!start.empty());
+
+		if ((long)found.size() != (max + 1) / 2) {
+			std::ostringstream ss;
+			ss << "paging cookie: found documents: " << found.size() << ", must be: " << (max + 1) / 2;
+			throw std::runtime_error(ss.str());
+		}
+
+		// bare document id sent by the older clients within a time range must not restart the range
+		auto all_docs = [] (const std::vector<greylock::eurl> &, greylock::intersect::result &) {return true;};
+		greylock::time_range range(max / 40, max / 20);
+
+		greylock::intersect::result first = inter.intersect(std::vector<greylock::eurl>({all}), start, 5, range, all_docs);
+
+		start = first.docs.back().doc.id;
+		greylock::intersect::result res = inter.intersect(std::vector<greylock::eurl>({all}), start, 5, range, all_docs);
+		for (const auto &doc: res.docs) {
+			for (const auto &prev: first.docs) {
+				if (doc.doc.id == prev.doc.id) {
+					std::ostringstream ss;
+					ss << "paging cookie: bare id: " << first.docs.back().doc.id <<
+						", document: " << doc.doc.str() << " has been returned again";
+					throw std::runtime_error(ss.str());
+				}
+			}
+		}
+	}
+
+	void test_cursor(T &t, int max) {
+		greylock::eurl all, third;
+		all.key = "cursor-test.all." + elliptics::lexical_cast(rand());
+		all.bucket = m_bucket;
+		third.key = "cursor-test.third." + elliptics::lexical_cast(rand());
+		third.bucket = m_bucket;
+
+		{
+			greylock::read_write_index<T> aidx(t, all);
+			greylock::read_write_index<T> tidx(t, third);
+
+			for (int i = 0; i < max; ++i) {
+				greylock::key k;
+				char id[32];
+				snprintf(id, sizeof(id), "cursor-key.%08d", i);
+				k.id = id;
+				k.url.key = "cursor-data." + elliptics::lexical_cast(i);
+				k.url.bucket = m_bucket;
+				k.set_timestamp(i, 0);
+
+				aidx.insert(k);
+				if (i % 3 == 0)
+					tidx.insert(k);
+			}
+		}
+
+		greylock::intersect::intersector<T> inter(t);
+
+		std::string start;
+		greylock::intersect::cursor_ptr cursor = inter.open(std::vector<greylock::eurl>({all, third}),
+				greylock::intersect::options(), start);
+
+		// every page continues where the previous one has stopped, documents are neither lost nor repeated
+		long found = 0;
+		std::string last;
+		while (true) {
+			greylock::intersect::result res = cursor->next(start, 7,
+					[] (const std::vector<greylock::eurl> &, greylock::intersect::result &) { return true; });
+
+			for (const auto &doc: res.docs) {
+				if (doc.doc.id <= last) {
+					std::ostringstream ss;
+					ss << "cursor: document: " << doc.doc.str() << " follows " << last;
+					throw std::runtime_error(ss.str());
+				}
+
+				last = doc.doc.id;
+			}
+
+			found += res.docs.size();
+			if (res.completed)
+				break;
+		}
+
+		long must_be = (max + 2) / 3;
+		if (found != must_be || !cursor->completed() || !start.empty()) {
+			std::ostringstream ss;
+			ss << "cursor: found documents: " << found << ", must be: " << must_be <<
+				", completed: " << cursor->completed() << ", start: " << start;
+			throw std::runtime_error(ss.str());
+		}
+
+		// streamed page is read in batches, stream which has been stopped continues from the cookie
+		const size_t batch = 7;
+		std::vector<std::string> streamed;
+		size_t batches = 0;
+		auto process = [&] (const greylock::intersect::result &res) {
+			if (res.docs.size() > batch) {
+				std::ostringstream ss;
+				ss << "cursor: streamed batch: " << res.docs.size() << ", must be at most: " << batch;
+				throw std::runtime_error(ss.str());
+			}
+
+			for (const auto &doc: res.docs) {
+				if (!streamed.empty() && doc.doc.id <= streamed.back()) {
+					std::ostringstream ss;
+					ss << "cursor: streamed document: " << doc.doc.str() << " follows " << streamed.back();
+					throw std::runtime_error(ss.str());
+				}
+
+				streamed.push_back(doc.doc.id);
+			}
+
+			return ++batches != 3;
+		};
+
+		start.clear();
+		cursor = inter.open(std::vector<greylock::eurl>({all, third}), greylock::intersect::options(), start);
+
+		greylock::intersect::result res = cursor->stream(start, must_be, batch,
+				[] (const std::vector<greylock::eurl> &, greylock::intersect::result &) { return true; }, process);
+		if (batches != 3 || streamed.size() != batch * 3 || res.completed || !res.docs.empty() ||
+				start.empty() || res.cookie != start) {
+			std::ostringstream ss;
+			ss << "cursor: stopped stream: batches: " << batches << ", documents: " << streamed.size() <<
+				", must be: " << batch * 3 << ", completed: " << res.completed << ", start: " << start;
+			throw std::runtime_error(ss.str());
+		}
+
+		res = cursor->stream(start, must_be, batch,
+				[] (const std::vector<greylock::eurl> &, greylock::intersect::result &) { return true; }, process);
+		if ((long)streamed.size() != must_be || !res.completed || !start.empty()) {
+			std::ostringstream ss;
+			ss << "cursor: streamed documents: " << streamed.size() << ", must be: " << must_be <<
+				", completed: " << res.completed << ", start: " << start;
+			throw std::runtime_error(ss.str());
+		}
+	}
+
+	void test_count(T &t, int max) {
+		greylock::eurl all, fifth;
+		all.key = "count-test.all." + elliptics::lexical_cast(rand());
+		all.bucket = m_bucket;
+		fifth.key = "count-test.fifth." + elliptics::lexical_cast(rand());
+		fifth.bucket = m_bucket;
+
+		{
+			greylock::read_write_index<T> aidx(t, all);
+			greylock::read_write_index<T> fidx(t, fifth);
+
+			for (int i = 0; i < max; ++i) {
+				greylock::key k;
+				char id[32];
+				snprintf(id, sizeof(id), "count-key.%08d", i);
+				k.id = id;
+				k.url.key = "count-data." + elliptics::lexical_cast(i);
+				k.url.bucket = m_bucket;
+				k.set_timestamp(i, 0);
+
+				aidx.insert(k);
+				if (i % 5 == 0)
+					fidx.insert(k);
+			}
+		}
+
+		greylock::intersect::intersector<T> inter(t);
+		std::vector<greylock::eurl> indexes({all, fifth});
+		uint64_t must_be = (max + 4) / 5;
+
+		std::string start;
+		greylock::intersect::result res = inter.count(indexes, greylock::intersect::options(), start, ~0UL);
+		if (res.count != must_be || !res.docs.empty() || !res.completed) {
+			std::ostringstream ss;
+			ss << "count: counted documents: " << res.count << ", must be: " << must_be <<
+				", returned documents: " << res.docs.size() << ", completed: " << res.completed;
+			throw std::runtime_error(ss.str());
+		}
+
+		// existence check stops at the first match, cookie points at the next candidate of the driving (smallest) list
+		start.clear();
+		res = inter.count(indexes, greylock::intersect::options(), start, 1);
+		greylock::intersect::paging_cookie cookie;
+		if (res.count != 1 || res.completed || !cookie.load(start) || cookie.start.id != "count-key.00000005") {
+			std::ostringstream ss;
+			ss << "count: existence: counted documents: " << res.count << ", completed: " << res.completed <<
+				", cookie: " << cookie.start.str();
+			throw std::runtime_error(ss.str());
+		}
+
+		// count resumed from that cookie does not count the first match again
+		res = inter.count(indexes, greylock::intersect::options(), start, ~0UL);
+		if (res.count != must_be - 1 || !res.completed) {
+			std::ostringstream ss;
+			ss << "count: resumed after existence: counted documents: " << res.count << ", must be: " << must_be - 1 <<
+				", completed: " << res.completed;
+			throw std::runtime_error(ss.str());
+		}
+
+		// partial counts continued from their cookies add up to the whole count
+		greylock::intersect::options opts;
+		opts.deadline = std::chrono::steady_clock::now();
+
+		uint64_t counted = 0;
+		start.clear();
+		do {
+			res = inter.count(indexes, opts, start, ~0UL);
+			counted += res.count;
+		} while (!res.completed);
+
+		if (counted != must_be) {
+			std::ostringstream ss;
+			ss << "count: counted documents with deadline: " << counted << ", must be: " << must_be;
+			throw std::runtime_error(ss.str());
+		}
+	}
+
+	void test_facets(T &t, int max) {
+		greylock::eurl all, half, third;
+		all.key = "facets-test.all." + elliptics::lexical_cast(rand());
+		all.bucket = m_bucket;
+		half.key = "facets-test.half." + elliptics::lexical_cast(rand());
+		half.bucket = m_bucket;
+		third.key = "facets-test.third." + elliptics::lexical_cast(rand());
+		third.bucket = m_bucket;
+
+		// documents are split between two buckets, every document of the first one is followed by the second
+		std::vector<std::string> buckets({"facets-bucket.0", "facets-bucket.1"});
+		{
+			greylock::read_write_index<T> aidx(t, all);
+			greylock::read_write_index<T> hidx(t, half);
+			greylock::read_write_index<T> tidx(t, third);
+
+			for (int i = 0; i < max; ++i) {
+				greylock::key k;
+				char id[32];
+				snprintf(id, sizeof(id), "facets-key.%08d", i);
+				k.id = id;
+				k.url.key = "facets-data." + elliptics::lexical_cast(i);
+				k.url.bucket = buckets[(i / 2) % 2];
+				k.set_timestamp(i, 0);
+
+				aidx.insert(k);
+				if (i % 2 == 0)
+					hidx.insert(k);
+				if (i % 3 == 0)
+					tidx.insert(k);
+			}
+		}
+
+		greylock::intersect::intersector<T> inter(t);
+
+		// facets are counted over all matching documents, not only over the returned page
+		greylock::intersect::options opts;
+		opts.facets.push_back(inter.postings(third, greylock::key(), opts.range));
+		opts.facet_buckets = true;
+
+		std::string start;
+		size_t num = 10;
+		greylock::intersect::result res = inter.intersect(std::vector<greylock::eurl>({all, half}), opts, start, num,
+				[] (const std::vector<greylock::eurl> &, greylock::intersect::result &) { return true; });
+
+		uint64_t matches = (max + 1) / 2;
+		uint64_t sixth = (max + 5) / 6;
+		uint64_t first_bucket = (matches + 1) / 2;
+		if (res.docs.size() != num || res.completed || start.empty() || !res.facets_completed ||
+				res.facets.size() != 1 || res.facets[0] != sixth ||
+				res.facet_buckets[buckets[0]] != first_bucket ||
+				res.facet_buckets[buckets[1]] != matches - first_bucket) {
+			std::ostringstream ss;
+			ss << "facets: returned documents: " << res.docs.size() << ", must be: " << num <<
+				", completed: " << res.completed << ", facets completed: " << res.facets_completed <<
+				", third facet: " << (res.facets.empty() ? 0 : res.facets[0]) << ", must be: " << sixth <<
+				", first bucket: " << res.facet_buckets[buckets[0]] << ", must be: " << first_bucket <<
+				", second bucket: " << res.facet_buckets[buckets[1]] << ", must be: " << matches - first_bucket;
+			throw std::runtime_error(ss.str());
+		}
+
+		// cookie saved before facets have been counted continues right after the page
+		res = inter.intersect(std::vector<greylock::eurl>({all, half}), start, num);
+
+		char id[32];
+		snprintf(id, sizeof(id), "facets-key.%08zd", num * 2);
+		if (res.docs.empty() || res.docs[0].doc.id != id) {
+			std::ostringstream ss;
+			ss << "facets: next page starts with: " << (res.docs.empty() ? "none" : res.docs[0].doc.id) <<
+				", must be: " << id;
+			throw std::runtime_error(ss.str());
+		}
+	}
+
+	void test_phrase(T &t, int max) {
+		greylock::eurl first, second;
+		first.key = "phrase-test.first." + elliptics::lexical_cast(rand());
+		first.bucket = m_bucket;
+		second.key = "phrase-test.second." + elliptics::lexical_cast(rand());
+		second.bucket = m_bucket;
+
+		// every document contains both words, the second word follows the first one in the even documents,
+		// in the odd documents the second word is @i % 10 positions before the first one
+		{
+			greylock::read_write_index<T> fidx(t, first);
+			greylock::read_write_index<T> sidx(t, second);
+
+			for (int i = 0; i < max; ++i) {
+				greylock::key k;
+				k.id = "phrase-key." + elliptics::lexical_cast(i);
+				k.url.key = "phrase-data." + elliptics::lexical_cast(i);
+				k.url.bucket = m_bucket;
+				k.set_timestamp(i, 0);
+
+				k.positions = std::vector<size_t>({10, 30});
+				fidx.insert(k);
+
+				if ((i & 1) == 0)
+					k.positions = std::vector<size_t>({11});
+				else
+					k.positions = std::vector<size_t>({10 - (size_t)(i % 10)});
+				sidx.insert(k);
+			}
+		}
+
+		greylock::intersect::intersector<T> inter(t);
+
+		auto check_match = [&] (const greylock::intersect::phrase_match &match, long must_be) {
+			std::string start;
+			greylock::intersect::result res = inter.intersect(std::vector<greylock::eurl>({first, second}),
+					std::vector<greylock::posting_list_ptr>(), std::vector<greylock::posting_list_ptr>(), match,
+					start, INT_MAX, greylock::time_range(),
+					[] (const std::vector<greylock::eurl> &, greylock::intersect::result &) { return true; });
+
+			if ((long)res.docs.size() != must_be) {
+				std::ostringstream ss;
+				ss << "phrase: match: " << match.str() << ", found documents: " << res.docs.size() <<
+					", must be: " << must_be;
+				throw std::runtime_error(ss.str());
+			}
+		};
+
+		greylock::intersect::phrase_match match;
+		check_match(match, max);
+
+		greylock::intersect::phrase_match::word w0, w1;
+		w0.index = 0;
+		w0.offsets.push_back(0);
+		w1.index = 1;
+		w1.offsets.push_back(1);
+		match.groups.push_back({w0, w1});
+
+		match.type = greylock::intersect::phrase_match::match_phrase;
+		check_match(match, max / 2);
+
+		// odd documents with i % 10 == 1, 3 fit into the window of 3 positions
+		match.type = greylock::intersect::phrase_match::match_proximity;
+		match.distance = 3;
+		check_match(match, max / 2 + max / 5);
+	}
+
+	void test_operators(T &t, int max) {
+		// index number N contains every document whose number is divisible by @divs[N]
+		std::vector<int> divs({1, 2, 3, 5});
+		std::vector<greylock::eurl> urls;
+
+		for (size_t n = 0; n < divs.size(); ++n) {
+			greylock::eurl url;
+			url.key = "operators-test." + elliptics::lexical_cast(divs[n]) + "." + elliptics::lexical_cast(rand());
+			url.bucket = m_bucket;
+			urls.push_back(url);
+		}
+
+		for (size_t n = 0; n < divs.size(); ++n) {
+			greylock::read_write_index<T> idx(t, urls[n]);
+
+			for (int i = 0; i < max; i += divs[n]) {
+				greylock::key k;
+				k.id = "operators-key." + elliptics::lexical_cast(i);
+				k.url.key = "operators-data." + elliptics::lexical_cast(i);
+				k.url.bucket = m_bucket;
+				k.set_timestamp(i, 0);
+
+				int err = idx.insert(k);
+				if (err < 0) {
+					std::ostringstream ss;
+					ss << "operators: failed to insert key: " << k.str() << ": " << err;
+					throw std::runtime_error(ss.str());
+				}
+			}
+		}
+
+		greylock::intersect::intersector<T> inter(t);
+		greylock::time_range range;
+
+		// all AND (by 2 OR by 3) NOT by 5
+		std::vector<greylock::posting_list_ptr> any;
+		any.emplace_back(inter.postings(urls[1], range.start_key(), range));
+		any.emplace_back(inter.postings(urls[2], range.start_key(), range));
+
+		std::vector<greylock::posting_list_ptr> filters;
+		filters.emplace_back(std::make_shared<greylock::union_postings>("or", std::move(any)));
+
+		std::vector<greylock::posting_list_ptr> excludes;
+		excludes.emplace_back(inter.postings(urls[3], range.start_key(), range));
+
+		std::string start;
+		greylock::intersect::result res = inter.intersect(std::vector<greylock::eurl>({urls[0]}), filters, excludes,
+				start, INT_MAX, range,
+				[] (const std::vector<greylock::eurl> &, greylock::intersect::result &) { return true; });
+
+		long must_be = 0;
+		for (int i = 0; i < max; ++i) {
+			if ((i % 2 == 0 || i % 3 == 0) && i % 5 != 0)
+				must_be++;
+		}
+
+		for (auto &r: res.docs) {
+			long tsec, tnsec;
+			r.doc.get_timestamp(tsec, tnsec);
+
+			if ((tsec % 2 != 0 && tsec % 3 != 0) || tsec % 5 == 0) {
+				std::ostringstream ss;
+				ss << "operators: document: " << r.doc.str() << " must not be found";
+				throw std::runtime_error(ss.str());
+			}
+		}
+
+		if ((long)res.docs.size() != must_be) {
+			std::ostringstream ss;
+			ss << "operators: found documents: " << res.docs.size() << ", must be: " << must_be;
+			throw std::runtime_error(ss.str());
+		}
+	}
+
+	void test_phrase_postings(int max) {
+		// the first list contains positions {i % 5, 10}, the second - {i % 3 + 1}
+		std::vector<greylock::key> first, second;
+		for (int i = 0; i < max; ++i) {
+			greylock::key k;
+			k.id = "phrase-postings-key." + elliptics::lexical_cast(i);
+			k.set_timestamp(i, 0);
+
+			k.positions = std::vector<size_t>({(size_t)i % 5, 10});
+			first.push_back(k);
+
+			k.positions = std::vector<size_t>({(size_t)i % 3 + 1});
+			second.push_back(k);
+		}
+
+		// document matches if some position of the first list plus @offset is a position of the second list,
+		// shifted second list has its positions increased by @shift
+		auto matches = [] (long i, size_t offset, size_t shift) {
+			size_t second = i % 3 + 1 + shift;
+			return (size_t)i % 5 + offset == second || 10 + offset == second;
+		};
+
+		auto check = [&] (size_t offset, size_t shift) {
+			greylock::posting_list_ptr slist = std::make_shared<greylock::vector_postings>("second",
+					std::vector<greylock::key>(second));
+			if (shift)
+				slist = std::make_shared<greylock::shifted_postings>(slist, shift);
+
+			std::vector<greylock::posting_list_ptr> lists;
+			lists.emplace_back(std::make_shared<greylock::vector_postings>("first", std::vector<greylock::key>(first)));
+			lists.emplace_back(slist);
+
+			greylock::phrase_postings phrase("phrase", std::move(lists), std::vector<size_t>({0, offset}));
+
+			long found = 0;
+			for (; !phrase.end(); phrase.next()) {
+				long tsec, tnsec;
+				phrase.current().get_timestamp(tsec, tnsec);
+				if (!matches(tsec, offset, shift)) {
+					std::ostringstream ss;
+					ss << "phrase postings: offset: " << offset << ", shift: " << shift <<
+						", document: " << phrase.current().str() << " must not be found";
+					throw std::runtime_error(ss.str());
+				}
+
+				found++;
+			}
+
+			long must_be = 0;
+			for (int i = 0; i < max; ++i) {
+				if (matches(i, offset, shift))
+					must_be++;
+			}
+
+			if (found != must_be) {
+				std::ostringstream ss;
+				ss << "phrase postings: offset: " << offset << ", shift: " << shift <<
+					", found documents: " << found << ", must be: " << must_be;
+				throw std::runtime_error(ss.str());
+			}
+		};
+
+		check(1, 0);
+		check(2, 0);
+		check(3, 2);
+		check(1, 2);
+		check(20, 0);
+	}
+
+	void test_truncate(T &t, int max) {
+		greylock::eurl start;
+		start.key = "truncate-test." + elliptics::lexical_cast(rand());
+		start.bucket = m_bucket;
+
+		{
+			greylock::read_write_index<T> idx(t, start);
+
+			for (int i = 0; i < max; ++i) {
+				greylock::key k;
+				k.id = elliptics::lexical_cast(rand()) + ".truncate-key." + elliptics::lexical_cast(i);
+				k.url.key = "truncate-data." + elliptics::lexical_cast(i);
+				k.url.bucket = m_bucket;
+				k.set_timestamp(i, 0);
+
+				int err = idx.insert(k);
+				if (err < 0) {
+					std::ostringstream ss;
+					ss << "truncate: failed to insert key: " << k.str() << ": " << err;
+					throw std::runtime_error(ss.str());
+				}
+			}
+		}
+
+		auto check_truncate = [&] (long cutoff) {
+			greylock::key ck;
+			ck.set_timestamp(cutoff, 0);
+
+			{
+				greylock::read_write_index<T> idx(t, start);
+				int err = idx.truncate(ck.timestamp);
+				if (err < 0) {
+					std::ostringstream ss;
+					ss << "truncate: cutoff: " << cutoff << ": could not truncate index: " << err;
+					throw std::runtime_error(ss.str());
+				}
+			}
+
+			greylock::read_only_index<T> idx(t, start);
+
+			long must_be = max - std::min((long)max, cutoff);
+			long num = 0;
+			for (auto it = idx.begin(), end = idx.end(); it != end; ++it) {
+				long tsec, tnsec;
+				it->get_timestamp(tsec, tnsec);
+
+				if (tsec < cutoff) {
+					std::ostringstream ss;
+					ss << "truncate: cutoff: " << cutoff << ", key: " << it->str() << " must be removed";
+					throw std::runtime_error(ss.str());
+				}
+
+				num++;
+			}
+
+			if (num != must_be || idx.meta().num_keys != (uint64_t)must_be) {
+				std::ostringstream ss;
+				ss << "truncate: cutoff: " << cutoff << ", found keys: " << num <<
+					", meta: " << idx.meta().str() << ", must be: " << must_be;
+				throw std::runtime_error(ss.str());
+			}
+
+			// page chain must not contain unlinked pages
+			uint64_t pages = 0;
+			for (auto it = idx.page_begin(), end = idx.page_end(); it != end; ++it) {
+				pages++;
+			}
+
+			if (pages != idx.meta().num_pages) {
+				std::ostringstream ss;
+				ss << "truncate: cutoff: " << cutoff << ", pages in chain: " << pages <<
+					", meta: " << idx.meta().str();
+				throw std::runtime_error(ss.str());
+			}
+		};
+
+		check_truncate(0);
+		check_truncate(max / 10);
+		check_truncate(max / 10 + 1);
+		check_truncate(max / 2);
+		check_truncate(max * 2);
+	}
+
+	void test_time_partitions(T &t, int max) {
+		const long period = 1000;
+
+		// every key is inserted into @all index, every even key into @even index
+		greylock::eurl all, even;
+		all.key = "time-partitions-test.all." + elliptics::lexical_cast(rand());
+		all.bucket = m_bucket;
+		even.key = "time-partitions-test.even." + elliptics::lexical_cast(rand());
+		even.bucket = m_bucket;
+
+		greylock::partitioned_index<T> all_idx(t, all, period, false);
+		greylock::partitioned_index<T> even_idx(t, even, period, false);
+
+		for (int i = 0; i < max; ++i) {
+			greylock::key k;
+			k.id = elliptics::lexical_cast(rand()) + ".time-partitions-key." + elliptics::lexical_cast(i);
+			k.url.key = "time-partitions-data." + elliptics::lexical_cast(i);
+			k.url.bucket = m_bucket;
+			k.set_timestamp(i, 0);
+
+			int err = all_idx.insert(k);
+			if (err < 0) {
+				std::ostringstream ss;
+				ss << "time-partitions: failed to insert key: " << k.str() << ": " << err;
+				throw std::runtime_error(ss.str());
+			}
+
+			if ((i & 1) == 0) {
+				err = even_idx.insert(k);
+				if (err < 0) {
+					std::ostringstream ss;
+					ss << "time-partitions: failed to insert even key: " << k.str() << ": " << err;
+					throw std::runtime_error(ss.str());
+				}
+			}
+		}
+
+		greylock::partitioned_index<T> ro(t, all, 0, true);
+		size_t must_be_partitions = (max + period - 1) / period;
+		if (ro.directory().partitions.size() != must_be_partitions) {
+			std::ostringstream ss;
+			ss << "time-partitions: directory: " << ro.directory().str() <<
+				", number of partitions must be: " << must_be_partitions;
+			throw std::runtime_error(ss.str());
+		}
+
+		greylock::intersect::intersector<T> inter(t, true);
+
+		auto check_range = [&] (const greylock::time_range &range, long must_be) {
+			uint64_t estimate = ro.estimate_count(range);
+			long all_must_be = 0;
+			for (int i = 0; i < max; ++i) {
+				if (i >= range.tsec_start && i <= range.tsec_end)
+					all_must_be++;
+			}
+
+			if (estimate != (uint64_t)all_must_be) {
+				std::ostringstream ss;
+				ss << "time-partitions: range: " << range.str() << ", estimated keys: " << estimate <<
+					", must be: " << all_must_be;
+				throw std::runtime_error(ss.str());
+			}
+
+			std::string start;
+			greylock::intersect::result res = inter.intersect(std::vector<greylock::eurl>({all, even}),
+					start, INT_MAX, range, [&] (const std::vector<greylock::eurl> &, greylock::intersect::result &) {
+						return true;
+					});
+
+			for (auto &r: res.docs) {
+				long tsec, tnsec;
+				r.doc.get_timestamp(tsec, tnsec);
+
+				if (tsec < range.tsec_start || tsec > range.tsec_end || (tsec & 1)) {
+					std::ostringstream ss;
+					ss << "time-partitions: range: " << range.str() << ", key: " << r.doc.str() <<
+						" must not be found";
+					throw std::runtime_error(ss.str());
+				}
+			}
+
+			if ((long)res.docs.size() != must_be) {
+				std::ostringstream ss;
+				ss << "time-partitions: range: " << range.str() << ", found keys: " << res.docs.size() <<
+					", must be: " << must_be;
+				throw std::runtime_error(ss.str());
+			}
+		};
+
+		check_range(greylock::time_range(), max / 2);
+		check_range(greylock::time_range(period / 2, period * 3 / 2 - 1), period / 2);
+		check_range(greylock::time_range(period * 2, period * 2), 1);
+		check_range(greylock::time_range(max * 2, max * 3), 0);
+
+		// directory is only rewritten and its generation only changes when partition is added
+		auto insert_generation = [&] (long tsec, bool must_change) {
+			greylock::partition_directory before = greylock::partitioned_index<T>(t, all, 0, true).directory();
+
+			greylock::key k;
+			k.id = "time-partitions-key.generation." + elliptics::lexical_cast(tsec);
+			k.url.key = "time-partitions-data.generation." + elliptics::lexical_cast(tsec);
+			k.url.bucket = m_bucket;
+			k.set_timestamp(tsec, 1);
+			all_idx.insert(k);
+
+			greylock::partition_directory after = greylock::partitioned_index<T>(t, all, 0, true).directory();
+			bool changed = before.generation_number_sec != after.generation_number_sec ||
+				before.generation_number_nsec != after.generation_number_nsec;
+			if (changed != must_change || after.partitions.size() != before.partitions.size() + must_change) {
+				std::ostringstream ss;
+				ss << "time-partitions: insert at: " << tsec << ", directory: " << before.str() <<
+					" -> " << after.str() << ", generation: " <<
+					before.generation_number_sec << "." << before.generation_number_nsec << " -> " <<
+					after.generation_number_sec << "." << after.generation_number_nsec <<
+					": directory must " << (must_change ? "" : "not ") << "change";
+				throw std::runtime_error(ss.str());
+			}
+		};
+
+		insert_generation(0, false);
+		insert_generation(max * 4, true);
+	}
+
+	void test_numeric_range(T &t, int max) {
+		greylock::eurl nstart;
+		nstart.key = "numeric-test." + elliptics::lexical_cast(rand());
+		nstart.bucket = m_bucket;
+
+		greylock::eurl sstart;
+		sstart.key = "numeric-string-test." + elliptics::lexical_cast(rand());
+		sstart.bucket = m_bucket;
+
+		{
+			greylock::numeric_index<T> nidx(t, nstart, false);
+			greylock::read_write_index<T> sidx(t, sstart);
+
+			for (int i = 0; i < max; ++i) {
+				greylock::key k;
+				k.id = elliptics::lexical_cast(rand()) + ".numeric-key." + elliptics::lexical_cast(i);
+				k.url.key = "numeric-data." + elliptics::lexical_cast(i);
+				k.url.bucket = m_bucket;
+				k.set_timestamp(max - i, 0);
+
+				// values go in the opposite order to timestamps, negative values included
+				int err = nidx.insert(i - max / 2, k);
+				if (err < 0) {
+					std::ostringstream ss;
+					ss << "numeric: failed to insert key: " << k.str() << ": " << err;
+					throw std::runtime_error(ss.str());
+				}
+
+				// every even document is present in the string index
+				if ((i & 1) == 0)
+					sidx.insert(k);
+			}
+		}
+
+		greylock::numeric_index<T> nidx(t, nstart, true);
+
+		greylock::numeric_range nr(-10, 9);
+		std::vector<greylock::key> docs = nidx.range(nr);
+		if (docs.size() != 20 || !std::is_sorted(docs.begin(), docs.end())) {
+			std::ostringstream ss;
+			ss << "numeric: range: " << nr.str() << ", found documents: " << docs.size() <<
+				", must be: 20, sorted: " << std::is_sorted(docs.begin(), docs.end());
+			throw std::runtime_error(ss.str());
+		}
+
+		greylock::intersect::intersector<T> inter(t);
+		std::vector<greylock::posting_list_ptr> filters;
+		filters.emplace_back(std::make_shared<greylock::vector_postings>(nstart.str(), std::move(docs)));
+
+		std::string start;
+		greylock::intersect::result res = inter.intersect(std::vector<greylock::eurl>({sstart}), filters,
+				start, INT_MAX, greylock::time_range(),
+				[] (const std::vector<greylock::eurl> &, greylock::intersect::result &) { return true; });
+
+		if (res.docs.size() != 10) {
+			std::ostringstream ss;
+			ss << "numeric: range: " << nr.str() << ", intersected documents: " << res.docs.size() << ", must be: 10";
+			throw std::runtime_error(ss.str());
+		}
+	}
+
 	void test_intersection(T &t, int num_indexes, size_t same_num, size_t different_num) {
 		std::vector<greylock::eurl> indexes;
 		std::vector<greylock::key> same; // documents which are present in every index